@@ -0,0 +1,77 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_BENCH_H
+#define NIMBLE_SERVER_BENCH_H
+
+#include <stddef.h>
+
+typedef struct NimbleServerBenchThroughputSetup {
+    size_t clientCount;
+    size_t participantsPerClient;
+    size_t stepOctetCount;
+    size_t redundancyCount;
+    size_t tickCount;
+    const char* recordFilename; ///< optional file to record the session to
+    const char* stepLogBasePath; ///< optional base path for an authoritative step log
+} NimbleServerBenchThroughputSetup;
+
+typedef struct NimbleServerBenchComposeSetup {
+    size_t roundCount;
+    const char* baselineFilename; ///< optional output from an earlier run to compare with
+    size_t thresholdPercent;
+} NimbleServerBenchComposeSetup;
+
+typedef struct NimbleServerBenchForcedStepsSetup {
+    size_t clientCount;
+    size_t redundancyCount;
+    size_t latencyMs;
+    size_t jitterMs;
+    size_t lossPerMille;
+    size_t reorderPerMille;
+    size_t reorderExtraDelayMs; ///< added to the delay of a reordered datagram
+    size_t inputHoldStepCount;
+    size_t tickCount;
+} NimbleServerBenchForcedStepsSetup;
+
+typedef struct NimbleServerBenchSpectatorsSetup {
+    size_t spectatorCount;
+    size_t clientCount;
+    size_t redundancyStepCount;
+    size_t tickCount;
+} NimbleServerBenchSpectatorsSetup;
+
+typedef struct NimbleServerBenchRelaySetup {
+    size_t edgeCount;
+    size_t clientCount;
+    size_t tickCount;
+} NimbleServerBenchRelaySetup;
+
+typedef struct NimbleServerBenchShmSetup {
+    size_t roundTripCount;
+    size_t octetCount;
+} NimbleServerBenchShmSetup;
+
+typedef struct NimbleServerBenchIngestSetup {
+    size_t roundCount;
+} NimbleServerBenchIngestSetup;
+
+typedef struct NimbleServerBenchValidateSetup {
+    size_t roundCount;
+} NimbleServerBenchValidateSetup;
+
+int nimbleServerBenchCompose(const NimbleServerBenchComposeSetup* setup);
+int nimbleServerBenchFeed(void);
+int nimbleServerBenchForcedSteps(const NimbleServerBenchForcedStepsSetup* setup);
+int nimbleServerBenchIngest(const NimbleServerBenchIngestSetup* setup);
+int nimbleServerBenchRelay(const NimbleServerBenchRelaySetup* setup);
+int nimbleServerBenchReplay(const char* filename);
+int nimbleServerBenchShm(const NimbleServerBenchShmSetup* setup);
+int nimbleServerBenchSpectators(const NimbleServerBenchSpectatorsSetup* setup);
+int nimbleServerBenchTickParties(void);
+int nimbleServerBenchThroughput(const NimbleServerBenchThroughputSetup* setup);
+int nimbleServerBenchValidate(const NimbleServerBenchValidateSetup* setup);
+
+#endif
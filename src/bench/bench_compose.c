@@ -0,0 +1,339 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "authoritative_steps.h"
+#include "bench.h"
+#include "perf_counters.h"
+#include "send_authoritative_steps.h"
+#include <flood/out_stream.h>
+#include <imprint/default_setup.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/server.h>
+#include <nimble-server/transport_connection.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BENCH_COMPOSE_PREDICTED_STEP_COUNT (32)
+#define BENCH_COMPOSE_REPLY_COUNT_EACH_ROUND (64)
+#define BENCH_COMPOSE_MAX_RESULT_COUNT (32)
+#define BENCH_COMPOSE_MAX_STEP_OCTET_COUNT (32)
+#define BENCH_COMPOSE_REPLY_BUFFER_OCTET_COUNT (32 * 1024)
+
+static const size_t g_participantCounts[] = {2, 8, 32};
+static const size_t g_stepOctetCounts[] = {4, 16, 28};
+static const size_t g_redundancyCounts[] = {1, 5, 20};
+
+#define BENCH_COMPOSE_ARRAY_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+typedef struct BenchComposeResult {
+    char name[64];
+    size_t participantCount;
+    size_t stepOctetCount;
+    size_t redundancyCount;
+    double composeNanosecondsPerStep;
+    size_t composeCopiedOctetsPerStep;
+    double replyNanoseconds;
+    size_t replyOctetCount;
+} BenchComposeResult;
+
+/// Measures one combination of participant count, step size and redundancy window on an initialized server.
+/// The fastest round is used, since it is the one least disturbed by the rest of the system, which makes the
+/// numbers comparable between runs.
+/// @param result the measurement
+/// @param server server initialized for the participant count and step size in result
+/// @param roundCount number of rounds to run
+/// @param log log to use for the transport connection
+/// @return negative on error
+static int measureCompose(BenchComposeResult* result, NimbleServer* server, size_t roundCount, Clog log)
+{
+    NimbleSerializeLocalPartyInfo partyInfos[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    for (size_t i = 0; i < result->participantCount; ++i) {
+        partyInfos[i].participantCount = 1;
+        partyInfos[i].participantIds[0] = (NimbleSerializeParticipantId) i;
+    }
+
+    int err = nimbleServerHostMigration(server, partyInfos, result->participantCount);
+    if (err < 0) {
+        return err;
+    }
+
+    NimbleServerGame* game = &server->game;
+    for (size_t i = 0; i < server->localParties.capacityCount; ++i) {
+        NimbleServerLocalParty* party = &server->localParties.parties[i];
+        if (!party->isUsed) {
+            continue;
+        }
+        party->state = NimbleServerLocalPartyStateNormal;
+    }
+    for (size_t i = 0; i < game->participants.participantCapacity; ++i) {
+        NimbleServerParticipant* participant = &game->participants.participants[i];
+        if (!participant->isUsed) {
+            continue;
+        }
+        participant->state = NimbleServerParticipantStateNormal;
+        nbsStepsReInit(participant->steps, game->authoritativeSteps.expectedWriteId);
+    }
+
+    NimbleServerTransportConnectionDiagnostics diagnostics;
+    tc_mem_clear_type(&diagnostics);
+    diagnostics.log = log;
+
+    NimbleServerTransportConnection transportConnection;
+    tc_mem_clear_type(&transportConnection);
+    transportConnection.diagnostics = &diagnostics;
+    transportConnection.assignedParty = &server->localParties.parties[0];
+
+    static uint8_t replyBuffer[BENCH_COMPOSE_REPLY_BUFFER_OCTET_COUNT];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, replyBuffer, sizeof(replyBuffer));
+
+    uint8_t predictedStep[BENCH_COMPOSE_MAX_STEP_OCTET_COUNT];
+    for (size_t i = 0; i < result->stepOctetCount; ++i) {
+        predictedStep[i] = (uint8_t) (i + 1);
+    }
+
+    double fastestComposeNanosecondsPerStep = 0;
+    double fastestReplyNanoseconds = 0;
+
+    // The first round is only for warming up the caches
+    for (size_t round = 0; round <= roundCount; ++round) {
+        for (size_t i = 0; i < game->participants.participantCapacity; ++i) {
+            NimbleServerParticipant* participant = &game->participants.participants[i];
+            if (!participant->isUsed) {
+                continue;
+            }
+            for (size_t j = 0; j < BENCH_COMPOSE_PREDICTED_STEP_COUNT; ++j) {
+                int writeErr = nbsStepsWrite(participant->steps, participant->steps->expectedWriteId, predictedStep,
+                                             result->stepOctetCount);
+                if (writeErr < 0) {
+                    return writeErr;
+                }
+            }
+        }
+
+        uint64_t composeStart = nimbleServerBenchNanoseconds();
+        int composedCount = nimbleServerComposeAuthoritativeSteps(game);
+        uint64_t composeNanoseconds = nimbleServerBenchNanoseconds() - composeStart;
+        if (composedCount <= 0) {
+            CLOG_SOFT_ERROR("compose: no authoritative steps were composed")
+            return -1;
+        }
+
+        StepId clientWaitingForStepId = (StepId) (game->authoritativeSteps.expectedWriteId - result->redundancyCount);
+
+        uint64_t replyStart = nimbleServerBenchNanoseconds();
+        for (size_t i = 0; i < BENCH_COMPOSE_REPLY_COUNT_EACH_ROUND; ++i) {
+            fldOutStreamRewind(&outStream);
+            ssize_t rangeCount = nimbleServerSendStepRanges(&outStream, &transportConnection, game,
+                                                            clientWaitingForStepId);
+            if (rangeCount < 0) {
+                return (int) rangeCount;
+            }
+        }
+        uint64_t replyNanoseconds = nimbleServerBenchNanoseconds() - replyStart;
+
+        // Only keep the steps needed for the largest redundancy window, the same way as the server discards
+        // authoritative steps that all clients have received
+        nbsStepsDiscardUpTo(&game->authoritativeSteps, (StepId) (game->authoritativeSteps.expectedWriteId - 20));
+
+        if (round == 0) {
+            continue;
+        }
+
+        double composeNanosecondsPerStep = (double) composeNanoseconds / (double) composedCount;
+        double replyNanosecondsEach = (double) replyNanoseconds / BENCH_COMPOSE_REPLY_COUNT_EACH_ROUND;
+        if (round == 1 || composeNanosecondsPerStep < fastestComposeNanosecondsPerStep) {
+            fastestComposeNanosecondsPerStep = composeNanosecondsPerStep;
+        }
+        if (round == 1 || replyNanosecondsEach < fastestReplyNanoseconds) {
+            fastestReplyNanoseconds = replyNanosecondsEach;
+        }
+    }
+
+    size_t composedStepOctetCount = 1 + result->participantCount * (2 + result->stepOctetCount);
+
+    result->composeNanosecondsPerStep = fastestComposeNanosecondsPerStep;
+    // Predicted steps are read into the read buffer, copied into the compose buffer and then into the
+    // authoritative steps buffer
+    result->composeCopiedOctetsPerStep = result->participantCount * result->stepOctetCount +
+                                         2 * composedStepOctetCount;
+    result->replyNanoseconds = fastestReplyNanoseconds;
+    result->replyOctetCount = outStream.pos;
+
+    return 0;
+}
+
+/// Measures one combination of participant count, step size and redundancy window.
+/// @param result the measurement
+/// @param roundCount number of rounds to run
+/// @return negative on error
+static int benchComposeOne(BenchComposeResult* result, size_t roundCount)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerSetup setup = {.applicationVersion.major = 0,
+                               .applicationVersion.minor = 0,
+                               .applicationVersion.patch = 0,
+                               .memory = &imprintSetup.tagAllocator.info,
+                               .blobAllocator = &imprintSetup.slabAllocator.info,
+                               .maxConnectionCount = result->participantCount,
+                               .maxParticipantCount = result->participantCount,
+                               .maxSingleParticipantStepOctetCount = result->stepOctetCount,
+                               .maxParticipantCountForEachConnection = 1,
+                               .maxWaitingForReconnectTicks = 32,
+                               .maxGameStateOctetCount = 1024,
+                               .callbackObject.self = 0,
+                               .now = 0,
+                               .targetTickTimeMs = 16,
+                               .log = log};
+
+    NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    if (err < 0) {
+        imprintDefaultSetupDestroy(&imprintSetup);
+        return err;
+    }
+
+    err = measureCompose(result, &server, roundCount, log);
+
+    imprintDefaultSetupDestroy(&imprintSetup);
+
+    return err;
+}
+
+/// Finds a number after a key in a line of JSON, e.g. `"replyNanoseconds":123.4`
+/// @param line line to search in
+/// @param key the key without quotes
+/// @param[out] value the number found
+/// @return true if the key was found
+static bool findJsonNumber(const char* line, const char* key, double* value)
+{
+    char quotedKey[80];
+    tc_snprintf(quotedKey, sizeof(quotedKey), "\"%s\":", key);
+
+    const char* found = strstr(line, quotedKey);
+    if (found == 0) {
+        return false;
+    }
+
+    *value = strtod(found + strlen(quotedKey), 0);
+
+    return true;
+}
+
+/// Compares the results with a baseline written by an earlier run of the bench.
+/// @param results the results of this run
+/// @param resultCount number of results
+/// @param baselineFilename file with one JSON object on each line, as written by this bench
+/// @param thresholdPercent how much slower a result can be before it is considered a regression
+/// @return negative on error, otherwise the number of regressions
+static int compareWithBaseline(const BenchComposeResult* results, size_t resultCount, const char* baselineFilename,
+                               size_t thresholdPercent)
+{
+    FILE* baselineFile = fopen(baselineFilename, "r");
+    if (baselineFile == 0) {
+        CLOG_SOFT_ERROR("could not open baseline '%s'", baselineFilename)
+        return -1;
+    }
+
+    double allowedFactor = 1.0 + (double) thresholdPercent / 100.0;
+    int regressionCount = 0;
+    size_t comparedCount = 0;
+    char line[512];
+
+    while (fgets(line, sizeof(line), baselineFile) != 0) {
+        for (size_t i = 0; i < resultCount; ++i) {
+            const BenchComposeResult* result = &results[i];
+            char quotedName[80];
+            tc_snprintf(quotedName, sizeof(quotedName), "\"name\":\"%s\"", result->name);
+            if (strstr(line, quotedName) == 0) {
+                continue;
+            }
+
+            double baselineCompose;
+            double baselineReply;
+            if (!findJsonNumber(line, "composeNanosecondsPerStep", &baselineCompose) ||
+                !findJsonNumber(line, "replyNanoseconds", &baselineReply)) {
+                continue;
+            }
+            comparedCount++;
+
+            if (result->composeNanosecondsPerStep > baselineCompose * allowedFactor) {
+                fprintf(stderr, "regression: %s compose %.1f ns/step (baseline %.1f)\n", result->name,
+                        result->composeNanosecondsPerStep, baselineCompose);
+                regressionCount++;
+            }
+            if (result->replyNanoseconds > baselineReply * allowedFactor) {
+                fprintf(stderr, "regression: %s reply %.1f ns (baseline %.1f)\n", result->name,
+                        result->replyNanoseconds, baselineReply);
+                regressionCount++;
+            }
+        }
+    }
+
+    fclose(baselineFile);
+
+    fprintf(stderr, "compared %zu of %zu results with '%s' (threshold %zu%%): %d regressions\n", comparedCount,
+            resultCount, baselineFilename, thresholdPercent, regressionCount);
+
+    return regressionCount;
+}
+
+/// Measures the time to compose authoritative steps from preloaded predicted steps and the time to serialize the
+/// step ranges reply, for a grid of participant counts, step sizes and redundancy windows.
+/// Prints one JSON object on each line, which can be saved and used as a baseline for a later run.
+/// @param setup round count and optional baseline to compare with
+/// @return negative on error or if any result is slower than the baseline allows
+int nimbleServerBenchCompose(const NimbleServerBenchComposeSetup* setup)
+{
+    BenchComposeResult results[BENCH_COMPOSE_MAX_RESULT_COUNT];
+    size_t resultCount = 0;
+
+    for (size_t p = 0; p < BENCH_COMPOSE_ARRAY_COUNT(g_participantCounts); ++p) {
+        for (size_t s = 0; s < BENCH_COMPOSE_ARRAY_COUNT(g_stepOctetCounts); ++s) {
+            for (size_t r = 0; r < BENCH_COMPOSE_ARRAY_COUNT(g_redundancyCounts); ++r) {
+                BenchComposeResult* result = &results[resultCount++];
+                result->participantCount = g_participantCounts[p];
+                result->stepOctetCount = g_stepOctetCounts[s];
+                result->redundancyCount = g_redundancyCounts[r];
+                tc_snprintf(result->name, sizeof(result->name), "p%zu-s%zu-r%zu", result->participantCount,
+                            result->stepOctetCount, result->redundancyCount);
+
+                int err = benchComposeOne(result, setup->roundCount);
+                if (err < 0) {
+                    CLOG_SOFT_ERROR("compose bench %s failed: %d", result->name, err)
+                    return err;
+                }
+
+                printf("{\"name\":\"%s\",\"participantCount\":%zu,\"stepOctetCount\":%zu,\"redundancyCount\":%zu,"
+                       "\"composeNanosecondsPerStep\":%.1f,\"composeCopiedOctetsPerStep\":%zu,"
+                       "\"replyNanoseconds\":%.1f,\"replyOctetCount\":%zu}\n",
+                       result->name, result->participantCount, result->stepOctetCount, result->redundancyCount,
+                       result->composeNanosecondsPerStep, result->composeCopiedOctetsPerStep,
+                       result->replyNanoseconds, result->replyOctetCount);
+            }
+        }
+    }
+
+    if (setup->baselineFilename == 0) {
+        return 0;
+    }
+
+    int regressionCount = compareWithBaseline(results, resultCount, setup->baselineFilename,
+                                              setup->thresholdPercent);
+    if (regressionCount < 0) {
+        return regressionCount;
+    }
+
+    return regressionCount > 0 ? -1 : 0;
+}
@@ -0,0 +1,150 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <datagram-transport/transport.h>
+#include <flood/out_stream.h>
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-serialize/commands.h>
+#include <nimble-serialize/serialize.h>
+#include <nimble-server/server.h>
+#include <ordered-datagram/out_logic.h>
+
+#define BENCH_FEED_CONNECTION_COUNT (NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS)
+#define BENCH_FEED_DATAGRAMS_PER_CONNECTION (256)
+#define BENCH_FEED_ROUND_COUNT (32)
+#define BENCH_FEED_MAX_DATAGRAM_OCTET_COUNT (32)
+
+typedef struct BenchFeedDatagram {
+    uint8_t octets[BENCH_FEED_MAX_DATAGRAM_OCTET_COUNT];
+    size_t octetCount;
+} BenchFeedDatagram;
+
+static BenchFeedDatagram g_datagrams[BENCH_FEED_DATAGRAMS_PER_CONNECTION][BENCH_FEED_CONNECTION_COUNT];
+
+static int discardSend(void* self_, const uint8_t* data, size_t octetCount)
+{
+    size_t* sentOctetCount = (size_t*) self_;
+    (void) data;
+    *sentOctetCount += octetCount;
+    return 0;
+}
+
+/// Writes ping datagrams for all connections, interleaved in the order that they are fed to the server
+/// @param outLogics ordered datagram out logic for each client
+/// @param clientTime time to put in the pings
+/// @param log target log
+static void prepareDatagrams(OrderedDatagramOutLogic* outLogics, uint64_t clientTime, Clog* log)
+{
+    for (size_t datagramIndex = 0; datagramIndex < BENCH_FEED_DATAGRAMS_PER_CONNECTION; ++datagramIndex) {
+        for (size_t connectionIndex = 0; connectionIndex < BENCH_FEED_CONNECTION_COUNT; ++connectionIndex) {
+            BenchFeedDatagram* datagram = &g_datagrams[datagramIndex][connectionIndex];
+            FldOutStream outStream;
+            fldOutStreamInit(&outStream, datagram->octets, sizeof(datagram->octets));
+
+            orderedDatagramOutLogicPrepare(&outLogics[connectionIndex], &outStream);
+            nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdPingRequest, log);
+            fldOutStreamWriteUInt64(&outStream, clientTime + datagramIndex);
+            orderedDatagramOutLogicCommit(&outLogics[connectionIndex]);
+
+            datagram->octetCount = outStream.pos;
+        }
+    }
+}
+
+/// Measures the time and cache misses for each datagram that is fed to the server.
+/// All transport connections are active and the datagrams are interleaved between them, which is the worst
+/// case for the transport connection array.
+/// @return negative on error
+int nimbleServerBenchFeed(void)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerSetup setup = {.applicationVersion.major = 0,
+                               .applicationVersion.minor = 0,
+                               .applicationVersion.patch = 0,
+                               .memory = &imprintSetup.tagAllocator.info,
+                               .blobAllocator = &imprintSetup.slabAllocator.info,
+                               .maxConnectionCount = BENCH_FEED_CONNECTION_COUNT,
+                               .maxParticipantCount = BENCH_FEED_CONNECTION_COUNT,
+                               .maxSingleParticipantStepOctetCount = 20,
+                               .maxParticipantCountForEachConnection = 1,
+                               .maxWaitingForReconnectTicks = 32,
+                               .maxGameStateOctetCount = 1024,
+                               .callbackObject.self = 0,
+                               .now = 0,
+                               .targetTickTimeMs = 16,
+                               .log = log};
+
+    NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    if (err < 0) {
+        return err;
+    }
+
+    size_t sentOctetCount = 0;
+    DatagramTransportOut transportOut;
+    transportOut.self = &sentOctetCount;
+    transportOut.send = discardSend;
+
+    NimbleServerResponse response;
+    response.transportOut = &transportOut;
+    response.runOut = 0;
+
+    OrderedDatagramOutLogic outLogics[BENCH_FEED_CONNECTION_COUNT];
+    for (size_t i = 0; i < BENCH_FEED_CONNECTION_COUNT; ++i) {
+        orderedDatagramOutLogicInit(&outLogics[i]);
+    }
+
+    NimbleServerBenchPerfCounters counters;
+    nimbleServerBenchPerfCountersInit(&counters);
+
+    uint64_t totalDatagramCount = 0;
+    uint64_t failedDatagramCount = 0;
+    NimbleServerBenchPerfCounters total = counters;
+
+    for (size_t round = 0; round < BENCH_FEED_ROUND_COUNT; ++round) {
+        prepareDatagrams(outLogics, round * BENCH_FEED_DATAGRAMS_PER_CONNECTION, &log);
+
+        nimbleServerBenchPerfCountersStart(&counters);
+        for (size_t datagramIndex = 0; datagramIndex < BENCH_FEED_DATAGRAMS_PER_CONNECTION; ++datagramIndex) {
+            for (size_t connectionIndex = 0; connectionIndex < BENCH_FEED_CONNECTION_COUNT; ++connectionIndex) {
+                const BenchFeedDatagram* datagram = &g_datagrams[datagramIndex][connectionIndex];
+                int feedErr = nimbleServerFeed(&server, (uint8_t) connectionIndex, datagram->octets,
+                                               datagram->octetCount, &response);
+                if (feedErr < 0) {
+                    failedDatagramCount++;
+                }
+            }
+        }
+        nimbleServerBenchPerfCountersStop(&counters);
+
+        // The first round connects all transport connections, and is not part of the measurement
+        if (round == 0) {
+            continue;
+        }
+
+        totalDatagramCount += BENCH_FEED_DATAGRAMS_PER_CONNECTION * BENCH_FEED_CONNECTION_COUNT;
+        total.elapsedNanoseconds += counters.elapsedNanoseconds;
+        for (size_t i = 0; i < NimbleServerBenchCounterCount; ++i) {
+            total.values[i] += counters.values[i];
+        }
+    }
+
+    total.isAvailable = counters.isAvailable;
+    nimbleServerBenchPerfCountersReport(&total, "feed", totalDatagramCount, "datagram");
+    CLOG_OUTPUT("feed: %" PRIu64 " datagrams failed, %zu octets sent", failedDatagramCount, sentOctetCount)
+
+    nimbleServerBenchPerfCountersDestroy(&counters);
+
+    return 0;
+}
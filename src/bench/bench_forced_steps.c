@@ -0,0 +1,163 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server-simulation/simulation.h>
+#include <stdio.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BENCH_FORCED_STEPS_MAX_JOIN_TICK_COUNT (1000)
+#define BENCH_FORCED_STEPS_TICK_TIME_MS (16)
+#define BENCH_FORCED_STEPS_MAX_REPEAT_COUNT (8)
+
+/// Repeats the last received input for a few steps, and then gives up and uses an empty step, as an example of an
+/// application-specific predictor
+static int repeatForAWhile(void* self, uint8_t participantId, StepId stepId, const uint8_t* lastOctets,
+                           size_t lastOctetCount, size_t forcedCountInRow, uint8_t* target, size_t maxOctetCount)
+{
+    (void) self;
+    (void) participantId;
+    (void) stepId;
+
+    if (lastOctets == 0 || forcedCountInRow > BENCH_FORCED_STEPS_MAX_REPEAT_COUNT || lastOctetCount > maxOctetCount) {
+        return -1;
+    }
+
+    tc_memcpy_octets(target, lastOctets, lastOctetCount);
+
+    return (int) lastOctetCount;
+}
+
+static const char* policyName(NimbleServerForcedStepPolicy policy)
+{
+    switch (policy) {
+        case NimbleServerForcedStepPolicyZero:
+            return "zero";
+        case NimbleServerForcedStepPolicyRepeatLast:
+            return "repeatLast";
+        case NimbleServerForcedStepPolicyDecay:
+            return "decay";
+        case NimbleServerForcedStepPolicyCallback:
+            return "callback";
+    }
+
+    return "unknown";
+}
+
+/// Counts the step datagrams that arrived after a newer datagram on the same connection, and were still used
+static uint64_t lateDatagramCount(const NimbleServer* server)
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        count += server->transportConnections[i].reorderWindow.lateCount;
+    }
+
+    return count;
+}
+
+/// Runs the simulation with one forced step policy and writes the result as a JSON object on one line
+/// @param setup bench setup
+/// @param policy forced step policy to use
+/// @return negative on error
+static int benchForcedStepsOne(const NimbleServerBenchForcedStepsSetup* setup, NimbleServerForcedStepPolicy policy)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerImpairment impairment;
+    tc_mem_clear_type(&impairment);
+    impairment.latencyMs = setup->latencyMs;
+    impairment.jitterMs = setup->jitterMs;
+    impairment.lossPerMille = setup->lossPerMille;
+    impairment.reorderPerMille = setup->reorderPerMille;
+    impairment.reorderExtraDelayMs = setup->reorderExtraDelayMs;
+
+    static NimbleServerCallbackObjectVtbl vtbl = {.forcedStepCreateFn = repeatForAWhile};
+
+    NimbleServerSimulationSetup simulationSetup = {.clientCount = setup->clientCount,
+                                                   .participantsPerClient = 1,
+                                                   .stepOctetCount = 8,
+                                                   .redundancyCount = setup->redundancyCount,
+                                                   .tickTimeMs = BENCH_FORCED_STEPS_TICK_TIME_MS,
+                                                   .seed = 0x5eed,
+                                                   .impairment = impairment,
+                                                   .allocator = &imprintSetup.tagAllocator.info,
+                                                   .blobAllocator = &imprintSetup.slabAllocator.info,
+                                                   .callbackObject = {.vtbl = &vtbl, .self = 0},
+                                                   .forcedStepPolicy = policy,
+                                                   .inputHoldStepCount = setup->inputHoldStepCount,
+                                                   .log = log};
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, simulationSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationJoinAll(&simulation, BENCH_FORCED_STEPS_MAX_JOIN_TICK_COUNT);
+    if (err < 0) {
+        return err;
+    }
+    nimbleServerSimulationResetStats(&simulation);
+    uint64_t lateDatagramCountBefore = lateDatagramCount(&simulation.server);
+
+    for (size_t i = 0; i < setup->tickCount; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    const NimbleServerSimulationStats* stats = &simulation.stats;
+    double minutes = (double) (setup->tickCount * BENCH_FORCED_STEPS_TICK_TIME_MS) / 60000.0;
+
+    uint64_t composedStepCount = stats->forcedStepCount + stats->providedStepCount;
+
+    printf("{\"policy\":\"%s\",\"clientCount\":%zu,\"latencyMs\":%zu,\"jitterMs\":%zu,\"lossPerMille\":%zu,"
+           "\"reorderPerMille\":%zu,\"inputHoldStepCount\":%zu,\"tickCount\":%zu,",
+           policyName(policy), setup->clientCount, setup->latencyMs, setup->jitterMs, setup->lossPerMille,
+           setup->reorderPerMille, setup->inputHoldStepCount, setup->tickCount);
+    printf("\"lateDatagramCount\":%" PRIu64 ",\"forcedStepCount\":%" PRIu64 ",\"forcedPerMille\":%.1f,"
+           "\"substitutedStepCount\":%" PRIu64 ",\"rollbackStepCount\":%" PRIu64
+           ",\"rollbackStepsPerMinute\":%.1f}\n",
+           lateDatagramCount(&simulation.server) - lateDatagramCountBefore, stats->forcedStepCount,
+           composedStepCount > 0 ? (double) stats->forcedStepCount * 1000.0 / (double) composedStepCount : 0.0,
+           simulation.server.game.forcedSteps.substitutedStepCount, stats->rollbackStepCount,
+           (double) stats->rollbackStepCount / minutes);
+
+    return 0;
+}
+
+/// Measures how many composed participant steps would make a client roll back, for each forced step policy, with
+/// jitter, loss and reordering on the in-memory transport. The synthetic input is held for a number of steps, like a
+/// button or a stick, so repeating the last input is often right.
+/// @param setup impairment, input hold and tick count
+/// @return negative on error
+int nimbleServerBenchForcedSteps(const NimbleServerBenchForcedStepsSetup* setup)
+{
+    if (setup->tickCount == 0) {
+        CLOG_SOFT_ERROR("forced steps: tick count must be set")
+        return -1;
+    }
+
+    static const NimbleServerForcedStepPolicy policies[] = {
+        NimbleServerForcedStepPolicyZero, NimbleServerForcedStepPolicyRepeatLast, NimbleServerForcedStepPolicyDecay,
+        NimbleServerForcedStepPolicyCallback};
+
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        int err = benchForcedStepsOne(setup, policies[i]);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/default_setup.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/server.h>
+#include <stdio.h>
+
+#define BENCH_INGEST_PARTICIPANT_COUNT (NIMBLE_SERIALIZE_MAX_LOCAL_PLAYERS)
+#define BENCH_INGEST_STEP_OCTET_COUNT (8)
+#define BENCH_INGEST_DATAGRAM_OCTET_COUNT (1200)
+#define BENCH_INGEST_FIRST_STEP_ID (1000)
+#define BENCH_INGEST_KEEP_STEP_COUNT (32)
+
+static const size_t g_ingestRedundancyCounts[] = {1, 3, 8, 20};
+
+/// Writes a datagram like a client sends it every tick: the latest predicted step and the redundant steps before it,
+/// for all participants in the party.
+static size_t writeRedundantPredictedSteps(uint8_t* target, size_t maxOctetCount, StepId latestStepId,
+                                           size_t redundancyCount)
+{
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, target, maxOctetCount);
+
+    uint8_t payload[BENCH_INGEST_STEP_OCTET_COUNT];
+    StepId firstStepId = latestStepId - (StepId) (redundancyCount - 1);
+
+    fldOutStreamWriteUInt32(&outStream, firstStepId);
+    fldOutStreamWriteUInt8(&outStream, BENCH_INGEST_PARTICIPANT_COUNT);
+    for (size_t participantIndex = 0; participantIndex < BENCH_INGEST_PARTICIPANT_COUNT; ++participantIndex) {
+        fldOutStreamWriteUInt8(&outStream, (uint8_t) participantIndex);
+        fldOutStreamWriteUInt8(&outStream, 0);
+        fldOutStreamWriteUInt8(&outStream, (uint8_t) redundancyCount);
+        for (size_t i = 0; i < redundancyCount; ++i) {
+            for (size_t octetIndex = 0; octetIndex < BENCH_INGEST_STEP_OCTET_COUNT; ++octetIndex) {
+                payload[octetIndex] = (uint8_t) (firstStepId + i + participantIndex + octetIndex);
+            }
+            fldOutStreamWriteUInt8(&outStream, BENCH_INGEST_STEP_OCTET_COUNT);
+            fldOutStreamWriteOctets(&outStream, payload, BENCH_INGEST_STEP_OCTET_COUNT);
+        }
+    }
+
+    return outStream.pos;
+}
+
+/// Reads the predicted steps one at a time through nimbleServerParticipantDeserializeSingleStep, without the party
+/// bookkeeping. Used as the baseline.
+static int deserializeEachStep(NimbleServerLocalParty* party, FldInStream* inStream)
+{
+    uint32_t lowestCommonStepId;
+    fldInStreamReadUInt32(inStream, &lowestCommonStepId);
+
+    uint8_t participantCount;
+    fldInStreamReadUInt8(inStream, &participantCount);
+
+    for (size_t participantIterator = 0; participantIterator < participantCount; ++participantIterator) {
+        uint8_t participantId;
+        fldInStreamReadUInt8(inStream, &participantId);
+        uint8_t deltaStepIdFromCommonStepId;
+        fldInStreamReadUInt8(inStream, &deltaStepIdFromCommonStepId);
+        uint8_t stepsThatFollow;
+        fldInStreamReadUInt8(inStream, &stepsThatFollow);
+
+        NimbleServerParticipant* participant = nimbleParticipantReferencesFind(&party->participantReferences,
+                                                                               participantId);
+        StepId firstStepId = lowestCommonStepId + deltaStepIdFromCommonStepId;
+        for (size_t i = 0; i < stepsThatFollow; ++i) {
+            int err = nimbleServerParticipantDeserializeSingleStep(participant, firstStepId + (StepId) i, inStream);
+            if (err < 0) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/// Feeds roundCount datagrams, each with one new step for every participant, and measures the time to read them
+/// @param useBulkIngest true to read through nimbleServerLocalPartyDeserializePredictedSteps
+/// @return nanoseconds for each datagram, negative on error
+static double benchIngestRounds(NimbleServer* server, NimbleServerLocalParty* party, size_t redundancyCount,
+                                size_t roundCount, bool useBulkIngest)
+{
+    static uint8_t datagram[BENCH_INGEST_DATAGRAM_OCTET_COUNT];
+    NimbleServerGame* game = &server->game;
+
+    for (size_t i = 0; i < party->participantReferences.participantReferenceCount; ++i) {
+        nbsStepsReInit(party->participantReferences.participantReferences[i]->steps, BENCH_INGEST_FIRST_STEP_ID);
+    }
+
+    uint64_t elapsed = 0;
+    for (size_t round = 0; round < roundCount; ++round) {
+        StepId latestStepId = (StepId) (BENCH_INGEST_FIRST_STEP_ID + round);
+        size_t octetCount = writeRedundantPredictedSteps(datagram, sizeof(datagram), latestStepId, redundancyCount);
+        FldInStream inStream;
+        fldInStreamInit(&inStream, datagram, octetCount);
+
+        uint64_t start = nimbleServerBenchNanoseconds();
+        int err = useBulkIngest
+                      ? nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &game->stepValidation)
+                      : deserializeEachStep(party, &inStream);
+        elapsed += nimbleServerBenchNanoseconds() - start;
+        if (err < 0) {
+            return err;
+        }
+
+        // Consume the steps like the authoritative composer does, so the steps buffers never fill up
+        for (size_t i = 0; i < party->participantReferences.participantReferenceCount; ++i) {
+            NbsSteps* steps = party->participantReferences.participantReferences[i]->steps;
+            if (steps->stepsCount > BENCH_INGEST_KEEP_STEP_COUNT) {
+                nbsStepsDiscardCount(steps, steps->stepsCount - BENCH_INGEST_KEEP_STEP_COUNT);
+            }
+        }
+    }
+
+    return (double) elapsed / (double) roundCount;
+}
+
+/// Measures reading the predicted steps datagrams that clients send every tick, where all but the latest step for each
+/// participant are redundant, one step at a time (the previous path) and through
+/// nimbleServerLocalPartyDeserializePredictedSteps. Both read each step with the nimble-steps-serialize reader, so the
+/// difference is the party bookkeeping. Prints one JSON object on each line.
+/// @param setup round count
+/// @return negative on error
+int nimbleServerBenchIngest(const NimbleServerBenchIngestSetup* setup)
+{
+    if (setup->roundCount == 0) {
+        CLOG_SOFT_ERROR("ingest: round count must be set")
+        return -1;
+    }
+
+    for (size_t r = 0; r < sizeof(g_ingestRedundancyCounts) / sizeof(g_ingestRedundancyCounts[0]); ++r) {
+        size_t redundancyCount = g_ingestRedundancyCounts[r];
+
+        ImprintDefaultSetup imprintSetup;
+        imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+        Clog log;
+        log.config = &g_clog;
+        log.constantPrefix = "bench";
+
+        NimbleServerSetup serverSetup = {.applicationVersion.major = 0,
+                                         .applicationVersion.minor = 0,
+                                         .applicationVersion.patch = 0,
+                                         .memory = &imprintSetup.tagAllocator.info,
+                                         .blobAllocator = &imprintSetup.slabAllocator.info,
+                                         .maxConnectionCount = 1,
+                                         .maxParticipantCount = BENCH_INGEST_PARTICIPANT_COUNT,
+                                         .maxSingleParticipantStepOctetCount = BENCH_INGEST_STEP_OCTET_COUNT,
+                                         .maxParticipantCountForEachConnection = BENCH_INGEST_PARTICIPANT_COUNT,
+                                         .maxWaitingForReconnectTicks = 32,
+                                         .maxGameStateOctetCount = 1024,
+                                         .callbackObject.self = 0,
+                                         .now = 0,
+                                         .targetTickTimeMs = 16,
+                                         .log = log};
+
+        NimbleServer server;
+        int err = nimbleServerInit(&server, serverSetup);
+        if (err < 0) {
+            return err;
+        }
+
+        NimbleSerializeLocalPartyInfo partyInfo;
+        partyInfo.participantCount = BENCH_INGEST_PARTICIPANT_COUNT;
+        for (size_t i = 0; i < BENCH_INGEST_PARTICIPANT_COUNT; ++i) {
+            partyInfo.participantIds[i] = (NimbleSerializeParticipantId) i;
+        }
+
+        err = nimbleServerHostMigration(&server, &partyInfo, 1);
+        if (err < 0) {
+            return err;
+        }
+        NimbleServerLocalParty* party = &server.localParties.parties[0];
+
+        double eachStepNanoseconds = benchIngestRounds(&server, party, redundancyCount, setup->roundCount, false);
+        if (eachStepNanoseconds < 0) {
+            return (int) eachStepNanoseconds;
+        }
+
+        double bulkNanoseconds = benchIngestRounds(&server, party, redundancyCount, setup->roundCount, true);
+        if (bulkNanoseconds < 0) {
+            return (int) bulkNanoseconds;
+        }
+
+        printf("{\"name\":\"ingest-r%zu\",\"participantCount\":%d,\"redundancyCount\":%zu,\"stepOctetCount\":%d,"
+               "\"eachStepNanosecondsPerDatagram\":%.1f,\"bulkNanosecondsPerDatagram\":%.1f}\n",
+               redundancyCount, BENCH_INGEST_PARTICIPANT_COUNT, redundancyCount, BENCH_INGEST_STEP_OCTET_COUNT,
+               eachStepNanoseconds, bulkNanoseconds);
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server-simulation/simulation.h>
+#include <nimble-server/relay.h>
+#include <stdio.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BENCH_RELAY_MAX_JOIN_TICK_COUNT (1000)
+#define BENCH_RELAY_TARGET_TICK_TIME_MS (16)
+#define BENCH_RELAY_LINK_QUEUE_CAPACITY (256)
+
+/// The upstream side of all the links. Each edge has its own in-process link, and the connectionId is the index of
+/// the edge.
+typedef struct BenchRelayLinks {
+    NimbleServerMemoryTransport transports[NIMBLE_SERVER_RELAY_MAX_LINK_COUNT];
+    size_t count;
+    size_t nextReadIndex;
+} BenchRelayLinks;
+
+static int linksSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    BenchRelayLinks* self = (BenchRelayLinks*) _self;
+    if (connectionId < 0 || (size_t) connectionId >= self->count) {
+        return -1;
+    }
+
+    DatagramTransportMulti* transport = &self->transports[connectionId].multiTransport;
+
+    return transport->sendTo(transport->self, connectionId, data, octetCount);
+}
+
+static ssize_t linksReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t octetCount)
+{
+    BenchRelayLinks* self = (BenchRelayLinks*) _self;
+
+    for (size_t i = 0; i < self->count; ++i) {
+        size_t index = (self->nextReadIndex + i) % self->count;
+        DatagramTransportMulti* transport = &self->transports[index].multiTransport;
+        ssize_t receivedCount = transport->receiveFrom(transport->self, connectionId, data, octetCount);
+        if (receivedCount != 0) {
+            self->nextReadIndex = (index + 1) % self->count;
+            return receivedCount;
+        }
+    }
+
+    return 0;
+}
+
+/// Runs an upstream server with synthetic clients and fans out the authoritative steps to edge relays over in-process
+/// links. Reports the latency that the hop adds (from when the upstream server composed the step until the edge has
+/// it, in simulated time), the CPU time for the relay updates, and checks that all edges ended up with the same
+/// steps as the upstream server.
+/// @param setup edge count, client count and tick count
+/// @return negative on error
+int nimbleServerBenchRelay(const NimbleServerBenchRelaySetup* setup)
+{
+    if (setup->tickCount == 0 || setup->edgeCount == 0 || setup->edgeCount > NIMBLE_SERVER_RELAY_MAX_LINK_COUNT) {
+        CLOG_SOFT_ERROR("relay: tick count must be set, and edge count must be 1 to %d",
+                        NIMBLE_SERVER_RELAY_MAX_LINK_COUNT)
+        return -1;
+    }
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 128 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerImpairment noImpairment;
+    tc_mem_clear_type(&noImpairment);
+
+    NimbleServerSimulationSetup simulationSetup = {.clientCount = setup->clientCount,
+                                                   .participantsPerClient = 1,
+                                                   .stepOctetCount = 8,
+                                                   .redundancyCount = 3,
+                                                   .tickTimeMs = BENCH_RELAY_TARGET_TICK_TIME_MS,
+                                                   .seed = 0,
+                                                   .impairment = noImpairment,
+                                                   .allocator = &imprintSetup.tagAllocator.info,
+                                                   .blobAllocator = &imprintSetup.slabAllocator.info,
+                                                   .log = log};
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, simulationSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationJoinAll(&simulation, BENCH_RELAY_MAX_JOIN_TICK_COUNT);
+    if (err < 0) {
+        return err;
+    }
+    nimbleServerSimulationResetStats(&simulation);
+
+    static BenchRelayLinks links;
+    links.count = setup->edgeCount;
+    links.nextReadIndex = 0;
+
+    static NimbleServerRelayUpstream upstream;
+    NimbleServerRelayUpstreamSetup upstreamSetup = {
+        .server = &simulation.server,
+        .linkTransport = {.self = &links, .sendTo = linksSendTo, .receiveFrom = linksReceiveFrom},
+        .allocator = &imprintSetup.tagAllocator.info,
+        .firstTunnelTransportIndex = (uint8_t) setup->clientCount,
+        .tunnelCount = 0,
+        .redundancyStepCount = 0,
+        .log = log};
+    err = nimbleServerRelayUpstreamInit(&upstream, upstreamSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    static NimbleServerMemoryTransport localTransports[NIMBLE_SERVER_RELAY_MAX_LINK_COUNT];
+    static NimbleServerRelay relays[NIMBLE_SERVER_RELAY_MAX_LINK_COUNT];
+    for (size_t i = 0; i < setup->edgeCount; ++i) {
+        nimbleServerMemoryTransportInit(&links.transports[i], &imprintSetup.tagAllocator.info,
+                                        BENCH_RELAY_LINK_QUEUE_CAPACITY);
+        nimbleServerMemoryTransportInit(&localTransports[i], &imprintSetup.tagAllocator.info,
+                                        BENCH_RELAY_LINK_QUEUE_CAPACITY);
+
+        NimbleServerSetup edgeSetup = simulation.server.setup;
+        edgeSetup.multiTransport = localTransports[i].multiTransport;
+        edgeSetup.maxSpectatorCount = 16;
+
+        NimbleServerRelaySetup relaySetup = {.upstreamTransport = links.transports[i].clientMultiTransport,
+                                             .upstreamConnectionId = (int) i,
+                                             .useSnapshots = false,
+                                             .allocator = &imprintSetup.tagAllocator.info,
+                                             .log = log};
+        err = nimbleServerRelayInit(&relays[i], edgeSetup, relaySetup);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    uint64_t upstreamNanoseconds = 0;
+    uint64_t edgeNanoseconds = 0;
+
+    for (size_t tick = 0; tick < setup->tickCount; ++tick) {
+        err = nimbleServerSimulationTick(&simulation);
+        if (err < 0) {
+            return err;
+        }
+
+        uint64_t start = nimbleServerBenchCpuNanoseconds();
+        err = nimbleServerRelayUpstreamUpdate(&upstream);
+        upstreamNanoseconds += nimbleServerBenchCpuNanoseconds() - start;
+        if (err < 0) {
+            return err;
+        }
+
+        start = nimbleServerBenchCpuNanoseconds();
+        for (size_t i = 0; i < setup->edgeCount; ++i) {
+            err = nimbleServerRelayUpdate(&relays[i], simulation.nowMs);
+            if (err < 0) {
+                return err;
+            }
+        }
+        edgeNanoseconds += nimbleServerBenchCpuNanoseconds() - start;
+    }
+
+    NimbleServerRelayStats total;
+    tc_mem_clear_type(&total);
+    size_t edgesBehindCount = 0;
+    const NbsSteps* upstreamSteps = &simulation.server.game.authoritativeSteps;
+    for (size_t i = 0; i < setup->edgeCount; ++i) {
+        const NimbleServerRelayStats* stats = &relays[i].stats;
+        total.receivedStepCount += stats->receivedStepCount;
+        total.restartCount += stats->restartCount;
+        total.hopLatencySampleCount += stats->hopLatencySampleCount;
+        total.hopLatencyTotalMs += stats->hopLatencyTotalMs;
+        if (stats->hopLatencyMaxMs > total.hopLatencyMaxMs) {
+            total.hopLatencyMaxMs = stats->hopLatencyMaxMs;
+        }
+        if (relays[i].edge.game.authoritativeSteps.expectedWriteId != upstreamSteps->expectedWriteId) {
+            edgesBehindCount++;
+        }
+    }
+
+    double tickCount = (double) setup->tickCount;
+
+    printf("{\"benchmark\":\"relay\",\"edgeCount\":%zu,\"clientCount\":%zu,\"tickCount\":%zu,", setup->edgeCount,
+           setup->clientCount, setup->tickCount);
+    printf("\"hopLatencyMs\":{\"average\":%.2f,\"max\":%" PRIu64 ",\"sampleCount\":%" PRIu64 "},",
+           total.hopLatencySampleCount > 0 ? (double) total.hopLatencyTotalMs / (double) total.hopLatencySampleCount
+                                           : 0.0,
+           total.hopLatencyMaxMs, total.hopLatencySampleCount);
+    printf("\"cpuNanosecondsPerTick\":{\"upstream\":%.1f,\"edges\":%.1f},", (double) upstreamNanoseconds / tickCount,
+           (double) edgeNanoseconds / tickCount);
+    printf("\"linkDatagramCount\":%" PRIu64 ",\"linkOctetCount\":%" PRIu64 ",", upstream.stats.stepsDatagramCount,
+           upstream.stats.stepsOctetCount);
+    printf("\"receivedStepCount\":%" PRIu64 ",\"restartCount\":%" PRIu64 ",\"edgesBehindCount\":%zu,",
+           total.receivedStepCount, total.restartCount, edgesBehindCount);
+    printf("\"authoritativeStepCount\":%" PRIu64 "}\n", simulation.stats.authoritativeStepCount);
+
+    return 0;
+}
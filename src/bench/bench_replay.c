@@ -0,0 +1,99 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server/replayer.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Reads a complete file into memory
+/// @param filename file to read
+/// @param[out] octetCount octet count of the file
+/// @return the file contents (to be freed with free()), or NULL on error
+static uint8_t* readFile(const char* filename, size_t* octetCount)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == 0) {
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (fileSize <= 0) {
+        fclose(file);
+        return 0;
+    }
+
+    uint8_t* octets = malloc((size_t) fileSize);
+    if (octets == 0 || fread(octets, 1, (size_t) fileSize, file) != (size_t) fileSize) {
+        free(octets);
+        fclose(file);
+        return 0;
+    }
+
+    fclose(file);
+    *octetCount = (size_t) fileSize;
+
+    return octets;
+}
+
+/// Replays a recorded session as fast as possible, checks that the server sends the same datagrams as in the
+/// recording and reports the throughput as a single JSON object on stdout.
+/// @param filename recording made with NimbleServerRecorder, e.g. by `nimble_server_bench throughput --record`
+/// @return negative on error or if the output differs from the recording
+int nimbleServerBenchReplay(const char* filename)
+{
+    size_t octetCount;
+    uint8_t* recording = readFile(filename, &octetCount);
+    if (recording == 0) {
+        CLOG_SOFT_ERROR("replay: could not read recording '%s'", filename)
+        return -1;
+    }
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "replay";
+
+    static NimbleServerReplayer replayer;
+    int err = nimbleServerReplayerInit(&replayer, recording, octetCount, &imprintSetup.tagAllocator.info,
+                                       &imprintSetup.slabAllocator.info, log);
+    if (err < 0) {
+        free(recording);
+        return err;
+    }
+
+    uint64_t start = nimbleServerBenchCpuNanoseconds();
+    err = nimbleServerReplayerRun(&replayer);
+    uint64_t elapsedNanoseconds = nimbleServerBenchCpuNanoseconds() - start;
+    free(recording);
+    if (err < 0) {
+        return err;
+    }
+
+    const NimbleServerReplayerStats* stats = &replayer.stats;
+    double seconds = (double) elapsedNanoseconds / 1000000000.0;
+
+    printf("{\"benchmark\":\"replay\",\"recordingOctetCount\":%zu,\"recordCount\":%" PRIu64 ",", octetCount,
+           stats->recordCount);
+    printf("\"datagramCount\":%" PRIu64 ",\"datagramOctetCount\":%" PRIu64 ",\"updateCount\":%" PRIu64
+           ",\"outputCount\":%" PRIu64 ",\"mismatchCount\":%" PRIu64 ",",
+           stats->feedCount, stats->feedOctetCount, stats->updateCount, stats->outputCount, stats->mismatchCount);
+    printf("\"cpuNanoseconds\":%" PRIu64 ",\"datagramsPerSecond\":%.1f,\"updatesPerSecond\":%.1f}\n",
+           elapsedNanoseconds, (double) stats->feedCount / seconds, (double) stats->updateCount / seconds);
+
+    if (stats->mismatchCount > 0) {
+        CLOG_SOFT_ERROR("replay: %" PRIu64 " outputs differ from the recording", stats->mismatchCount)
+        return -1;
+    }
+
+    return 0;
+}
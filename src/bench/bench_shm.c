@@ -0,0 +1,326 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <arpa/inet.h>
+#include <clog/clog.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <nimble-server-shm-transport/shm_transport.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_SHM_NAME "/nimble-server-bench-shm"
+#define BENCH_SHM_WAIT_TIMEOUT_MS (100)
+#define BENCH_SHM_SLOT_COUNT (256)
+
+typedef int (*BenchShmWaitFn)(void* self, int timeoutMs);
+
+/// The server side of the bench. It echoes every datagram back to the connection it came from, using only the
+/// DatagramTransportMulti interface, the same way as nimbleServerReadFromMultiTransport.
+typedef struct BenchShmEcho {
+    DatagramTransportMulti transport;
+    BenchShmWaitFn wait;
+    void* waitSelf;
+    int shouldStop;
+} BenchShmEcho;
+
+typedef struct BenchShmClient {
+    DatagramTransport transport;
+    BenchShmWaitFn wait;
+    void* waitSelf;
+} BenchShmClient;
+
+typedef struct BenchShmUdpServer {
+    int socket;
+    struct sockaddr_in peer;
+} BenchShmUdpServer;
+
+typedef struct BenchShmResult {
+    uint64_t totalNanoseconds;
+    uint64_t p50Nanoseconds;
+    uint64_t p99Nanoseconds;
+    uint64_t maxNanoseconds;
+    uint64_t cpuNanoseconds;
+} BenchShmResult;
+
+static void* echoThread(void* _self)
+{
+    BenchShmEcho* self = (BenchShmEcho*) _self;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    while (!__atomic_load_n(&self->shouldStop, __ATOMIC_ACQUIRE)) {
+        self->wait(self->waitSelf, BENCH_SHM_WAIT_TIMEOUT_MS);
+        int connectionId;
+        ssize_t octetCount;
+        while ((octetCount = self->transport.receiveFrom(self->transport.self, &connectionId, datagram,
+                                                         sizeof(datagram))) > 0) {
+            self->transport.sendTo(self->transport.self, connectionId, datagram, (size_t) octetCount);
+        }
+    }
+
+    return 0;
+}
+
+static int waitForSocket(int socket, int timeoutMs)
+{
+    struct pollfd pollDescriptor = {.fd = socket, .events = POLLIN, .revents = 0};
+    return poll(&pollDescriptor, 1, timeoutMs);
+}
+
+static int udpServerWait(void* _self, int timeoutMs)
+{
+    return waitForSocket(((BenchShmUdpServer*) _self)->socket, timeoutMs);
+}
+
+/// Loopback UDP as a DatagramTransportMulti with a single peer, that is connection zero
+static int udpServerSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    BenchShmUdpServer* self = (BenchShmUdpServer*) _self;
+    (void) connectionId;
+
+    ssize_t sentCount = sendto(self->socket, data, octetCount, 0, (const struct sockaddr*) &self->peer,
+                               sizeof(self->peer));
+    return sentCount < 0 ? -1 : 0;
+}
+
+static ssize_t udpServerReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t octetCount)
+{
+    BenchShmUdpServer* self = (BenchShmUdpServer*) _self;
+    socklen_t addressLength = sizeof(self->peer);
+    ssize_t receivedCount = recvfrom(self->socket, data, octetCount, MSG_DONTWAIT, (struct sockaddr*) &self->peer,
+                                     &addressLength);
+    if (receivedCount < 0) {
+        return 0;
+    }
+
+    *connectionId = 0;
+
+    return receivedCount;
+}
+
+static int udpClientWait(void* _self, int timeoutMs)
+{
+    return waitForSocket(*(int*) _self, timeoutMs);
+}
+
+static int udpClientSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    return send(*(int*) _self, data, octetCount, 0) < 0 ? -1 : 0;
+}
+
+static ssize_t udpClientReceive(void* _self, uint8_t* data, size_t octetCount)
+{
+    ssize_t receivedCount = recv(*(int*) _self, data, octetCount, MSG_DONTWAIT);
+    return receivedCount < 0 ? 0 : receivedCount;
+}
+
+static int shmServerWait(void* _self, int timeoutMs)
+{
+    return nimbleServerShmTransportWait((NimbleServerShmTransport*) _self, timeoutMs);
+}
+
+static int shmClientWait(void* _self, int timeoutMs)
+{
+    return nimbleServerShmTransportClientWait((NimbleServerShmTransportClient*) _self, timeoutMs);
+}
+
+static int compareNanoseconds(const void* a, const void* b)
+{
+    uint64_t first = *(const uint64_t*) a;
+    uint64_t second = *(const uint64_t*) b;
+
+    return first < second ? -1 : first > second;
+}
+
+/// Sends one datagram at a time and waits for the echo
+/// @return negative on error
+static int pingPong(BenchShmClient* client, BenchShmEcho* echo, const NimbleServerBenchShmSetup* setup,
+                    uint64_t* roundTripNanoseconds, BenchShmResult* result)
+{
+    pthread_t thread;
+    echo->shouldStop = 0;
+    if (pthread_create(&thread, 0, echoThread, echo) != 0) {
+        return -1;
+    }
+
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    uint8_t received[DATAGRAM_TRANSPORT_MAX_SIZE];
+    memset(datagram, 0x5a, setup->octetCount);
+
+    int err = 0;
+    uint64_t cpuStart = nimbleServerBenchCpuNanoseconds();
+    uint64_t start = nimbleServerBenchNanoseconds();
+    for (size_t i = 0; i < setup->roundTripCount; ++i) {
+        datagram[0] = (uint8_t) i;
+        uint64_t sentAt = nimbleServerBenchNanoseconds();
+        err = client->transport.send(client->transport.self, datagram, setup->octetCount);
+        if (err < 0) {
+            break;
+        }
+
+        ssize_t receivedCount;
+        while ((receivedCount = client->transport.receive(client->transport.self, received, sizeof(received))) == 0) {
+            if (client->wait(client->waitSelf, BENCH_SHM_WAIT_TIMEOUT_MS) == 0) {
+                CLOG_SOFT_ERROR("shm: no echo for datagram %zu", i)
+                err = -1;
+                break;
+            }
+        }
+        if (err < 0 || receivedCount != (ssize_t) setup->octetCount || received[0] != (uint8_t) i) {
+            err = -1;
+            break;
+        }
+
+        roundTripNanoseconds[i] = nimbleServerBenchNanoseconds() - sentAt;
+    }
+    result->totalNanoseconds = nimbleServerBenchNanoseconds() - start;
+    result->cpuNanoseconds = nimbleServerBenchCpuNanoseconds() - cpuStart;
+
+    __atomic_store_n(&echo->shouldStop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+
+    if (err < 0) {
+        return err;
+    }
+
+    qsort(roundTripNanoseconds, setup->roundTripCount, sizeof(uint64_t), compareNanoseconds);
+    result->p50Nanoseconds = roundTripNanoseconds[setup->roundTripCount / 2];
+    result->p99Nanoseconds = roundTripNanoseconds[(setup->roundTripCount * 99) / 100];
+    result->maxNanoseconds = roundTripNanoseconds[setup->roundTripCount - 1];
+
+    return 0;
+}
+
+static int pingPongUdp(const NimbleServerBenchShmSetup* setup, uint64_t* roundTripNanoseconds,
+                       BenchShmResult* result)
+{
+    BenchShmUdpServer server;
+    server.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    int clientSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server.socket < 0 || clientSocket < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t addressLength = sizeof(address);
+    int err = -1;
+    if (bind(server.socket, (struct sockaddr*) &address, sizeof(address)) == 0 &&
+        getsockname(server.socket, (struct sockaddr*) &address, &addressLength) == 0 &&
+        connect(clientSocket, (struct sockaddr*) &address, sizeof(address)) == 0) {
+        BenchShmEcho echo = {.transport = {.self = &server,
+                                           .sendTo = udpServerSendTo,
+                                           .receiveFrom = udpServerReceiveFrom},
+                             .wait = udpServerWait,
+                             .waitSelf = &server};
+        BenchShmClient client = {.transport = {.self = &clientSocket,
+                                               .send = udpClientSend,
+                                               .receive = udpClientReceive},
+                                 .wait = udpClientWait,
+                                 .waitSelf = &clientSocket};
+        err = pingPong(&client, &echo, setup, roundTripNanoseconds, result);
+    }
+
+    close(clientSocket);
+    close(server.socket);
+
+    return err;
+}
+
+static int pingPongShm(const NimbleServerBenchShmSetup* setup, uint64_t* roundTripNanoseconds,
+                       BenchShmResult* result, NimbleServerShmTransportStats* serverStats)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    static NimbleServerShmTransport server;
+    NimbleServerShmTransportSetup shmSetup = {
+        .name = BENCH_SHM_NAME, .connectionCount = 1, .slotCount = BENCH_SHM_SLOT_COUNT, .log = log};
+    int err = nimbleServerShmTransportCreate(&server, shmSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    static NimbleServerShmTransportClient shmClient;
+    err = nimbleServerShmTransportClientAttach(&shmClient, BENCH_SHM_NAME, log);
+    if (err >= 0) {
+        BenchShmEcho echo = {.transport = server.multiTransport, .wait = shmServerWait, .waitSelf = &server};
+        BenchShmClient client = {.transport = shmClient.transport, .wait = shmClientWait, .waitSelf = &shmClient};
+        err = pingPong(&client, &echo, setup, roundTripNanoseconds, result);
+        nimbleServerShmTransportClientDetach(&shmClient);
+    }
+
+    *serverStats = server.stats;
+    nimbleServerShmTransportDestroy(&server);
+
+    return err;
+}
+
+static void outputResultJson(const char* name, const BenchShmResult* result, size_t roundTripCount)
+{
+    printf("\"%s\":{\"roundTripsPerSecond\":%.0f,\"roundTripNanoseconds\":{\"average\":%.0f,\"p50\":%" PRIu64
+           ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 "},\"processCpuNanosecondsPerRoundTrip\":%.0f}",
+           name, (double) roundTripCount * 1e9 / (double) result->totalNanoseconds,
+           (double) result->totalNanoseconds / (double) roundTripCount, result->p50Nanoseconds, result->p99Nanoseconds,
+           result->maxNanoseconds, (double) result->cpuNanoseconds / (double) roundTripCount);
+}
+
+/// Compares the shared memory transport with loopback UDP. A client sends one datagram at a time and waits for the
+/// echo from a server thread that only uses the DatagramTransportMulti interface. Both sides sleep while they wait,
+/// (futex for the shared memory transport, poll() for UDP), so the round trip includes the wakeups.
+/// @param setup round trip count and datagram size
+/// @return negative on error
+int nimbleServerBenchShm(const NimbleServerBenchShmSetup* setup)
+{
+    if (setup->roundTripCount == 0 || setup->octetCount == 0 || setup->octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        CLOG_SOFT_ERROR("shm: round trip count must be set, and octet count must be 1 to %d",
+                        DATAGRAM_TRANSPORT_MAX_SIZE)
+        return -1;
+    }
+
+    uint64_t* roundTripNanoseconds = malloc(setup->roundTripCount * sizeof(uint64_t));
+    if (roundTripNanoseconds == 0) {
+        return -1;
+    }
+
+    BenchShmResult udpResult;
+    int err = pingPongUdp(setup, roundTripNanoseconds, &udpResult);
+    if (err < 0) {
+        free(roundTripNanoseconds);
+        return err;
+    }
+
+    BenchShmResult shmResult;
+    NimbleServerShmTransportStats shmStats;
+    err = pingPongShm(setup, roundTripNanoseconds, &shmResult, &shmStats);
+    free(roundTripNanoseconds);
+    if (err < 0) {
+        return err;
+    }
+
+    printf("{\"benchmark\":\"shm\",\"roundTripCount\":%zu,\"octetCount\":%zu,", setup->roundTripCount,
+           setup->octetCount);
+    outputResultJson("udpLoopback", &udpResult, setup->roundTripCount);
+    printf(",");
+    outputResultJson("sharedMemory", &shmResult, setup->roundTripCount);
+    printf(",\"sharedMemoryWakeupsFromServerCount\":%" PRIu64 "}\n", shmStats.wakeupCount);
+
+    return 0;
+}
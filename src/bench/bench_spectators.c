@@ -0,0 +1,159 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server-simulation/simulation.h>
+#include <nimble-server/spectators.h>
+#include <stdio.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BENCH_SPECTATORS_MAX_JOIN_TICK_COUNT (1000)
+#define BENCH_SPECTATORS_TARGET_TICK_TIME_MS (16)
+#define BENCH_SPECTATORS_FIRST_CONNECTION_ID (1000)
+#define BENCH_SPECTATORS_ACK_INTERVAL_TICK_COUNT (4)
+
+typedef struct BenchSpectatorsTransport {
+    uint64_t datagramCount;
+    uint64_t octetCount;
+} BenchSpectatorsTransport;
+
+static int countingSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    BenchSpectatorsTransport* self = (BenchSpectatorsTransport*) _self;
+    (void) connectionId;
+    (void) data;
+
+    self->datagramCount++;
+    self->octetCount += octetCount;
+
+    return 0;
+}
+
+static ssize_t nothingToReceive(void* _self, int* connectionId, uint8_t* data, size_t octetCount)
+{
+    (void) _self;
+    (void) connectionId;
+    (void) data;
+    (void) octetCount;
+
+    return 0;
+}
+
+/// Runs the server with synthetic clients and pushes the authoritative steps to the spectators every tick.
+/// The spectators do not go through the transport connections (they are limited to
+/// NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS), they are added directly and the datagrams are counted instead of
+/// sent. The spectators ack at different ticks, so they need a few different ranges.
+/// Reports the CPU time for the push, the number of serializations compared to the number of datagrams, and the
+/// authoritative and forced steps, that should be the same as without spectators.
+/// @param setup spectator count, client count and tick count
+/// @return negative on error
+int nimbleServerBenchSpectators(const NimbleServerBenchSpectatorsSetup* setup)
+{
+    if (setup->tickCount == 0) {
+        CLOG_SOFT_ERROR("spectators: tick count must be set")
+        return -1;
+    }
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerImpairment noImpairment;
+    tc_mem_clear_type(&noImpairment);
+
+    NimbleServerSimulationSetup simulationSetup = {.clientCount = setup->clientCount,
+                                                   .participantsPerClient = 1,
+                                                   .stepOctetCount = 8,
+                                                   .redundancyCount = 3,
+                                                   .tickTimeMs = BENCH_SPECTATORS_TARGET_TICK_TIME_MS,
+                                                   .seed = 0,
+                                                   .impairment = noImpairment,
+                                                   .allocator = &imprintSetup.tagAllocator.info,
+                                                   .blobAllocator = &imprintSetup.slabAllocator.info,
+                                                   .log = log};
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, simulationSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationJoinAll(&simulation, BENCH_SPECTATORS_MAX_JOIN_TICK_COUNT);
+    if (err < 0) {
+        return err;
+    }
+    nimbleServerSimulationResetStats(&simulation);
+
+    const NimbleServerGame* game = &simulation.server.game;
+
+    static NimbleServerSpectators spectators;
+    nimbleServerSpectatorsInit(&spectators, &imprintSetup.tagAllocator.info, setup->spectatorCount,
+                               setup->redundancyStepCount, log);
+    for (size_t i = 0; i < setup->spectatorCount; ++i) {
+        int spectatorIndex = nimbleServerSpectatorsAdd(&spectators, BENCH_SPECTATORS_FIRST_CONNECTION_ID + (int) i,
+                                                       0, game->authoritativeSteps.expectedWriteId);
+        if (spectatorIndex < 0) {
+            return spectatorIndex;
+        }
+        nimbleServerSpectatorsAck(&spectators, &spectators.spectators[spectatorIndex],
+                                  game->authoritativeSteps.expectedWriteId);
+    }
+
+    BenchSpectatorsTransport countingTransport = {0, 0};
+    DatagramTransportMulti transport;
+    transport.self = &countingTransport;
+    transport.sendTo = countingSendTo;
+    transport.receiveFrom = nothingToReceive;
+
+    uint64_t pushNanoseconds = 0;
+    uint64_t maxPushNanoseconds = 0;
+
+    for (size_t tick = 0; tick < setup->tickCount; ++tick) {
+        err = nimbleServerSimulationTick(&simulation);
+        if (err < 0) {
+            return err;
+        }
+
+        for (size_t i = tick % BENCH_SPECTATORS_ACK_INTERVAL_TICK_COUNT; i < spectators.capacity;
+             i += BENCH_SPECTATORS_ACK_INTERVAL_TICK_COUNT) {
+            NimbleServerSpectator* spectator = &spectators.spectators[i];
+            nimbleServerSpectatorsAck(&spectators, spectator, spectator->pushedUpToStepId);
+        }
+
+        uint64_t start = nimbleServerBenchCpuNanoseconds();
+        err = nimbleServerSpectatorsPush(&spectators, game, &transport);
+        uint64_t elapsed = nimbleServerBenchCpuNanoseconds() - start;
+        if (err < 0) {
+            return err;
+        }
+
+        pushNanoseconds += elapsed;
+        if (elapsed > maxPushNanoseconds) {
+            maxPushNanoseconds = elapsed;
+        }
+    }
+
+    const NimbleServerSpectatorsStats* stats = &spectators.stats;
+    const NimbleServerSimulationStats* simulationStats = &simulation.stats;
+    double tickCount = (double) setup->tickCount;
+
+    printf("{\"benchmark\":\"spectators\",\"spectatorCount\":%zu,\"clientCount\":%zu,\"tickCount\":%zu,",
+           setup->spectatorCount, setup->clientCount, setup->tickCount);
+    printf("\"pushDatagramCount\":%" PRIu64 ",\"pushOctetCount\":%" PRIu64 ",\"serializeCount\":%" PRIu64 ",",
+           stats->pushDatagramCount, stats->pushOctetCount, stats->serializeCount);
+    printf("\"pushCpuNanoseconds\":{\"averagePerTick\":%.1f,\"max\":%" PRIu64 ",\"averagePerDatagram\":%.1f},",
+           (double) pushNanoseconds / tickCount, maxPushNanoseconds,
+           stats->pushDatagramCount > 0 ? (double) pushNanoseconds / (double) stats->pushDatagramCount : 0.0);
+    printf("\"authoritativeStepCount\":%" PRIu64 ",\"forcedStepCount\":%" PRIu64 "}\n",
+           simulationStats->authoritativeStepCount, simulationStats->forcedStepCount);
+
+    return 0;
+}
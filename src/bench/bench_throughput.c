@@ -0,0 +1,257 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-server-simulation/simulation.h>
+#include <nimble-server/recorder.h>
+#if !defined TORNADO_OS_WINDOWS
+#include <nimble-server-step-log/step_log.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define BENCH_THROUGHPUT_MAX_JOIN_TICK_COUNT (1000)
+#define BENCH_THROUGHPUT_TARGET_TICK_TIME_MS (16)
+#define BENCH_THROUGHPUT_STEP_LOG_RING_OCTET_COUNT (4 * 1024 * 1024)
+#define BENCH_THROUGHPUT_STEP_LOG_WRITE_BUFFER_OCTET_COUNT (256 * 1024)
+#define BENCH_THROUGHPUT_STEP_LOG_SNAPSHOT_INTERVAL_STEP_COUNT (600)
+#define BENCH_THROUGHPUT_GAME_STATE_OCTET_COUNT (16 * 1024)
+
+static int compareUInt64(const void* a, const void* b)
+{
+    uint64_t valueA = *(const uint64_t*) a;
+    uint64_t valueB = *(const uint64_t*) b;
+
+    return valueA < valueB ? -1 : (valueA > valueB ? 1 : 0);
+}
+
+static int writeToFile(void* self, const uint8_t* octets, size_t octetCount)
+{
+    FILE* file = (FILE*) self;
+
+    return fwrite(octets, 1, octetCount, file) == octetCount ? 0 : -1;
+}
+
+/// Returns a game state of a fixed size, so the step log has snapshots to write
+static void serializeGameState(void* _self, NimbleServerSerializedGameState* state)
+{
+    const NimbleServerSimulation* simulation = (const NimbleServerSimulation*) _self;
+    static uint8_t gameState[BENCH_THROUGHPUT_GAME_STATE_OCTET_COUNT];
+
+    state->gameState = gameState;
+    state->gameStateOctetCount = sizeof(gameState);
+    state->stepId = simulation->server.game.authoritativeSteps.expectedWriteId;
+    state->hash = 0;
+}
+
+/// Writes the result as a single JSON object on stdout, without the closing brace.
+/// The rates are calculated from the CPU time spent in the server, the time for the synthetic clients is not
+/// included.
+/// @param self simulation
+/// @param setup bench setup
+/// @param tickNanoseconds the server thread CPU time for each tick. Is sorted in place.
+/// @param tickWallNanoseconds the wall clock time for each tick. Is sorted in place.
+static void outputJson(const NimbleServerSimulation* self, const NimbleServerBenchThroughputSetup* setup,
+                       uint64_t* tickNanoseconds, uint64_t* tickWallNanoseconds)
+{
+    uint64_t totalTickNanoseconds = 0;
+    for (size_t i = 0; i < setup->tickCount; ++i) {
+        totalTickNanoseconds += tickNanoseconds[i];
+    }
+    qsort(tickNanoseconds, setup->tickCount, sizeof(tickNanoseconds[0]), compareUInt64);
+    qsort(tickWallNanoseconds, setup->tickCount, sizeof(tickWallNanoseconds[0]), compareUInt64);
+
+    double seconds = (double) totalTickNanoseconds / 1000000000.0;
+    double tickCount = (double) setup->tickCount;
+    const NimbleServerMemoryTransport* transport = &self->memoryTransport;
+    const NimbleServerSimulationStats* stats = &self->stats;
+
+    printf("{\"benchmark\":\"throughput\","
+           "\"clientCount\":%zu,\"participantsPerClient\":%zu,\"stepOctetCount\":%zu,\"redundancyCount\":%zu,"
+           "\"tickCount\":%zu,",
+           setup->clientCount, setup->participantsPerClient, setup->stepOctetCount, setup->redundancyCount,
+           setup->tickCount);
+    printf("\"datagramCount\":%" PRIu64 ",\"datagramsPerSecond\":%.1f,\"requestOctetCount\":%" PRIu64 ",",
+           transport->datagramsToServerCount, (double) transport->datagramsToServerCount / seconds,
+           transport->octetsToServerCount);
+    printf("\"authoritativeStepCount\":%" PRIu64 ",\"authoritativeStepsPerSecond\":%.1f,", stats->authoritativeStepCount,
+           (double) stats->authoritativeStepCount / seconds);
+    printf("\"tickCpuNanoseconds\":{\"average\":%.1f,\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 "},",
+           (double) totalTickNanoseconds / tickCount, tickNanoseconds[setup->tickCount / 2],
+           tickNanoseconds[(setup->tickCount * 99) / 100], tickNanoseconds[setup->tickCount - 1]);
+    printf("\"tickWallNanoseconds\":{\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 "},",
+           tickWallNanoseconds[setup->tickCount / 2], tickWallNanoseconds[(setup->tickCount * 99) / 100],
+           tickWallNanoseconds[setup->tickCount - 1]);
+    printf("\"replyDatagramCount\":%" PRIu64 ",\"replyOctetCount\":%" PRIu64 ",\"replyOctetsPerTick\":%.1f,",
+           stats->replyDatagramCount, stats->replyOctetCount, (double) stats->replyOctetCount / tickCount);
+    printf("\"droppedDatagramCount\":%zu", transport->toServer.droppedCount + transport->toClients.droppedCount);
+}
+
+#if !defined TORNADO_OS_WINDOWS
+/// Adds what the step log writer did to the JSON object. Compare tickCpuNanoseconds and tickWallNanoseconds with a
+/// run without the step log to see the cost on the server thread.
+/// @param stepLog closed step log
+static void outputStepLogJson(const NimbleServerStepLog* stepLog)
+{
+    const NimbleServerStepLogStats* stats = &stepLog->stats;
+    double writerSeconds = (double) stats->busyNanoseconds / 1000000000.0;
+    double megaOctetsPerSecond = writerSeconds > 0.0 ? (double) stats->octetCount / writerSeconds / 1000000.0 : 0.0;
+
+    printf(",\"stepLog\":{\"stepCount\":%" PRIu64 ",\"snapshotCount\":%" PRIu64 ",\"octetCount\":%" PRIu64
+           ",\"droppedCount\":%" PRIu64 ",",
+           stats->stepCount, stats->snapshotCount, stats->octetCount, stepLog->droppedCount);
+    printf("\"writeCallCount\":%" PRIu64 ",\"writerBusyNanoseconds\":%" PRIu64 ",\"writerMegaOctetsPerSecond\":%.1f}",
+           stats->writeCallCount, stats->busyNanoseconds, megaOctetsPerSecond);
+}
+#endif
+
+/// Runs the server with synthetic clients that connect, join and send predicted steps every tick, over an
+/// in-memory transport. Reports datagrams and authoritative steps per second, the CPU time for each server tick
+/// and the reply octets as JSON. The session can be recorded, to be used with `nimble_server_bench replay`, and
+/// the authoritative steps can be written to a step log.
+/// @param setup client count, participants, step size, tick count, optional recording file and step log
+/// @return negative on error
+int nimbleServerBenchThroughput(const NimbleServerBenchThroughputSetup* setup)
+{
+    if (setup->tickCount == 0) {
+        CLOG_SOFT_ERROR("throughput: tick count must be set")
+        return -1;
+    }
+
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerImpairment noImpairment;
+    tc_mem_clear_type(&noImpairment);
+
+    static NimbleServerSimulation simulation;
+    static NimbleServerCallbackObjectVtbl stepLogVtbl = {.authoritativeStateSerializeFn = serializeGameState};
+    NimbleServerCallbackObject callbackObject = {.vtbl = setup->stepLogBasePath != 0 ? &stepLogVtbl : 0,
+                                                 .self = &simulation};
+
+    NimbleServerSimulationSetup simulationSetup = {.clientCount = setup->clientCount,
+                                                   .participantsPerClient = setup->participantsPerClient,
+                                                   .stepOctetCount = setup->stepOctetCount,
+                                                   .redundancyCount = setup->redundancyCount,
+                                                   .tickTimeMs = BENCH_THROUGHPUT_TARGET_TICK_TIME_MS,
+                                                   .seed = 0,
+                                                   .impairment = noImpairment,
+                                                   .allocator = &imprintSetup.tagAllocator.info,
+                                                   .blobAllocator = &imprintSetup.slabAllocator.info,
+                                                   .callbackObject = callbackObject,
+                                                   .log = log};
+
+    int err = nimbleServerSimulationInit(&simulation, simulationSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    FILE* recordFile = 0;
+    static NimbleServerRecorder recorder;
+    if (setup->recordFilename != 0) {
+        recordFile = fopen(setup->recordFilename, "wb");
+        if (recordFile == 0) {
+            CLOG_SOFT_ERROR("throughput: could not create recording '%s'", setup->recordFilename)
+            return -1;
+        }
+        err = nimbleServerRecorderInit(&recorder, &simulation.server, writeToFile, recordFile);
+        if (err < 0) {
+            fclose(recordFile);
+            return err;
+        }
+    }
+
+#if !defined TORNADO_OS_WINDOWS
+    static NimbleServerStepLog stepLog;
+    if (setup->stepLogBasePath != 0) {
+        NimbleServerStepLogSetup stepLogSetup = {.basePath = setup->stepLogBasePath,
+                                                 .ringOctetCount = BENCH_THROUGHPUT_STEP_LOG_RING_OCTET_COUNT,
+                                                 .writeBufferOctetCount =
+                                                     BENCH_THROUGHPUT_STEP_LOG_WRITE_BUFFER_OCTET_COUNT,
+                                                 .initialIndexCapacity = setup->tickCount + 1024,
+                                                 .snapshotIntervalStepCount =
+                                                     BENCH_THROUGHPUT_STEP_LOG_SNAPSHOT_INTERVAL_STEP_COUNT,
+                                                 .log = log};
+        err = nimbleServerStepLogInit(&stepLog, stepLogSetup, &imprintSetup.tagAllocator.info);
+        if (err < 0) {
+            return err;
+        }
+        nimbleServerStepLogAttach(&stepLog, &simulation.server);
+    }
+#else
+    if (setup->stepLogBasePath != 0) {
+        CLOG_SOFT_ERROR("throughput: the step log is not supported on this platform")
+        return -1;
+    }
+#endif
+
+    err = nimbleServerSimulationJoinAll(&simulation, BENCH_THROUGHPUT_MAX_JOIN_TICK_COUNT);
+    if (err < 0) {
+        return err;
+    }
+
+    nimbleServerSimulationResetStats(&simulation);
+    simulation.memoryTransport.datagramsToServerCount = 0;
+    simulation.memoryTransport.octetsToServerCount = 0;
+
+    // The server thread CPU time, so the time of the step log writer thread is not included
+    uint64_t* tickNanoseconds = IMPRINT_ALLOC_TYPE_COUNT(&imprintSetup.tagAllocator.info, uint64_t, setup->tickCount);
+    uint64_t* tickWallNanoseconds = IMPRINT_ALLOC_TYPE_COUNT(&imprintSetup.tagAllocator.info, uint64_t,
+                                                             setup->tickCount);
+
+    for (size_t i = 0; i < setup->tickCount; ++i) {
+        err = nimbleServerSimulationTickClients(&simulation);
+        if (err < 0) {
+            return err;
+        }
+
+        uint64_t wallStart = nimbleServerBenchNanoseconds();
+        uint64_t start = nimbleServerBenchThreadCpuNanoseconds();
+        err = nimbleServerSimulationTickServer(&simulation);
+        tickNanoseconds[i] = nimbleServerBenchThreadCpuNanoseconds() - start;
+        tickWallNanoseconds[i] = nimbleServerBenchNanoseconds() - wallStart;
+        if (err < 0) {
+            return err;
+        }
+
+        nimbleServerSimulationDeliverToClients(&simulation);
+    }
+
+    outputJson(&simulation, setup, tickNanoseconds, tickWallNanoseconds);
+
+#if !defined TORNADO_OS_WINDOWS
+    int stepLogErr = 0;
+    if (setup->stepLogBasePath != 0) {
+        simulation.server.game.observer.stepComposedFn = 0;
+        simulation.server.game.observer.snapshotFn = 0;
+        stepLogErr = nimbleServerStepLogClose(&stepLog);
+        outputStepLogJson(&stepLog);
+    }
+#endif
+    printf("}\n");
+
+    if (recordFile != 0) {
+        fclose(recordFile);
+        if (recorder.writeError < 0) {
+            return recorder.writeError;
+        }
+    }
+
+#if !defined TORNADO_OS_WINDOWS
+    if (stepLogErr < 0) {
+        return stepLogErr;
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include "tick_parties.h"
+#include <imprint/default_setup.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/server.h>
+#include <tiny-libc/tiny_libc.h>
+#include <stddef.h>
+
+#define BENCH_TICK_PARTIES_COUNT (64)
+#define BENCH_TICK_PARTIES_TICK_COUNT (100000)
+#define BENCH_TICK_PARTIES_WAITING_MAX_TICKS (2000)
+
+/// The NimbleServerLocalParty field order from before the cache line aware layout.
+/// The quality types are the current ones, the debug prefix that used to be in the quality is kept as padding.
+typedef struct BenchTickPartiesOldLayoutParty {
+    NimbleSerializeLocalPartyId id;
+    bool isUsed;
+    NimbleServerLocalPartyState state;
+    NimbleServerParticipantReferences participantReferences;
+    StatsInt incomingStepCountInBufferStats;
+    struct NimbleServerTransportConnection* transportConnection;
+    size_t waitingForReconnectTimer;
+    size_t waitingForReconnectMaxTimer;
+    NimbleServerConnectionQuality quality;
+    char qualityDebugPrefix[64];
+    NimbleServerConnectionQualityDelayed delayedQuality;
+    uint32_t warningCount;
+    uint32_t warningAboutZeroAddedSteps;
+    StepId highestReceivedStepId;
+    size_t stepsInBufferCount;
+    char debugPrefix[32];
+    Clog log;
+} BenchTickPartiesOldLayoutParty;
+
+/// Ticks the parties in the old layout, doing the same work as nimbleServerLocalPartyTick
+/// @param parties parties in the old layout
+/// @param count number of parties
+static void tickOldLayoutParties(BenchTickPartiesOldLayoutParty* parties, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        BenchTickPartiesOldLayoutParty* party = &parties[i];
+        if (!party->isUsed) {
+            continue;
+        }
+
+        switch (party->state) {
+            case NimbleServerLocalPartyStateNormal:
+                if (!nimbleServerConnectionQualityDelayedTick(&party->delayedQuality, &party->quality)) {
+                    party->state = NimbleServerLocalPartyStateWaitingForReJoin;
+                    party->waitingForReconnectTimer = 0;
+                }
+                break;
+            case NimbleServerLocalPartyStateWaitingForReJoin:
+                party->waitingForReconnectTimer++;
+                if (party->waitingForReconnectTimer >= party->waitingForReconnectMaxTimer) {
+                    party->isUsed = false;
+                }
+                break;
+            case NimbleServerLocalPartyStateDissolved:
+                break;
+        }
+    }
+}
+
+/// Measures ticking the parties in the old layout
+/// @param counters perf counters to fill in
+/// @param log log to use for the quality checks
+static void benchOldLayout(NimbleServerBenchPerfCounters* counters, Clog log)
+{
+    BenchTickPartiesOldLayoutParty parties[BENCH_TICK_PARTIES_COUNT];
+    tc_mem_clear_type_n(parties, BENCH_TICK_PARTIES_COUNT);
+
+    for (size_t i = 0; i < BENCH_TICK_PARTIES_COUNT; ++i) {
+        BenchTickPartiesOldLayoutParty* party = &parties[i];
+        party->id = (NimbleSerializeLocalPartyId) i;
+        party->isUsed = true;
+        party->state = (i % 2) == 0 ? NimbleServerLocalPartyStateNormal : NimbleServerLocalPartyStateWaitingForReJoin;
+        party->waitingForReconnectMaxTimer = BENCH_TICK_PARTIES_WAITING_MAX_TICKS;
+        party->log = log;
+        nimbleServerConnectionQualityInit(&party->quality, log);
+        nimbleServerConnectionQualityDelayedInit(&party->delayedQuality, log);
+    }
+
+    nimbleServerBenchPerfCountersStart(counters);
+    for (size_t tick = 0; tick < BENCH_TICK_PARTIES_TICK_COUNT; ++tick) {
+        tickOldLayoutParties(parties, BENCH_TICK_PARTIES_COUNT);
+
+        // Keep the parties that are waiting for rejoin from timing out
+        if ((tick % 1000) == 0) {
+            for (size_t i = 1; i < BENCH_TICK_PARTIES_COUNT; i += 2) {
+                parties[i].waitingForReconnectTimer = 0;
+            }
+        }
+    }
+    nimbleServerBenchPerfCountersStop(counters);
+}
+
+/// Measures ticking the parties of a server with nimbleServerTickParties, using the current layout
+/// @param counters perf counters to fill in
+/// @param log log to use for the server
+/// @return negative on error
+static int benchNewLayout(NimbleServerBenchPerfCounters* counters, Clog log)
+{
+    ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = {.applicationVersion.major = 0,
+                               .applicationVersion.minor = 0,
+                               .applicationVersion.patch = 0,
+                               .memory = &imprintSetup.tagAllocator.info,
+                               .blobAllocator = &imprintSetup.slabAllocator.info,
+                               .maxConnectionCount = BENCH_TICK_PARTIES_COUNT,
+                               .maxParticipantCount = BENCH_TICK_PARTIES_COUNT,
+                               .maxSingleParticipantStepOctetCount = 20,
+                               .maxParticipantCountForEachConnection = 1,
+                               .maxWaitingForReconnectTicks = BENCH_TICK_PARTIES_WAITING_MAX_TICKS,
+                               .maxGameStateOctetCount = 1024,
+                               .callbackObject.self = 0,
+                               .now = 0,
+                               .targetTickTimeMs = 16,
+                               .log = log};
+
+    NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    if (err < 0) {
+        imprintDefaultSetupDestroy(&imprintSetup);
+        return err;
+    }
+
+    NimbleSerializeLocalPartyInfo partyInfos[BENCH_TICK_PARTIES_COUNT];
+    for (size_t i = 0; i < BENCH_TICK_PARTIES_COUNT; ++i) {
+        partyInfos[i].participantCount = 1;
+        partyInfos[i].participantIds[0] = (NimbleSerializeParticipantId) i;
+    }
+
+    err = nimbleServerHostMigration(&server, partyInfos, BENCH_TICK_PARTIES_COUNT);
+    if (err < 0) {
+        imprintDefaultSetupDestroy(&imprintSetup);
+        return err;
+    }
+
+    for (size_t i = 0; i < BENCH_TICK_PARTIES_COUNT; ++i) {
+        NimbleServerLocalParty* party = &server.localParties.parties[i];
+        party->state = (i % 2) == 0 ? NimbleServerLocalPartyStateNormal : NimbleServerLocalPartyStateWaitingForReJoin;
+        party->waitingForReconnectMaxTimer = BENCH_TICK_PARTIES_WAITING_MAX_TICKS;
+    }
+
+    nimbleServerBenchPerfCountersStart(counters);
+    for (size_t tick = 0; tick < BENCH_TICK_PARTIES_TICK_COUNT; ++tick) {
+        nimbleServerTickParties(&server);
+
+        // Keep the parties that are waiting for rejoin from timing out
+        if ((tick % 1000) == 0) {
+            for (size_t i = 1; i < BENCH_TICK_PARTIES_COUNT; i += 2) {
+                server.localParties.parties[i].waitingForReconnectTimer = 0;
+            }
+        }
+    }
+    nimbleServerBenchPerfCountersStop(counters);
+
+    if (server.localParties.partiesCount != BENCH_TICK_PARTIES_COUNT) {
+        CLOG_NOTICE("tickParties: %zu of %d parties were dissolved during the bench",
+                    BENCH_TICK_PARTIES_COUNT - server.localParties.partiesCount, BENCH_TICK_PARTIES_COUNT)
+    }
+
+    imprintDefaultSetupDestroy(&imprintSetup);
+
+    return 0;
+}
+
+/// Prints one row of the layout comparison
+/// @param name name of the row
+/// @param oldValue value for the old layout
+/// @param newValue value for the new layout
+static void reportRow(const char* name, double oldValue, double newValue)
+{
+    CLOG_OUTPUT("tickParties: %-28s %12.3f %12.3f", name, oldValue, newValue)
+}
+
+/// Measures the time and cache misses for ticking 64 local parties, in the old and the current party layout.
+/// Half of the parties are in the normal state (connection quality checks) and half are waiting for rejoin.
+/// @return negative on error
+int nimbleServerBenchTickParties(void)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    NimbleServerBenchPerfCounters oldCounters;
+    nimbleServerBenchPerfCountersInit(&oldCounters);
+    benchOldLayout(&oldCounters, log);
+
+    NimbleServerBenchPerfCounters newCounters;
+    nimbleServerBenchPerfCountersInit(&newCounters);
+    int err = benchNewLayout(&newCounters, log);
+    if (err < 0) {
+        nimbleServerBenchPerfCountersDestroy(&newCounters);
+        nimbleServerBenchPerfCountersDestroy(&oldCounters);
+        return err;
+    }
+
+    size_t oldHotOctetCount = offsetof(BenchTickPartiesOldLayoutParty, stepsInBufferCount) + sizeof(size_t);
+    size_t newHotOctetCount = offsetof(NimbleServerLocalParty, transportConnection);
+    double tickCount = (double) BENCH_TICK_PARTIES_TICK_COUNT;
+
+    CLOG_OUTPUT("tickParties: %-28s %12s %12s", "", "old layout", "new layout")
+    reportRow("octets per party", (double) sizeof(BenchTickPartiesOldLayoutParty),
+              (double) sizeof(NimbleServerLocalParty));
+    reportRow("cache lines for tick fields",
+              (double) (nimbleServerAlignToCacheLine(oldHotOctetCount) / NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT),
+              (double) (nimbleServerAlignToCacheLine(newHotOctetCount) / NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT));
+    reportRow("ns/tick", (double) oldCounters.elapsedNanoseconds / tickCount,
+              (double) newCounters.elapsedNanoseconds / tickCount);
+    if (oldCounters.isAvailable && newCounters.isAvailable) {
+        reportRow("L1D read misses/tick",
+                  (double) oldCounters.values[NimbleServerBenchCounterL1DataReadMisses] / tickCount,
+                  (double) newCounters.values[NimbleServerBenchCounterL1DataReadMisses] / tickCount);
+        reportRow("LLC read misses/tick",
+                  (double) oldCounters.values[NimbleServerBenchCounterLastLevelReadMisses] / tickCount,
+                  (double) newCounters.values[NimbleServerBenchCounterLastLevelReadMisses] / tickCount);
+        reportRow("instructions/tick", (double) oldCounters.values[NimbleServerBenchCounterInstructions] / tickCount,
+                  (double) newCounters.values[NimbleServerBenchCounterInstructions] / tickCount);
+    }
+
+    nimbleServerBenchPerfCountersDestroy(&newCounters);
+    nimbleServerBenchPerfCountersDestroy(&oldCounters);
+
+    return 0;
+}
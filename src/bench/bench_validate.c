@@ -0,0 +1,178 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include "perf_counters.h"
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/default_setup.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/server.h>
+#include <stdio.h>
+
+#define BENCH_VALIDATE_PARTICIPANT_COUNT (NIMBLE_SERIALIZE_MAX_LOCAL_PLAYERS)
+#define BENCH_VALIDATE_STEPS_FOR_EACH_PARTICIPANT (NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT / \
+                                                   BENCH_VALIDATE_PARTICIPANT_COUNT)
+#define BENCH_VALIDATE_MAX_STEP_OCTET_COUNT (32)
+#define BENCH_VALIDATE_DATAGRAM_OCTET_COUNT (8 * 1024)
+
+static const size_t g_validateStepOctetCounts[] = {4, 16, 28};
+
+/// Clamps every octet of the step, the kind of work an application does for analog input
+static void clampValidate(void* self, NimbleServerValidatedStep* steps, size_t stepCount)
+{
+    (void) self;
+
+    for (size_t i = 0; i < stepCount; ++i) {
+        NimbleServerValidatedStep* step = &steps[i];
+        for (size_t j = 0; j < step->octetCount; ++j) {
+            if (step->octets[j] > 0x7f) {
+                step->octets[j] = 0x7f;
+            }
+        }
+    }
+}
+
+/// Writes the predicted steps for all participants in the party, in the layout that
+/// nimbleServerLocalPartyDeserializePredictedSteps reads.
+static size_t writePredictedSteps(uint8_t* target, size_t maxOctetCount, StepId firstStepId, size_t stepOctetCount)
+{
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, target, maxOctetCount);
+
+    uint8_t payload[BENCH_VALIDATE_MAX_STEP_OCTET_COUNT];
+
+    fldOutStreamWriteUInt32(&outStream, firstStepId);
+    fldOutStreamWriteUInt8(&outStream, BENCH_VALIDATE_PARTICIPANT_COUNT);
+    for (size_t participantIndex = 0; participantIndex < BENCH_VALIDATE_PARTICIPANT_COUNT; ++participantIndex) {
+        fldOutStreamWriteUInt8(&outStream, (uint8_t) participantIndex);
+        fldOutStreamWriteUInt8(&outStream, 0);
+        fldOutStreamWriteUInt8(&outStream, BENCH_VALIDATE_STEPS_FOR_EACH_PARTICIPANT);
+        for (size_t i = 0; i < BENCH_VALIDATE_STEPS_FOR_EACH_PARTICIPANT; ++i) {
+            for (size_t octetIndex = 0; octetIndex < stepOctetCount; ++octetIndex) {
+                payload[octetIndex] = (uint8_t) (i * 31 + participantIndex + octetIndex);
+            }
+            fldOutStreamWriteUInt8(&outStream, (uint8_t) stepOctetCount);
+            fldOutStreamWriteOctets(&outStream, payload, stepOctetCount);
+        }
+    }
+
+    return outStream.pos;
+}
+
+/// Measures the fastest round of inserting the predicted steps of one datagram
+/// @return nanoseconds for each inserted step, negative on error
+static double benchValidateRounds(NimbleServer* server, NimbleServerLocalParty* party, size_t stepOctetCount,
+                                  size_t roundCount)
+{
+    static uint8_t datagram[BENCH_VALIDATE_DATAGRAM_OCTET_COUNT];
+    NimbleServerGame* game = &server->game;
+    double fastestNanosecondsPerStep = 0;
+
+    // The first round is only for warming up the caches
+    for (size_t round = 0; round <= roundCount; ++round) {
+        StepId firstStepId = (StepId) (round * BENCH_VALIDATE_STEPS_FOR_EACH_PARTICIPANT);
+        for (size_t i = 0; i < party->participantReferences.participantReferenceCount; ++i) {
+            nbsStepsReInit(party->participantReferences.participantReferences[i]->steps, firstStepId);
+        }
+
+        size_t octetCount = writePredictedSteps(datagram, sizeof(datagram), firstStepId, stepOctetCount);
+        FldInStream inStream;
+        fldInStreamInit(&inStream, datagram, octetCount);
+
+        uint64_t start = nimbleServerBenchNanoseconds();
+        int err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &game->stepValidation);
+        uint64_t elapsed = nimbleServerBenchNanoseconds() - start;
+        if (err < 0) {
+            return err;
+        }
+
+        if (round == 0) {
+            continue;
+        }
+
+        double nanosecondsPerStep = (double) elapsed / (double) NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT;
+        if (round == 1 || nanosecondsPerStep < fastestNanosecondsPerStep) {
+            fastestNanosecondsPerStep = nanosecondsPerStep;
+        }
+    }
+
+    return fastestNanosecondsPerStep;
+}
+
+/// Measures the cost for each predicted step of validating the steps in a batch, compared to inserting them
+/// directly. All the steps of a datagram fit in one batch.
+/// Prints one JSON object on each line.
+/// @param setup round count
+/// @return negative on error
+int nimbleServerBenchValidate(const NimbleServerBenchValidateSetup* setup)
+{
+    for (size_t s = 0; s < sizeof(g_validateStepOctetCounts) / sizeof(g_validateStepOctetCounts[0]); ++s) {
+        size_t stepOctetCount = g_validateStepOctetCounts[s];
+
+        ImprintDefaultSetup imprintSetup;
+        imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+        Clog log;
+        log.config = &g_clog;
+        log.constantPrefix = "bench";
+
+        NimbleServerSetup serverSetup = {.applicationVersion.major = 0,
+                                         .applicationVersion.minor = 0,
+                                         .applicationVersion.patch = 0,
+                                         .memory = &imprintSetup.tagAllocator.info,
+                                         .blobAllocator = &imprintSetup.slabAllocator.info,
+                                         .maxConnectionCount = 1,
+                                         .maxParticipantCount = BENCH_VALIDATE_PARTICIPANT_COUNT,
+                                         .maxSingleParticipantStepOctetCount = stepOctetCount,
+                                         .maxParticipantCountForEachConnection = BENCH_VALIDATE_PARTICIPANT_COUNT,
+                                         .maxWaitingForReconnectTicks = 32,
+                                         .maxGameStateOctetCount = 1024,
+                                         .callbackObject.self = 0,
+                                         .now = 0,
+                                         .targetTickTimeMs = 16,
+                                         .log = log};
+
+        NimbleServer server;
+        int err = nimbleServerInit(&server, serverSetup);
+        if (err < 0) {
+            return err;
+        }
+
+        NimbleSerializeLocalPartyInfo partyInfo;
+        partyInfo.participantCount = BENCH_VALIDATE_PARTICIPANT_COUNT;
+        for (size_t i = 0; i < BENCH_VALIDATE_PARTICIPANT_COUNT; ++i) {
+            partyInfo.participantIds[i] = (NimbleSerializeParticipantId) i;
+        }
+
+        err = nimbleServerHostMigration(&server, &partyInfo, 1);
+        if (err < 0) {
+            return err;
+        }
+        NimbleServerLocalParty* party = &server.localParties.parties[0];
+
+        double directNanosecondsPerStep = benchValidateRounds(&server, party, stepOctetCount, setup->roundCount);
+        if (directNanosecondsPerStep < 0) {
+            return (int) directNanosecondsPerStep;
+        }
+
+        nimbleServerGameInitStepValidation(&server.game, &imprintSetup.tagAllocator.info, stepOctetCount,
+                                           clampValidate, 0);
+
+        double validatedNanosecondsPerStep = benchValidateRounds(&server, party, stepOctetCount, setup->roundCount);
+        if (validatedNanosecondsPerStep < 0) {
+            return (int) validatedNanosecondsPerStep;
+        }
+
+        printf("{\"name\":\"validate-s%zu\",\"stepOctetCount\":%zu,\"batchStepCount\":%d,"
+               "\"directNanosecondsPerStep\":%.1f,\"validatedNanosecondsPerStep\":%.1f,"
+               "\"validationNanosecondsPerStep\":%.1f}\n",
+               stepOctetCount, stepOctetCount, NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT, directNanosecondsPerStep,
+               validatedNanosecondsPerStep, validatedNanosecondsPerStep - directNanosecondsPerStep);
+    }
+
+    return 0;
+}
@@ -0,0 +1,386 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "bench.h"
+#include <clog/clog.h>
+#include <clog/console.h>
+#include <stdlib.h>
+#include <string.h>
+
+clog_config g_clog;
+
+/// Reads the options for the throughput bench, e.g. `--clients 32 --participants 2 --step-octets 8`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseThroughputOptions(NimbleServerBenchThroughputSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        size_t value = (size_t) strtoul(argv[i + 1], 0, 10);
+        const char* option = argv[i];
+
+        if (strcmp(option, "--record") == 0) {
+            setup->recordFilename = argv[i + 1];
+        } else if (strcmp(option, "--step-log") == 0) {
+            setup->stepLogBasePath = argv[i + 1];
+        } else if (strcmp(option, "--clients") == 0) {
+            setup->clientCount = value;
+        } else if (strcmp(option, "--participants") == 0) {
+            setup->participantsPerClient = value;
+        } else if (strcmp(option, "--step-octets") == 0) {
+            setup->stepOctetCount = value;
+        } else if (strcmp(option, "--redundancy") == 0) {
+            setup->redundancyCount = value;
+        } else if (strcmp(option, "--ticks") == 0) {
+            setup->tickCount = value;
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the options for the compose bench, e.g. `--baseline baseline.jsonl --threshold 10`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseComposeOptions(NimbleServerBenchComposeSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        const char* option = argv[i];
+
+        if (strcmp(option, "--rounds") == 0) {
+            setup->roundCount = (size_t) strtoul(argv[i + 1], 0, 10);
+        } else if (strcmp(option, "--baseline") == 0) {
+            setup->baselineFilename = argv[i + 1];
+        } else if (strcmp(option, "--threshold") == 0) {
+            setup->thresholdPercent = (size_t) strtoul(argv[i + 1], 0, 10);
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the options for the forced steps bench, e.g. `--jitter-ms 40 --loss 20 --reorder 50 --hold 16`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseForcedStepsOptions(NimbleServerBenchForcedStepsSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        size_t value = (size_t) strtoul(argv[i + 1], 0, 10);
+        const char* option = argv[i];
+
+        if (strcmp(option, "--clients") == 0) {
+            setup->clientCount = value;
+        } else if (strcmp(option, "--redundancy") == 0) {
+            setup->redundancyCount = value;
+        } else if (strcmp(option, "--latency-ms") == 0) {
+            setup->latencyMs = value;
+        } else if (strcmp(option, "--jitter-ms") == 0) {
+            setup->jitterMs = value;
+        } else if (strcmp(option, "--loss") == 0) {
+            setup->lossPerMille = value;
+        } else if (strcmp(option, "--reorder") == 0) {
+            setup->reorderPerMille = value;
+        } else if (strcmp(option, "--reorder-ms") == 0) {
+            setup->reorderExtraDelayMs = value;
+        } else if (strcmp(option, "--hold") == 0) {
+            setup->inputHoldStepCount = value;
+        } else if (strcmp(option, "--ticks") == 0) {
+            setup->tickCount = value;
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the options for the relay bench, e.g. `--edges 4 --clients 8`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseRelayOptions(NimbleServerBenchRelaySetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        size_t value = (size_t) strtoul(argv[i + 1], 0, 10);
+        const char* option = argv[i];
+
+        if (strcmp(option, "--edges") == 0) {
+            setup->edgeCount = value;
+        } else if (strcmp(option, "--clients") == 0) {
+            setup->clientCount = value;
+        } else if (strcmp(option, "--ticks") == 0) {
+            setup->tickCount = value;
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the options for the shared memory transport bench, e.g. `--round-trips 100000 --octets 64`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseShmOptions(NimbleServerBenchShmSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        size_t value = (size_t) strtoul(argv[i + 1], 0, 10);
+        const char* option = argv[i];
+
+        if (strcmp(option, "--round-trips") == 0) {
+            setup->roundTripCount = value;
+        } else if (strcmp(option, "--octets") == 0) {
+            setup->octetCount = value;
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the options for the spectators bench, e.g. `--spectators 500 --clients 8`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseSpectatorsOptions(NimbleServerBenchSpectatorsSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        size_t value = (size_t) strtoul(argv[i + 1], 0, 10);
+        const char* option = argv[i];
+
+        if (strcmp(option, "--spectators") == 0) {
+            setup->spectatorCount = value;
+        } else if (strcmp(option, "--clients") == 0) {
+            setup->clientCount = value;
+        } else if (strcmp(option, "--redundancy") == 0) {
+            setup->redundancyStepCount = value;
+        } else if (strcmp(option, "--ticks") == 0) {
+            setup->tickCount = value;
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the options for the step validation bench, e.g. `--rounds 1000`
+/// @param setup the setup to overwrite the options in
+/// @param argc argument count
+/// @param argv arguments, starting after the bench name
+/// @return negative on error
+static int parseIngestOptions(NimbleServerBenchIngestSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        const char* option = argv[i];
+
+        if (strcmp(option, "--rounds") == 0) {
+            setup->roundCount = (size_t) strtoul(argv[i + 1], 0, 10);
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int parseValidateOptions(NimbleServerBenchValidateSetup* setup, int argc, char* argv[])
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        const char* option = argv[i];
+
+        if (strcmp(option, "--rounds") == 0) {
+            setup->roundCount = (size_t) strtoul(argv[i + 1], 0, 10);
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    g_clog.log = clog_console;
+    g_clog.level = CLOG_TYPE_WARN;
+
+    if (argc > 1 && strcmp(argv[1], "throughput") == 0) {
+        NimbleServerBenchThroughputSetup setup = {.clientCount = 32,
+                                                  .participantsPerClient = 1,
+                                                  .stepOctetCount = 8,
+                                                  .redundancyCount = 3,
+                                                  .tickCount = 10000,
+                                                  .recordFilename = 0,
+                                                  .stepLogBasePath = 0};
+        int err = parseThroughputOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchThroughput(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+        if (argc != 3) {
+            CLOG_SOFT_ERROR("usage: nimble_server_bench replay <recording>")
+            return -1;
+        }
+
+        return nimbleServerBenchReplay(argv[2]);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "compose") == 0) {
+        NimbleServerBenchComposeSetup setup = {.roundCount = 200, .baselineFilename = 0, .thresholdPercent = 10};
+        int err = parseComposeOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchCompose(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "spectators") == 0) {
+        NimbleServerBenchSpectatorsSetup setup = {
+            .spectatorCount = 500, .clientCount = 8, .redundancyStepCount = 0, .tickCount = 5000};
+        int err = parseSpectatorsOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchSpectators(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "relay") == 0) {
+        NimbleServerBenchRelaySetup setup = {.edgeCount = 4, .clientCount = 8, .tickCount = 5000};
+        int err = parseRelayOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchRelay(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "shm") == 0) {
+        NimbleServerBenchShmSetup setup = {.roundTripCount = 100000, .octetCount = 64};
+        int err = parseShmOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchShm(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "forced") == 0) {
+        NimbleServerBenchForcedStepsSetup setup = {.clientCount = 8,
+                                                   .redundancyCount = 3,
+                                                   .latencyMs = 30,
+                                                   .jitterMs = 40,
+                                                   .lossPerMille = 20,
+                                                   .reorderPerMille = 0,
+                                                   .reorderExtraDelayMs = 30,
+                                                   .inputHoldStepCount = 16,
+                                                   .tickCount = 3750};
+        int err = parseForcedStepsOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchForcedSteps(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "ingest") == 0) {
+        NimbleServerBenchIngestSetup setup = {.roundCount = 10000};
+        int err = parseIngestOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchIngest(&setup);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "validate") == 0) {
+        NimbleServerBenchValidateSetup setup = {.roundCount = 1000};
+        int err = parseValidateOptions(&setup, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
+
+        return nimbleServerBenchValidate(&setup);
+    }
+
+    int err = nimbleServerBenchFeed();
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerBenchTickParties();
+    if (err < 0) {
+        return err;
+    }
+
+    return 0;
+}
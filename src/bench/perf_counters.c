@@ -0,0 +1,186 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if defined TORNADO_OS_LINUX && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#elif !defined TORNADO_OS_WINDOWS && !defined _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "perf_counters.h"
+#include <clog/clog.h>
+#include <time.h>
+
+#if defined TORNADO_OS_LINUX
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int openCounter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+
+    return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+static uint64_t cacheReadMissConfig(uint64_t cache)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+/// Returns a monotonic timestamp with nanosecond resolution
+/// @return nanoseconds
+uint64_t nimbleServerBenchNanoseconds(void)
+{
+#if defined TORNADO_OS_WINDOWS
+    return (uint64_t) clock() * (1000000000u / CLOCKS_PER_SEC);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/// Returns the CPU time used by the process, in nanoseconds.
+/// Falls back to the monotonic time on platforms without a process CPU clock.
+/// @return CPU time in nanoseconds
+uint64_t nimbleServerBenchCpuNanoseconds(void)
+{
+#if defined CLOCK_PROCESS_CPUTIME_ID
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#else
+    return nimbleServerBenchNanoseconds();
+#endif
+}
+
+/// Returns the CPU time used by the calling thread, in nanoseconds. Unlike nimbleServerBenchCpuNanoseconds(), the
+/// time of other threads (e.g. a step log writer) is not included.
+/// Falls back to the process CPU time on platforms without a thread CPU clock.
+/// @return CPU time in nanoseconds
+uint64_t nimbleServerBenchThreadCpuNanoseconds(void)
+{
+#if defined CLOCK_THREAD_CPUTIME_ID
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#else
+    return nimbleServerBenchCpuNanoseconds();
+#endif
+}
+
+/// Opens the hardware cache counters for the current thread.
+/// If the counters are not available (not Linux, or perf_event_paranoid too strict), only the time is measured.
+/// @param self perf counters
+void nimbleServerBenchPerfCountersInit(NimbleServerBenchPerfCounters* self)
+{
+    self->isAvailable = false;
+    self->elapsedNanoseconds = 0;
+    for (size_t i = 0; i < NimbleServerBenchCounterCount; ++i) {
+        self->fileDescriptors[i] = -1;
+        self->values[i] = 0;
+    }
+
+#if defined TORNADO_OS_LINUX
+    self->fileDescriptors[NimbleServerBenchCounterL1DataReadMisses] =
+        openCounter(PERF_TYPE_HW_CACHE, cacheReadMissConfig(PERF_COUNT_HW_CACHE_L1D));
+    self->fileDescriptors[NimbleServerBenchCounterLastLevelReadMisses] =
+        openCounter(PERF_TYPE_HW_CACHE, cacheReadMissConfig(PERF_COUNT_HW_CACHE_LL));
+    self->fileDescriptors[NimbleServerBenchCounterInstructions] =
+        openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+
+    self->isAvailable = true;
+    for (size_t i = 0; i < NimbleServerBenchCounterCount; ++i) {
+        if (self->fileDescriptors[i] < 0) {
+            self->isAvailable = false;
+        }
+    }
+
+    if (!self->isAvailable) {
+        CLOG_NOTICE("perf counters are not available, only measuring time")
+    }
+#endif
+}
+
+/// Closes the counters
+/// @param self perf counters
+void nimbleServerBenchPerfCountersDestroy(NimbleServerBenchPerfCounters* self)
+{
+#if defined TORNADO_OS_LINUX
+    for (size_t i = 0; i < NimbleServerBenchCounterCount; ++i) {
+        if (self->fileDescriptors[i] >= 0) {
+            close(self->fileDescriptors[i]);
+            self->fileDescriptors[i] = -1;
+        }
+    }
+#endif
+    self->isAvailable = false;
+}
+
+/// Resets and enables the counters
+/// @param self perf counters
+void nimbleServerBenchPerfCountersStart(NimbleServerBenchPerfCounters* self)
+{
+#if defined TORNADO_OS_LINUX
+    if (self->isAvailable) {
+        for (size_t i = 0; i < NimbleServerBenchCounterCount; ++i) {
+            ioctl(self->fileDescriptors[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(self->fileDescriptors[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+    self->startNanoseconds = nimbleServerBenchNanoseconds();
+}
+
+/// Disables the counters and reads the values
+/// @param self perf counters
+void nimbleServerBenchPerfCountersStop(NimbleServerBenchPerfCounters* self)
+{
+    self->elapsedNanoseconds = nimbleServerBenchNanoseconds() - self->startNanoseconds;
+
+#if defined TORNADO_OS_LINUX
+    if (self->isAvailable) {
+        for (size_t i = 0; i < NimbleServerBenchCounterCount; ++i) {
+            ioctl(self->fileDescriptors[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(self->fileDescriptors[i], &self->values[i], sizeof(self->values[i])) !=
+                sizeof(self->values[i])) {
+                self->values[i] = 0;
+            }
+        }
+    }
+#endif
+}
+
+/// Outputs the measured values divided by the number of iterations
+/// @param self perf counters
+/// @param name name of the benchmark
+/// @param iterationCount number of iterations measured
+/// @param iterationName what one iteration is, e.g. "datagram"
+void nimbleServerBenchPerfCountersReport(const NimbleServerBenchPerfCounters* self, const char* name,
+                                         uint64_t iterationCount, const char* iterationName)
+{
+    double count = iterationCount == 0 ? 1.0 : (double) iterationCount;
+
+    CLOG_OUTPUT("%s: %.1f ns/%s", name, (double) self->elapsedNanoseconds / count, iterationName)
+    if (!self->isAvailable) {
+        return;
+    }
+
+    CLOG_OUTPUT("%s: %.3f L1D read misses/%s, %.3f LLC read misses/%s, %.1f instructions/%s", name,
+                (double) self->values[NimbleServerBenchCounterL1DataReadMisses] / count, iterationName,
+                (double) self->values[NimbleServerBenchCounterLastLevelReadMisses] / count, iterationName,
+                (double) self->values[NimbleServerBenchCounterInstructions] / count, iterationName)
+}
@@ -0,0 +1,37 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_BENCH_PERF_COUNTERS_H
+#define NIMBLE_SERVER_BENCH_PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum NimbleServerBenchCounter {
+    NimbleServerBenchCounterL1DataReadMisses,
+    NimbleServerBenchCounterLastLevelReadMisses,
+    NimbleServerBenchCounterInstructions,
+    NimbleServerBenchCounterCount
+} NimbleServerBenchCounter;
+
+typedef struct NimbleServerBenchPerfCounters {
+    int fileDescriptors[NimbleServerBenchCounterCount];
+    uint64_t values[NimbleServerBenchCounterCount];
+    uint64_t startNanoseconds;
+    uint64_t elapsedNanoseconds;
+    bool isAvailable;
+} NimbleServerBenchPerfCounters;
+
+void nimbleServerBenchPerfCountersInit(NimbleServerBenchPerfCounters* self);
+void nimbleServerBenchPerfCountersDestroy(NimbleServerBenchPerfCounters* self);
+void nimbleServerBenchPerfCountersStart(NimbleServerBenchPerfCounters* self);
+void nimbleServerBenchPerfCountersStop(NimbleServerBenchPerfCounters* self);
+void nimbleServerBenchPerfCountersReport(const NimbleServerBenchPerfCounters* self, const char* name,
+                                         uint64_t iterationCount, const char* iterationName);
+uint64_t nimbleServerBenchNanoseconds(void);
+uint64_t nimbleServerBenchCpuNanoseconds(void);
+uint64_t nimbleServerBenchThreadCpuNanoseconds(void);
+
+#endif
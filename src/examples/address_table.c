@@ -0,0 +1,141 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-daemon/address_table.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// FNV-1a over the IPv4 address and the port, both in network byte order
+static size_t hashAddress(const struct sockaddr_in* address)
+{
+    uint32_t hash = 2166136261u;
+    const uint8_t* host = (const uint8_t*) &address->sin_addr.s_addr;
+    for (size_t i = 0; i < 4; ++i) {
+        hash = (hash ^ host[i]) * 16777619u;
+    }
+    const uint8_t* port = (const uint8_t*) &address->sin_port;
+    for (size_t i = 0; i < 2; ++i) {
+        hash = (hash ^ port[i]) * 16777619u;
+    }
+
+    return hash & (NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT - 1);
+}
+
+static bool isSameAddress(const struct sockaddr_in* a, const struct sockaddr_in* b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void insertSlot(NimbleServerDaemonAddressTable* self, uint8_t transportIndex)
+{
+    size_t slot = hashAddress(&self->entries[transportIndex].address);
+    while (self->slots[slot] != 0) {
+        slot = (slot + 1) & (NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT - 1);
+    }
+    self->slots[slot] = (uint8_t) (transportIndex + 1);
+}
+
+/// Initializes an empty address table
+/// @param self address table
+/// @param connectionCount maximum number of client addresses, the transport connection indices are below this
+/// @param idleTimeoutMs an address that has not sent anything for this long is expired
+void nimbleServerDaemonAddressTableInit(NimbleServerDaemonAddressTable* self, size_t connectionCount,
+                                        MonotonicTimeMs idleTimeoutMs)
+{
+    if (connectionCount > NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT) {
+        connectionCount = NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT;
+    }
+    self->connectionCount = connectionCount;
+    self->usedCount = 0;
+    self->idleTimeoutMs = idleTimeoutMs;
+    tc_mem_clear_type_n(self->entries, NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT);
+    tc_mem_clear_type_n(self->slots, NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT);
+}
+
+/// Finds the transport connection index for an address
+/// @param self address table
+/// @param address client address
+/// @return transport connection index, or -1 if the address is not in the table
+int nimbleServerDaemonAddressTableFind(const NimbleServerDaemonAddressTable* self, const struct sockaddr_in* address)
+{
+    size_t slot = hashAddress(address);
+    while (self->slots[slot] != 0) {
+        uint8_t transportIndex = (uint8_t) (self->slots[slot] - 1);
+        if (isSameAddress(&self->entries[transportIndex].address, address)) {
+            return transportIndex;
+        }
+        slot = (slot + 1) & (NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT - 1);
+    }
+
+    return -1;
+}
+
+/// Adds an address that is not in the table, using the lowest free transport connection index
+/// @param self address table
+/// @param address client address
+/// @param now the time the address sent its first datagram
+/// @return transport connection index, or -1 if the table is full
+int nimbleServerDaemonAddressTableAdd(NimbleServerDaemonAddressTable* self, const struct sockaddr_in* address,
+                                      MonotonicTimeMs now)
+{
+    for (size_t i = 0; i < self->connectionCount; ++i) {
+        NimbleServerDaemonAddressEntry* entry = &self->entries[i];
+        if (entry->isUsed) {
+            continue;
+        }
+        entry->isUsed = true;
+        entry->address = *address;
+        entry->lastReceivedAtMs = now;
+        insertSlot(self, (uint8_t) i);
+        self->usedCount++;
+        return (int) i;
+    }
+
+    return -1;
+}
+
+/// Removes an address, so the transport connection index can be reused
+/// @param self address table
+/// @param transportIndex transport connection index to remove
+void nimbleServerDaemonAddressTableRemove(NimbleServerDaemonAddressTable* self, uint8_t transportIndex)
+{
+    if (transportIndex >= self->connectionCount || !self->entries[transportIndex].isUsed) {
+        return;
+    }
+
+    self->entries[transportIndex].isUsed = false;
+    self->usedCount--;
+
+    tc_mem_clear_type_n(self->slots, NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT);
+    for (size_t i = 0; i < self->connectionCount; ++i) {
+        if (self->entries[i].isUsed) {
+            insertSlot(self, (uint8_t) i);
+        }
+    }
+}
+
+/// Removes the addresses that have not sent anything within the idle timeout
+/// @param self address table
+/// @param now current time
+/// @param expiredTransportIndices target for the removed transport connection indices
+/// @param maxCount capacity of expiredTransportIndices
+/// @return number of removed addresses
+size_t nimbleServerDaemonAddressTableExpire(NimbleServerDaemonAddressTable* self, MonotonicTimeMs now,
+                                            uint8_t* expiredTransportIndices, size_t maxCount)
+{
+    size_t expiredCount = 0;
+    for (size_t i = 0; i < self->connectionCount && expiredCount < maxCount; ++i) {
+        const NimbleServerDaemonAddressEntry* entry = &self->entries[i];
+        if (!entry->isUsed || now - entry->lastReceivedAtMs < self->idleTimeoutMs) {
+            continue;
+        }
+        expiredTransportIndices[expiredCount++] = (uint8_t) i;
+    }
+
+    for (size_t i = 0; i < expiredCount; ++i) {
+        nimbleServerDaemonAddressTableRemove(self, expiredTransportIndices[i]);
+    }
+
+    return expiredCount;
+}
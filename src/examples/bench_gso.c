@@ -0,0 +1,325 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <clog/clog.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <nimble-daemon/bench_gso.h>
+#include <nimble-daemon/daemon.h>
+#include <nimble-daemon/udp_segments.h>
+#include <nimble-server/datagram_run.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Same as NIMBLE_SERVER_BLOB_STREAM_MAX_ENTRIES_FOR_EACH_SEND, the chunks that a blob stream sends at a time
+#define NIMBLE_DAEMON_BENCH_GSO_DATAGRAMS_FOR_EACH_RUN (4)
+
+/// How far the sender can be ahead of the receiver, so the receive buffer never overflows
+#define NIMBLE_DAEMON_BENCH_GSO_MAX_IN_FLIGHT_DATAGRAM_COUNT (256)
+
+typedef enum BenchGsoMode {
+    BenchGsoModePlain, ///< one sendto() for each datagram, one recvmsg() for each datagram
+    BenchGsoModeGso, ///< one UDP_SEGMENT sendmsg() for each run, one recvmsg() for each datagram
+    BenchGsoModeGsoGro, ///< one UDP_SEGMENT sendmsg() for each run, UDP_GRO on the receiving socket
+} BenchGsoMode;
+
+typedef struct BenchGsoReceiver {
+    int handle;
+    bool isGroEnabled;
+    uint64_t receivedDatagramCount; ///< read by the sender, for the pacing
+    uint64_t receiveCallCount;
+    bool isStopping;
+    uint8_t octets[NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT];
+} BenchGsoReceiver;
+
+typedef struct BenchGsoSender {
+    int handle;
+    struct sockaddr_in receiverAddress;
+    bool isSegmentationSupported;
+    uint64_t sendCallCount;
+} BenchGsoSender;
+
+typedef struct BenchGsoResult {
+    uint64_t sentDatagramCount;
+    uint64_t receivedDatagramCount;
+    uint64_t sendCallCount;
+    uint64_t receiveCallCount;
+    uint64_t cpuUs;
+    uint64_t wallUs;
+} BenchGsoResult;
+
+static uint64_t processCpuMicroseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+static int openLoopbackSocket(uint16_t port)
+{
+    int handle = socket(AF_INET, SOCK_DGRAM, 0);
+    if (handle < 0) {
+        return -1;
+    }
+
+    int bufferOctetCount = 4 * 1024 * 1024;
+    setsockopt(handle, SOL_SOCKET, SO_RCVBUF, &bufferOctetCount, sizeof(bufferOctetCount));
+    setsockopt(handle, SOL_SOCKET, SO_SNDBUF, &bufferOctetCount, sizeof(bufferOctetCount));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(handle, (const struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(handle);
+        return -2;
+    }
+
+    return handle;
+}
+
+/// Receives until the sender is done, and splits the coalesced buffers into datagrams when GRO is enabled
+static void* receiveUntilStopped(void* _self)
+{
+    BenchGsoReceiver* self = (BenchGsoReceiver*) _self;
+    uint64_t control[NIMBLE_DAEMON_UDP_SEGMENTS_CONTROL_OCTET_COUNT / sizeof(uint64_t)];
+
+    while (true) {
+        struct iovec iovec;
+        iovec.iov_base = self->octets;
+        iovec.iov_len = sizeof(self->octets);
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iovec;
+        message.msg_iovlen = 1;
+        message.msg_control = self->isGroEnabled ? control : 0;
+        message.msg_controllen = self->isGroEnabled ? sizeof(control) : 0;
+
+        ssize_t octetCount = recvmsg(self->handle, &message, 0);
+        self->receiveCallCount++;
+        if (octetCount < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (__atomic_load_n(&self->isStopping, __ATOMIC_ACQUIRE)) {
+                return 0;
+            }
+            continue;
+        }
+
+        size_t segmentOctetCount = nimbleServerDaemonUdpSegmentsGroOctetCount(&message, (size_t) octetCount);
+        uint64_t datagramCount = segmentOctetCount > 0
+                                     ? ((size_t) octetCount + segmentOctetCount - 1) / segmentOctetCount
+                                     : 1;
+        __atomic_add_fetch(&self->receivedDatagramCount, datagramCount, __ATOMIC_RELEASE);
+    }
+}
+
+static int sendSingle(void* _self, const uint8_t* data, size_t octetCount)
+{
+    BenchGsoSender* self = (BenchGsoSender*) _self;
+
+    self->sendCallCount++;
+
+    return sendto(self->handle, data, octetCount, 0, (const struct sockaddr*) &self->receiverAddress,
+                  sizeof(self->receiverAddress)) < 0
+               ? -1
+               : 0;
+}
+
+static int sendRun(void* _self, const uint8_t* octets, size_t octetCount, size_t segmentOctetCount)
+{
+    BenchGsoSender* self = (BenchGsoSender*) _self;
+
+    if (self->isSegmentationSupported) {
+        self->sendCallCount++;
+        int err = nimbleServerDaemonUdpSegmentsSend(self->handle, &self->receiverAddress, octets, octetCount,
+                                                    segmentOctetCount);
+        if (err != NIMBLE_DAEMON_UDP_SEGMENTS_ERR_NOT_SUPPORTED) {
+            return err;
+        }
+        self->isSegmentationSupported = false;
+    }
+
+    self->sendCallCount += (octetCount + segmentOctetCount - 1) / segmentOctetCount;
+
+    return nimbleServerDaemonUdpSegmentsSendEach(self->handle, &self->receiverAddress, octets, octetCount,
+                                                 segmentOctetCount);
+}
+
+/// Sends the datagrams in runs through a NimbleServerDatagramRun, as the blob stream does, while a thread receives
+/// them. Measures the CPU time of the whole process, so both the sending and the receiving side are included.
+/// @return negative on error
+static int benchMode(const NimbleServerDaemonBenchGsoSetup* setup, BenchGsoMode mode, BenchGsoResult* result,
+                     Clog log)
+{
+    memset(result, 0, sizeof(*result));
+
+    static BenchGsoReceiver receiver;
+    receiver.receivedDatagramCount = 0;
+    receiver.receiveCallCount = 0;
+    receiver.isStopping = false;
+    receiver.isGroEnabled = false;
+    receiver.handle = openLoopbackSocket(setup->port);
+    if (receiver.handle < 0) {
+        CLOG_SOFT_ERROR("bench gso: could not open port %d", setup->port)
+        return receiver.handle;
+    }
+    struct timeval receiveTimeout = {.tv_sec = 0, .tv_usec = 50000};
+    setsockopt(receiver.handle, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+    if (mode == BenchGsoModeGsoGro) {
+        if (nimbleServerDaemonUdpSegmentsEnableGro(receiver.handle) < 0) {
+            CLOG_C_NOTICE(&log, "bench gso: UDP_GRO is not supported %d", errno)
+        } else {
+            receiver.isGroEnabled = true;
+        }
+    }
+
+    BenchGsoSender sender;
+    sender.sendCallCount = 0;
+    sender.isSegmentationSupported = true;
+    sender.handle = openLoopbackSocket(0);
+    if (sender.handle < 0) {
+        close(receiver.handle);
+        return -3;
+    }
+    memset(&sender.receiverAddress, 0, sizeof(sender.receiverAddress));
+    sender.receiverAddress.sin_family = AF_INET;
+    sender.receiverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sender.receiverAddress.sin_port = htons(setup->port);
+
+    DatagramTransportOut transportOut;
+    transportOut.self = &sender;
+    transportOut.send = sendSingle;
+    NimbleServerDatagramRunOut runOut;
+    runOut.self = &sender;
+    runOut.sendRun = sendRun;
+    const NimbleServerDatagramRunOut* runOutToUse = mode == BenchGsoModePlain ? 0 : &runOut;
+
+    uint64_t startedAtUs = nimbleServerDaemonMicroseconds();
+    uint64_t cpuStartedAtUs = processCpuMicroseconds();
+
+    pthread_t receiverThread;
+    if (pthread_create(&receiverThread, 0, receiveUntilStopped, &receiver) != 0) {
+        close(sender.handle);
+        close(receiver.handle);
+        return -4;
+    }
+
+    static NimbleServerDatagramRun run;
+    nimbleServerDatagramRunInit(&run);
+    int err = 0;
+    for (size_t i = 0; i < setup->datagramCount && err >= 0; ++i) {
+        uint8_t* target = nimbleServerDatagramRunNext(&run);
+        memset(target, (int) (i & 0x7f), setup->datagramOctetCount);
+        nimbleServerDatagramRunCommit(&run, setup->datagramOctetCount);
+        if (run.datagramCount < NIMBLE_DAEMON_BENCH_GSO_DATAGRAMS_FOR_EACH_RUN && i + 1 < setup->datagramCount) {
+            continue;
+        }
+
+        while (i + 1 - __atomic_load_n(&receiver.receivedDatagramCount, __ATOMIC_ACQUIRE) >
+               NIMBLE_DAEMON_BENCH_GSO_MAX_IN_FLIGHT_DATAGRAM_COUNT) {
+            sched_yield();
+        }
+        err = nimbleServerDatagramRunFlush(&run, &transportOut, runOutToUse);
+    }
+
+    // Wait for the datagrams that are still in flight, but not for the ones that were dropped
+    uint64_t receivedCount = 0;
+    for (size_t attempt = 0; attempt < 20; ++attempt) {
+        uint64_t latestReceivedCount = __atomic_load_n(&receiver.receivedDatagramCount, __ATOMIC_ACQUIRE);
+        if (latestReceivedCount >= setup->datagramCount ||
+            (attempt > 0 && latestReceivedCount == receivedCount)) {
+            break;
+        }
+        receivedCount = latestReceivedCount;
+        usleep(5000);
+    }
+
+    __atomic_store_n(&receiver.isStopping, true, __ATOMIC_RELEASE);
+    pthread_join(receiverThread, 0);
+
+    result->cpuUs = processCpuMicroseconds() - cpuStartedAtUs;
+    result->wallUs = nimbleServerDaemonMicroseconds() - startedAtUs;
+    result->sentDatagramCount = setup->datagramCount;
+    result->receivedDatagramCount = receiver.receivedDatagramCount;
+    result->sendCallCount = sender.sendCallCount;
+    result->receiveCallCount = receiver.receiveCallCount;
+
+    if (mode != BenchGsoModePlain && !sender.isSegmentationSupported) {
+        CLOG_C_NOTICE(&log, "bench gso: UDP_SEGMENT is not supported, sent one datagram at a time")
+    }
+
+    close(sender.handle);
+    close(receiver.handle);
+
+    return err;
+}
+
+static void printResult(const char* modeName, const BenchGsoResult* result, size_t datagramOctetCount,
+                        double plainCpuMsForEachMegabyte)
+{
+    double megabyteCount = (double) (result->receivedDatagramCount * datagramOctetCount) / (1024.0 * 1024.0);
+    double cpuMsForEachMegabyte = megabyteCount > 0.0 ? (double) result->cpuUs / 1000.0 / megabyteCount : 0.0;
+
+    printf("{\"mode\":\"%s\",\"sentDatagramCount\":%" PRIu64 ",\"receivedDatagramCount\":%" PRIu64
+           ",\"sendCallCount\":%" PRIu64 ",\"receiveCallCount\":%" PRIu64 ",\"cpuUs\":%" PRIu64 ",\"wallUs\":%" PRIu64
+           ",\"megabytes\":%.1f,\"cpuMsPerMegabyte\":%.3f,\"comparedToPlain\":%.2f}\n",
+           modeName, result->sentDatagramCount, result->receivedDatagramCount, result->sendCallCount,
+           result->receiveCallCount, result->cpuUs, result->wallUs, megabyteCount, cpuMsForEachMegabyte,
+           plainCpuMsForEachMegabyte > 0.0 ? cpuMsForEachMegabyte / plainCpuMsForEachMegabyte : 1.0);
+}
+
+/// Measures the CPU time for each megabyte that blob stream sized datagrams cost over loopback, when each datagram
+/// is sent and received on its own, when runs are sent with UDP_SEGMENT (GSO), and when they are also received
+/// coalesced with UDP_GRO. Prints a JSON object for each mode, with the CPU time compared to the plain mode.
+/// @param setup port, datagram count and size
+/// @return negative on error
+int nimbleServerDaemonBenchGso(const NimbleServerDaemonBenchGsoSetup* setup)
+{
+    if (setup->datagramCount == 0 || setup->datagramOctetCount == 0 ||
+        setup->datagramOctetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        CLOG_SOFT_ERROR("bench gso: datagram count must be set and datagram size must be 1 to %d",
+                        DATAGRAM_TRANSPORT_MAX_SIZE)
+        return -1;
+    }
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    const BenchGsoMode modes[] = {BenchGsoModePlain, BenchGsoModeGso, BenchGsoModeGsoGro};
+    const char* modeNames[] = {"plain", "gso", "gso+gro"};
+    double plainCpuMsForEachMegabyte = 0.0;
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        BenchGsoResult result;
+        int err = benchMode(setup, modes[i], &result, log);
+        if (err < 0) {
+            CLOG_SOFT_ERROR("bench gso: %s failed %d", modeNames[i], err)
+            return err;
+        }
+        if (modes[i] == BenchGsoModePlain && result.receivedDatagramCount > 0) {
+            double megabyteCount = (double) (result.receivedDatagramCount * setup->datagramOctetCount) /
+                                   (1024.0 * 1024.0);
+            plainCpuMsForEachMegabyte = (double) result.cpuUs / 1000.0 / megabyteCount;
+        }
+        printResult(modeNames[i], &result, setup->datagramOctetCount, plainCpuMsForEachMegabyte);
+    }
+
+    return 0;
+}
@@ -0,0 +1,307 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <clog/clog.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <nimble-daemon/address_table.h>
+#include <nimble-daemon/bench_transport.h>
+#include <nimble-daemon/daemon.h>
+#include <nimble-daemon/uring_transport.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NIMBLE_DAEMON_BENCH_TRANSPORT_MAX_CLIENT_COUNT (64)
+#define NIMBLE_DAEMON_BENCH_TRANSPORT_STOP_OCTET (0xff)
+#define NIMBLE_DAEMON_BENCH_TRANSPORT_STOP_DATAGRAM_COUNT (32)
+#define NIMBLE_DAEMON_BENCH_TRANSPORT_DATAGRAMS_FOR_EACH_FLUSH (64)
+
+typedef struct BenchTransportSender {
+    const NimbleServerDaemonBenchTransportSetup* setup;
+    int sockets[NIMBLE_DAEMON_BENCH_TRANSPORT_MAX_CLIENT_COUNT];
+    struct sockaddr_in serverAddress;
+} BenchTransportSender;
+
+typedef struct BenchTransportResult {
+    uint64_t receivedDatagramCount;
+    uint64_t sentDatagramCount;
+    uint64_t systemCallCount;
+    uint64_t cpuUs;
+    uint64_t wallUs;
+} BenchTransportResult;
+
+static uint64_t threadCpuMicroseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+static int openLoopbackSocket(uint16_t port)
+{
+    int handle = socket(AF_INET, SOCK_DGRAM, 0);
+    if (handle < 0) {
+        return -1;
+    }
+
+    int receiveBufferOctetCount = 4 * 1024 * 1024;
+    setsockopt(handle, SOL_SOCKET, SO_RCVBUF, &receiveBufferOctetCount, sizeof(receiveBufferOctetCount));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(handle, (const struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(handle);
+        return -2;
+    }
+
+    return handle;
+}
+
+/// Sends all the datagrams round-robin from the client sockets, followed by the stop datagrams
+static void* sendDatagrams(void* _self)
+{
+    BenchTransportSender* self = (BenchTransportSender*) _self;
+    const NimbleServerDaemonBenchTransportSetup* setup = self->setup;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    memset(datagram, 0, sizeof(datagram));
+
+    for (size_t i = 0; i < setup->datagramCount; ++i) {
+        sendto(self->sockets[i % setup->clientCount], datagram, setup->datagramOctetCount, 0,
+               (const struct sockaddr*) &self->serverAddress, sizeof(self->serverAddress));
+    }
+
+    // The receiver can be behind, so the stop datagram is sent a few times in case some of them are dropped
+    datagram[0] = NIMBLE_DAEMON_BENCH_TRANSPORT_STOP_OCTET;
+    for (size_t i = 0; i < NIMBLE_DAEMON_BENCH_TRANSPORT_STOP_DATAGRAM_COUNT; ++i) {
+        sendto(self->sockets[0], datagram, 1, 0, (const struct sockaddr*) &self->serverAddress,
+               sizeof(self->serverAddress));
+        usleep(1000);
+    }
+
+    return 0;
+}
+
+/// Receives with recvfrom() and echoes with sendto(), one system call for each datagram
+static void echoWithSocket(int handle, NimbleServerDaemonAddressTable* addressTable, BenchTransportResult* result)
+{
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    MonotonicTimeMs now = monotonicTimeMsNow();
+
+    while (true) {
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        ssize_t octetCount = recvfrom(handle, datagram, sizeof(datagram), 0, (struct sockaddr*) &address,
+                                      &addressLength);
+        result->systemCallCount++;
+        if (octetCount <= 0) {
+            if (octetCount < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (datagram[0] == NIMBLE_DAEMON_BENCH_TRANSPORT_STOP_OCTET) {
+            return;
+        }
+        result->receivedDatagramCount++;
+
+        int transportIndex = nimbleServerDaemonAddressTableFind(addressTable, &address);
+        if (transportIndex < 0) {
+            transportIndex = nimbleServerDaemonAddressTableAdd(addressTable, &address, now);
+            if (transportIndex < 0) {
+                continue;
+            }
+        }
+
+        if (sendto(handle, datagram, (size_t) octetCount, 0,
+                   (const struct sockaddr*) &addressTable->entries[transportIndex].address,
+                   sizeof(struct sockaddr_in)) >= 0) {
+            result->sentDatagramCount++;
+        }
+        result->systemCallCount++;
+    }
+}
+
+/// Receives and echoes through the DatagramTransportMulti of the io_uring backend, flushing the sends after each
+/// group of datagrams as the daemon does once every tick
+static int echoWithUring(int handle, NimbleServerDaemonAddressTable* addressTable, BenchTransportResult* result,
+                         Clog log)
+{
+    static NimbleServerDaemonUringTransport transport;
+    NimbleServerDaemonUringTransportSetup setup = {
+        .socketHandle = handle, .addressTable = addressTable, .newAddressFn = 0, .newAddressSelf = 0, .log = log};
+    int err = nimbleServerDaemonUringTransportInit(&transport, setup);
+    if (err < 0) {
+        nimbleServerDaemonUringTransportDestroy(&transport);
+        return err;
+    }
+
+    DatagramTransportMulti* multi = &transport.multiTransport;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    bool isDone = false;
+
+    while (!isDone) {
+        for (size_t i = 0; i < NIMBLE_DAEMON_BENCH_TRANSPORT_DATAGRAMS_FOR_EACH_FLUSH; ++i) {
+            int connectionId;
+            ssize_t octetCount = multi->receiveFrom(multi->self, &connectionId, datagram, sizeof(datagram));
+            if (octetCount <= 0) {
+                break;
+            }
+            if (datagram[0] == NIMBLE_DAEMON_BENCH_TRANSPORT_STOP_OCTET) {
+                isDone = true;
+                break;
+            }
+            result->receivedDatagramCount++;
+            multi->sendTo(multi->self, connectionId, datagram, (size_t) octetCount);
+        }
+
+        if (isDone || nimbleServerDaemonUringTransportHasPending(&transport)) {
+            err = nimbleServerDaemonUringTransportFlush(&transport);
+        } else {
+            err = nimbleServerDaemonUringTransportWait(&transport);
+        }
+        if (err < 0) {
+            break;
+        }
+    }
+
+    // Reap the completions of the last sends
+    while (nimbleServerDaemonUringTransportHasPending(&transport)) {
+        int connectionId;
+        multi->receiveFrom(multi->self, &connectionId, datagram, sizeof(datagram));
+    }
+
+    result->sentDatagramCount = transport.stats.sentDatagramCount;
+    result->systemCallCount = transport.stats.enterCount;
+    CLOG_C_DEBUG(&log, "uring: rearm:%" PRIu64 " noBuffer:%" PRIu64 " dropped:%" PRIu64, transport.stats.rearmCount,
+                 transport.stats.noBufferCount, transport.stats.droppedDatagramCount)
+
+    nimbleServerDaemonUringTransportDestroy(&transport);
+
+    return err;
+}
+
+/// Runs the sender on its own thread and measures the CPU time that the receiving thread spends
+/// @return negative on error
+static int benchBackend(const NimbleServerDaemonBenchTransportSetup* setup, NimbleServerDaemonBackend backend,
+                        BenchTransportResult* result, Clog log)
+{
+    memset(result, 0, sizeof(*result));
+
+    int handle = openLoopbackSocket(setup->port);
+    if (handle < 0) {
+        CLOG_SOFT_ERROR("bench transport: could not open port %d", setup->port)
+        return handle;
+    }
+
+    static NimbleServerDaemonAddressTable addressTable;
+    nimbleServerDaemonAddressTableInit(&addressTable, setup->clientCount, 60000);
+
+    static BenchTransportSender sender;
+    sender.setup = setup;
+    memset(&sender.serverAddress, 0, sizeof(sender.serverAddress));
+    sender.serverAddress.sin_family = AF_INET;
+    sender.serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sender.serverAddress.sin_port = htons(setup->port);
+    for (size_t i = 0; i < setup->clientCount; ++i) {
+        sender.sockets[i] = openLoopbackSocket(0);
+        if (sender.sockets[i] < 0) {
+            return -3;
+        }
+    }
+
+    uint64_t startedAtUs = nimbleServerDaemonMicroseconds();
+    uint64_t cpuStartedAtUs = threadCpuMicroseconds();
+
+    pthread_t senderThread;
+    if (pthread_create(&senderThread, 0, sendDatagrams, &sender) != 0) {
+        return -4;
+    }
+
+    int err = 0;
+    if (backend == NimbleServerDaemonBackendUring) {
+        err = echoWithUring(handle, &addressTable, result, log);
+    } else {
+        // In case all the stop datagrams are dropped
+        struct timeval receiveTimeout = {.tv_sec = 1, .tv_usec = 0};
+        setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+        echoWithSocket(handle, &addressTable, result);
+    }
+
+    result->cpuUs = threadCpuMicroseconds() - cpuStartedAtUs;
+    result->wallUs = nimbleServerDaemonMicroseconds() - startedAtUs;
+
+    pthread_join(senderThread, 0);
+    for (size_t i = 0; i < setup->clientCount; ++i) {
+        close(sender.sockets[i]);
+    }
+    close(handle);
+
+    return err;
+}
+
+static void printResult(const char* backendName, const BenchTransportResult* result)
+{
+    uint64_t cpuUs = result->cpuUs > 0 ? result->cpuUs : 1;
+    uint64_t wallUs = result->wallUs > 0 ? result->wallUs : 1;
+
+    printf("{\"backend\":\"%s\",\"receivedDatagramCount\":%" PRIu64 ",\"sentDatagramCount\":%" PRIu64
+           ",\"systemCallCount\":%" PRIu64 ",\"cpuUs\":%" PRIu64 ",\"wallUs\":%" PRIu64
+           ",\"datagramsPerCpuSecond\":%" PRIu64 ",\"datagramsPerSecond\":%" PRIu64 "}\n",
+           backendName, result->receivedDatagramCount, result->sentDatagramCount, result->systemCallCount,
+           result->cpuUs, result->wallUs, result->receivedDatagramCount * 1000000u / cpuUs,
+           result->receivedDatagramCount * 1000000u / wallUs);
+}
+
+/// Compares the plain socket backend with the io_uring backend over loopback. A sender thread sends datagrams from
+/// a number of client sockets, and the receiving thread echoes each one back to its sender through the backend.
+/// Prints a JSON object for each backend with the datagrams received for each second of CPU time on the receiving
+/// thread, which is the throughput of a single core.
+/// @param setup port, client count, datagram count and size
+/// @return negative on error
+int nimbleServerDaemonBenchTransport(const NimbleServerDaemonBenchTransportSetup* setup)
+{
+    if (setup->clientCount == 0 || setup->clientCount > NIMBLE_DAEMON_BENCH_TRANSPORT_MAX_CLIENT_COUNT) {
+        CLOG_SOFT_ERROR("bench transport: client count must be 1 to %d",
+                        NIMBLE_DAEMON_BENCH_TRANSPORT_MAX_CLIENT_COUNT)
+        return -1;
+    }
+
+    if (setup->datagramOctetCount == 0 || setup->datagramOctetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        CLOG_SOFT_ERROR("bench transport: datagram size must be 1 to %d", DATAGRAM_TRANSPORT_MAX_SIZE)
+        return -2;
+    }
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    BenchTransportResult result;
+    int err = benchBackend(setup, NimbleServerDaemonBackendSocket, &result, log);
+    if (err < 0) {
+        return err;
+    }
+    printResult("socket", &result);
+
+    err = benchBackend(setup, NimbleServerDaemonBackendUring, &result, log);
+    if (err < 0) {
+        CLOG_SOFT_ERROR("bench transport: io_uring backend failed %d", err)
+        return err;
+    }
+    printResult("uring", &result);
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <nimble-daemon/bench_workers.h>
+#include <nimble-daemon/workers.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NIMBLE_DAEMON_BENCH_WORKERS_MAX_SENDER_COUNT (16)
+#define NIMBLE_DAEMON_BENCH_WORKERS_MAX_CLIENT_COUNT (256)
+
+typedef struct BenchWorkersSender {
+    int sockets[NIMBLE_DAEMON_BENCH_WORKERS_MAX_CLIENT_COUNT];
+    size_t socketCount;
+    size_t datagramOctetCount;
+    struct sockaddr_in serverAddress;
+    bool* isStopping;
+    pthread_t thread;
+} BenchWorkersSender;
+
+/// Sends round-robin from the client sockets of the sender until the run is stopped
+static void* sendUntilStopped(void* _self)
+{
+    BenchWorkersSender* self = (BenchWorkersSender*) _self;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    memset(datagram, 0, sizeof(datagram));
+
+    for (size_t i = 0; self->socketCount > 0 && !__atomic_load_n(self->isStopping, __ATOMIC_ACQUIRE); ++i) {
+        sendto(self->sockets[i % self->socketCount], datagram, self->datagramOctetCount, 0,
+               (const struct sockaddr*) &self->serverAddress, sizeof(self->serverAddress));
+    }
+
+    return 0;
+}
+
+static int openClientSocket(void)
+{
+    int handle = socket(AF_INET, SOCK_DGRAM, 0);
+    if (handle < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    if (bind(handle, (const struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(handle);
+        return -2;
+    }
+
+    return handle;
+}
+
+/// Runs the workers while the senders send for the duration, and prints the datagrams that the rooms were fed
+/// @return datagrams per second, or negative on error
+static int64_t benchWorkerCount(const NimbleServerDaemonBenchWorkersSetup* setup, uint16_t port, size_t workerCount,
+                                int64_t baseDatagramsPerSecond, Clog log)
+{
+    static NimbleServerDaemonWorkers workers;
+    // The clients are not spread evenly over the workers, so each worker must be able to take all of them
+    size_t maxConnectionCount = setup->clientCount;
+    if (maxConnectionCount > NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT) {
+        maxConnectionCount = NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT;
+    }
+    NimbleServerDaemonWorkersSetup workersSetup = {.port = port,
+                                                   .workerCount = workerCount,
+                                                   .maxConnectionCount = maxConnectionCount,
+                                                   .targetTickTimeMs = 16,
+                                                   .idleTimeoutMs = 60000,
+                                                   .log = log};
+    int err = nimbleServerDaemonWorkersInit(&workers, workersSetup);
+    if (err < 0) {
+        nimbleServerDaemonWorkersDestroy(&workers);
+        return err;
+    }
+
+    err = nimbleServerDaemonWorkersStart(&workers);
+    if (err < 0) {
+        nimbleServerDaemonWorkersStop(&workers);
+        nimbleServerDaemonWorkersDestroy(&workers);
+        return err;
+    }
+
+    static BenchWorkersSender senders[NIMBLE_DAEMON_BENCH_WORKERS_MAX_SENDER_COUNT];
+    bool isStopping = false;
+    for (size_t i = 0; i < setup->senderCount; ++i) {
+        BenchWorkersSender* sender = &senders[i];
+        sender->socketCount = 0;
+        sender->datagramOctetCount = setup->datagramOctetCount;
+        sender->isStopping = &isStopping;
+        memset(&sender->serverAddress, 0, sizeof(sender->serverAddress));
+        sender->serverAddress.sin_family = AF_INET;
+        sender->serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sender->serverAddress.sin_port = htons(port);
+    }
+    for (size_t i = 0; i < setup->clientCount; ++i) {
+        BenchWorkersSender* sender = &senders[i % setup->senderCount];
+        int handle = openClientSocket();
+        if (handle < 0) {
+            CLOG_SOFT_ERROR("bench workers: could not open client socket %d", handle)
+            continue;
+        }
+        sender->sockets[sender->socketCount++] = handle;
+    }
+
+    for (size_t i = 0; i < setup->senderCount; ++i) {
+        pthread_create(&senders[i].thread, 0, sendUntilStopped, &senders[i]);
+    }
+
+    usleep((useconds_t) setup->durationMs * 1000u);
+    __atomic_store_n(&isStopping, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < setup->senderCount; ++i) {
+        pthread_join(senders[i].thread, 0);
+    }
+
+    // Let the workers drain what is left in the sockets
+    usleep(50 * 1000);
+    err = nimbleServerDaemonWorkersStop(&workers);
+
+    uint64_t receivedDatagramCount = 0;
+    uint64_t handedOffDatagramCount = 0;
+    uint64_t minReceivedDatagramCount = UINT64_MAX;
+    uint64_t maxReceivedDatagramCount = 0;
+    for (size_t i = 0; i < workerCount; ++i) {
+        const NimbleServerDaemonStats* stats = &workers.workers[i].daemon.stats;
+        receivedDatagramCount += stats->receivedDatagramCount;
+        handedOffDatagramCount += stats->handedOffDatagramCount;
+        if (stats->receivedDatagramCount < minReceivedDatagramCount) {
+            minReceivedDatagramCount = stats->receivedDatagramCount;
+        }
+        if (stats->receivedDatagramCount > maxReceivedDatagramCount) {
+            maxReceivedDatagramCount = stats->receivedDatagramCount;
+        }
+    }
+
+    int64_t datagramsPerSecond = (int64_t) (receivedDatagramCount * 1000u / setup->durationMs);
+    int64_t base = baseDatagramsPerSecond > 0 ? baseDatagramsPerSecond : datagramsPerSecond;
+
+    printf("{\"workerCount\":%zu,\"steered\":%s,\"receivedDatagramCount\":%" PRIu64
+           ",\"handedOffDatagramCount\":%" PRIu64 ",\"minWorkerDatagramCount\":%" PRIu64
+           ",\"maxWorkerDatagramCount\":%" PRIu64 ",\"datagramsPerSecond\":%" PRId64 ",\"speedup\":%.2f}\n",
+           workerCount, workers.isSteered ? "true" : "false", receivedDatagramCount, handedOffDatagramCount,
+           minReceivedDatagramCount, maxReceivedDatagramCount, datagramsPerSecond,
+           base > 0 ? (double) datagramsPerSecond / (double) base : 0.0);
+
+    for (size_t i = 0; i < setup->senderCount; ++i) {
+        for (size_t j = 0; j < senders[i].socketCount; ++j) {
+            close(senders[i].sockets[j]);
+        }
+    }
+    nimbleServerDaemonWorkersDestroy(&workers);
+
+    return err < 0 ? err : datagramsPerSecond;
+}
+
+/// Measures how the packet processing of the daemon scales with the number of SO_REUSEPORT workers. Sender threads
+/// send datagrams over loopback from a number of client sockets for a fixed duration, and the datagrams that were fed
+/// to the rooms are counted. Prints a JSON object for each worker count, with the speedup compared to one worker.
+/// The senders run on the same host, so leave cores for them.
+/// @param setup port, worker count, client and sender count, duration and datagram size
+/// @return negative on error
+int nimbleServerDaemonBenchWorkers(const NimbleServerDaemonBenchWorkersSetup* setup)
+{
+    if (setup->senderCount == 0 || setup->senderCount > NIMBLE_DAEMON_BENCH_WORKERS_MAX_SENDER_COUNT ||
+        setup->clientCount < setup->senderCount ||
+        setup->clientCount > NIMBLE_DAEMON_BENCH_WORKERS_MAX_CLIENT_COUNT) {
+        CLOG_SOFT_ERROR("bench workers: sender count must be 1 to %d, and client count from the sender count to %d",
+                        NIMBLE_DAEMON_BENCH_WORKERS_MAX_SENDER_COUNT, NIMBLE_DAEMON_BENCH_WORKERS_MAX_CLIENT_COUNT)
+        return -1;
+    }
+
+    if (setup->durationMs == 0 || setup->datagramOctetCount == 0 ||
+        setup->datagramOctetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        CLOG_SOFT_ERROR("bench workers: duration must be set and datagram size must be 1 to %d",
+                        DATAGRAM_TRANSPORT_MAX_SIZE)
+        return -2;
+    }
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "bench";
+
+    int64_t baseDatagramsPerSecond = 0;
+    uint16_t port = setup->port;
+    for (size_t workerCount = 1; workerCount <= setup->maxWorkerCount; workerCount *= 2) {
+        int64_t datagramsPerSecond = benchWorkerCount(setup, port++, workerCount, baseDatagramsPerSecond, log);
+        if (datagramsPerSecond < 0) {
+            CLOG_SOFT_ERROR("bench workers: %zu workers failed %" PRId64, workerCount, datagramsPerSecond)
+            return (int) datagramsPerSecond;
+        }
+        if (workerCount == 1) {
+            baseDatagramsPerSecond = datagramsPerSecond;
+        }
+        if (workerCount < setup->maxWorkerCount && workerCount * 2 > setup->maxWorkerCount) {
+            datagramsPerSecond = benchWorkerCount(setup, port++, setup->maxWorkerCount, baseDatagramsPerSecond, log);
+            if (datagramsPerSecond < 0) {
+                return (int) datagramsPerSecond;
+            }
+        }
+    }
+
+    return 0;
+}
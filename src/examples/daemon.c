@@ -3,14 +3,681 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <nimble-daemon/daemon.h>
+#include <nimble-server/datagram_run.h>
+#include <nimble-server/memory_report.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct NimbleServerDaemonReply {
+    NimbleServerDaemon* daemon;
+    int transportIndex;
+} NimbleServerDaemonReply;
+
+/// Monotonic time in microseconds, for the tick measurements
+/// @return microseconds
+uint64_t nimbleServerDaemonMicroseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+/// Finds the client address of the transport connection
+/// @return the address, or NULL if the transport connection is not in use
+static const struct sockaddr_in* addressForConnection(NimbleServerDaemon* self, int connectionId)
+{
+    if (connectionId < 0 || (size_t) connectionId >= self->addressTable.connectionCount ||
+        !self->addressTable.entries[connectionId].isUsed) {
+        CLOG_C_NOTICE(&self->log, "no address for transport connection %d", connectionId)
+        return 0;
+    }
+
+    return &self->addressTable.entries[connectionId].address;
+}
+
+static int daemonSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerDaemon* self = (NimbleServerDaemon*) _self;
+
+    const struct sockaddr_in* address = addressForConnection(self, connectionId);
+    if (address == 0) {
+        return -1;
+    }
+
+    int err = udpServerSend(&self->socket, data, octetCount, address);
+    if (err < 0) {
+        CLOG_C_NOTICE(&self->log, "could not send %zu octets to transport connection %d", octetCount, connectionId)
+    }
+
+    return err;
+}
+
+/// The daemon feeds the datagrams directly to the server, so there is never anything to read from the transport
+static ssize_t daemonReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t octetCount)
+{
+    (void) _self;
+    (void) connectionId;
+    (void) data;
+    (void) octetCount;
+
+    return 0;
+}
+
+static int replyToTransportIndex(void* _self, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerDaemonReply* self = (NimbleServerDaemonReply*) _self;
+
+    return daemonSendTo(self->daemon, self->transportIndex, data, octetCount);
+}
+
+/// Sends a run of datagrams with one UDP_SEGMENT sendmsg(). Falls back to one datagram at a time for the rest of the
+/// run of the daemon, if the kernel or the network device can not segment.
+static int replyRunToTransportIndex(void* _self, const uint8_t* octets, size_t octetCount, size_t segmentOctetCount)
+{
+    NimbleServerDaemonReply* reply = (NimbleServerDaemonReply*) _self;
+    NimbleServerDaemon* self = reply->daemon;
+
+    const struct sockaddr_in* address = addressForConnection(self, reply->transportIndex);
+    if (address == 0) {
+        return -1;
+    }
+
+    if (self->isGsoEnabled) {
+        int err = nimbleServerDaemonUdpSegmentsSend(self->socket.handle, address, octets, octetCount,
+                                                    segmentOctetCount);
+        if (err != NIMBLE_DAEMON_UDP_SEGMENTS_ERR_NOT_SUPPORTED) {
+            if (err < 0) {
+                CLOG_C_NOTICE(&self->log, "could not send %zu octets to transport connection %d", octetCount,
+                              reply->transportIndex)
+                return err;
+            }
+            self->stats.segmentedSendCount++;
+            self->stats.segmentedDatagramCount += (octetCount + segmentOctetCount - 1) / segmentOctetCount;
+            return 0;
+        }
+        CLOG_C_NOTICE(&self->log, "daemon: UDP_SEGMENT is not supported, sending one datagram at a time")
+        self->isGsoEnabled = false;
+    }
+
+    return nimbleServerDaemonUdpSegmentsSendEach(self->socket.handle, address, octets, octetCount, segmentOctetCount);
+}
+
+static int addToEpoll(int epollFd, int fd)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/// Opens a non-blocking UDP socket on the port that other sockets can bind to as well. The kernel spreads the
+/// datagrams over the sockets by a hash of the addresses, unless a steering program is attached to the group.
+static int openReusePortSocket(UdpServerSocket* socketToOpen, uint16_t port)
+{
+    int handle = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (handle < 0) {
+        return -1;
+    }
+
+    int enable = 1;
+    if (setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        close(handle);
+        return -2;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(handle, (const struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(handle);
+        return -3;
+    }
+
+    socketToOpen->handle = handle;
+
+    return 0;
+}
 
-int nimbleServerDaemonInit(NimbleServerDaemon* self)
+static int uringNewAddress(void* _self, uint8_t transportIndex)
 {
+    NimbleServerDaemon* self = (NimbleServerDaemon*) _self;
+
+    CLOG_C_DEBUG(&self->log, "new client address on transport connection %d", transportIndex)
+    int err = nimbleServerConnectionConnected(self->server, transportIndex);
+    if (err < 0) {
+        CLOG_C_NOTICE(&self->log, "could not connect transport connection %d: error %d", transportIndex, err)
+    }
+
+    return err;
+}
+
+/// Switches the receive batch over to buffers that can hold the datagrams that the kernel has coalesced. Receives one
+/// datagram at a time if the kernel does not support UDP_GRO.
+static void enableGro(NimbleServerDaemon* self)
+{
+    NimbleServerDaemonReceiveBatch* batch = &self->receiveBatch;
+    size_t groOctetCount = NIMBLE_DAEMON_RECEIVE_BATCH_COUNT * NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT;
+
+    void* groOctets = mmap(0, groOctetCount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (groOctets == MAP_FAILED) {
+        CLOG_C_NOTICE(&self->log, "daemon: could not allocate the UDP_GRO buffers %d", errno)
+        return;
+    }
+
+    if (nimbleServerDaemonUdpSegmentsEnableGro(self->socket.handle) < 0) {
+        CLOG_C_NOTICE(&self->log, "daemon: UDP_GRO is not supported %d, receiving one datagram at a time", errno)
+        munmap(groOctets, groOctetCount);
+        return;
+    }
+
+    batch->groOctets = (uint8_t*) groOctets;
+    for (size_t i = 0; i < NIMBLE_DAEMON_RECEIVE_BATCH_COUNT; ++i) {
+        batch->iovecs[i].iov_base = batch->groOctets + i * NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT;
+        batch->iovecs[i].iov_len = NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT;
+        batch->messages[i].msg_hdr.msg_control = batch->controls[i];
+    }
+    self->isGroEnabled = true;
+}
+
+/// Opens a non-blocking UDP socket on the port, a timerfd that expires every targetTickTimeMs, and an epoll for both
+/// (and for the handoff fd, if set)
+/// @param self daemon
+/// @param setup port, backend, GSO and GRO, connection count, tick time, idle timeout and handoff
+/// @return negative on error
+int nimbleServerDaemonInit(NimbleServerDaemon* self, NimbleServerDaemonSetup setup)
+{
+    self->log = setup.log;
+    self->backend = setup.backend;
+    // The io_uring backend sends the replies through the multiTransport, so there are never any runs to segment
+    self->isGsoEnabled = setup.isGsoEnabled && setup.backend == NimbleServerDaemonBackendSocket;
+    self->isGroEnabled = false;
+    self->receiveBatch.groOctets = 0;
+    self->server = 0;
+    self->handoff = setup.handoff;
+    self->uringTransport.ringFd = -1;
+    self->targetTickTimeMs = setup.targetTickTimeMs;
+    self->lastTickAtUs = 0;
+    self->epollFd = -1;
+    self->timerFd = -1;
+    memset(&self->stats, 0, sizeof(self->stats));
+
+    if (setup.targetTickTimeMs == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: target tick time must be set")
+        return -1;
+    }
+
+    nimbleServerDaemonAddressTableInit(&self->addressTable, setup.maxConnectionCount, setup.idleTimeoutMs);
+
+    self->multiTransport.self = self;
+    self->multiTransport.sendTo = daemonSendTo;
+    self->multiTransport.receiveFrom = daemonReceiveFrom;
+
+    NimbleServerDaemonReceiveBatch* batch = &self->receiveBatch;
+    for (size_t i = 0; i < NIMBLE_DAEMON_RECEIVE_BATCH_COUNT; ++i) {
+        batch->iovecs[i].iov_base = batch->octets[i];
+        batch->iovecs[i].iov_len = DATAGRAM_TRANSPORT_MAX_SIZE;
+        memset(&batch->messages[i], 0, sizeof(batch->messages[i]));
+        batch->messages[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->messages[i].msg_hdr.msg_iovlen = 1;
+        batch->messages[i].msg_hdr.msg_name = &batch->addresses[i];
+    }
+
     int err = udpServerStartup();
     if (err < 0) {
         return err;
     }
 
-    return udpServerInit(&self->socket, 27000, true);
+    if (setup.isReusePort) {
+        err = openReusePortSocket(&self->socket, setup.port);
+    } else {
+        err = udpServerInit(&self->socket, setup.port, false);
+    }
+    if (err < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: could not open UDP port %d", setup.port)
+        return err;
+    }
+
+    if (setup.isGroEnabled && self->backend == NimbleServerDaemonBackendSocket) {
+        enableGro(self);
+    }
+
+    if (self->backend == NimbleServerDaemonBackendUring) {
+        NimbleServerDaemonUringTransportSetup uringSetup = {.socketHandle = self->socket.handle,
+                                                            .addressTable = &self->addressTable,
+                                                            .newAddressFn = uringNewAddress,
+                                                            .newAddressSelf = self,
+                                                            .log = self->log};
+        err = nimbleServerDaemonUringTransportInit(&self->uringTransport, uringSetup);
+        if (err < 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "daemon: could not start the io_uring backend %d", err)
+            return err;
+        }
+        self->multiTransport = self->uringTransport.multiTransport;
+    }
+
+    self->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (self->timerFd < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: timerfd_create failed %d", errno)
+        return -2;
+    }
+
+    struct itimerspec tickInterval;
+    tickInterval.it_interval.tv_sec = (time_t) (setup.targetTickTimeMs / 1000);
+    tickInterval.it_interval.tv_nsec = (long) (setup.targetTickTimeMs % 1000) * 1000000L;
+    tickInterval.it_value = tickInterval.it_interval;
+    if (timerfd_settime(self->timerFd, 0, &tickInterval, 0) < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: timerfd_settime failed %d", errno)
+        return -3;
+    }
+
+    self->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (self->epollFd < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: epoll_create1 failed %d", errno)
+        return -4;
+    }
+
+    bool isSocketPolled = self->backend == NimbleServerDaemonBackendSocket;
+    if ((isSocketPolled && addToEpoll(self->epollFd, self->socket.handle) < 0) ||
+        addToEpoll(self->epollFd, self->timerFd) < 0 ||
+        (self->handoff.drainFn != 0 && addToEpoll(self->epollFd, self->handoff.handoffFd) < 0)) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: epoll_ctl failed %d", errno)
+        return -5;
+    }
+
+    return 0;
+}
+
+/// Closes the epoll, the timer, the io_uring backend and the socket, and frees the UDP_GRO buffers
+/// @param self daemon
+void nimbleServerDaemonDestroy(NimbleServerDaemon* self)
+{
+    if (self->receiveBatch.groOctets != 0) {
+        munmap(self->receiveBatch.groOctets,
+               NIMBLE_DAEMON_RECEIVE_BATCH_COUNT * NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT);
+        self->receiveBatch.groOctets = 0;
+        self->isGroEnabled = false;
+    }
+    if (self->backend == NimbleServerDaemonBackendUring) {
+        nimbleServerDaemonUringTransportDestroy(&self->uringTransport);
+    }
+    if (self->epollFd >= 0) {
+        close(self->epollFd);
+        self->epollFd = -1;
+    }
+    if (self->timerFd >= 0) {
+        close(self->timerFd);
+        self->timerFd = -1;
+    }
+    close(self->socket.handle);
+}
+
+/// Finds the transport connection index for the address, or connects a new one
+/// @return transport connection index, negative if all transport connections are in use
+static int transportIndexForAddress(NimbleServerDaemon* self, NimbleServer* server, const struct sockaddr_in* address,
+                                    MonotonicTimeMs now)
+{
+    int transportIndex = nimbleServerDaemonAddressTableFind(&self->addressTable, address);
+    if (transportIndex >= 0) {
+        self->addressTable.entries[transportIndex].lastReceivedAtMs = now;
+        return transportIndex;
+    }
+
+    transportIndex = nimbleServerDaemonAddressTableAdd(&self->addressTable, address, now);
+    if (transportIndex < 0) {
+        return transportIndex;
+    }
+
+    CLOG_C_DEBUG(&self->log, "new client address on transport connection %d", transportIndex)
+    int err = nimbleServerConnectionConnected(server, (uint8_t) transportIndex);
+    if (err < 0) {
+        CLOG_C_NOTICE(&self->log, "could not connect transport connection %d: error %d", transportIndex, err)
+        nimbleServerDaemonAddressTableRemove(&self->addressTable, (uint8_t) transportIndex);
+        return err;
+    }
+
+    return transportIndex;
+}
+
+/// Feeds a datagram from a client address to the server, and connects the address if it is new
+/// @param self daemon
+/// @param server the server to feed
+/// @param address the client address
+/// @param octets datagram
+/// @param octetCount octet count of the datagram
+/// @param now current time
+void nimbleServerDaemonFeed(NimbleServerDaemon* self, NimbleServer* server, const struct sockaddr_in* address,
+                            const uint8_t* octets, size_t octetCount, MonotonicTimeMs now)
+{
+    int transportIndex = transportIndexForAddress(self, server, address, now);
+    if (transportIndex < 0) {
+        self->stats.rejectedDatagramCount++;
+        return;
+    }
+
+    NimbleServerDaemonReply reply = {.daemon = self, .transportIndex = transportIndex};
+    DatagramTransportOut transportOut;
+    transportOut.self = &reply;
+    transportOut.send = replyToTransportIndex;
+
+    NimbleServerDatagramRunOut runOut;
+    runOut.self = &reply;
+    runOut.sendRun = replyRunToTransportIndex;
+
+    NimbleServerResponse response;
+    response.transportOut = &transportOut;
+    response.runOut = self->isGsoEnabled ? &runOut : 0;
+
+    int err = nimbleServerFeed(server, (uint8_t) transportIndex, octets, octetCount, &response);
+    if (err < 0 && !nimbleServerIsErrorExternal(err)) {
+        CLOG_C_NOTICE(&self->log, "nimbleServerFeed: error %d from transport connection %d", err, transportIndex)
+    }
+
+    self->stats.receivedDatagramCount++;
+}
+
+/// Feeds a datagram to the server, or hands it off to the daemon that owns the client
+static void feedOrHandOff(NimbleServerDaemon* self, NimbleServer* server, const struct sockaddr_in* address,
+                          const uint8_t* octets, size_t octetCount, MonotonicTimeMs now)
+{
+    if (self->handoff.routeFn != 0 && self->handoff.routeFn(self->handoff.self, address, octets, octetCount)) {
+        self->stats.handedOffDatagramCount++;
+        return;
+    }
+
+    nimbleServerDaemonFeed(self, server, address, octets, octetCount, now);
+}
+
+/// Feeds all the datagrams in a received batch to the server. With UDP_GRO, a message is split into the datagrams
+/// that the kernel coalesced.
+static void feedBatch(NimbleServerDaemon* self, NimbleServer* server, size_t messageCount, MonotonicTimeMs now)
+{
+    NimbleServerDaemonReceiveBatch* batch = &self->receiveBatch;
+
+    for (size_t i = 0; i < messageCount; ++i) {
+        struct mmsghdr* message = &batch->messages[i];
+        if (message->msg_hdr.msg_namelen != sizeof(struct sockaddr_in)) {
+            continue;
+        }
+
+        if (!self->isGroEnabled) {
+            feedOrHandOff(self, server, &batch->addresses[i], batch->octets[i], message->msg_len, now);
+            continue;
+        }
+
+        const uint8_t* octets = batch->groOctets + i * NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT;
+        size_t segmentOctetCount = nimbleServerDaemonUdpSegmentsGroOctetCount(&message->msg_hdr, message->msg_len);
+        if (segmentOctetCount < message->msg_len) {
+            self->stats.coalescedDatagramCount += (message->msg_len + segmentOctetCount - 1) / segmentOctetCount;
+        }
+        for (size_t offset = 0; offset < message->msg_len; offset += segmentOctetCount) {
+            size_t datagramOctetCount = message->msg_len - offset < segmentOctetCount ? message->msg_len - offset
+                                                                                       : segmentOctetCount;
+            if (datagramOctetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+                continue;
+            }
+            feedOrHandOff(self, server, &batch->addresses[i], octets + offset, datagramOctetCount, now);
+        }
+    }
+
+    self->stats.receiveBatchCount++;
+}
+
+/// Receives datagrams with recvmmsg() until the socket is drained, or for at most
+/// NIMBLE_DAEMON_MAX_RECEIVE_BATCHES_FOR_EACH_WAKEUP batches so a flood can not delay the tick
+/// @return negative on error
+static int receiveAll(NimbleServerDaemon* self, NimbleServer* server)
+{
+    NimbleServerDaemonReceiveBatch* batch = &self->receiveBatch;
+    MonotonicTimeMs now = monotonicTimeMsNow();
+
+    for (size_t batchIndex = 0; batchIndex < NIMBLE_DAEMON_MAX_RECEIVE_BATCHES_FOR_EACH_WAKEUP; ++batchIndex) {
+        for (size_t i = 0; i < NIMBLE_DAEMON_RECEIVE_BATCH_COUNT; ++i) {
+            batch->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            batch->messages[i].msg_hdr.msg_controllen = self->isGroEnabled ? sizeof(batch->controls[i]) : 0;
+        }
+
+        int messageCount = recvmmsg(self->socket.handle, batch->messages, NIMBLE_DAEMON_RECEIVE_BATCH_COUNT,
+                                    MSG_DONTWAIT, 0);
+        if (messageCount < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            CLOG_C_SOFT_ERROR(&self->log, "daemon: recvmmsg failed %d", errno)
+            return -1;
+        }
+
+        feedBatch(self, server, (size_t) messageCount, now);
+
+        if (messageCount < NIMBLE_DAEMON_RECEIVE_BATCH_COUNT) {
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/// Reads the datagrams that the io_uring backend has received through the multiTransport, in the same way as
+/// nimbleServerUpdate() does, until there are no completions left or for at most
+/// NIMBLE_DAEMON_MAX_RECEIVE_BATCHES_FOR_EACH_WAKEUP reads
+static void receiveAllFromUring(NimbleServerDaemon* self, NimbleServer* server)
+{
+    uint64_t receivedCountBefore = self->uringTransport.stats.receivedDatagramCount;
+
+    for (size_t i = 0; i < NIMBLE_DAEMON_MAX_RECEIVE_BATCHES_FOR_EACH_WAKEUP &&
+                       nimbleServerDaemonUringTransportHasPending(&self->uringTransport);
+         ++i) {
+        int err = nimbleServerReadFromMultiTransport(server);
+        if (err < 0 && !nimbleServerIsErrorExternal(err)) {
+            CLOG_C_NOTICE(&self->log, "nimbleServerReadFromMultiTransport: error %d", err)
+        }
+        self->stats.receiveBatchCount++;
+    }
+
+    self->stats.receivedDatagramCount += self->uringTransport.stats.receivedDatagramCount - receivedCountBefore;
+}
+
+/// Disconnects the client addresses that have been idle for too long
+static void expireIdleAddresses(NimbleServerDaemon* self, NimbleServer* server, MonotonicTimeMs now)
+{
+    uint8_t expiredTransportIndices[NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT];
+    size_t expiredCount = nimbleServerDaemonAddressTableExpire(&self->addressTable, now, expiredTransportIndices,
+                                                               NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT);
+    for (size_t i = 0; i < expiredCount; ++i) {
+        CLOG_C_DEBUG(&self->log, "transport connection %d was idle, disconnecting", expiredTransportIndices[i])
+        int err = nimbleServerConnectionDisconnected(server, expiredTransportIndices[i]);
+        if (err < 0) {
+            CLOG_C_NOTICE(&self->log, "could not disconnect transport connection %d: error %d",
+                          expiredTransportIndices[i], err)
+        }
+    }
+    self->stats.expiredConnectionCount += expiredCount;
+}
+
+/// Handles the timer: drains the socket, updates the server and measures how far the tick was from the target
+/// @param expirationCount number of timer expirations since the previous tick
+/// @return negative on error
+static int tick(NimbleServerDaemon* self, NimbleServer* server, uint64_t expirationCount)
+{
+    uint64_t startedAtUs = nimbleServerDaemonMicroseconds();
+    if (self->lastTickAtUs != 0) {
+        uint64_t intervalUs = startedAtUs - self->lastTickAtUs;
+        uint64_t targetUs = expirationCount * self->targetTickTimeMs * 1000u;
+        uint64_t jitterUs = intervalUs > targetUs ? intervalUs - targetUs : targetUs - intervalUs;
+        self->stats.tickJitterTotalUs += jitterUs;
+        if (jitterUs > self->stats.tickJitterMaxUs) {
+            self->stats.tickJitterMaxUs = jitterUs;
+        }
+    }
+    self->lastTickAtUs = startedAtUs;
+    if (expirationCount > 1) {
+        self->stats.missedTickCount += expirationCount - 1;
+    }
+
+    if (self->backend == NimbleServerDaemonBackendUring) {
+        receiveAllFromUring(self, server);
+    } else {
+        int err = receiveAll(self, server);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    MonotonicTimeMs now = monotonicTimeMsNow();
+
+    uint64_t updateStartedAtUs = nimbleServerDaemonMicroseconds();
+    int err = nimbleServerUpdate(server, now);
+    uint64_t updateUs = nimbleServerDaemonMicroseconds() - updateStartedAtUs;
+    if (err < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: nimbleServerUpdate failed %d", err)
+        return err;
+    }
+    self->stats.updateTotalUs += updateUs;
+    if (updateUs > self->stats.updateMaxUs) {
+        self->stats.updateMaxUs = updateUs;
+    }
+
+    if (self->backend == NimbleServerDaemonBackendUring) {
+        // All the replies of the tick are sent with one system call
+        err = nimbleServerDaemonUringTransportFlush(&self->uringTransport);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    expireIdleAddresses(self, server, now);
+    self->stats.tickCount++;
+
+    return 0;
+}
+
+/// Waits for datagrams or the tick timer, at most timeoutMs, and handles them
+/// @param self daemon
+/// @param server the server to feed and update
+/// @param timeoutMs maximum time to wait, -1 to wait until something happens
+/// @return number of ticks, negative on error
+int nimbleServerDaemonPoll(NimbleServerDaemon* self, NimbleServer* server, int timeoutMs)
+{
+    self->server = server;
+
+    struct epoll_event events[3];
+    int eventCount = epoll_wait(self->epollFd, events, 3, timeoutMs);
+    if (eventCount < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        CLOG_C_SOFT_ERROR(&self->log, "daemon: epoll_wait failed %d", errno)
+        return -1;
+    }
+
+    bool timerExpired = false;
+    for (int i = 0; i < eventCount; ++i) {
+        if (events[i].data.fd == self->timerFd) {
+            timerExpired = true;
+            continue;
+        }
+        if (self->handoff.drainFn != 0 && events[i].data.fd == self->handoff.handoffFd) {
+            self->handoff.drainFn(self->handoff.self, self, server);
+            continue;
+        }
+        int err = receiveAll(self, server);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    if (!timerExpired) {
+        return 0;
+    }
+
+    uint64_t expirationCount;
+    ssize_t octetCount = read(self->timerFd, &expirationCount, sizeof(expirationCount));
+    if (octetCount != (ssize_t) sizeof(expirationCount)) {
+        return 0;
+    }
+
+    int err = tick(self, server, expirationCount);
+    if (err < 0) {
+        return err;
+    }
+
+    return 1;
+}
+
+/// Returns how many ticks there are between the stats that are written to the log, about ten seconds.
+/// Ticks that are longer than ten seconds write the stats on every tick.
+/// @param self daemon
+/// @return tick count, at least one
+uint64_t nimbleServerDaemonStatsEveryTickCount(const NimbleServerDaemon* self)
+{
+    uint64_t tickCount = 10000u / self->targetTickTimeMs;
+
+    return tickCount > 0 ? tickCount : 1;
+}
+
+/// Polls forever, and writes the stats and the memory report to the log every ten seconds
+/// @param self daemon
+/// @param server the server to feed and update
+/// @return negative on error
+int nimbleServerDaemonRun(NimbleServerDaemon* self, NimbleServer* server)
+{
+    uint64_t statsEveryTickCount = nimbleServerDaemonStatsEveryTickCount(self);
+
+    while (true) {
+        int tickCount = nimbleServerDaemonPoll(self, server, -1);
+        if (tickCount < 0) {
+            return tickCount;
+        }
+
+        if (tickCount > 0 && (self->stats.tickCount % statsEveryTickCount) == 0) {
+            nimbleServerDaemonStatsDebugOutput(&self->stats, &self->log);
+            nimbleServerDaemonMemoryReportDebugOutput(server, &self->log);
+        }
+    }
+}
+
+/// Writes the memory that each subsystem of the server has reserved and uses to the log
+/// @param server server
+/// @param log target log
+void nimbleServerDaemonMemoryReportDebugOutput(const NimbleServer* server, Clog* log)
+{
+    NimbleServerMemoryReport memoryReport;
+    nimbleServerMemoryReport(server, &memoryReport);
+    nimbleServerMemoryReportDebugOutput(&memoryReport, log);
+}
+
+/// Writes the tick and receive stats to the log
+/// @param self stats
+/// @param log target log
+void nimbleServerDaemonStatsDebugOutput(const NimbleServerDaemonStats* self, Clog* log)
+{
+    uint64_t tickCount = self->tickCount > 0 ? self->tickCount : 1;
+    uint64_t batchCount = self->receiveBatchCount > 0 ? self->receiveBatchCount : 1;
+
+    CLOG_C_INFO(log,
+                "ticks:%" PRIu64 " missed:%" PRIu64 " jitter avg:%" PRIu64 "us max:%" PRIu64 "us update avg:%" PRIu64
+                "us max:%" PRIu64 "us datagrams:%" PRIu64 " (%" PRIu64 " per batch) rejected:%" PRIu64
+                " handed off:%" PRIu64 " expired:%" PRIu64 " segmented sends:%" PRIu64 " (%" PRIu64
+                " datagrams) coalesced:%" PRIu64,
+                self->tickCount, self->missedTickCount, self->tickJitterTotalUs / tickCount, self->tickJitterMaxUs,
+                self->updateTotalUs / tickCount, self->updateMaxUs, self->receivedDatagramCount,
+                self->receivedDatagramCount / batchCount, self->rejectedDatagramCount, self->handedOffDatagramCount,
+                self->expiredConnectionCount, self->segmentedSendCount, self->segmentedDatagramCount,
+                self->coalescedDatagramCount)
 }
@@ -0,0 +1,67 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <imprint/default_setup.h>
+#include <monotonic-time/monotonic_time.h>
+#include <nimble-daemon/example_game.h>
+
+static void serializeGameState(void* _self, NimbleServerSerializedGameState* state)
+{
+    NimbleServerDaemonExampleGame* self = (NimbleServerDaemonExampleGame*) _self;
+
+    state->gameState = &self->gameState;
+    state->gameStateOctetCount = sizeof(self->gameState);
+    state->stepId = self->server->game.authoritativeSteps.expectedWriteId;
+    state->hash = self->gameState;
+}
+
+static void authoritativeStepsComposed(void* _self, const NbsSteps* authoritativeSteps, StepId firstStepId,
+                                       size_t stepCount)
+{
+    NimbleServerDaemonExampleGame* self = (NimbleServerDaemonExampleGame*) _self;
+    (void) authoritativeSteps;
+    (void) firstStepId;
+
+    self->composedStepCount += stepCount;
+}
+
+/// Initializes the server with the example game
+/// @param self example game
+/// @param server the server to initialize
+/// @param memory memory for the server
+/// @param multiTransport the transport that the server sends through
+/// @param maxConnectionCount maximum number of clients
+/// @param targetTickTimeMs the tick time of the game
+/// @param log target log
+/// @return negative on error
+int nimbleServerDaemonExampleGameInit(NimbleServerDaemonExampleGame* self, NimbleServer* server,
+                                      ImprintDefaultSetup* memory, DatagramTransportMulti multiTransport,
+                                      size_t maxConnectionCount, size_t targetTickTimeMs, Clog log)
+{
+    self->server = server;
+    self->gameState = 42;
+    self->composedStepCount = 0;
+    self->vtbl.authoritativeStateSerializeFn = serializeGameState;
+    self->vtbl.authoritativeStepsComposedFn = authoritativeStepsComposed;
+    self->vtbl.predictedStepsValidateFn = 0;
+    self->vtbl.forcedStepCreateFn = 0;
+
+    NimbleServerSetup setup = {.applicationVersion = {0x10, 0x20, 0x30},
+                               .memory = &memory->tagAllocator.info,
+                               .blobAllocator = &memory->slabAllocator.info,
+                               .maxConnectionCount = maxConnectionCount,
+                               .maxParticipantCount = maxConnectionCount * 2,
+                               .maxSingleParticipantStepOctetCount = 8,
+                               .maxParticipantCountForEachConnection = 2,
+                               .maxWaitingForReconnectTicks = 62,
+                               .maxGameStateOctetCount = 1024,
+                               .callbackObject = {.vtbl = &self->vtbl, .self = self},
+                               .multiTransport = multiTransport,
+                               .now = monotonicTimeMsNow(),
+                               .targetTickTimeMs = targetTickTimeMs,
+                               .log = log};
+
+    return nimbleServerInit(server, setup);
+}
@@ -0,0 +1,46 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_ADDRESS_TABLE_H
+#define NIMBLE_DAEMON_ADDRESS_TABLE_H
+
+#include <monotonic-time/monotonic_time.h>
+#include <netinet/in.h>
+#include <nimble-server/server.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT (NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS)
+#define NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT (2 * NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT)
+
+typedef struct NimbleServerDaemonAddressEntry {
+    struct sockaddr_in address;
+    MonotonicTimeMs lastReceivedAtMs;
+    bool isUsed;
+} NimbleServerDaemonAddressEntry;
+
+/// Maps the address of a client to the transport connection index that the server uses for it.
+/// The entries are indexed by the transport connection index. The hash slots use linear probing and hold the
+/// transport connection index plus one, so zero is an empty slot. The slots are rebuilt when an entry is removed,
+/// which is rare and cheap for 64 connections.
+typedef struct NimbleServerDaemonAddressTable {
+    NimbleServerDaemonAddressEntry entries[NIMBLE_DAEMON_ADDRESS_TABLE_MAX_CONNECTION_COUNT];
+    uint8_t slots[NIMBLE_DAEMON_ADDRESS_TABLE_SLOT_COUNT];
+    size_t connectionCount;
+    size_t usedCount;
+    MonotonicTimeMs idleTimeoutMs;
+} NimbleServerDaemonAddressTable;
+
+void nimbleServerDaemonAddressTableInit(NimbleServerDaemonAddressTable* self, size_t connectionCount,
+                                        MonotonicTimeMs idleTimeoutMs);
+int nimbleServerDaemonAddressTableFind(const NimbleServerDaemonAddressTable* self, const struct sockaddr_in* address);
+int nimbleServerDaemonAddressTableAdd(NimbleServerDaemonAddressTable* self, const struct sockaddr_in* address,
+                                      MonotonicTimeMs now);
+void nimbleServerDaemonAddressTableRemove(NimbleServerDaemonAddressTable* self, uint8_t transportIndex);
+size_t nimbleServerDaemonAddressTableExpire(NimbleServerDaemonAddressTable* self, MonotonicTimeMs now,
+                                            uint8_t* expiredTransportIndices, size_t maxCount);
+
+#endif
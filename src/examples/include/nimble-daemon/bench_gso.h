@@ -0,0 +1,20 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_BENCH_GSO_H
+#define NIMBLE_DAEMON_BENCH_GSO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct NimbleServerDaemonBenchGsoSetup {
+    uint16_t port;
+    size_t datagramCount; ///< datagrams sent for each mode
+    size_t datagramOctetCount; ///< e.g. the size of a full blob stream chunk
+} NimbleServerDaemonBenchGsoSetup;
+
+int nimbleServerDaemonBenchGso(const NimbleServerDaemonBenchGsoSetup* setup);
+
+#endif
@@ -0,0 +1,21 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_BENCH_TRANSPORT_H
+#define NIMBLE_DAEMON_BENCH_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct NimbleServerDaemonBenchTransportSetup {
+    uint16_t port;
+    size_t clientCount; ///< sending sockets, each one is a transport connection on the receiving side
+    size_t datagramCount; ///< datagrams sent for each backend
+    size_t datagramOctetCount;
+} NimbleServerDaemonBenchTransportSetup;
+
+int nimbleServerDaemonBenchTransport(const NimbleServerDaemonBenchTransportSetup* setup);
+
+#endif
@@ -0,0 +1,23 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_BENCH_WORKERS_H
+#define NIMBLE_DAEMON_BENCH_WORKERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct NimbleServerDaemonBenchWorkersSetup {
+    uint16_t port;
+    size_t maxWorkerCount; ///< runs with 1, 2, 4 ... workers up to this count
+    size_t clientCount; ///< sending sockets, spread over the sender threads
+    size_t senderCount; ///< sender threads
+    size_t durationMs; ///< how long to send for each worker count
+    size_t datagramOctetCount;
+} NimbleServerDaemonBenchWorkersSetup;
+
+int nimbleServerDaemonBenchWorkers(const NimbleServerDaemonBenchWorkersSetup* setup);
+
+#endif
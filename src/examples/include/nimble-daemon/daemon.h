@@ -6,14 +6,122 @@
 #ifndef NIMBLE_DAEMON_DAEMON_H
 #define NIMBLE_DAEMON_DAEMON_H
 
+#include <clog/clog.h>
+#include <datagram-transport/multi.h>
+#include <datagram-transport/transport.h>
+#include <datagram-transport/types.h>
+#include <nimble-daemon/address_table.h>
+#include <nimble-daemon/udp_segments.h>
+#include <nimble-daemon/uring_transport.h>
 #include <nimble-server/server.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <udp-server/udp_server.h>
 
+#define NIMBLE_DAEMON_RECEIVE_BATCH_COUNT (32)
+#define NIMBLE_DAEMON_MAX_RECEIVE_BATCHES_FOR_EACH_WAKEUP (8)
+
+typedef enum NimbleServerDaemonBackend {
+    NimbleServerDaemonBackendSocket, ///< recvmmsg() when epoll reports the socket as readable, sendto() for each datagram
+    NimbleServerDaemonBackendUring, ///< see NimbleServerDaemonUringTransport
+} NimbleServerDaemonBackend;
+
+struct NimbleServerDaemon;
+
+/// Returns true if the datagram belongs to another daemon and has been handed off to it
+typedef bool (*NimbleServerDaemonRouteFn)(void* self, const struct sockaddr_in* address, const uint8_t* octets,
+                                          size_t octetCount);
+/// Feeds the datagrams that other daemons have handed off, when handoffFd is readable
+typedef void (*NimbleServerDaemonDrainHandoffFn)(void* self, struct NimbleServerDaemon* daemon, NimbleServer* server);
+
+/// Lets several daemons share a port, and pass the datagrams that arrived on the wrong socket to the daemon that
+/// owns the client. Leave routeFn as NULL when there is only one daemon.
+typedef struct NimbleServerDaemonHandoff {
+    NimbleServerDaemonRouteFn routeFn;
+    NimbleServerDaemonDrainHandoffFn drainFn;
+    int handoffFd; ///< added to the epoll, e.g. an eventfd that is written when a datagram is handed off
+    void* self;
+} NimbleServerDaemonHandoff;
+
+typedef struct NimbleServerDaemonSetup {
+    uint16_t port;
+    NimbleServerDaemonBackend backend;
+    bool isReusePort; ///< opens the socket with SO_REUSEPORT, so other sockets can bind to the same port
+    bool isGsoEnabled; ///< sends runs of equal sized replies, e.g. blob stream chunks, with one UDP_SEGMENT sendmsg()
+    bool isGroEnabled; ///< lets the kernel coalesce received datagrams from the same client (UDP_GRO)
+    size_t maxConnectionCount;
+    size_t targetTickTimeMs;
+    MonotonicTimeMs idleTimeoutMs; ///< a client address that has not sent anything for this long is disconnected
+    NimbleServerDaemonHandoff handoff;
+    Clog log;
+} NimbleServerDaemonSetup;
+
+typedef struct NimbleServerDaemonStats {
+    uint64_t tickCount;
+    uint64_t missedTickCount; ///< timer expirations that passed before the daemon could handle them
+    uint64_t tickJitterTotalUs; ///< sum of the differences between the measured tick interval and the target
+    uint64_t tickJitterMaxUs;
+    uint64_t updateTotalUs; ///< time spent in nimbleServerUpdate
+    uint64_t updateMaxUs;
+    uint64_t receivedDatagramCount;
+    uint64_t receiveBatchCount;
+    uint64_t rejectedDatagramCount; ///< from new addresses when all transport connections are in use
+    uint64_t handedOffDatagramCount; ///< received on this socket, but handed off to the daemon that owns the client
+    uint64_t segmentedSendCount; ///< runs of datagrams sent with one UDP_SEGMENT sendmsg()
+    uint64_t segmentedDatagramCount; ///< datagrams in those runs
+    uint64_t coalescedDatagramCount; ///< received in one UDP_GRO buffer together with other datagrams
+    uint64_t expiredConnectionCount;
+} NimbleServerDaemonStats;
+
+/// Buffers for receiving up to NIMBLE_DAEMON_RECEIVE_BATCH_COUNT datagrams with one recvmmsg().
+/// With UDP_GRO each message can hold several datagrams, and is received into groOctets instead of octets.
+typedef struct NimbleServerDaemonReceiveBatch {
+    struct mmsghdr messages[NIMBLE_DAEMON_RECEIVE_BATCH_COUNT];
+    struct iovec iovecs[NIMBLE_DAEMON_RECEIVE_BATCH_COUNT];
+    struct sockaddr_in addresses[NIMBLE_DAEMON_RECEIVE_BATCH_COUNT];
+    uint8_t octets[NIMBLE_DAEMON_RECEIVE_BATCH_COUNT][DATAGRAM_TRANSPORT_MAX_SIZE];
+    uint64_t controls[NIMBLE_DAEMON_RECEIVE_BATCH_COUNT]
+                     [NIMBLE_DAEMON_UDP_SEGMENTS_CONTROL_OCTET_COUNT / sizeof(uint64_t)]; ///< aligned for cmsghdr
+    uint8_t* groOctets; ///< NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT for each message, only when GRO is enabled
+} NimbleServerDaemonReceiveBatch;
+
+/// Runs a server on a UDP socket (Linux only). A single epoll waits for both the socket and a timerfd that expires
+/// every targetTickTimeMs. Datagrams are received in batches and fed to the server as they arrive, and the socket
+/// is drained once more before each nimbleServerUpdate(), so the tick sees everything that has arrived.
+/// Each client address is mapped to a transport connection index, and is disconnected when it has been idle for
+/// idleTimeoutMs.
+/// Runs of equal sized replies to one client are sent with UDP_SEGMENT (GSO) and received datagrams are coalesced
+/// with UDP_GRO, when enabled and supported by the kernel.
+/// With the io_uring backend only the timerfd is in the epoll. The datagrams are read through the multiTransport by
+/// nimbleServerReadFromMultiTransport() at the start of each tick, and the replies are sent when the tick is done.
 typedef struct NimbleServerDaemon {
-    NimbleServer server;
     UdpServerSocket socket;
+    NimbleServerDaemonBackend backend;
+    bool isGsoEnabled;
+    bool isGroEnabled;
+    NimbleServerDaemonUringTransport uringTransport;
+    NimbleServer* server; ///< the server of the latest poll, for connecting new addresses from the io_uring backend
+    int epollFd;
+    int timerFd;
+    NimbleServerDaemonAddressTable addressTable;
+    DatagramTransportMulti multiTransport; ///< use as the multiTransport in the NimbleServerSetup
+    size_t targetTickTimeMs;
+    uint64_t lastTickAtUs;
+    NimbleServerDaemonStats stats;
+    NimbleServerDaemonReceiveBatch receiveBatch;
+    NimbleServerDaemonHandoff handoff;
+    Clog log;
 } NimbleServerDaemon;
 
-int nimbleServerDaemonInit(NimbleServerDaemon* self);
+int nimbleServerDaemonInit(NimbleServerDaemon* self, NimbleServerDaemonSetup setup);
+void nimbleServerDaemonDestroy(NimbleServerDaemon* self);
+void nimbleServerDaemonFeed(NimbleServerDaemon* self, NimbleServer* server, const struct sockaddr_in* address,
+                            const uint8_t* octets, size_t octetCount, MonotonicTimeMs now);
+int nimbleServerDaemonPoll(NimbleServerDaemon* self, NimbleServer* server, int timeoutMs);
+int nimbleServerDaemonRun(NimbleServerDaemon* self, NimbleServer* server);
+uint64_t nimbleServerDaemonStatsEveryTickCount(const NimbleServerDaemon* self);
+void nimbleServerDaemonStatsDebugOutput(const NimbleServerDaemonStats* self, Clog* log);
+void nimbleServerDaemonMemoryReportDebugOutput(const NimbleServer* server, Clog* log);
+uint64_t nimbleServerDaemonMicroseconds(void);
 
 #endif
@@ -0,0 +1,27 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_EXAMPLE_GAME_H
+#define NIMBLE_DAEMON_EXAMPLE_GAME_H
+
+#include <clog/clog.h>
+#include <nimble-server/server.h>
+
+struct ImprintDefaultSetup;
+
+/// A headless game without any logic. The game state is a single octet, and is always up to date with the latest
+/// composed authoritative step, so the server never waits for a game state.
+typedef struct NimbleServerDaemonExampleGame {
+    NimbleServer* server;
+    NimbleServerCallbackObjectVtbl vtbl;
+    uint8_t gameState;
+    uint64_t composedStepCount;
+} NimbleServerDaemonExampleGame;
+
+int nimbleServerDaemonExampleGameInit(NimbleServerDaemonExampleGame* self, NimbleServer* server,
+                                      struct ImprintDefaultSetup* memory, DatagramTransportMulti multiTransport,
+                                      size_t maxConnectionCount, size_t targetTickTimeMs, Clog log);
+
+#endif
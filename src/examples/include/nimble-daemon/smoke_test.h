@@ -0,0 +1,23 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_SMOKE_TEST_H
+#define NIMBLE_DAEMON_SMOKE_TEST_H
+
+#include <nimble-daemon/daemon.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct NimbleServerDaemonSmokeTestSetup {
+    uint16_t port;
+    NimbleServerDaemonBackend backend;
+    size_t clientCount;
+    size_t tickCount; ///< ticks to run after all clients have joined
+    size_t targetTickTimeMs;
+} NimbleServerDaemonSmokeTestSetup;
+
+int nimbleServerDaemonSmokeTest(const NimbleServerDaemonSmokeTestSetup* setup);
+
+#endif
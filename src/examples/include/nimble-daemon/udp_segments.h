@@ -0,0 +1,30 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_UDP_SEGMENTS_H
+#define NIMBLE_DAEMON_UDP_SEGMENTS_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/// Largest datagram that the kernel hands over when it has coalesced received datagrams (UDP_GRO)
+#define NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT (65535)
+
+/// Room for the UDP_GRO control message with the segment size
+#define NIMBLE_DAEMON_UDP_SEGMENTS_CONTROL_OCTET_COUNT (64)
+
+/// The kernel or the network device can not segment (UDP_SEGMENT), send the datagrams one at a time instead
+#define NIMBLE_DAEMON_UDP_SEGMENTS_ERR_NOT_SUPPORTED (-2)
+
+int nimbleServerDaemonUdpSegmentsSend(int socketHandle, const struct sockaddr_in* address, const uint8_t* octets,
+                                      size_t octetCount, size_t segmentOctetCount);
+int nimbleServerDaemonUdpSegmentsSendEach(int socketHandle, const struct sockaddr_in* address, const uint8_t* octets,
+                                          size_t octetCount, size_t segmentOctetCount);
+int nimbleServerDaemonUdpSegmentsEnableGro(int socketHandle);
+size_t nimbleServerDaemonUdpSegmentsGroOctetCount(const struct msghdr* message, size_t octetCount);
+
+#endif
@@ -0,0 +1,111 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_URING_TRANSPORT_H
+#define NIMBLE_DAEMON_URING_TRANSPORT_H
+
+#include <clog/clog.h>
+#include <datagram-transport/multi.h>
+#include <datagram-transport/types.h>
+#include <linux/io_uring.h>
+#include <monotonic-time/monotonic_time.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct NimbleServerDaemonAddressTable;
+
+#define NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT (1024)
+#define NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_OCTET_COUNT (2048)
+#define NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT (1024)
+#define NIMBLE_DAEMON_URING_TRANSPORT_SUBMISSION_ENTRY_COUNT (1024)
+#define NIMBLE_DAEMON_URING_TRANSPORT_COMPLETION_ENTRY_COUNT (4096)
+
+/// Called when a datagram from a new address is received. The datagram is dropped if it returns negative.
+typedef int (*NimbleServerDaemonNewAddressFn)(void* self, uint8_t transportIndex);
+
+typedef struct NimbleServerDaemonUringTransportSetup {
+    int socketHandle; ///< a bound UDP socket
+    struct NimbleServerDaemonAddressTable* addressTable;
+    NimbleServerDaemonNewAddressFn newAddressFn; ///< called when a datagram from a new address is received
+    void* newAddressSelf;
+    Clog log;
+} NimbleServerDaemonUringTransportSetup;
+
+typedef struct NimbleServerDaemonUringTransportStats {
+    uint64_t receivedDatagramCount;
+    uint64_t sentDatagramCount;
+    uint64_t droppedDatagramCount; ///< truncated, from unknown addresses when the table is full, or no send slot
+    uint64_t enterCount; ///< io_uring_enter system calls
+    uint64_t rearmCount; ///< multishot receives that had to be submitted again
+    uint64_t noBufferCount; ///< times the kernel ran out of provided receive buffers
+} NimbleServerDaemonUringTransportStats;
+
+typedef struct NimbleServerDaemonUringSendSlot {
+    struct msghdr message;
+    struct iovec iovec;
+    struct sockaddr_in address;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerDaemonUringSendSlot;
+
+/// DatagramTransportMulti on a UDP socket using io_uring (Linux only), so receiving and sending do not need a system
+/// call for each datagram:
+/// - A single multishot recvmsg is kept armed. The kernel writes the datagrams, with the source address, into buffers
+///   from a provided buffer ring that is registered with the ring. A buffer is given back to the kernel as soon as the
+///   datagram has been copied out by receiveFrom().
+/// - sendTo() copies the datagram to a send slot and queues a sendmsg entry without submitting it.
+///   nimbleServerDaemonUringTransportFlush() submits all the queued sends with one io_uring_enter(). Call it once
+///   every tick. The send completions are reaped by receiveFrom(), which frees the send slots.
+/// The transport index for an address comes from the address table of the daemon.
+typedef struct NimbleServerDaemonUringTransport {
+    int ringFd;
+    int socketHandle;
+
+    uint8_t* submissionRing;
+    size_t submissionRingOctetCount;
+    uint8_t* completionRing;
+    size_t completionRingOctetCount;
+    struct io_uring_sqe* submissionEntries;
+    size_t submissionEntriesOctetCount;
+    uint32_t* submissionHead;
+    uint32_t* submissionTail;
+    uint32_t submissionMask;
+    uint32_t* submissionArray;
+    uint32_t* completionHead;
+    uint32_t* completionTail;
+    uint32_t completionMask;
+    struct io_uring_cqe* completionEntries;
+    uint32_t pendingSubmissionCount;
+
+    struct io_uring_buf_ring* bufferRing;
+    size_t bufferRingOctetCount;
+    uint8_t* receiveBuffers;
+    struct msghdr receiveTemplate;
+    bool isReceiveArmed;
+
+    NimbleServerDaemonUringSendSlot* sendSlots;
+    uint16_t freeSendSlots[NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT];
+    size_t freeSendSlotCount;
+
+    struct NimbleServerDaemonAddressTable* addressTable;
+    NimbleServerDaemonNewAddressFn newAddressFn;
+    void* newAddressSelf;
+
+    DatagramTransportMulti multiTransport;
+    NimbleServerDaemonUringTransportStats stats;
+    Clog log;
+} NimbleServerDaemonUringTransport;
+
+int nimbleServerDaemonUringTransportInit(NimbleServerDaemonUringTransport* self,
+                                         NimbleServerDaemonUringTransportSetup setup);
+void nimbleServerDaemonUringTransportDestroy(NimbleServerDaemonUringTransport* self);
+int nimbleServerDaemonUringTransportFlush(NimbleServerDaemonUringTransport* self);
+int nimbleServerDaemonUringTransportWait(NimbleServerDaemonUringTransport* self);
+bool nimbleServerDaemonUringTransportHasPending(const NimbleServerDaemonUringTransport* self);
+
+#endif
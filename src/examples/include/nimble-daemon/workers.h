@@ -0,0 +1,85 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_DAEMON_WORKERS_H
+#define NIMBLE_DAEMON_WORKERS_H
+
+#include <clog/clog.h>
+#include <imprint/default_setup.h>
+#include <nimble-daemon/daemon.h>
+#include <nimble-daemon/example_game.h>
+#include <nimble-server/server.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#define NIMBLE_DAEMON_MAX_WORKER_COUNT (16)
+#define NIMBLE_DAEMON_HANDOFF_QUEUE_CAPACITY (256)
+
+typedef struct NimbleServerDaemonHandoffDatagram {
+    struct sockaddr_in address;
+    size_t octetCount;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerDaemonHandoffDatagram;
+
+/// Datagrams that other workers received for clients that this worker owns. Any worker can write to it, and the
+/// eventFd is signalled so the owner wakes up and feeds them to its room.
+typedef struct NimbleServerDaemonHandoffQueue {
+    pthread_mutex_t mutex;
+    NimbleServerDaemonHandoffDatagram datagrams[NIMBLE_DAEMON_HANDOFF_QUEUE_CAPACITY];
+    size_t readIndex;
+    size_t count;
+    int eventFd;
+    uint64_t droppedCount; ///< the queue was full
+} NimbleServerDaemonHandoffQueue;
+
+struct NimbleServerDaemonWorkers;
+
+/// A thread with its own SO_REUSEPORT socket, daemon and room (a server with the example game)
+typedef struct NimbleServerDaemonWorker {
+    size_t index;
+    struct NimbleServerDaemonWorkers* workers;
+    NimbleServerDaemon daemon;
+    NimbleServer server;
+    NimbleServerDaemonExampleGame game;
+    ImprintDefaultSetup memory;
+    NimbleServerDaemonHandoffQueue handoffQueue;
+    NimbleServerDaemonHandoffDatagram incoming; ///< the handed off datagram that is being fed
+    pthread_t thread;
+    bool isStarted;
+    int result;
+} NimbleServerDaemonWorker;
+
+typedef struct NimbleServerDaemonWorkersSetup {
+    uint16_t port;
+    size_t workerCount;
+    bool isGsoEnabled;
+    bool isGroEnabled;
+    size_t maxConnectionCount; ///< for each worker
+    size_t targetTickTimeMs;
+    MonotonicTimeMs idleTimeoutMs;
+    Clog log;
+} NimbleServerDaemonWorkersSetup;
+
+/// Runs a number of workers on the same UDP port, so packet processing is spread over that many cores.
+/// A client is owned by the worker with the index `source port % workerCount`. A classic BPF program attached to the
+/// SO_REUSEPORT group steers each datagram to the socket of that worker, so the datagrams of a client always land on
+/// the thread that runs its room. Datagrams that still arrive on the wrong socket, e.g. before the program is
+/// attached, on a kernel without SO_ATTACH_REUSEPORT_CBPF or with IP options, are handed off to the owner.
+typedef struct NimbleServerDaemonWorkers {
+    NimbleServerDaemonWorker workers[NIMBLE_DAEMON_MAX_WORKER_COUNT];
+    size_t workerCount;
+    bool isSteered; ///< the steering program could be attached
+    bool isStopping;
+    Clog log;
+} NimbleServerDaemonWorkers;
+
+int nimbleServerDaemonWorkersInit(NimbleServerDaemonWorkers* self, NimbleServerDaemonWorkersSetup setup);
+void nimbleServerDaemonWorkersDestroy(NimbleServerDaemonWorkers* self);
+int nimbleServerDaemonWorkersStart(NimbleServerDaemonWorkers* self);
+int nimbleServerDaemonWorkersWait(NimbleServerDaemonWorkers* self);
+int nimbleServerDaemonWorkersStop(NimbleServerDaemonWorkers* self);
+size_t nimbleServerDaemonWorkersOwner(const NimbleServerDaemonWorkers* self, const struct sockaddr_in* address);
+
+#endif
@@ -3,128 +3,261 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
-#include <clog/clog.h>
-#include <clog/console.h>
-#include <flood/in_stream.h>
-#include <flood/out_stream.h>
-#include <nimble-daemon/daemon.h>
-
-#if !defined TORNADO_OS_WINDOWS
-#include <unistd.h>
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
 #endif
 
+#include <clog/clog.h>
+#include <clog/console.h>
 #include <imprint/default_setup.h>
-
-#include <datagram-transport/transport.h>
-#include <datagram-transport/types.h>
+#include <nimble-daemon/bench_gso.h>
+#include <nimble-daemon/bench_transport.h>
+#include <nimble-daemon/bench_workers.h>
+#include <nimble-daemon/daemon.h>
+#include <nimble-daemon/example_game.h>
+#include <nimble-daemon/smoke_test.h>
 #include <nimble-daemon/version.h>
+#include <nimble-daemon/workers.h>
+#include <stdlib.h>
+#include <string.h>
 
 clog_config g_clog;
 
-typedef struct UdpServerSocketSendToAddress {
-    struct sockaddr_in* sockAddrIn;
-    UdpServerSocket* serverSocket;
-} UdpServerSocketSendToAddress;
-
-static int sendToAddress(void* self_, const uint8_t* buf, size_t count)
+typedef struct NimbleServerDaemonOptions {
+    uint16_t port;
+    NimbleServerDaemonBackend backend;
+    bool isGsoEnabled;
+    bool isGroEnabled;
+    size_t maxConnectionCount;
+    size_t targetTickTimeMs;
+    size_t idleTimeoutMs;
+    size_t clientCount;
+    size_t tickCount;
+    size_t datagramCount;
+    size_t datagramOctetCount;
+    size_t workerCount;
+    size_t senderCount;
+    size_t durationMs;
+} NimbleServerDaemonOptions;
+
+static int parseOptions(NimbleServerDaemonOptions* options, int argc, char* argv[])
 {
-    UdpServerSocketSendToAddress* self = (UdpServerSocketSendToAddress*) self_;
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            CLOG_SOFT_ERROR("missing value for option '%s'", argv[i])
+            return -1;
+        }
+
+        const char* option = argv[i];
+        size_t value = (size_t) strtoul(argv[i + 1], 0, 10);
+
+        if (strcmp(option, "--backend") == 0) {
+            if (strcmp(argv[i + 1], "socket") == 0) {
+                options->backend = NimbleServerDaemonBackendSocket;
+            } else if (strcmp(argv[i + 1], "uring") == 0) {
+                options->backend = NimbleServerDaemonBackendUring;
+            } else {
+                CLOG_SOFT_ERROR("unknown backend '%s', must be 'socket' or 'uring'", argv[i + 1])
+                return -1;
+            }
+        } else if (strcmp(option, "--gso") == 0) {
+            options->isGsoEnabled = value != 0;
+        } else if (strcmp(option, "--gro") == 0) {
+            options->isGroEnabled = value != 0;
+        } else if (strcmp(option, "--port") == 0) {
+            options->port = (uint16_t) value;
+        } else if (strcmp(option, "--connections") == 0) {
+            options->maxConnectionCount = value;
+        } else if (strcmp(option, "--tick-ms") == 0) {
+            options->targetTickTimeMs = value;
+        } else if (strcmp(option, "--idle-timeout-ms") == 0) {
+            options->idleTimeoutMs = value;
+        } else if (strcmp(option, "--clients") == 0) {
+            options->clientCount = value;
+        } else if (strcmp(option, "--ticks") == 0) {
+            options->tickCount = value;
+        } else if (strcmp(option, "--datagrams") == 0) {
+            options->datagramCount = value;
+        } else if (strcmp(option, "--size") == 0) {
+            options->datagramOctetCount = value;
+        } else if (strcmp(option, "--workers") == 0) {
+            options->workerCount = value;
+        } else if (strcmp(option, "--senders") == 0) {
+            options->senderCount = value;
+        } else if (strcmp(option, "--duration-ms") == 0) {
+            options->durationMs = value;
+        } else {
+            CLOG_SOFT_ERROR("unknown option '%s'", option)
+            return -1;
+        }
+    }
 
-    return udpServerSend(self->serverSocket, buf, count, self->sockAddrIn);
+    return 0;
 }
 
 int main(int argc, char* argv[])
 {
-    (void) argc;
-    (void) argv;
-
     g_clog.log = clog_console;
 
-    CLOG_OUTPUT("nimbled v%s starting up", NIMBLE_DAEMON_VERSION)
-
-    NimbleServerDaemon daemon;
+    NimbleServerDaemonOptions options = {.port = 27000,
+                                         .backend = NimbleServerDaemonBackendSocket,
+                                         .isGsoEnabled = true,
+                                         .isGroEnabled = true,
+                                         .maxConnectionCount = 16,
+                                         .targetTickTimeMs = 16,
+                                         .idleTimeoutMs = 10000,
+                                         .clientCount = 4,
+                                         .tickCount = 600,
+                                         .datagramCount = 1000000,
+                                         .datagramOctetCount = 64,
+                                         .workerCount = 1,
+                                         .senderCount = 4,
+                                         .durationMs = 2000};
+
+    if (argc > 1 && strcmp(argv[1], "bench-transport") == 0) {
+        g_clog.level = CLOG_TYPE_WARN;
+        options.port = 27002;
+        options.clientCount = 16;
+        int err = parseOptions(&options, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
 
-    int err = nimbleServerDaemonInit(&daemon);
-    if (err < 0) {
-        return err;
+        NimbleServerDaemonBenchTransportSetup setup = {.port = options.port,
+                                                       .clientCount = options.clientCount,
+                                                       .datagramCount = options.datagramCount,
+                                                       .datagramOctetCount = options.datagramOctetCount};
+        return nimbleServerDaemonBenchTransport(&setup) < 0 ? 1 : 0;
     }
 
-    UdpServerSocketSendToAddress socketSendToAddress;
-    socketSendToAddress.serverSocket = &daemon.socket;
+    if (argc > 1 && strcmp(argv[1], "bench-gso") == 0) {
+        g_clog.level = CLOG_TYPE_WARN;
+        options.port = 27030;
+        options.datagramCount = 200000;
+        options.datagramOctetCount = 1100;
+        int err = parseOptions(&options, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
 
-    DatagramTransportOut transportOut;
-    transportOut.self = &socketSendToAddress;
-    transportOut.send = sendToAddress;
+        NimbleServerDaemonBenchGsoSetup setup = {.port = options.port,
+                                                 .datagramCount = options.datagramCount,
+                                                 .datagramOctetCount = options.datagramOctetCount};
+        return nimbleServerDaemonBenchGso(&setup) < 0 ? 1 : 0;
+    }
 
-    NimbleServer server;
+    if (argc > 1 && strcmp(argv[1], "bench-workers") == 0) {
+        g_clog.level = CLOG_TYPE_WARN;
+        options.port = 27010;
+        options.clientCount = 64;
+        options.workerCount = 4;
+        int err = parseOptions(&options, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
 
-    ImprintDefaultSetup memory;
-    imprintDefaultSetupInit(&memory, 16 * 1024 * 1024);
+        NimbleServerDaemonBenchWorkersSetup setup = {.port = options.port,
+                                                     .maxWorkerCount = options.workerCount,
+                                                     .clientCount = options.clientCount,
+                                                     .senderCount = options.senderCount,
+                                                     .durationMs = options.durationMs,
+                                                     .datagramOctetCount = options.datagramOctetCount};
+        return nimbleServerDaemonBenchWorkers(&setup) < 0 ? 1 : 0;
+    }
 
-    NimbleSerializeVersion applicationVersion = {0x10, 0x20, 0x30};
+    if (argc > 1 && strcmp(argv[1], "smoke-test") == 0) {
+        g_clog.level = CLOG_TYPE_WARN;
+        options.port = 27001;
+        int err = parseOptions(&options, argc - 2, argv + 2);
+        if (err < 0) {
+            return err;
+        }
 
-    NimbleServerSetup setup;
+        NimbleServerDaemonSmokeTestSetup setup = {.port = options.port,
+                                                  .backend = options.backend,
+                                                  .clientCount = options.clientCount,
+                                                  .tickCount = options.tickCount,
+                                                  .targetTickTimeMs = options.targetTickTimeMs};
+        return nimbleServerDaemonSmokeTest(&setup) < 0 ? 1 : 0;
+    }
 
-    Clog serverLog;
-    serverLog.constantPrefix = "example";
-    serverLog.config = &g_clog;
+    int err = parseOptions(&options, argc - 1, argv + 1);
+    if (err < 0) {
+        return err;
+    }
 
-    setup.applicationVersion = applicationVersion;
-    setup.blobAllocator = &memory.slabAllocator.info;
-    setup.log = serverLog;
-    setup.maxConnectionCount = 8;
-    setup.maxParticipantCount = 8;
-    setup.maxParticipantCountForEachConnection = 2;
-    setup.maxSingleParticipantStepOctetCount = 8;
-    setup.memory = &memory.tagAllocator.info;
+    CLOG_OUTPUT("nimbled v%s starting up", NIMBLE_DAEMON_VERSION)
 
-    nimbleServerInit(&server, setup);
+    Clog log;
+    log.constantPrefix = "nimbled";
+    log.config = &g_clog;
 
-    nimbleServerGameInit(&server.game, &memory.tagAllocator.info, setup.maxSingleParticipantStepOctetCount,
-                         setup.maxGameStateOctetCount, setup.maxParticipantCount, setup.log);
+    if (options.workerCount > 1) {
+        if (options.backend != NimbleServerDaemonBackendSocket) {
+            CLOG_SOFT_ERROR("workers can only use the socket backend")
+            return -1;
+        }
 
-    static uint8_t exampleGameState = 42;
-    nimbleServerGameSetGameState(&server.game, 0, &exampleGameState, 1, &serverLog);
+        static NimbleServerDaemonWorkers workers;
+        NimbleServerDaemonWorkersSetup workersSetup = {.port = options.port,
+                                                       .workerCount = options.workerCount,
+                                                       .isGsoEnabled = options.isGsoEnabled,
+                                                       .isGroEnabled = options.isGroEnabled,
+                                                       .maxConnectionCount = options.maxConnectionCount,
+                                                       .targetTickTimeMs = options.targetTickTimeMs,
+                                                       .idleTimeoutMs = (MonotonicTimeMs) options.idleTimeoutMs,
+                                                       .log = log};
+        err = nimbleServerDaemonWorkersInit(&workers, workersSetup);
+        if (err < 0) {
+            return err;
+        }
 
+        CLOG_OUTPUT("listening on UDP port %d with %zu workers (%s), tick every %zu ms", options.port,
+                    options.workerCount, workers.isSteered ? "steered" : "handing off", options.targetTickTimeMs)
 
-    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
-    size_t size;
-    struct sockaddr_in address;
+        err = nimbleServerDaemonWorkersStart(&workers);
+        if (err >= 0) {
+            err = nimbleServerDaemonWorkersWait(&workers);
+        }
 
-    uint8_t reply[DATAGRAM_TRANSPORT_MAX_SIZE];
-    FldOutStream outStream;
-    fldOutStreamInit(&outStream, reply, DATAGRAM_TRANSPORT_MAX_SIZE);
+        nimbleServerDaemonWorkersDestroy(&workers);
 
-    CLOG_OUTPUT("ready for incoming packets")
+        return err;
+    }
 
-    while (1) {
-        size = DATAGRAM_TRANSPORT_MAX_SIZE;
-        ssize_t errorCode = udpServerReceive(&daemon.socket, buf, size, &address);
-        if (errorCode < 0) {
-            CLOG_WARN("problem with receive %zd", errorCode)
-        } else {
-            NimbleServerResponse response;
-            response.transportOut = &transportOut;
-            socketSendToAddress.sockAddrIn = &address;
+    static NimbleServerDaemon daemon;
+    NimbleServerDaemonSetup daemonSetup = {.port = options.port,
+                                           .backend = options.backend,
+                                           .isGsoEnabled = options.isGsoEnabled,
+                                           .isGroEnabled = options.isGroEnabled,
+                                           .maxConnectionCount = options.maxConnectionCount,
+                                           .targetTickTimeMs = options.targetTickTimeMs,
+                                           .idleTimeoutMs = (MonotonicTimeMs) options.idleTimeoutMs,
+                                           .log = log};
+    err = nimbleServerDaemonInit(&daemon, daemonSetup);
+    if (err < 0) {
+        return err;
+    }
 
-            fldOutStreamRewind(&outStream);
-#if CONFIGURATION_DEBUG
-            nimbleSerializeDebugHex("received", buf, size);
-#endif
-            errorCode = nimbleServerFeed(&server, 1, buf, size, &response);
-            if (errorCode < 0) {
-                CLOG_WARN("nimbleServerFeed: error %zd", errorCode)
-            }
+    static ImprintDefaultSetup memory;
+    imprintDefaultSetupInit(&memory, 16 * 1024 * 1024);
 
-            NbsSteps* authoritativeSteps = &server.game.authoritativeSteps;
-            if (authoritativeSteps->stepsCount > 30) {
-                nimbleServerGameSetGameState(&server.game, server.game.authoritativeSteps.expectedWriteId,
-                                             &exampleGameState, 1, &serverLog);
-            }
-        }
+    static NimbleServer server;
+    static NimbleServerDaemonExampleGame game;
+    err = nimbleServerDaemonExampleGameInit(&game, &server, &memory, daemon.multiTransport,
+                                            options.maxConnectionCount, options.targetTickTimeMs, log);
+    if (err < 0) {
+        return err;
     }
 
-    // imprintDefaultSetupDestroy(&memory);
+    nimbleServerDaemonMemoryReportDebugOutput(&server, &log);
+
+    CLOG_OUTPUT("listening on UDP port %d with the %s backend, tick every %zu ms", options.port,
+                options.backend == NimbleServerDaemonBackendUring ? "io_uring" : "socket", options.targetTickTimeMs)
+
+    err = nimbleServerDaemonRun(&daemon, &server);
+
+    nimbleServerDaemonDestroy(&daemon);
 
-    // return 0;
+    return err;
 }
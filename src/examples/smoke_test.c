@@ -0,0 +1,270 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <imprint/default_setup.h>
+#include <inttypes.h>
+#include <nimble-daemon/daemon.h>
+#include <nimble-daemon/example_game.h>
+#include <nimble-daemon/smoke_test.h>
+#include <nimble-server-simulation/memory_transport.h>
+#include <nimble-server-simulation/synthetic_client.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/participant.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NIMBLE_DAEMON_SMOKE_TEST_MAX_CLIENT_COUNT (16)
+#define NIMBLE_DAEMON_SMOKE_TEST_MAX_JOIN_TICK_COUNT (500)
+
+typedef struct SmokeTestClient {
+    NimbleServerSyntheticClient client;
+    int socket;
+    struct sockaddr_in address;
+} SmokeTestClient;
+
+static int openClientSocket(SmokeTestClient* self)
+{
+    self->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (self->socket < 0) {
+        return -1;
+    }
+
+    memset(&self->address, 0, sizeof(self->address));
+    self->address.sin_family = AF_INET;
+    self->address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    self->address.sin_port = 0;
+    if (bind(self->socket, (const struct sockaddr*) &self->address, sizeof(self->address)) < 0) {
+        return -2;
+    }
+
+    socklen_t addressLength = sizeof(self->address);
+    if (getsockname(self->socket, (struct sockaddr*) &self->address, &addressLength) < 0) {
+        return -3;
+    }
+
+    return 0;
+}
+
+/// Sends everything that the synthetic clients wrote to the memory transport over their own loopback sockets
+static void sendFromClients(SmokeTestClient* clients, NimbleServerMemoryTransport* memoryTransport,
+                            const struct sockaddr_in* serverAddress)
+{
+    int connectionId;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    while (true) {
+        ssize_t octetCount = memoryTransport->multiTransport.receiveFrom(memoryTransport->multiTransport.self,
+                                                                         &connectionId, datagram, sizeof(datagram));
+        if (octetCount <= 0) {
+            break;
+        }
+        sendto(clients[connectionId].socket, datagram, (size_t) octetCount, 0, (const struct sockaddr*) serverAddress,
+               sizeof(*serverAddress));
+    }
+}
+
+/// Delivers the replies to the synthetic clients, and lets a joined client start to predict steps
+static void receiveToClients(SmokeTestClient* clients, size_t clientCount, const NimbleServerDaemon* daemon,
+                             const NimbleServer* server)
+{
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    for (size_t i = 0; i < clientCount; ++i) {
+        SmokeTestClient* smokeClient = &clients[i];
+        NimbleServerSyntheticClient* client = &smokeClient->client;
+
+        while (true) {
+            ssize_t octetCount = recv(smokeClient->socket, datagram, sizeof(datagram), 0);
+            if (octetCount <= 0) {
+                break;
+            }
+            nimbleServerSyntheticClientReceive(client, datagram, (size_t) octetCount);
+        }
+
+        if (client->phase != NimbleServerSyntheticClientPhaseJoining || !client->hasReceivedReply) {
+            continue;
+        }
+
+        int transportIndex = nimbleServerDaemonAddressTableFind(&daemon->addressTable, &smokeClient->address);
+        if (transportIndex < 0) {
+            continue;
+        }
+
+        const NimbleServerLocalParty* party = server->transportConnections[transportIndex].assignedParty;
+        if (party == 0) {
+            continue;
+        }
+
+        NimbleSerializeParticipantId participantIds[NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_PARTICIPANTS];
+        for (size_t p = 0; p < party->participantReferences.participantReferenceCount; ++p) {
+            participantIds[p] = party->participantReferences.participantReferences[p]->id;
+        }
+
+        const NimbleServerParticipant* firstParticipant = party->participantReferences.participantReferences[0];
+        nimbleServerSyntheticClientStartPlaying(client, firstParticipant->steps->expectedWriteId, participantIds);
+    }
+}
+
+static bool allClientsArePlaying(const SmokeTestClient* clients, size_t clientCount)
+{
+    for (size_t i = 0; i < clientCount; ++i) {
+        if (clients[i].client.phase != NimbleServerSyntheticClientPhasePlaying) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Runs the clients for one tick of the daemon
+/// @return negative on error
+static int tickOnce(SmokeTestClient* clients, size_t clientCount, NimbleServerMemoryTransport* memoryTransport,
+                    const struct sockaddr_in* serverAddress, NimbleServerDaemon* daemon, NimbleServer* server)
+{
+    NimbleSerializeVersion applicationVersion = server->applicationVersion;
+    StepId receivedAuthoritativeStepId = server->game.authoritativeSteps.expectedWriteId;
+
+    for (size_t i = 0; i < clientCount; ++i) {
+        int err = nimbleServerSyntheticClientTick(&clients[i].client, applicationVersion, receivedAuthoritativeStepId,
+                                                  memoryTransport);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    sendFromClients(clients, memoryTransport, serverAddress);
+
+    int tickCount = 0;
+    while (tickCount == 0) {
+        tickCount = nimbleServerDaemonPoll(daemon, server, (int) (daemon->targetTickTimeMs * 4));
+        if (tickCount < 0) {
+            return tickCount;
+        }
+    }
+
+    receiveToClients(clients, clientCount, daemon, server);
+
+    return 0;
+}
+
+/// Starts the daemon on a port, connects synthetic clients to it over loopback sockets, and checks that all of them
+/// can join and that the server composes authoritative steps in time. Prints the result and the tick stats of the
+/// daemon as a JSON object.
+/// @param setup port, backend, client count and tick count
+/// @return negative on error, or if the clients could not join or too few steps were composed
+int nimbleServerDaemonSmokeTest(const NimbleServerDaemonSmokeTestSetup* setup)
+{
+    if (setup->clientCount == 0 || setup->clientCount > NIMBLE_DAEMON_SMOKE_TEST_MAX_CLIENT_COUNT) {
+        CLOG_SOFT_ERROR("smoke test: client count must be 1 to %d", NIMBLE_DAEMON_SMOKE_TEST_MAX_CLIENT_COUNT)
+        return -1;
+    }
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "smoke";
+
+    static ImprintDefaultSetup memory;
+    imprintDefaultSetupInit(&memory, 32 * 1024 * 1024);
+
+    static NimbleServerDaemon daemon;
+    NimbleServerDaemonSetup daemonSetup = {.port = setup->port,
+                                           .backend = setup->backend,
+                                           .maxConnectionCount = setup->clientCount,
+                                           .targetTickTimeMs = setup->targetTickTimeMs,
+                                           .idleTimeoutMs = 5000,
+                                           .log = log};
+    int err = nimbleServerDaemonInit(&daemon, daemonSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    static NimbleServer server;
+    static NimbleServerDaemonExampleGame game;
+    err = nimbleServerDaemonExampleGameInit(&game, &server, &memory, daemon.multiTransport, setup->clientCount,
+                                            setup->targetTickTimeMs, log);
+    if (err < 0) {
+        return err;
+    }
+
+    NimbleServerMemoryTransport memoryTransport;
+    nimbleServerMemoryTransportInit(&memoryTransport, &memory.tagAllocator.info, setup->clientCount * 8 + 64);
+
+    static SmokeTestClient clients[NIMBLE_DAEMON_SMOKE_TEST_MAX_CLIENT_COUNT];
+    for (size_t i = 0; i < setup->clientCount; ++i) {
+        nimbleServerSyntheticClientInit(&clients[i].client, (int) i, 1, 8, 3, log);
+        err = openClientSocket(&clients[i]);
+        if (err < 0) {
+            CLOG_SOFT_ERROR("smoke test: could not open client socket %d", errno)
+            return err;
+        }
+    }
+
+    struct sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddress.sin_port = htons(setup->port);
+
+    size_t joinTickCount = 0;
+    for (; joinTickCount < NIMBLE_DAEMON_SMOKE_TEST_MAX_JOIN_TICK_COUNT &&
+           !allClientsArePlaying(clients, setup->clientCount);
+         ++joinTickCount) {
+        err = tickOnce(clients, setup->clientCount, &memoryTransport, &serverAddress, &daemon, &server);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    bool allJoined = allClientsArePlaying(clients, setup->clientCount);
+
+    memset(&daemon.stats, 0, sizeof(daemon.stats));
+    daemon.lastTickAtUs = 0;
+    uint64_t composedStepCountBefore = game.composedStepCount;
+
+    for (size_t i = 0; allJoined && i < setup->tickCount; ++i) {
+        err = tickOnce(clients, setup->clientCount, &memoryTransport, &serverAddress, &daemon, &server);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    uint64_t composedStepCount = game.composedStepCount - composedStepCountBefore;
+    const NimbleServerDaemonStats* stats = &daemon.stats;
+    uint64_t tickCount = stats->tickCount > 0 ? stats->tickCount : 1;
+
+    printf("{\"clientCount\":%zu,\"joined\":%s,\"joinTickCount\":%zu,\"tickCount\":%" PRIu64
+           ",\"composedStepCount\":%" PRIu64 ",\"receivedDatagramCount\":%" PRIu64 ",\"missedTickCount\":%" PRIu64
+           ",\"tickJitterAvgUs\":%" PRIu64 ",\"tickJitterMaxUs\":%" PRIu64 ",\"updateAvgUs\":%" PRIu64
+           ",\"updateMaxUs\":%" PRIu64 "}\n",
+           setup->clientCount, allJoined ? "true" : "false", joinTickCount, stats->tickCount, composedStepCount,
+           stats->receivedDatagramCount, stats->missedTickCount, stats->tickJitterTotalUs / tickCount,
+           stats->tickJitterMaxUs, stats->updateTotalUs / tickCount, stats->updateMaxUs);
+
+    for (size_t i = 0; i < setup->clientCount; ++i) {
+        close(clients[i].socket);
+    }
+    nimbleServerDaemonDestroy(&daemon);
+
+    if (!allJoined) {
+        CLOG_SOFT_ERROR("smoke test: all clients could not join in %zu ticks", joinTickCount)
+        return -2;
+    }
+
+    // The clients send one new step every tick, so almost every tick must compose a step
+    if (composedStepCount < setup->tickCount / 2) {
+        CLOG_SOFT_ERROR("smoke test: only %" PRIu64 " steps were composed in %zu ticks", composedStepCount,
+                        setup->tickCount)
+        return -3;
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <netinet/udp.h>
+#include <nimble-daemon/udp_segments.h>
+#include <string.h>
+
+#if !defined SOL_UDP
+#define SOL_UDP (17)
+#endif
+
+#if !defined UDP_SEGMENT
+#define UDP_SEGMENT (103)
+#endif
+
+#if !defined UDP_GRO
+#define UDP_GRO (104)
+#endif
+
+/// Sends a run of datagrams with one sendmsg(). The kernel splits the octets into datagrams of segmentOctetCount
+/// octets each, the last one can be shorter.
+/// @param socketHandle UDP socket
+/// @param address destination
+/// @param octets the datagrams, back to back
+/// @param octetCount total octet count
+/// @param segmentOctetCount octet count of each datagram
+/// @return negative on error, NIMBLE_DAEMON_UDP_SEGMENTS_ERR_NOT_SUPPORTED if segmentation is not available
+int nimbleServerDaemonUdpSegmentsSend(int socketHandle, const struct sockaddr_in* address, const uint8_t* octets,
+                                      size_t octetCount, size_t segmentOctetCount)
+{
+    struct iovec iovec;
+    iovec.iov_base = (void*) octets;
+    iovec.iov_len = octetCount;
+
+    union {
+        uint8_t octets[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = (void*) address;
+    message.msg_namelen = sizeof(*address);
+    message.msg_iov = &iovec;
+    message.msg_iovlen = 1;
+    message.msg_control = control.octets;
+    message.msg_controllen = sizeof(control.octets);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_UDP;
+    header->cmsg_type = UDP_SEGMENT;
+    header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segmentSize = (uint16_t) segmentOctetCount;
+    memcpy(CMSG_DATA(header), &segmentSize, sizeof(segmentSize));
+
+    if (sendmsg(socketHandle, &message, 0) < 0) {
+        // EIO when the device has no checksum offload, the others when the kernel is older than 4.18
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+            return NIMBLE_DAEMON_UDP_SEGMENTS_ERR_NOT_SUPPORTED;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/// Sends a run of datagrams with one sendto() for each datagram
+/// @param socketHandle UDP socket
+/// @param address destination
+/// @param octets the datagrams, back to back
+/// @param octetCount total octet count
+/// @param segmentOctetCount octet count of each datagram, the last one can be shorter
+/// @return negative on error
+int nimbleServerDaemonUdpSegmentsSendEach(int socketHandle, const struct sockaddr_in* address, const uint8_t* octets,
+                                          size_t octetCount, size_t segmentOctetCount)
+{
+    int result = 0;
+
+    for (size_t offset = 0; offset < octetCount; offset += segmentOctetCount) {
+        size_t datagramOctetCount = octetCount - offset < segmentOctetCount ? octetCount - offset : segmentOctetCount;
+        if (sendto(socketHandle, octets + offset, datagramOctetCount, 0, (const struct sockaddr*) address,
+                   sizeof(*address)) < 0) {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+/// Lets the kernel coalesce received datagrams from the same sender into one buffer (UDP_GRO). The receive buffer
+/// must then have room for NIMBLE_DAEMON_UDP_SEGMENTS_MAX_OCTET_COUNT octets and the segment size control message.
+/// @param socketHandle UDP socket
+/// @return negative if the kernel does not support it
+int nimbleServerDaemonUdpSegmentsEnableGro(int socketHandle)
+{
+    int enable = 1;
+
+    return setsockopt(socketHandle, SOL_UDP, UDP_GRO, &enable, sizeof(enable));
+}
+
+/// Finds the size of the datagrams that the kernel coalesced into a received message
+/// @param message the received message, with the control messages
+/// @param octetCount octet count of the received message
+/// @return octet count of each datagram, the last one can be shorter. octetCount if nothing was coalesced.
+size_t nimbleServerDaemonUdpSegmentsGroOctetCount(const struct msghdr* message, size_t octetCount)
+{
+    if (message->msg_controllen == 0) {
+        return octetCount;
+    }
+
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(message); header != 0;
+         header = CMSG_NXTHDR((struct msghdr*) message, header)) {
+        if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO) {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(header), sizeof(segmentSize));
+            return segmentSize > 0 ? (size_t) segmentSize : octetCount;
+        }
+    }
+
+    return octetCount;
+}
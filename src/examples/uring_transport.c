@@ -0,0 +1,437 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <nimble-daemon/address_table.h>
+#include <nimble-daemon/uring_transport.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_USER_DATA (UINT64_MAX)
+#define NIMBLE_DAEMON_URING_TRANSPORT_BUFFER_GROUP_ID (0)
+
+static void* mapAnonymous(size_t octetCount)
+{
+    void* memory = mmap(0, octetCount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    return memory == MAP_FAILED ? 0 : memory;
+}
+
+/// Submits the queued entries
+/// @param self uring transport
+/// @param minCompleteCount number of completions to wait for
+/// @return negative on error
+static int submit(NimbleServerDaemonUringTransport* self, uint32_t minCompleteCount)
+{
+    uint32_t flags = minCompleteCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+    long submittedCount = syscall(__NR_io_uring_enter, self->ringFd, self->pendingSubmissionCount, minCompleteCount,
+                                  flags, 0, 0);
+    self->stats.enterCount++;
+    if (submittedCount < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return 0;
+        }
+        CLOG_C_SOFT_ERROR(&self->log, "uring: io_uring_enter failed %d", errno)
+        return -1;
+    }
+
+    self->pendingSubmissionCount -= (uint32_t) submittedCount;
+
+    return 0;
+}
+
+/// Gets the next free submission entry. There is no kernel polling thread, so the kernel only reads the entries in
+/// io_uring_enter() and the tail can be advanced before the entry is filled in.
+/// @return the cleared entry, or NULL if the submission queue is full
+static struct io_uring_sqe* nextSubmissionEntry(NimbleServerDaemonUringTransport* self)
+{
+    uint32_t tail = *self->submissionTail;
+    uint32_t head = __atomic_load_n(self->submissionHead, __ATOMIC_ACQUIRE);
+    if (tail - head > self->submissionMask) {
+        if (submit(self, 0) < 0) {
+            return 0;
+        }
+        head = __atomic_load_n(self->submissionHead, __ATOMIC_ACQUIRE);
+        if (tail - head > self->submissionMask) {
+            return 0;
+        }
+    }
+
+    uint32_t index = tail & self->submissionMask;
+    struct io_uring_sqe* entry = &self->submissionEntries[index];
+    memset(entry, 0, sizeof(*entry));
+    self->submissionArray[index] = index;
+    __atomic_store_n(self->submissionTail, tail + 1, __ATOMIC_RELEASE);
+    self->pendingSubmissionCount++;
+
+    return entry;
+}
+
+/// Queues a multishot recvmsg that picks its buffers from the provided buffer ring
+/// @return negative on error
+static int armReceive(NimbleServerDaemonUringTransport* self)
+{
+    struct io_uring_sqe* entry = nextSubmissionEntry(self);
+    if (entry == 0) {
+        return -1;
+    }
+
+    entry->opcode = IORING_OP_RECVMSG;
+    entry->fd = self->socketHandle;
+    entry->addr = (uint64_t) (uintptr_t) &self->receiveTemplate;
+    entry->len = 1;
+    entry->ioprio = IORING_RECV_MULTISHOT;
+    entry->flags = IOSQE_BUFFER_SELECT;
+    entry->buf_group = NIMBLE_DAEMON_URING_TRANSPORT_BUFFER_GROUP_ID;
+    entry->user_data = NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_USER_DATA;
+    self->isReceiveArmed = true;
+
+    return 0;
+}
+
+/// Gives a receive buffer back to the kernel
+static void recycleBuffer(NimbleServerDaemonUringTransport* self, uint16_t bufferId)
+{
+    struct io_uring_buf_ring* ring = self->bufferRing;
+    uint16_t tail = ring->tail;
+    struct io_uring_buf* buffer = &ring->bufs[tail & (NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (self->receiveBuffers +
+                                           (size_t) bufferId * NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_OCTET_COUNT);
+    buffer->len = NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_OCTET_COUNT;
+    buffer->bid = bufferId;
+    __atomic_store_n(&ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/// Copies a received datagram out of its provided buffer and finds the transport index for the source address
+/// @return octet count, zero if the datagram was dropped
+static ssize_t readDatagram(NimbleServerDaemonUringTransport* self, uint16_t bufferId, int* connectionId,
+                            uint8_t* data, size_t maxOctetCount)
+{
+    const uint8_t* buffer = self->receiveBuffers +
+                            (size_t) bufferId * NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_OCTET_COUNT;
+    const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*) buffer;
+    if ((out->flags & MSG_TRUNC) != 0 || out->namelen < sizeof(struct sockaddr_in) ||
+        out->payloadlen > maxOctetCount) {
+        self->stats.droppedDatagramCount++;
+        return 0;
+    }
+
+    const struct sockaddr_in* address = (const struct sockaddr_in*) (buffer + sizeof(*out));
+    const uint8_t* payload = buffer + sizeof(*out) + self->receiveTemplate.msg_namelen +
+                             self->receiveTemplate.msg_controllen;
+
+    MonotonicTimeMs now = monotonicTimeMsNow();
+    int transportIndex = nimbleServerDaemonAddressTableFind(self->addressTable, address);
+    if (transportIndex >= 0) {
+        self->addressTable->entries[transportIndex].lastReceivedAtMs = now;
+    } else {
+        transportIndex = nimbleServerDaemonAddressTableAdd(self->addressTable, address, now);
+        if (transportIndex < 0) {
+            self->stats.droppedDatagramCount++;
+            return 0;
+        }
+        if (self->newAddressFn != 0 && self->newAddressFn(self->newAddressSelf, (uint8_t) transportIndex) < 0) {
+            nimbleServerDaemonAddressTableRemove(self->addressTable, (uint8_t) transportIndex);
+            self->stats.droppedDatagramCount++;
+            return 0;
+        }
+    }
+
+    memcpy(data, payload, out->payloadlen);
+    *connectionId = transportIndex;
+    self->stats.receivedDatagramCount++;
+
+    return (ssize_t) out->payloadlen;
+}
+
+static ssize_t uringReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerDaemonUringTransport* self = (NimbleServerDaemonUringTransport*) _self;
+
+    while (true) {
+        uint32_t head = *self->completionHead;
+        uint32_t tail = __atomic_load_n(self->completionTail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (!self->isReceiveArmed) {
+                armReceive(self);
+            }
+            return 0;
+        }
+
+        const struct io_uring_cqe* completion = &self->completionEntries[head & self->completionMask];
+        uint64_t userData = completion->user_data;
+        int32_t result = completion->res;
+        uint32_t flags = completion->flags;
+        __atomic_store_n(self->completionHead, head + 1, __ATOMIC_RELEASE);
+
+        if (userData != NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_USER_DATA) {
+            self->freeSendSlots[self->freeSendSlotCount++] = (uint16_t) userData;
+            if (result < 0) {
+                self->stats.droppedDatagramCount++;
+            } else {
+                self->stats.sentDatagramCount++;
+            }
+            continue;
+        }
+
+        if ((flags & IORING_CQE_F_MORE) == 0) {
+            // The kernel stopped the multishot receive, e.g. when it ran out of buffers
+            self->isReceiveArmed = false;
+            self->stats.rearmCount++;
+        }
+
+        if (result < 0) {
+            if (result == -ENOBUFS) {
+                self->stats.noBufferCount++;
+            } else {
+                CLOG_C_NOTICE(&self->log, "uring: receive failed %d", result)
+            }
+            continue;
+        }
+
+        if ((flags & IORING_CQE_F_BUFFER) == 0) {
+            continue;
+        }
+
+        uint16_t bufferId = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+        ssize_t octetCount = readDatagram(self, bufferId, connectionId, data, maxOctetCount);
+        recycleBuffer(self, bufferId);
+        if (octetCount > 0) {
+            return octetCount;
+        }
+    }
+}
+
+static int uringSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerDaemonUringTransport* self = (NimbleServerDaemonUringTransport*) _self;
+
+    if (connectionId < 0 || (size_t) connectionId >= self->addressTable->connectionCount ||
+        !self->addressTable->entries[connectionId].isUsed || octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        return -1;
+    }
+
+    if (self->freeSendSlotCount == 0) {
+        // The completions are reaped by receiveFrom(), so the sends of this tick have used up all the slots
+        self->stats.droppedDatagramCount++;
+        return 0;
+    }
+
+    struct io_uring_sqe* entry = nextSubmissionEntry(self);
+    if (entry == 0) {
+        self->stats.droppedDatagramCount++;
+        return 0;
+    }
+
+    uint16_t slotIndex = self->freeSendSlots[--self->freeSendSlotCount];
+    NimbleServerDaemonUringSendSlot* slot = &self->sendSlots[slotIndex];
+    memcpy(slot->octets, data, octetCount);
+    slot->address = self->addressTable->entries[connectionId].address;
+    slot->iovec.iov_base = slot->octets;
+    slot->iovec.iov_len = octetCount;
+    memset(&slot->message, 0, sizeof(slot->message));
+    slot->message.msg_name = &slot->address;
+    slot->message.msg_namelen = sizeof(slot->address);
+    slot->message.msg_iov = &slot->iovec;
+    slot->message.msg_iovlen = 1;
+
+    entry->opcode = IORING_OP_SENDMSG;
+    entry->fd = self->socketHandle;
+    entry->addr = (uint64_t) (uintptr_t) &slot->message;
+    entry->len = 1;
+    entry->user_data = slotIndex;
+
+    return 0;
+}
+
+/// Creates the ring, registers the provided receive buffers and arms the multishot receive
+/// @param self uring transport
+/// @param setup socket, address table and new address callback
+/// @return negative on error, e.g. if the kernel does not support io_uring or provided buffer rings (5.19)
+int nimbleServerDaemonUringTransportInit(NimbleServerDaemonUringTransport* self,
+                                         NimbleServerDaemonUringTransportSetup setup)
+{
+    memset(self, 0, sizeof(*self));
+    self->log = setup.log;
+    self->socketHandle = setup.socketHandle;
+    self->addressTable = setup.addressTable;
+    self->newAddressFn = setup.newAddressFn;
+    self->newAddressSelf = setup.newAddressSelf;
+    self->ringFd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = NIMBLE_DAEMON_URING_TRANSPORT_COMPLETION_ENTRY_COUNT;
+
+    self->ringFd = (int) syscall(__NR_io_uring_setup, NIMBLE_DAEMON_URING_TRANSPORT_SUBMISSION_ENTRY_COUNT, &params);
+    if (self->ringFd < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "uring: io_uring_setup failed %d", errno)
+        return -1;
+    }
+
+    self->submissionRingOctetCount = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    self->completionRingOctetCount = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (self->completionRingOctetCount > self->submissionRingOctetCount) {
+            self->submissionRingOctetCount = self->completionRingOctetCount;
+        }
+        self->completionRingOctetCount = 0;
+    }
+
+    void* submissionRing = mmap(0, self->submissionRingOctetCount, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                self->ringFd, IORING_OFF_SQ_RING);
+    if (submissionRing == MAP_FAILED) {
+        return -2;
+    }
+    self->submissionRing = (uint8_t*) submissionRing;
+    self->completionRing = self->submissionRing;
+    if (self->completionRingOctetCount > 0) {
+        void* completionRing = mmap(0, self->completionRingOctetCount, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, self->ringFd, IORING_OFF_CQ_RING);
+        if (completionRing == MAP_FAILED) {
+            return -3;
+        }
+        self->completionRing = (uint8_t*) completionRing;
+    }
+
+    self->submissionEntriesOctetCount = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* submissionEntries = mmap(0, self->submissionEntriesOctetCount, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, self->ringFd, IORING_OFF_SQES);
+    if (submissionEntries == MAP_FAILED) {
+        return -4;
+    }
+    self->submissionEntries = (struct io_uring_sqe*) submissionEntries;
+
+    self->submissionHead = (uint32_t*) (self->submissionRing + params.sq_off.head);
+    self->submissionTail = (uint32_t*) (self->submissionRing + params.sq_off.tail);
+    self->submissionMask = *(uint32_t*) (self->submissionRing + params.sq_off.ring_mask);
+    self->submissionArray = (uint32_t*) (self->submissionRing + params.sq_off.array);
+    self->completionHead = (uint32_t*) (self->completionRing + params.cq_off.head);
+    self->completionTail = (uint32_t*) (self->completionRing + params.cq_off.tail);
+    self->completionMask = *(uint32_t*) (self->completionRing + params.cq_off.ring_mask);
+    self->completionEntries = (struct io_uring_cqe*) (self->completionRing + params.cq_off.cqes);
+
+    self->bufferRingOctetCount = NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    self->bufferRing = (struct io_uring_buf_ring*) mapAnonymous(self->bufferRingOctetCount);
+    self->receiveBuffers = (uint8_t*) mapAnonymous(NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT *
+                                                   NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_OCTET_COUNT);
+    self->sendSlots = (NimbleServerDaemonUringSendSlot*) mapAnonymous(NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT *
+                                                                      sizeof(NimbleServerDaemonUringSendSlot));
+    if (self->bufferRing == 0 || self->receiveBuffers == 0 || self->sendSlots == 0) {
+        return -5;
+    }
+
+    struct io_uring_buf_reg bufferRegistration;
+    memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+    bufferRegistration.ring_addr = (uint64_t) (uintptr_t) self->bufferRing;
+    bufferRegistration.ring_entries = NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT;
+    bufferRegistration.bgid = NIMBLE_DAEMON_URING_TRANSPORT_BUFFER_GROUP_ID;
+    if (syscall(__NR_io_uring_register, self->ringFd, IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "uring: could not register the provided buffer ring %d", errno)
+        return -6;
+    }
+
+    for (uint16_t i = 0; i < NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT; ++i) {
+        recycleBuffer(self, i);
+    }
+
+    for (uint16_t i = 0; i < NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT; ++i) {
+        self->freeSendSlots[i] = (uint16_t) (NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT - 1 - i);
+    }
+    self->freeSendSlotCount = NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT;
+
+    // Only the source address is received in front of the payload
+    self->receiveTemplate.msg_namelen = sizeof(struct sockaddr_in);
+
+    self->multiTransport.self = self;
+    self->multiTransport.sendTo = uringSendTo;
+    self->multiTransport.receiveFrom = uringReceiveFrom;
+
+    int err = armReceive(self);
+    if (err < 0) {
+        return err;
+    }
+
+    return nimbleServerDaemonUringTransportFlush(self);
+}
+
+/// Closes the ring and frees the buffers. The socket is not closed.
+/// @param self uring transport
+void nimbleServerDaemonUringTransportDestroy(NimbleServerDaemonUringTransport* self)
+{
+    if (self->ringFd >= 0) {
+        close(self->ringFd);
+        self->ringFd = -1;
+    }
+    if (self->submissionEntries != 0) {
+        munmap(self->submissionEntries, self->submissionEntriesOctetCount);
+    }
+    if (self->completionRing != 0 && self->completionRing != self->submissionRing) {
+        munmap(self->completionRing, self->completionRingOctetCount);
+    }
+    if (self->submissionRing != 0) {
+        munmap(self->submissionRing, self->submissionRingOctetCount);
+    }
+    if (self->bufferRing != 0) {
+        munmap(self->bufferRing, self->bufferRingOctetCount);
+    }
+    if (self->receiveBuffers != 0) {
+        munmap(self->receiveBuffers, NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_COUNT *
+                                         NIMBLE_DAEMON_URING_TRANSPORT_RECEIVE_BUFFER_OCTET_COUNT);
+    }
+    if (self->sendSlots != 0) {
+        munmap(self->sendSlots, NIMBLE_DAEMON_URING_TRANSPORT_SEND_SLOT_COUNT * sizeof(NimbleServerDaemonUringSendSlot));
+    }
+}
+
+/// Submits all the sends that were queued since the previous flush, and re-arms the receive if the kernel stopped it,
+/// with a single io_uring_enter()
+/// @param self uring transport
+/// @return negative on error
+int nimbleServerDaemonUringTransportFlush(NimbleServerDaemonUringTransport* self)
+{
+    if (!self->isReceiveArmed) {
+        int err = armReceive(self);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    if (self->pendingSubmissionCount == 0) {
+        return 0;
+    }
+
+    return submit(self, 0);
+}
+
+/// Blocks until at least one completion is available, after submitting the queued entries
+/// @param self uring transport
+/// @return negative on error
+int nimbleServerDaemonUringTransportWait(NimbleServerDaemonUringTransport* self)
+{
+    if (!self->isReceiveArmed) {
+        int err = armReceive(self);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return submit(self, 1);
+}
+
+/// Checks if there are completions that have not been read with receiveFrom()
+/// @param self uring transport
+/// @return true if there are completions
+bool nimbleServerDaemonUringTransportHasPending(const NimbleServerDaemonUringTransport* self)
+{
+    return *self->completionHead != __atomic_load_n(self->completionTail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,273 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <nimble-daemon/workers.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define NIMBLE_DAEMON_WORKER_POLL_TIMEOUT_MS (100)
+
+/// The offset of the UDP source port from the network header, when the IPv4 header has no options
+#define NIMBLE_DAEMON_WORKERS_SOURCE_PORT_OFFSET (20)
+
+/// Attaches a program to the SO_REUSEPORT group that returns `source port % workerCount`, which is the index of the
+/// socket (in the order they were bound) that the kernel delivers the datagram to
+/// @return negative on error
+static int attachSteering(int socketHandle, size_t workerCount)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t) (SKF_NET_OFF + NIMBLE_DAEMON_WORKERS_SOURCE_PORT_OFFSET)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) workerCount},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+
+    return setsockopt(socketHandle, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+}
+
+/// Finds the worker that owns the client address. Must give the same result as the steering program.
+/// @param self workers
+/// @param address client address
+/// @return worker index
+size_t nimbleServerDaemonWorkersOwner(const NimbleServerDaemonWorkers* self, const struct sockaddr_in* address)
+{
+    return ntohs(address->sin_port) % self->workerCount;
+}
+
+static bool routeToOwner(void* _self, const struct sockaddr_in* address, const uint8_t* octets, size_t octetCount)
+{
+    NimbleServerDaemonWorker* self = (NimbleServerDaemonWorker*) _self;
+
+    size_t ownerIndex = nimbleServerDaemonWorkersOwner(self->workers, address);
+    if (ownerIndex == self->index) {
+        return false;
+    }
+
+    NimbleServerDaemonHandoffQueue* queue = &self->workers->workers[ownerIndex].handoffQueue;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == NIMBLE_DAEMON_HANDOFF_QUEUE_CAPACITY) {
+        queue->droppedCount++;
+        pthread_mutex_unlock(&queue->mutex);
+        return true;
+    }
+    NimbleServerDaemonHandoffDatagram* datagram = &queue->datagrams[(queue->readIndex + queue->count) %
+                                                                    NIMBLE_DAEMON_HANDOFF_QUEUE_CAPACITY];
+    datagram->address = *address;
+    datagram->octetCount = octetCount;
+    memcpy(datagram->octets, octets, octetCount);
+    queue->count++;
+    pthread_mutex_unlock(&queue->mutex);
+
+    uint64_t signal = 1;
+    ssize_t ignored = write(queue->eventFd, &signal, sizeof(signal));
+    (void) ignored;
+
+    return true;
+}
+
+/// Feeds the handed off datagrams one at a time, so the queue is not locked while the server handles them
+static void drainHandoff(void* _self, NimbleServerDaemon* daemon, NimbleServer* server)
+{
+    NimbleServerDaemonWorker* self = (NimbleServerDaemonWorker*) _self;
+    NimbleServerDaemonHandoffQueue* queue = &self->handoffQueue;
+
+    uint64_t signalCount;
+    ssize_t ignored = read(queue->eventFd, &signalCount, sizeof(signalCount));
+    (void) ignored;
+
+    MonotonicTimeMs now = monotonicTimeMsNow();
+
+    while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->count == 0) {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        self->incoming = queue->datagrams[queue->readIndex];
+        queue->readIndex = (queue->readIndex + 1) % NIMBLE_DAEMON_HANDOFF_QUEUE_CAPACITY;
+        queue->count--;
+        pthread_mutex_unlock(&queue->mutex);
+
+        nimbleServerDaemonFeed(daemon, server, &self->incoming.address, self->incoming.octets,
+                               self->incoming.octetCount, now);
+    }
+}
+
+static int initWorker(NimbleServerDaemonWorker* self, NimbleServerDaemonWorkers* workers, size_t index,
+                      const NimbleServerDaemonWorkersSetup* setup)
+{
+    self->index = index;
+    self->workers = workers;
+    self->isStarted = false;
+    self->result = 0;
+
+    NimbleServerDaemonHandoffQueue* queue = &self->handoffQueue;
+    queue->readIndex = 0;
+    queue->count = 0;
+    queue->droppedCount = 0;
+    pthread_mutex_init(&queue->mutex, 0);
+    queue->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->eventFd < 0) {
+        CLOG_C_SOFT_ERROR(&workers->log, "workers: eventfd failed %d", errno)
+        return -1;
+    }
+
+    NimbleServerDaemonSetup daemonSetup = {.port = setup->port,
+                                           .backend = NimbleServerDaemonBackendSocket,
+                                           .isReusePort = true,
+                                           .isGsoEnabled = setup->isGsoEnabled,
+                                           .isGroEnabled = setup->isGroEnabled,
+                                           .maxConnectionCount = setup->maxConnectionCount,
+                                           .targetTickTimeMs = setup->targetTickTimeMs,
+                                           .idleTimeoutMs = setup->idleTimeoutMs,
+                                           .handoff = {.routeFn = routeToOwner,
+                                                       .drainFn = drainHandoff,
+                                                       .handoffFd = queue->eventFd,
+                                                       .self = self},
+                                           .log = setup->log};
+    int err = nimbleServerDaemonInit(&self->daemon, daemonSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    imprintDefaultSetupInit(&self->memory, 16 * 1024 * 1024);
+
+    return nimbleServerDaemonExampleGameInit(&self->game, &self->server, &self->memory, self->daemon.multiTransport,
+                                             setup->maxConnectionCount, setup->targetTickTimeMs, setup->log);
+}
+
+/// Opens a SO_REUSEPORT socket and a room for each worker, and steers the datagrams of the port over them
+/// @param self workers
+/// @param setup port, worker count, GSO and GRO, and the connection count, tick time and idle timeout for each worker
+/// @return negative on error
+int nimbleServerDaemonWorkersInit(NimbleServerDaemonWorkers* self, NimbleServerDaemonWorkersSetup setup)
+{
+    self->log = setup.log;
+    self->workerCount = 0;
+    self->isSteered = false;
+    self->isStopping = false;
+
+    if (setup.workerCount == 0 || setup.workerCount > NIMBLE_DAEMON_MAX_WORKER_COUNT) {
+        CLOG_C_SOFT_ERROR(&self->log, "workers: worker count must be 1 to %d", NIMBLE_DAEMON_MAX_WORKER_COUNT)
+        return -1;
+    }
+
+    for (size_t i = 0; i < setup.workerCount; ++i) {
+        int err = initWorker(&self->workers[i], self, i, &setup);
+        if (err < 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "workers: could not start worker %zu %d", i, err)
+            return err;
+        }
+        self->workerCount++;
+    }
+
+    if (self->workerCount > 1) {
+        if (attachSteering(self->workers[0].daemon.socket.handle, self->workerCount) < 0) {
+            CLOG_C_NOTICE(&self->log, "workers: could not attach the steering program %d, handing off instead", errno)
+        } else {
+            self->isSteered = true;
+        }
+    }
+
+    return 0;
+}
+
+/// Closes the sockets and frees the memory of all the workers. The workers must be stopped.
+/// @param self workers
+void nimbleServerDaemonWorkersDestroy(NimbleServerDaemonWorkers* self)
+{
+    for (size_t i = 0; i < self->workerCount; ++i) {
+        NimbleServerDaemonWorker* worker = &self->workers[i];
+        nimbleServerDaemonDestroy(&worker->daemon);
+        close(worker->handoffQueue.eventFd);
+        pthread_mutex_destroy(&worker->handoffQueue.mutex);
+        imprintDefaultSetupDestroy(&worker->memory);
+    }
+    self->workerCount = 0;
+}
+
+static void* runWorker(void* _self)
+{
+    NimbleServerDaemonWorker* self = (NimbleServerDaemonWorker*) _self;
+    uint64_t statsEveryTickCount = nimbleServerDaemonStatsEveryTickCount(&self->daemon);
+
+    nimbleServerDaemonMemoryReportDebugOutput(&self->server, &self->daemon.log);
+
+    while (!__atomic_load_n(&self->workers->isStopping, __ATOMIC_ACQUIRE)) {
+        int tickCount = nimbleServerDaemonPoll(&self->daemon, &self->server, NIMBLE_DAEMON_WORKER_POLL_TIMEOUT_MS);
+        if (tickCount < 0) {
+            self->result = tickCount;
+            break;
+        }
+
+        if (tickCount > 0 && (self->daemon.stats.tickCount % statsEveryTickCount) == 0) {
+            nimbleServerDaemonStatsDebugOutput(&self->daemon.stats, &self->daemon.log);
+            nimbleServerDaemonMemoryReportDebugOutput(&self->server, &self->daemon.log);
+        }
+    }
+
+    return 0;
+}
+
+/// Starts a thread for each worker
+/// @param self workers
+/// @return negative on error
+int nimbleServerDaemonWorkersStart(NimbleServerDaemonWorkers* self)
+{
+    __atomic_store_n(&self->isStopping, false, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < self->workerCount; ++i) {
+        NimbleServerDaemonWorker* worker = &self->workers[i];
+        if (pthread_create(&worker->thread, 0, runWorker, worker) != 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "workers: could not create thread for worker %zu", i)
+            return -1;
+        }
+        worker->isStarted = true;
+    }
+
+    return 0;
+}
+
+/// Waits until all the worker threads have finished
+/// @param self workers
+/// @return negative if a worker failed
+int nimbleServerDaemonWorkersWait(NimbleServerDaemonWorkers* self)
+{
+    int result = 0;
+    for (size_t i = 0; i < self->workerCount; ++i) {
+        NimbleServerDaemonWorker* worker = &self->workers[i];
+        if (!worker->isStarted) {
+            continue;
+        }
+        pthread_join(worker->thread, 0);
+        worker->isStarted = false;
+        if (worker->result < 0) {
+            result = worker->result;
+        }
+    }
+
+    return result;
+}
+
+/// Lets the workers finish their current poll and waits for the threads
+/// @param self workers
+/// @return negative if a worker failed
+int nimbleServerDaemonWorkersStop(NimbleServerDaemonWorkers* self)
+{
+    __atomic_store_n(&self->isStopping, true, __ATOMIC_RELEASE);
+
+    return nimbleServerDaemonWorkersWait(self);
+}
@@ -21,7 +21,6 @@ typedef struct NimbleServerConnectionQuality {
     size_t addedStepsToBufferCounter;
     bool hasAddedFirstAcceptedSteps;
 
-    char debugPrefix[64];
     Clog log;
 } NimbleServerConnectionQuality;
 
@@ -0,0 +1,44 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_DATAGRAM_RUN_H
+#define NIMBLE_SERVER_DATAGRAM_RUN_H
+
+#include <datagram-transport/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct DatagramTransportOut;
+
+#define NIMBLE_SERVER_DATAGRAM_RUN_MAX_COUNT (8)
+
+/// Sends a run of datagrams to the same destination with one call. The datagrams are stored back to back in octets,
+/// and all of them except the last are exactly segmentOctetCount octets, the layout that a UDP_SEGMENT (GSO) send
+/// expects. The last one can be shorter.
+/// @return negative on error
+typedef int (*NimbleServerSendDatagramRunFn)(void* self, const uint8_t* octets, size_t octetCount,
+                                             size_t segmentOctetCount);
+
+/// Optional way for a transport to send several datagrams at once, set in NimbleServerResponse
+typedef struct NimbleServerDatagramRunOut {
+    void* self;
+    NimbleServerSendDatagramRunFn sendRun;
+} NimbleServerDatagramRunOut;
+
+/// Datagrams to one destination that are written back to back, so the ones with the same size can be sent together
+typedef struct NimbleServerDatagramRun {
+    uint8_t octets[NIMBLE_SERVER_DATAGRAM_RUN_MAX_COUNT * DATAGRAM_TRANSPORT_MAX_SIZE];
+    size_t octetCounts[NIMBLE_SERVER_DATAGRAM_RUN_MAX_COUNT];
+    size_t datagramCount;
+    size_t octetCount;
+} NimbleServerDatagramRun;
+
+void nimbleServerDatagramRunInit(NimbleServerDatagramRun* self);
+uint8_t* nimbleServerDatagramRunNext(NimbleServerDatagramRun* self);
+void nimbleServerDatagramRunCommit(NimbleServerDatagramRun* self, size_t octetCount);
+int nimbleServerDatagramRunFlush(NimbleServerDatagramRun* self, struct DatagramTransportOut* transportOut,
+                                 const NimbleServerDatagramRunOut* runOut);
+
+#endif
@@ -11,6 +11,7 @@ const static int NimbleServerErrSerializeVersion = -44;
 const static int NimbleServerErrSessionFull = -54;
 const static int NimbleServerErrDatagramFromDisconnectedConnection = -42;
 const static int NimbleServerErrOutOfParticipantMemory = -43;
+const static int NimbleServerErrOutOfBlobMemory = -45;
 
 #endif
 
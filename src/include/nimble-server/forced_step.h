@@ -0,0 +1,66 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_FORCED_STEP_H
+#define NIMBLE_SERVER_FORCED_STEP_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+/// What the server composes for a participant that has not provided a step in time
+typedef enum NimbleServerForcedStepPolicy {
+    NimbleServerForcedStepPolicyZero,       ///< an empty StepNotProvidedInTime step (the default)
+    NimbleServerForcedStepPolicyRepeatLast, ///< the last step that was received from the participant
+    NimbleServerForcedStepPolicyDecay, ///< the last received step, with each octet as a signed axis halved for every
+                                       ///< forced step in a row
+    NimbleServerForcedStepPolicyCallback, ///< created by the application
+} NimbleServerForcedStepPolicy;
+
+/// Creates the payload of a forced step.
+/// @return octet count written to target, negative to use an empty StepNotProvidedInTime step
+typedef int (*NimbleServerCreateForcedStepFn)(void* self, uint8_t participantId, StepId stepId,
+                                              const uint8_t* lastOctets, size_t lastOctetCount,
+                                              size_t forcedCountInRow, uint8_t* target, size_t maxOctetCount);
+
+typedef struct NimbleServerForcedStepsParticipant {
+    uint8_t* lastOctets;
+    size_t lastOctetCount;
+    bool hasLastStep;
+    size_t forcedCountInRow;
+} NimbleServerForcedStepsParticipant;
+
+/// Remembers the last received step for each participant slot, so a step that was not provided in time can be
+/// replaced with something that is more likely to match what the clients predicted than an empty step.
+/// A substituted step is composed as a normal step.
+typedef struct NimbleServerForcedSteps {
+    NimbleServerForcedStepPolicy policy;
+    NimbleServerCreateForcedStepFn createFn;
+    void* createSelf;
+    NimbleServerForcedStepsParticipant* participants;
+    size_t participantCapacity;
+    size_t maxStepOctetCount;
+    uint64_t substitutedStepCount;
+    Clog log;
+} NimbleServerForcedSteps;
+
+void nimbleServerForcedStepsInit(NimbleServerForcedSteps* self, struct ImprintAllocator* allocator,
+                                 NimbleServerForcedStepPolicy policy, size_t participantCapacity,
+                                 size_t maxStepOctetCount, NimbleServerCreateForcedStepFn createFn, void* createSelf,
+                                 Clog log);
+bool nimbleServerForcedStepsIsEnabled(const NimbleServerForcedSteps* self);
+void nimbleServerForcedStepsReset(NimbleServerForcedSteps* self, size_t participantIndex);
+void nimbleServerForcedStepsReceived(NimbleServerForcedSteps* self, size_t participantIndex, const uint8_t* octets,
+                                     size_t octetCount);
+int nimbleServerForcedStepsCreate(NimbleServerForcedSteps* self, size_t participantIndex, uint8_t participantId,
+                                  StepId stepId, uint8_t* target, size_t maxOctetCount);
+size_t nimbleServerForcedStepsCalculateMemoryRequirement(NimbleServerForcedStepPolicy policy,
+                                                         size_t participantCapacity, size_t maxStepOctetCount);
+
+#endif
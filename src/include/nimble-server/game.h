@@ -6,23 +6,73 @@
 #ifndef NIMBLE_SERVER_GAME_H
 #define NIMBLE_SERVER_GAME_H
 
+#include <nimble-server/forced_step.h>
 #include <nimble-server/game_state.h>
 #include <nimble-server/local_parties.h>
+#include <nimble-server/step_history.h>
+#include <nimble-server/step_validation.h>
 #include <nimble-steps/steps.h>
 #include <stdbool.h>
 
 struct ImprintAllocator;
 
+typedef void (*NimbleServerGameStepComposedFn)(void* self, StepId stepId, const uint8_t* octets, size_t octetCount);
+typedef void (*NimbleServerGameSnapshotFn)(void* self, StepId stepId, const uint8_t* octets, size_t octetCount);
+
+/// Optional functions that are called when an authoritative step has been composed, and when the application has
+/// provided a game state. They are called on the thread that updates the server, and must not block.
+typedef struct NimbleServerGameObserver {
+    NimbleServerGameStepComposedFn stepComposedFn;
+    NimbleServerGameSnapshotFn snapshotFn;
+    void* self;
+} NimbleServerGameObserver;
+
 /// Tracks the latestState, as well as the all authoritative Steps after the game state.
+/// Authoritative steps that are discarded from the window are moved to the (optional) history, so clients that
+/// return after a short absence can catch up with steps instead of downloading a new game state.
 typedef struct NimbleServerGame {
     NbsSteps authoritativeSteps;
     NimbleServerParticipants participants;
     bool debugIsFrozen;
+    bool isSimulatedOnServer; ///< a game state can always be serialized, so composing never waits for one
+    NimbleServerGameObserver observer;
+    NimbleServerStepValidation stepValidation; ///< only allocated if a validation function is provided
+    NimbleServerForcedSteps forcedSteps; ///< only allocated if the policy is not NimbleServerForcedStepPolicyZero
+    NimbleServerStepHistory history;
+    NbsSteps catchUpSteps; ///< only allocated if the history is enabled
+    size_t combinedStepOctetCount;
+    size_t latestGameStateOctetCount; ///< zero if no game state has been provided
     Clog log;
 } NimbleServerGame;
 
+/// Allocators for the different parts of the game, so they can be tagged separately
+typedef struct NimbleServerGameAllocators {
+    struct ImprintAllocator* authoritativeSteps;
+    struct ImprintAllocator* participants;
+    struct ImprintAllocator* participantSteps;
+} NimbleServerGameAllocators;
+
 void nimbleServerGameInit(NimbleServerGame* self, struct ImprintAllocator* allocator,
-                          size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount, Clog log);
+                          size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount,
+                          size_t participantStepBudgetOctetCount, Clog log);
+void nimbleServerGameInitWithAllocators(NimbleServerGame* self, NimbleServerGameAllocators allocators,
+                                        size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount,
+                                        size_t participantStepBudgetOctetCount, Clog log);
+void nimbleServerGameInitHistory(NimbleServerGame* self, struct ImprintAllocator* allocator, size_t stepCapacity,
+                                 size_t octetCapacity);
+void nimbleServerGameInitStepValidation(NimbleServerGame* self, struct ImprintAllocator* allocator,
+                                        size_t maxSingleParticipantStepOctetCount,
+                                        NimbleServerValidatePredictedStepsFn validateFn, void* validateSelf);
+void nimbleServerGameInitForcedSteps(NimbleServerGame* self, struct ImprintAllocator* allocator,
+                                     NimbleServerForcedStepPolicy policy, size_t maxSingleParticipantStepOctetCount,
+                                     NimbleServerCreateForcedStepFn createFn, void* createSelf);
+void nimbleServerGameReInit(NimbleServerGame* self, StepId stepId);
+int nimbleServerGameDiscardAuthoritativeSteps(NimbleServerGame* self, size_t stepCount);
+size_t nimbleServerGameCalculateMemoryRequirement(size_t maxSingleParticipantStepOctetCount,
+                                                  size_t maxParticipantCount, size_t participantStepBudgetOctetCount);
+size_t nimbleServerGameCalculateHistoryMemoryRequirement(size_t maxSingleParticipantStepOctetCount,
+                                                         size_t maxParticipantCount, size_t stepCapacity,
+                                                         size_t octetCapacity);
 
 
 #endif
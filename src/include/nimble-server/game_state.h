@@ -20,8 +20,8 @@ typedef struct NimbleServerGameState {
     StepId stepId;
 } NimbleServerGameState;
 
-void nimbleServerGameStateInit(NimbleServerGameState* self, struct ImprintAllocator* allocatorWithFree,
-                               size_t octetCount);
+int nimbleServerGameStateInit(NimbleServerGameState* self, struct ImprintAllocator* allocatorWithFree,
+                              size_t octetCount);
 int nimbleServerGameStateSet(NimbleServerGameState* state, StepId stepId, const uint8_t* gameState,
                              size_t gameStateOctetCount, Clog* log);
 int nimbleServerGameStateCopy(NimbleServerGameState* state, const NimbleServerGameState* copyFrom, Clog* log);
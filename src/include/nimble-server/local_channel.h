@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_LOCAL_CHANNEL_H
+#define NIMBLE_SERVER_LOCAL_CHANNEL_H
+
+#include <clog/clog.h>
+#include <nimble-serialize/serialize.h>
+#include <nimble-steps/steps.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct NimbleServer;
+struct NimbleServerLocalParty;
+struct NimbleServerTransportConnection;
+
+typedef struct NimbleServerLocalChannelStats {
+    uint64_t insertedStepCount;
+    uint64_t readStepCount;
+} NimbleServerLocalChannelStats;
+
+/// An in-process channel for the party of a client that hosts the server itself.
+/// The predicted steps are written directly into the steps buffers of the participants, and the authoritative steps
+/// are read directly from the game, without any serialization, ordered datagram headers or datagram transport.
+/// The channel uses a transport connection index that the normal transport must never use.
+/// Note: the recorder does not capture the steps that are added through a local channel.
+typedef struct NimbleServerLocalChannel {
+    struct NimbleServer* server;
+    struct NimbleServerTransportConnection* transportConnection;
+    struct NimbleServerLocalParty* party;
+    StepId nextReadStepId;
+    NimbleServerLocalChannelStats stats;
+    Clog log;
+} NimbleServerLocalChannel;
+
+int nimbleServerLocalChannelJoin(NimbleServerLocalChannel* self, struct NimbleServer* server, uint8_t transportIndex,
+                                 const NimbleSerializeJoinGameRequestPlayer* players, size_t playerCount);
+int nimbleServerLocalChannelAddPredictedStep(NimbleServerLocalChannel* self, uint8_t participantId, StepId stepId,
+                                             const uint8_t* octets, size_t octetCount);
+int nimbleServerLocalChannelCompose(NimbleServerLocalChannel* self);
+int nimbleServerLocalChannelReadAuthoritativeStep(NimbleServerLocalChannel* self, StepId* outStepId, uint8_t* target,
+                                                  size_t maxOctetCount);
+int nimbleServerLocalChannelLeave(NimbleServerLocalChannel* self);
+
+#endif
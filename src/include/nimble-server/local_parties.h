@@ -22,6 +22,7 @@ struct NimbleServerTransportConnection;
 
 typedef struct NimbleServerLocalParties {
     struct NimbleServerLocalParty* parties;
+    struct NimbleServerLocalPartyDiagnostics* diagnostics;
     size_t partiesCount;
     size_t capacityCount;
     struct ImprintAllocator* allocator;
@@ -34,6 +35,7 @@ void nimbleServerLocalPartiesInit(NimbleServerLocalParties* self, size_t maxCoun
                                             struct ImprintAllocator* connectionAllocator,
                                             size_t maxNumberOfParticipantsForConnection,
                                             size_t maxSingleParticipantOctetCount, Clog log);
+size_t nimbleServerLocalPartiesCalculateMemoryRequirement(size_t maxCount);
 void nimbleServerLocalPartiesReset(NimbleServerLocalParties* self);
 void nimbleServerLocalPartiesRemove(NimbleServerLocalParties* self,
                                               struct NimbleServerLocalParty* connection);
@@ -19,6 +19,7 @@
 
 struct NimbleServerParticipant;
 struct NimbleServerTransportConnection;
+struct NimbleServerStepValidation;
 
 typedef enum NimbleServerLocalPartyState {
     NimbleServerLocalPartyStateNormal,
@@ -26,31 +27,37 @@ typedef enum NimbleServerLocalPartyState {
     NimbleServerLocalPartyStateDissolved
 } NimbleServerLocalPartyState;
 
+/// Diagnostics for a local party that are not needed every tick.
+/// Stored out of line, so they do not take up space in the cache lines used by tickParties.
+typedef struct NimbleServerLocalPartyDiagnostics {
+    StatsInt incomingStepCountInBufferStats;
+    char debugPrefix[32];
+    char qualityDebugPrefix[64];
+} NimbleServerLocalPartyDiagnostics;
+
 /// Represents the collection of participants joined from one device (one client transport connection). */
+/// The fields used every tick are placed first.
 typedef struct NimbleServerLocalParty {
-    NimbleSerializeLocalPartyId id;
-    bool isUsed;
-
     NimbleServerLocalPartyState state;
-    NimbleServerParticipantReferences participantReferences;
-
-    StatsInt incomingStepCountInBufferStats;
-    struct NimbleServerTransportConnection* transportConnection;
+    bool isUsed;
+    NimbleSerializeLocalPartyId id;
     size_t waitingForReconnectTimer;
     size_t waitingForReconnectMaxTimer;
     NimbleServerConnectionQuality quality;
     NimbleServerConnectionQualityDelayed delayedQuality;
+    StepId highestReceivedStepId;
+    size_t stepsInBufferCount;
     uint32_t warningCount;
     uint32_t warningAboutZeroAddedSteps;
 
-    StepId highestReceivedStepId;
-    size_t stepsInBufferCount;
+    struct NimbleServerTransportConnection* transportConnection;
+    NimbleServerParticipantReferences participantReferences;
 
-    char debugPrefix[32];
+    NimbleServerLocalPartyDiagnostics* diagnostics;
     Clog log;
 } NimbleServerLocalParty;
 
-void nimbleServerLocalPartyInit(NimbleServerLocalParty* self,
+void nimbleServerLocalPartyInit(NimbleServerLocalParty* self, NimbleServerLocalPartyDiagnostics* diagnostics,
                                 NimbleSerializeLocalPartyId id, Clog log);
 void nimbleServerLocalPartyReset(NimbleServerLocalParty* self);
 void nimbleServerLocalPartyReInit(NimbleServerLocalParty* self,
@@ -60,6 +67,7 @@ void nimbleServerLocalPartyRejoin(NimbleServerLocalParty* self,
 void nimbleServerLocalPartyDestroy(NimbleServerLocalParty* self);
 bool nimbleServerLocalPartyHasParticipantId(const NimbleServerLocalParty* self, uint8_t participantId);
 bool nimbleServerLocalPartyTick(NimbleServerLocalParty* self);
-int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, struct FldInStream* inStream);
+int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, struct FldInStream* inStream,
+                                                    struct NimbleServerStepValidation* validation);
 
 #endif
@@ -0,0 +1,81 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_MEMORY_REPORT_H
+#define NIMBLE_SERVER_MEMORY_REPORT_H
+
+#include <clog/clog.h>
+#include <imprint/allocator.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct NimbleServer;
+
+typedef enum NimbleServerMemoryTag {
+    NimbleServerMemoryTagAuthoritativeSteps,
+    NimbleServerMemoryTagParticipantSteps,
+    NimbleServerMemoryTagParticipants,
+    NimbleServerMemoryTagLocalParties,
+    NimbleServerMemoryTagTransportConnections,
+    NimbleServerMemoryTagStepHistory,
+    NimbleServerMemoryTagStepValidation,
+    NimbleServerMemoryTagForcedSteps,
+    NimbleServerMemoryTagSpectators,
+    NimbleServerMemoryTagGameStateCopies,
+    NimbleServerMemoryTagBlobStreams,
+    NimbleServerMemoryTagCount
+} NimbleServerMemoryTag;
+
+typedef struct NimbleServerMemoryTagCounter {
+    size_t octetCount;
+    size_t allocationCount;
+} NimbleServerMemoryTagCounter;
+
+/// Forwards allocations to the parent allocator and counts them for a tag.
+/// If alignToCacheLine is set, each octet count is rounded up to a cache line, so allocations from a cache line aligned
+/// linear allocator all start on a cache line.
+typedef struct NimbleServerTaggedAllocator {
+    ImprintAllocator info;
+    ImprintAllocator* parent;
+    NimbleServerMemoryTagCounter* counter;
+    bool alignToCacheLine;
+} NimbleServerTaggedAllocator;
+
+/// Forwards allocations and frees to the parent allocator and counts the live octets for a tag.
+/// Each allocation is prefixed with a small header that holds the octet count, so it can be subtracted on free.
+typedef struct NimbleServerTaggedAllocatorWithFree {
+    ImprintAllocatorWithFree info;
+    ImprintAllocatorWithFree* parent;
+    NimbleServerMemoryTagCounter* counter;
+} NimbleServerTaggedAllocatorWithFree;
+
+typedef struct NimbleServerMemoryTags {
+    NimbleServerMemoryTagCounter counters[NimbleServerMemoryTagCount];
+    NimbleServerTaggedAllocator fixed[NimbleServerMemoryTagCount];
+    NimbleServerTaggedAllocatorWithFree withFree[NimbleServerMemoryTagCount];
+} NimbleServerMemoryTags;
+
+typedef struct NimbleServerMemoryReportEntry {
+    const char* name;
+    size_t reservedOctetCount;
+    size_t inUseOctetCount;
+} NimbleServerMemoryReportEntry;
+
+typedef struct NimbleServerMemoryReport {
+    NimbleServerMemoryReportEntry entries[NimbleServerMemoryTagCount];
+    size_t reservedOctetCount;
+    size_t inUseOctetCount;
+} NimbleServerMemoryReport;
+
+void nimbleServerMemoryTagsInit(NimbleServerMemoryTags* self, ImprintAllocator* fixedParent,
+                                ImprintAllocator* pageParent, ImprintAllocatorWithFree* withFreeParent);
+ImprintAllocator* nimbleServerMemoryTagsFixed(NimbleServerMemoryTags* self, NimbleServerMemoryTag tag);
+ImprintAllocatorWithFree* nimbleServerMemoryTagsWithFree(NimbleServerMemoryTags* self, NimbleServerMemoryTag tag);
+const char* nimbleServerMemoryTagToString(NimbleServerMemoryTag tag);
+
+void nimbleServerMemoryReport(const struct NimbleServer* self, NimbleServerMemoryReport* report);
+void nimbleServerMemoryReportDebugOutput(const NimbleServerMemoryReport* self, Clog* log);
+
+#endif
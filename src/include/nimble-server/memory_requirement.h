@@ -0,0 +1,18 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_MEMORY_REQUIREMENT_H
+#define NIMBLE_SERVER_MEMORY_REQUIREMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT (64)
+
+size_t nimbleServerAlignToCacheLine(size_t octetCount);
+uint8_t* nimbleServerAlignPointerToCacheLine(uint8_t* memory);
+size_t nimbleServerStepsCalculateMemoryRequirement(size_t maxCombinedStepOctetCount);
+
+#endif
@@ -11,7 +11,7 @@
 #include <stdlib.h>
 
 struct NimbleServerLocalParty;
-struct ImprintAllocator;
+struct NimbleServerStepsPool;
 struct FldInStream;
 
 typedef enum NimbleServerParticipantState {
@@ -26,7 +26,8 @@ typedef struct NimbleServerParticipant {
     size_t localIndex;
     uint8_t id;
     bool isUsed;
-    NbsSteps steps;
+    NbsSteps* steps;
+    struct NimbleServerStepsPool* stepsPool;
 
     struct NimbleServerLocalParty* inParty;
     NimbleServerParticipantState state;
@@ -36,13 +37,12 @@ typedef struct NimbleServerParticipant {
 
 typedef struct NimbleServerParticipantSetup {
     uint8_t id;
-    struct ImprintAllocator* connectionAllocator;
-    size_t maxStepOctetSizeForOneParticipant;
+    struct NimbleServerStepsPool* stepsPool;
     Clog log;
 } NimbleServerParticipantSetup;
 
 void nimbleServerParticipantInit(NimbleServerParticipant* self, NimbleServerParticipantSetup setup);
-void nimbleServerParticipantReInit(NimbleServerParticipant* self, struct NimbleServerLocalParty* party, StepId stepId);
+int nimbleServerParticipantReInit(NimbleServerParticipant* self, struct NimbleServerLocalParty* party, StepId stepId);
 void nimbleServerParticipantDestroy(NimbleServerParticipant* self);
 void nimbleServerParticipantMarkAsLeaving(NimbleServerParticipant* self);
 int nimbleServerParticipantDeserializeSingleStep(NimbleServerParticipant* self, StepId stepId,
@@ -9,6 +9,7 @@
 #include <clog/clog.h>
 #include <nimble-serialize/types.h>
 #include <nimble-server/circular_buffer.h>
+#include <nimble-server/steps_pool.h>
 #include <nimble-steps/types.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -23,6 +24,9 @@ typedef struct NimbleServerParticipants {
     size_t participantCapacity;
     size_t participantCount;
     NimbleServerCircularBuffer freeList;
+    NimbleServerStepsPool stepsPool;
+    uint64_t forcedStepCount;   ///< participant steps that were not provided in time, since (re)init
+    uint64_t providedStepCount; ///< participant steps that were provided in time, since (re)init
     Clog log;
     char debugPrefix[32];
 } NimbleServerParticipants;
@@ -31,8 +35,13 @@ typedef struct NimbleServerParticipantJoinInfo {
     uint8_t localIndex;
 } NimbleServerParticipantJoinInfo;
 
-void nimbleServerParticipantsInit(NimbleServerParticipants* self, struct ImprintAllocator* allocator, size_t maxCount,
-                                  size_t maxStepOctetSize, Clog* log);
+void nimbleServerParticipantsInit(NimbleServerParticipants* self, struct ImprintAllocator* allocator,
+                                  struct ImprintAllocator* stepsAllocator, size_t maxCount, size_t maxStepOctetSize,
+                                  size_t stepsPoolCapacity, Clog* log);
+void nimbleServerParticipantsReInit(NimbleServerParticipants* self);
+size_t nimbleServerParticipantsCalculateMemoryRequirement(size_t maxCount, size_t maxStepOctetSize,
+                                                          size_t stepsPoolCapacity);
+void nimbleServerParticipantsDebugOutputMemory(const NimbleServerParticipants* self);
 int nimbleServerParticipantsJoin(NimbleServerParticipants* self, const NimbleSerializeJoinGameRequestPlayer* joinInfo,
                                  size_t localParticipantCount, struct NimbleServerLocalParty* party, StepId stepId,
                                  struct NimbleServerParticipant** results);
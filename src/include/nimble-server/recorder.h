@@ -0,0 +1,77 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_RECORDER_H
+#define NIMBLE_SERVER_RECORDER_H
+
+#include <datagram-transport/transport.h>
+#include <monotonic-time/monotonic_time.h>
+#include <nimble-serialize/types.h>
+#include <nimble-steps/steps.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct NimbleServer;
+struct NimbleServerResponse;
+struct NimbleServerSerializedGameState;
+struct NimbleServerValidatedStep;
+
+#define NIMBLE_SERVER_RECORDING_MAGIC (0x4E535231)
+#define NIMBLE_SERVER_RECORDING_FORMAT_VERSION (7)
+
+/// Each record starts with the type octet. All values are big endian, as written by flood.
+typedef enum NimbleServerRecordType {
+    NimbleServerRecordTypeFeed = 1,               ///< direct nimbleServerFeed(): transportIndex (u8), octetCount (u16), octets
+    NimbleServerRecordTypeUpdate,                 ///< now (u64)
+    NimbleServerRecordTypeConnectionConnected,    ///< transportIndex (u8)
+    NimbleServerRecordTypeConnectionDisconnected, ///< transportIndex (u8)
+    NimbleServerRecordTypeReInitWithGame,         ///< stepId (u32), now (u64)
+    NimbleServerRecordTypeHostMigration,          ///< partyCount (u8), for each party: count (u8) and the ids (u8)
+    NimbleServerRecordTypeSerializedGameState,    ///< stepId (u32), hash (u64), octetCount (u32), octets
+    NimbleServerRecordTypeSecret,                 ///< secret (u64)
+    NimbleServerRecordTypeOutput,                 ///< transportIndex (u8), octetCount (u16), hash of octets (u64)
+    NimbleServerRecordTypeReceive,                ///< read from the multi transport, same layout as Feed
+    NimbleServerRecordTypeValidatedSteps,         ///< stepCount (u16), each: rejected (u8), octetCount (u8), octets
+} NimbleServerRecordType;
+
+/// Receives the recorded octets, e.g. to append them to a file. Called with small chunks, a record can be split
+/// into more than one call.
+typedef int (*NimbleServerRecorderWriteFn)(void* self, const uint8_t* octets, size_t octetCount);
+
+/// Records everything that affects a server: the datagrams fed to it, the update calls with their time, the
+/// results from the callbacks and the secrets it generates. The datagrams it sends are recorded as hashes, so a
+/// replay can verify that it produced the same output.
+typedef struct NimbleServerRecorder {
+    NimbleServerRecorderWriteFn write;
+    void* writeSelf;
+    DatagramTransportOut recordingTransportOut;
+    struct DatagramTransportOut* feedTransportOut;
+    uint8_t feedTransportIndex;
+    uint64_t recordCount;
+    uint64_t octetCount;
+    int writeError;
+} NimbleServerRecorder;
+
+int nimbleServerRecorderInit(NimbleServerRecorder* self, struct NimbleServer* server, NimbleServerRecorderWriteFn write,
+                             void* writeSelf);
+uint64_t nimbleServerRecordingHash(const uint8_t* octets, size_t octetCount);
+
+void nimbleServerRecorderFeed(NimbleServerRecorder* self, NimbleServerRecordType type, uint8_t transportIndex,
+                              const uint8_t* data, size_t octetCount, struct NimbleServerResponse* response,
+                              struct NimbleServerResponse* recordingResponse);
+void nimbleServerRecorderUpdate(NimbleServerRecorder* self, MonotonicTimeMs now);
+void nimbleServerRecorderConnection(NimbleServerRecorder* self, NimbleServerRecordType type, uint8_t transportIndex);
+void nimbleServerRecorderReInitWithGame(NimbleServerRecorder* self, StepId stepId, MonotonicTimeMs now);
+void nimbleServerRecorderHostMigration(NimbleServerRecorder* self, const NimbleSerializeLocalPartyInfo* localPartyInfos,
+                                       size_t localPartyCount);
+void nimbleServerRecorderSerializedGameState(NimbleServerRecorder* self,
+                                             const struct NimbleServerSerializedGameState* state);
+void nimbleServerRecorderSecret(NimbleServerRecorder* self, uint64_t secret);
+void nimbleServerRecorderValidatedSteps(NimbleServerRecorder* self, const struct NimbleServerValidatedStep* steps,
+                                        size_t stepCount);
+void nimbleServerRecorderOutput(NimbleServerRecorder* self, uint8_t transportIndex, const uint8_t* data,
+                                size_t octetCount);
+
+#endif
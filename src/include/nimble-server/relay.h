@@ -0,0 +1,161 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_RELAY_H
+#define NIMBLE_SERVER_RELAY_H
+
+#include <clog/clog.h>
+#include <datagram-transport/multi.h>
+#include <monotonic-time/monotonic_time.h>
+#include <nimble-server/server.h>
+#include <nimble-steps/steps.h>
+#include <ordered-datagram/in_logic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+#define NIMBLE_SERVER_RELAY_MAX_LINK_COUNT (8)
+#define NIMBLE_SERVER_RELAY_MAX_TUNNEL_COUNT (32)
+#define NIMBLE_SERVER_RELAY_DEFAULT_REDUNDANCY_STEP_COUNT (8)
+#define NIMBLE_SERVER_RELAY_SNAPSHOT_CHUNKS_PER_UPDATE (8)
+#define NIMBLE_SERVER_RELAY_IDLE_TIMEOUT_MS (5000)
+
+/// The frames that are sent over the link between an upstream server and an edge relay.
+/// Every link datagram starts with the frame type as an octet.
+typedef enum NimbleServerRelayFrameType {
+    NimbleServerRelayFrameTypeAck = 1,          ///< edge to upstream: which step and snapshot octet the edge waits for
+    NimbleServerRelayFrameTypeTunnel,           ///< both directions: a datagram to or from a client of the edge
+    NimbleServerRelayFrameTypeSteps,            ///< upstream to edge: a range of authoritative steps
+    NimbleServerRelayFrameTypeSnapshotChunk,    ///< upstream to edge: a part of the serialized game state
+    NimbleServerRelayFrameTypeTunnelClosed,     ///< both directions: a tunneled client has disconnected or expired
+} NimbleServerRelayFrameType;
+
+typedef struct NimbleServerRelaySnapshotTransfer {
+    bool isActive;
+    StepId stepId;
+    size_t ackedOctetCount;
+    size_t sentOctetCount;
+} NimbleServerRelaySnapshotTransfer;
+
+/// An edge relay, as seen from the upstream server
+typedef struct NimbleServerRelayLink {
+    bool isUsed;
+    bool hasStarted; ///< the edge has told us which step it is waiting for
+    int connectionId;
+    StepId waitingForStepId;
+    StepId pushedUpToStepId;
+    NimbleServerRelaySnapshotTransfer snapshot;
+    MonotonicTimeMs lastReceivedAtMs;
+} NimbleServerRelayLink;
+
+/// A client of an edge relay that has joined with participants, and is served by the upstream server.
+/// It uses a transport connection index on the upstream server that the normal transport never uses.
+typedef struct NimbleServerRelayUpstreamTunnel {
+    bool isUsed;
+    size_t linkIndex;
+    uint8_t clientConnectionId;
+    uint8_t transportIndex;
+    MonotonicTimeMs lastReceivedAtMs;
+} NimbleServerRelayUpstreamTunnel;
+
+typedef struct NimbleServerRelayUpstreamStats {
+    uint64_t stepsDatagramCount;
+    uint64_t stepsOctetCount;
+    uint64_t snapshotChunkCount;
+    uint64_t tunnelDatagramCount;
+    uint64_t closedTunnelCount;
+    uint64_t expiredLinkCount;
+} NimbleServerRelayUpstreamStats;
+
+typedef struct NimbleServerRelayUpstreamSetup {
+    NimbleServer* server;
+    DatagramTransportMulti linkTransport; ///< the edges connect to the upstream server over this transport
+    struct ImprintAllocator* allocator;
+    uint8_t firstTunnelTransportIndex; ///< the transport connection indices from here are reserved for tunnels
+    size_t tunnelCount;
+    size_t redundancyStepCount; ///< zero uses the default
+    Clog log;
+} NimbleServerRelayUpstreamSetup;
+
+/// Serves the authoritative steps and game state snapshots of an upstream server to edge relays.
+/// Each edge is a single link, no matter how many clients it serves.
+typedef struct NimbleServerRelayUpstream {
+    NimbleServer* server;
+    DatagramTransportMulti linkTransport;
+    NimbleServerRelayLink links[NIMBLE_SERVER_RELAY_MAX_LINK_COUNT];
+    NimbleServerRelayUpstreamTunnel tunnels[NIMBLE_SERVER_RELAY_MAX_TUNNEL_COUNT];
+    uint8_t firstTunnelTransportIndex;
+    size_t tunnelCount;
+    size_t redundancyStepCount;
+    MonotonicTimeMs composedAtMs[NBS_WINDOW_SIZE]; ///< when each step in the window was seen the first time
+    StepId seenUpToStepId;
+    uint8_t* snapshotOctets;
+    size_t snapshotOctetCount;
+    size_t snapshotCapacity;
+    StepId snapshotStepId;
+    NimbleServerRelayUpstreamStats stats;
+    Clog log;
+} NimbleServerRelayUpstream;
+
+int nimbleServerRelayUpstreamInit(NimbleServerRelayUpstream* self, NimbleServerRelayUpstreamSetup setup);
+int nimbleServerRelayUpstreamUpdate(NimbleServerRelayUpstream* self);
+int nimbleServerRelayUpstreamLinkDisconnected(NimbleServerRelayUpstream* self, int connectionId);
+
+/// Local connection on the edge that has been handed over to the upstream server
+typedef struct NimbleServerRelayTunnel {
+    bool isTunneled;
+    OrderedDatagramInLogic fromUpstream;
+} NimbleServerRelayTunnel;
+
+typedef struct NimbleServerRelayStats {
+    uint64_t receivedStepCount;
+    uint64_t restartCount;
+    uint64_t tunnelDatagramCount;
+    uint64_t closedTunnelCount;
+    uint64_t hopLatencySampleCount;
+    uint64_t hopLatencyTotalMs;
+    uint64_t hopLatencyMaxMs;
+} NimbleServerRelayStats;
+
+typedef struct NimbleServerRelaySetup {
+    DatagramTransportMulti upstreamTransport; ///< the link to the upstream server
+    int upstreamConnectionId;
+    bool useSnapshots; ///< the upstream server provides game states, so the edge can serve downloads
+    struct ImprintAllocator* allocator;
+    Clog log;
+} NimbleServerRelaySetup;
+
+/// An edge server that fans out the authoritative steps of an upstream server.
+/// The edge connects to the upstream as a single link, and serves the steps and the latest snapshot to its own
+/// spectators. Clients that join with participants are tunneled to the upstream server, since only the
+/// upstream server can compose authoritative steps.
+typedef struct NimbleServerRelay {
+    NimbleServer edge;
+    DatagramTransportMulti localTransport;
+    DatagramTransportMulti upstreamTransport;
+    int upstreamConnectionId;
+    bool useSnapshots;
+    bool hasStarted;
+    NimbleServerRelayTunnel tunnels[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    NimbleServerCallbackObjectVtbl callbackVtbl;
+    uint8_t* snapshotOctets; ///< the snapshot that is served to the local clients
+    size_t snapshotOctetCount;
+    StepId snapshotStepId;
+    bool hasSnapshot;
+    uint8_t* receivingSnapshotOctets;
+    size_t receivingSnapshotOctetCount;
+    StepId receivingSnapshotStepId;
+    size_t snapshotCapacity;
+    NimbleServerRelayStats stats;
+    Clog log;
+} NimbleServerRelay;
+
+int nimbleServerRelayInit(NimbleServerRelay* self, NimbleServerSetup edgeSetup, NimbleServerRelaySetup setup);
+int nimbleServerRelayUpdate(NimbleServerRelay* self, MonotonicTimeMs now);
+int nimbleServerRelayConnectionDisconnected(NimbleServerRelay* self, uint8_t connectionIndex);
+
+#endif
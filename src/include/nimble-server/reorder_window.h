@@ -0,0 +1,41 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_REORDER_WINDOW_H
+#define NIMBLE_SERVER_REORDER_WINDOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct FldInStream;
+
+/// How far behind the newest received datagram that a late datagram can be, and still be accepted
+#define NIMBLE_SERVER_REORDER_WINDOW_SIZE (64)
+
+typedef enum NimbleServerReorderWindowResult {
+    NimbleServerReorderWindowNewer, ///< newer than all the datagrams received so far
+    NimbleServerReorderWindowLate, ///< older than the newest, but inside the window and not received before
+    NimbleServerReorderWindowDuplicate, ///< has already been received
+    NimbleServerReorderWindowTooOld, ///< further behind the newest than the window
+} NimbleServerReorderWindowResult;
+
+/// Reads the sequence id that OrderedDatagramOutLogic prefixes each datagram with, and remembers which of the
+/// latest NIMBLE_SERVER_REORDER_WINDOW_SIZE sequence ids that have been received. Unlike OrderedDatagramInLogic, a
+/// datagram that arrives after a newer one is not rejected, it is up to the caller to decide if the commands in it
+/// can be applied late.
+typedef struct NimbleServerReorderWindow {
+    uint16_t newestSequenceId;
+    uint64_t receivedMask; ///< bit N is set if newestSequenceId - N has been received
+    bool hasReceivedInitialDatagram;
+    uint64_t lateCount;
+    uint64_t duplicateCount;
+    uint64_t tooOldCount;
+} NimbleServerReorderWindow;
+
+void nimbleServerReorderWindowInit(NimbleServerReorderWindow* self);
+int nimbleServerReorderWindowReceive(NimbleServerReorderWindow* self, struct FldInStream* inStream,
+                                     NimbleServerReorderWindowResult* result);
+
+#endif
@@ -0,0 +1,50 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_REPLAYER_H
+#define NIMBLE_SERVER_REPLAYER_H
+
+#include <clog/clog.h>
+#include <datagram-transport/transport.h>
+#include <flood/in_stream.h>
+#include <nimble-server/server.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct ImprintAllocatorWithFree;
+
+typedef struct NimbleServerReplayerStats {
+    uint64_t recordCount;
+    uint64_t feedCount;
+    uint64_t feedOctetCount;
+    uint64_t updateCount;
+    uint64_t outputCount;
+    uint64_t mismatchCount; ///< outputs, secrets or game states that did not match the recording
+} NimbleServerReplayerStats;
+
+/// Drives a fresh server with the inputs from a recording made by NimbleServerRecorder, and checks that the server
+/// sends the same datagrams. The recording must stay in memory while replaying, the game states are not copied.
+/// The replay runs as fast as possible, the times in the recording are only passed on to the server.
+typedef struct NimbleServerReplayer {
+    NimbleServer server;
+    FldInStream inStream;
+    NimbleServerCallbackObjectVtbl callbackVtbl;
+    DatagramTransportOut checkingTransportOut;
+    uint8_t feedTransportIndex;
+    NimbleServerReplayerStats stats;
+    Clog log;
+} NimbleServerReplayer;
+
+int nimbleServerReplayerInit(NimbleServerReplayer* self, const uint8_t* recording, size_t octetCount,
+                             struct ImprintAllocator* memory, struct ImprintAllocatorWithFree* blobAllocator,
+                             Clog log);
+int nimbleServerReplayerNext(NimbleServerReplayer* self);
+int nimbleServerReplayerRun(NimbleServerReplayer* self);
+bool nimbleServerReplayerIsDone(const NimbleServerReplayer* self);
+uint64_t nimbleServerReplayerSecret(NimbleServerReplayer* self);
+
+#endif
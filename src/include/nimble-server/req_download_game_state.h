@@ -13,9 +13,9 @@ struct ImprintAllocator;
 struct NimbleServerGame;
 struct FldOutStream;
 struct FldInStream;
-struct DatagramTransportOut;
+struct NimbleServerResponse;
 
 int nimbleServerReqDownloadGameState(NimbleServer* self, struct NimbleServerTransportConnection* transportConnection,
-                                     struct FldInStream* inStream, struct DatagramTransportOut* transportOut);
+                                     struct FldInStream* inStream, struct NimbleServerResponse* response);
 
 #endif
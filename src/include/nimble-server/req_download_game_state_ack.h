@@ -6,19 +6,21 @@
 #ifndef NIMBLE_SERVER_REQ_DOWNLOAD_GAME_STATE_ACK_H
 #define NIMBLE_SERVER_REQ_DOWNLOAD_GAME_STATE_ACK_H
 
+#include <monotonic-time/monotonic_time.h>
 #include <stddef.h>
 #include <stdint.h>
 
 struct NimbleServerLocalParty;
 struct NimbleServerTransportConnection;
-struct DatagramTransportOut;
+struct NimbleServerResponse;
 struct FldInStream;
 
 int nimbleServerReqBlobStream(struct NimbleServerGame* game,
                                         struct NimbleServerTransportConnection* transportConnection,
-                                        struct FldInStream* inStream, struct DatagramTransportOut* transportOut);
+                                        struct FldInStream* inStream, struct NimbleServerResponse* response,
+                                        MonotonicTimeMs now);
 
 int nimbleServerSendBlobStream(struct NimbleServerTransportConnection* transportConnection,
-                               struct DatagramTransportOut* transportOut);
+                               struct NimbleServerResponse* response, MonotonicTimeMs now);
 
 #endif
@@ -13,6 +13,7 @@
 struct NimbleServerGame;
 struct NimbleServerLocalParty;
 struct NimbleServerLocalParties;
+struct NimbleServerSpectators;
 struct NimbleServerTransportConnection;
 struct FldOutStream;
 struct FldInStream;
@@ -20,5 +21,8 @@ struct FldInStream;
 int nimbleServerReqGameStep(struct NimbleServerGame* game, struct NimbleServerTransportConnection* transportConnection,
                             StatsIntPerSecond* authoritativeStepsPerSecondStat, struct FldInStream* inStream,
                             struct FldOutStream* response);
+int nimbleServerReqSpectatorStep(struct NimbleServerGame* game, struct NimbleServerSpectators* spectators,
+                                 struct NimbleServerTransportConnection* transportConnection,
+                                 struct FldInStream* inStream, struct FldOutStream* response);
 
 #endif
@@ -8,10 +8,13 @@
 
 #include <clog/clog.h>
 #include <datagram-transport/multi.h>
+#include <imprint/linear_allocator.h>
 #include <nimble-serialize/version.h>
 #include <nimble-server/game.h>
 #include <nimble-server/local_parties.h>
+#include <nimble-server/memory_report.h>
 #include <nimble-server/serialized_game_state.h>
+#include <nimble-server/spectators.h>
 #include <nimble-server/transport_connection.h>
 #include <nimble-server/update_quality.h>
 #include <nimble-steps/steps.h>
@@ -21,14 +24,31 @@
 
 struct ImprintAllocatorWithFree;
 struct ImprintAllocator;
+struct NimbleServerDatagramRunOut;
 struct NimbleServerParticipant;
+struct NimbleServerRecorder;
+struct NimbleServerReplayer;
 
 #define NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS 64
 
 typedef void (*NimbleServerSerializeStateFn)(void* self, NimbleServerSerializedGameState* state);
+typedef void (*NimbleServerAuthoritativeStepsComposedFn)(void* self, const NbsSteps* authoritativeSteps,
+                                                         StepId firstStepId, size_t stepCount);
 
+/// authoritativeStepsComposedFn is optional. It is called once every nimbleServerUpdate() with all the authoritative
+/// steps that were composed since the previous call, so the application can advance a headless simulation on the
+/// server. The steps are read from authoritativeSteps with nbsStepsGetIndexForStep() and nbsStepsReadAtIndex().
+/// A server that simulates always has a fresh game state, so composing never waits for a game state.
+/// predictedStepsValidateFn is optional. It is called once for each datagram with predicted steps, with all the new
+/// steps in it, before they are inserted into the steps buffers. It can rewrite the octets of a step in place or
+/// reject it.
+/// forcedStepCreateFn is only used with NimbleServerForcedStepPolicyCallback. It creates the payload for a participant
+/// that did not provide a step in time.
 typedef struct NimbleServerCallbackObjectVtbl {
     NimbleServerSerializeStateFn authoritativeStateSerializeFn;
+    NimbleServerAuthoritativeStepsComposedFn authoritativeStepsComposedFn;
+    NimbleServerValidatePredictedStepsFn predictedStepsValidateFn;
+    NimbleServerCreateForcedStepFn forcedStepCreateFn;
 } NimbleServerCallbackObjectVtbl;
 
 typedef struct NimbleServerCallbackObject {
@@ -46,17 +66,25 @@ typedef struct NimbleServerSetup {
     size_t maxParticipantCountForEachConnection;
     size_t maxWaitingForReconnectTicks;
     size_t maxGameStateOctetCount;
+    size_t participantStepBudgetOctetCount;
+    size_t historyStepCount; ///< authoritative steps to keep after the authoritative window, zero disables it
+    size_t historyOctetCount; ///< octet capacity for the history
+    size_t maxSpectatorCount; ///< connections that join without participants, zero disables spectators
+    size_t spectatorRedundancyStepCount; ///< already pushed steps that are pushed again, zero uses the default
+    NimbleServerForcedStepPolicy forcedStepPolicy; ///< what to compose for steps that are not provided in time
     NimbleServerCallbackObject callbackObject;
     DatagramTransportMulti multiTransport;
     MonotonicTimeMs now;
     size_t targetTickTimeMs;
+    bool useSingleArena;
     Clog log;
 } NimbleServerSetup;
 
 typedef struct NimbleServer {
-    NimbleServerTransportConnection transportConnections[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    NimbleServerTransportConnection* transportConnections;
     NimbleServerLocalParties localParties;
     NimbleServerGame game;
+    NimbleServerSpectators spectators;
     struct ImprintAllocator* pageAllocator;
     struct ImprintAllocatorWithFree* blobAllocator;
     NimbleSerializeVersion applicationVersion;
@@ -70,13 +98,26 @@ typedef struct NimbleServer {
 
     NimbleServerCircularBuffer freeTransportConnectionList;
     NimbleSerializeSessionSecret sessionSecret;
+
+    struct ImprintAllocator* fixedAllocator;
+    NimbleServerMemoryTags memoryTags;
+    ImprintLinearAllocator arena;
+    uint8_t* arenaMemory;
+    size_t arenaOctetCount;
+
+    MonotonicTimeMs now; ///< from the latest nimbleServerUpdate(), so a session only depends on its inputs
+    StepId stepsComposedCallbackStepId; ///< the first step for the next authoritativeStepsComposedFn call
+    struct NimbleServerRecorder* recorder;
+    struct NimbleServerReplayer* replayer;
 } NimbleServer;
 
 typedef struct NimbleServerResponse {
     struct DatagramTransportOut* transportOut;
+    const struct NimbleServerDatagramRunOut* runOut; ///< optional, for sending blob stream chunks with one call
 } NimbleServerResponse;
 
 int nimbleServerInit(NimbleServer* self, NimbleServerSetup setup);
+size_t nimbleServerCalculateMemoryRequirement(NimbleServerSetup setup);
 int nimbleServerHostMigration(NimbleServer* self,NimbleSerializeLocalPartyInfo localPartyInfos[],
                               size_t localPartyCount);
 int nimbleServerReInitWithGame(NimbleServer* self, StepId stepId, MonotonicTimeMs now);
@@ -84,11 +125,13 @@ void nimbleServerReset(NimbleServer* self);
 int nimbleServerFeed(NimbleServer* self, uint8_t connectionIndex, const uint8_t* data, size_t len,
                      NimbleServerResponse* response);
 int nimbleServerReadFromMultiTransport(NimbleServer* self);
+NimbleServerTransportConnection* nimbleServerPrepareTransportConnection(NimbleServer* self, uint8_t transportIndex);
 int nimbleServerUpdate(NimbleServer* self, MonotonicTimeMs now);
 bool nimbleServerMustProvideGameState(const NimbleServer* self);
 void nimbleServerSetGameState(NimbleServer* self, const uint8_t* gameState, size_t gameStateOctetCount, StepId stepId);
 int nimbleServerConnectionConnected(NimbleServer* self, uint8_t connectionIndex);
 int nimbleServerConnectionDisconnected(NimbleServer* self, uint8_t connectionIndex);
 bool nimbleServerIsErrorExternal(int err);
+uint64_t nimbleServerGenerateSecret(NimbleServer* self);
 
 #endif
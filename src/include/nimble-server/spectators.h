@@ -0,0 +1,82 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SPECTATORS_H
+#define NIMBLE_SERVER_SPECTATORS_H
+
+#include <clog/clog.h>
+#include <datagram-transport/multi.h>
+#include <datagram-transport/types.h>
+#include <nimble-steps/steps.h>
+#include <ordered-datagram/out_logic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct NimbleServerGame;
+struct NimbleServerTransportConnection;
+
+#define NIMBLE_SERVER_SPECTATORS_PAYLOAD_CACHE_COUNT (4)
+#define NIMBLE_SERVER_SPECTATORS_DEFAULT_REDUNDANCY_STEP_COUNT (8)
+#define NIMBLE_SERVER_SPECTATORS_MAX_PAYLOAD_OCTET_COUNT (DATAGRAM_TRANSPORT_MAX_SIZE - 32)
+
+/// A connection that receives the authoritative steps, but does not have any participants.
+/// Spectators are never part of the party and participant bookkeeping, so they do not affect when a step is composed
+/// or when a step is forced.
+typedef struct NimbleServerSpectator {
+    bool isUsed;
+    bool hasAcked; ///< no steps are pushed until the spectator has told us which step it is waiting for
+    int connectionId;
+    StepId waitingForStepId; ///< from the latest ack
+    StepId pushedUpToStepId; ///< the StepId after the latest pushed step
+    struct NimbleServerTransportConnection* transportConnection; ///< can be NULL for spectators added directly
+    OrderedDatagramOutLogic orderedDatagramOutLogic; ///< only used if there is no transport connection
+} NimbleServerSpectator;
+
+/// A serialized step datagram payload (without the ordered datagram header), shared by all spectators that need
+/// the same range
+typedef struct NimbleServerSpectatorsPayload {
+    StepId startStepId;
+    size_t stepCount;
+    size_t octetCount;
+    uint8_t octets[NIMBLE_SERVER_SPECTATORS_MAX_PAYLOAD_OCTET_COUNT];
+} NimbleServerSpectatorsPayload;
+
+typedef struct NimbleServerSpectatorsStats {
+    uint64_t pushDatagramCount;
+    uint64_t pushOctetCount;
+    uint64_t serializeCount;
+} NimbleServerSpectatorsStats;
+
+/// Keeps track of the spectators and pushes the latest authoritative steps to them every update.
+/// Each pushed datagram contains the latest redundancyStepCount steps, so a spectator can lose datagrams
+/// without having to ask for them again. The payload is serialized once for each distinct range, and is reused for
+/// all spectators that need that range.
+typedef struct NimbleServerSpectators {
+    NimbleServerSpectator* spectators;
+    size_t capacity;
+    size_t count;
+    size_t redundancyStepCount;
+    NimbleServerSpectatorsPayload payloads[NIMBLE_SERVER_SPECTATORS_PAYLOAD_CACHE_COUNT];
+    size_t payloadCount;
+    NimbleServerSpectatorsStats stats;
+    Clog log;
+} NimbleServerSpectators;
+
+void nimbleServerSpectatorsInit(NimbleServerSpectators* self, struct ImprintAllocator* allocator, size_t capacity,
+                                size_t redundancyStepCount, Clog log);
+void nimbleServerSpectatorsReInit(NimbleServerSpectators* self);
+int nimbleServerSpectatorsAdd(NimbleServerSpectators* self, int connectionId,
+                              struct NimbleServerTransportConnection* transportConnection,
+                              StepId waitingForStepId);
+void nimbleServerSpectatorsRemove(NimbleServerSpectators* self, NimbleServerSpectator* spectator);
+void nimbleServerSpectatorsAck(NimbleServerSpectators* self, NimbleServerSpectator* spectator,
+                               StepId waitingForStepId);
+int nimbleServerSpectatorsPush(NimbleServerSpectators* self, const struct NimbleServerGame* game,
+                               DatagramTransportMulti* transport);
+size_t nimbleServerSpectatorsCalculateMemoryRequirement(size_t capacity);
+
+#endif
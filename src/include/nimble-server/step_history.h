@@ -0,0 +1,49 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEP_HISTORY_H
+#define NIMBLE_SERVER_STEP_HISTORY_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+typedef struct NimbleServerStepHistoryEntry {
+    uint64_t position; ///< position in the octet ring where the step starts
+    uint16_t octetCount;
+} NimbleServerStepHistoryEntry;
+
+/// Second tier for the authoritative steps that are discarded from the NbsSteps window. Steps are stored with their
+/// exact octet count in an octet ring buffer, so it holds many more steps than the same amount of memory in NbsSteps.
+/// The oldest steps are overwritten when the ring is full. The StepIds are always consecutive.
+typedef struct NimbleServerStepHistory {
+    NimbleServerStepHistoryEntry* entries;
+    size_t entryCapacity;
+    uint8_t* octets;
+    size_t octetCapacity;
+    StepId firstStepId;
+    size_t stepCount;
+    size_t firstEntryIndex;
+    uint64_t writePosition;
+    Clog log;
+} NimbleServerStepHistory;
+
+void nimbleServerStepHistoryInit(NimbleServerStepHistory* self, struct ImprintAllocator* allocator,
+                                 size_t stepCapacity, size_t octetCapacity, Clog log);
+void nimbleServerStepHistoryReInit(NimbleServerStepHistory* self);
+bool nimbleServerStepHistoryIsEnabled(const NimbleServerStepHistory* self);
+int nimbleServerStepHistoryAdd(NimbleServerStepHistory* self, StepId stepId, const uint8_t* octets,
+                               size_t octetCount);
+bool nimbleServerStepHistoryHasStep(const NimbleServerStepHistory* self, StepId stepId);
+int nimbleServerStepHistoryRead(const NimbleServerStepHistory* self, StepId stepId, uint8_t* target,
+                                size_t maxOctetCount);
+size_t nimbleServerStepHistoryOctetCountFrom(const NimbleServerStepHistory* self, StepId stepId);
+size_t nimbleServerStepHistoryCalculateMemoryRequirement(size_t stepCapacity, size_t octetCapacity);
+
+#endif
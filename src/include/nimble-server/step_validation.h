@@ -0,0 +1,65 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEP_VALIDATION_H
+#define NIMBLE_SERVER_STEP_VALIDATION_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct NimbleServerRecorder;
+
+#define NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT (128)
+
+/// A new predicted step, before it is inserted into the steps buffer of the participant.
+/// The octets can be rewritten in place, up to maxOctetCount.
+typedef struct NimbleServerValidatedStep {
+    uint8_t participantId;
+    StepId stepId;
+    uint8_t* octets;
+    size_t octetCount;
+    size_t maxOctetCount;
+    bool isRejected; ///< a rejected step is inserted without octets, so the participant does not get a gap
+} NimbleServerValidatedStep;
+
+typedef void (*NimbleServerValidatePredictedStepsFn)(void* self, NimbleServerValidatedStep* steps, size_t stepCount);
+
+typedef struct NimbleServerStepValidationStats {
+    uint64_t batchCount;
+    uint64_t validatedStepCount;
+    uint64_t rejectedStepCount;
+} NimbleServerStepValidationStats;
+
+/// Collects the new predicted steps from a datagram into one batch, so the validator is called once for all of them
+/// instead of once for every step. Old (redundant) steps that are already in the steps buffers are not included.
+typedef struct NimbleServerStepValidation {
+    NimbleServerValidatePredictedStepsFn validateFn;
+    void* validateSelf;
+    NimbleServerValidatedStep* steps;
+    size_t stepCount;
+    uint8_t* octets;
+    size_t maxStepOctetCount;
+    NbsSteps readSteps; ///< each predicted step is read into this, before it is copied to the batch
+    struct NimbleServerRecorder* recorder; ///< records the result of every validation, set by nimbleServerRecorderInit
+    NimbleServerStepValidationStats stats;
+    Clog log;
+} NimbleServerStepValidation;
+
+void nimbleServerStepValidationInit(NimbleServerStepValidation* self, struct ImprintAllocator* allocator,
+                                    size_t maxStepOctetCount, NimbleServerValidatePredictedStepsFn validateFn,
+                                    void* validateSelf, Clog log);
+bool nimbleServerStepValidationIsEnabled(const NimbleServerStepValidation* self);
+bool nimbleServerStepValidationIsFull(const NimbleServerStepValidation* self);
+NimbleServerValidatedStep* nimbleServerStepValidationAdd(NimbleServerStepValidation* self, uint8_t participantId,
+                                                         StepId stepId);
+void nimbleServerStepValidationValidate(NimbleServerStepValidation* self);
+void nimbleServerStepValidationClear(NimbleServerStepValidation* self);
+size_t nimbleServerStepValidationCalculateMemoryRequirement(size_t maxStepOctetCount);
+
+#endif
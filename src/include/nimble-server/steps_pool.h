@@ -0,0 +1,36 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEPS_POOL_H
+#define NIMBLE_SERVER_STEPS_POOL_H
+
+#include <clog/clog.h>
+#include <nimble-server/circular_buffer.h>
+#include <nimble-steps/steps.h>
+#include <stddef.h>
+
+struct ImprintAllocator;
+
+/// A fixed number of participant step buffers that are shared between all participant slots.
+/// A buffer is acquired when a participant joins and released when the participant is destroyed.
+typedef struct NimbleServerStepsPool {
+    NbsSteps* entries;
+    size_t capacity;
+    size_t usedCount;
+    size_t maxStepOctetCount;
+    NimbleServerCircularBuffer freeList;
+    Clog log;
+} NimbleServerStepsPool;
+
+void nimbleServerStepsPoolInit(NimbleServerStepsPool* self, struct ImprintAllocator* allocator, size_t capacity,
+                               size_t maxStepOctetCount, Clog log);
+NbsSteps* nimbleServerStepsPoolAcquire(NimbleServerStepsPool* self);
+void nimbleServerStepsPoolRelease(NimbleServerStepsPool* self, NbsSteps* steps);
+size_t nimbleServerStepsPoolCapacityFromBudget(size_t stepBudgetOctetCount, size_t maxStepOctetCount,
+                                               size_t maxParticipantCount);
+size_t nimbleServerStepsPoolCalculateMemoryRequirement(size_t capacity, size_t maxStepOctetCount);
+size_t nimbleServerStepsPoolOctetCountPerEntry(const NimbleServerStepsPool* self);
+
+#endif
@@ -12,11 +12,12 @@
 #include <imprint/tagged_allocator.h>
 #include <nimble-serialize/serialize.h>
 #include <nimble-serialize/version.h>
+#include <nimble-server/datagram_run.h>
 #include <nimble-server/game.h>
 #include <nimble-server/local_parties.h>
 #include <nimble-server/participants.h>
+#include <nimble-server/reorder_window.h>
 #include <nimble-steps/steps.h>
-#include <ordered-datagram/in_logic.h>
 #include <ordered-datagram/out_logic.h>
 #include <stats/stats.h>
 #include <stdarg.h>
@@ -24,6 +25,7 @@
 #include <stdint.h>
 
 struct FldOutStream;
+struct NimbleServerSpectator;
 
 typedef enum NimbleServerTransportConnectionPhase {
     NbTransportConnectionPhaseIdle,
@@ -33,34 +35,56 @@ typedef enum NimbleServerTransportConnectionPhase {
     NbTransportConnectionPhaseDisconnected
 } NimbleServerTransportConnectionPhase;
 
+/// Blob transfer state for a transport connection.
+/// Only allocated when the client starts to download the game state, and freed when the connection disconnects.
+typedef struct NimbleServerTransportConnectionDownload {
+    BlobStreamOut blobStreamOut;
+    BlobStreamLogicOut blobStreamLogicOut;
+    bool hasBlobStream; ///< blobStreamOut holds allocations from the blob stream allocator
+    NimbleServerGameState gameState;
+    NimbleServerDatagramRun chunkRun; ///< the blob stream chunks that are sent together, written back to back
+} NimbleServerTransportConnectionDownload;
+
+/// Diagnostics for a transport connection that are not needed for every datagram.
+/// Stored out of line, so they do not take up space in the transport connection array.
+typedef struct NimbleServerTransportConnectionDiagnostics {
+    Clog log;
+    StatsInt stepsBehindStats;
+    size_t debugCounter;
+} NimbleServerTransportConnectionDiagnostics;
+
+/// The fields that are touched for every datagram are placed first, so they share the same cache line.
 typedef struct NimbleServerTransportConnection {
+    bool isUsed;
     uint8_t id;
     uint8_t transportConnectionId;
     uint8_t transportIndex;
-    NimbleSerializeClientRequestId connectedFromConnectRequestId;
-    uint64_t secret;
+    uint8_t noRangesToSendCounter;
+    bool useDebugStreams;
+    NimbleServerTransportConnectionPhase phase;
     struct NimbleServerLocalParty* assignedParty;
-    OrderedDatagramInLogic orderedDatagramInLogic;
+    struct NimbleServerSpectator* spectator; ///< set if the connection joined without participants
+    NimbleServerReorderWindow reorderWindow; ///< step datagrams are accepted out of order, see nimbleServerFeed()
     OrderedDatagramOutLogic orderedDatagramOutLogic;
 
-    BlobStreamOut blobStreamOut;
-    BlobStreamLogicOut blobStreamLogicOut;
+    NimbleSerializeClientRequestId connectedFromConnectRequestId;
+    bool isIdFromFreeList; ///< the id was taken from the free list by a connect request, and is returned on disconnect
+    uint64_t secret;
+    NimbleServerTransportConnectionDiagnostics* diagnostics;
+
+    NimbleServerTransportConnectionDownload* download;
     BlobStreamTransferId nextBlobStreamOutChannel;
     uint8_t blobStreamOutClientRequestId;
     ImprintAllocatorWithFree* blobStreamOutAllocator;
-    StatsInt stepsBehindStats;
-    size_t debugCounter;
-    Clog log;
-    bool isUsed;
-    bool useDebugStreams;
-    uint8_t noRangesToSendCounter;
-    NimbleServerTransportConnectionPhase phase;
-    NimbleServerGameState gameState;
+    ImprintAllocatorWithFree* gameStateAllocator;
+    size_t maxGameStateOctetCount;
 } NimbleServerTransportConnection;
 
-void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* blobStreamAllocator,
-                             size_t maxGameOctetSize, Clog log);
+void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* gameStateAllocator,
+                             ImprintAllocatorWithFree* blobStreamAllocator, size_t maxGameOctetSize, Clog log);
 void transportConnectionDisconnect(NimbleServerTransportConnection* self);
+int transportConnectionStartDownload(NimbleServerTransportConnection* self);
+void transportConnectionDestroyBlobStream(NimbleServerTransportConnection* self);
 void transportConnectionSetGameStateTickId(NimbleServerTransportConnection* self);
 int transportConnectionWriteHeader(NimbleServerTransportConnection* self, struct FldOutStream* outStream);
 void transportConnectionCommitHeader(NimbleServerTransportConnection* self);
@@ -6,6 +6,7 @@
 #include "authoritative_steps.h"
 #include <flood/in_stream.h>
 #include <nimble-serialize/server_out.h>
+#include <nimble-server/forced_step.h>
 #include <nimble-server/local_parties.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/participant.h>
@@ -17,13 +18,17 @@
 
 /// Composes one authoritative steps from the collection of participants.
 /// @param participants all the participants to combine steps from .
+/// @param forcedSteps how to compose steps that participants did not provide in time
 /// @param lookingFor the stepId to compose
 /// @param composeStepBuffer the buffer to use for composing.
 /// @param maxLength maximum size of the composeStepBuffer
 /// @return the number of octets written or negative on error
-static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participants, StepId lookingFor,
+static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participants,
+                                           NimbleServerForcedSteps* forcedSteps, StepId lookingFor,
                                            uint8_t* composeStepBuffer, size_t maxLength)
 {
+    bool useForcedStepPolicy = nimbleServerForcedStepsIsEnabled(forcedSteps);
+
     FldOutStream composeStream;
     fldOutStreamInit(&composeStream, composeStepBuffer, maxLength);
     fldOutStreamWriteUInt8(&composeStream, (uint8_t) participants->participantCount);
@@ -37,16 +42,21 @@ static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participant
             continue;
         }
         CLOG_EXECUTE(foundParticipantCount++;)
-        NbsSteps* steps = &participant->steps;
+        NbsSteps* steps = participant->steps;
 
         uint8_t mask = 0x00;
         NimbleSerializeStepType stepType = NimbleSerializeStepTypeNormal;
 
+        if (useForcedStepPolicy && participant->state == NimbleServerParticipantStateJustJoined) {
+            nimbleServerForcedStepsReset(forcedSteps, i);
+        }
+
         uint8_t readStepOctetCountToUse = 0;
         {
             int readStepOctetCount = nbsStepsReadExactStepId(steps, lookingFor, stepReadBuffer, 1024);
             if (readStepOctetCount < 0) {
                 if (readStepOctetCount == NimbleStepErrCollectionIsEmpty) {
+                    participants->forcedStepCount++;
                     nimbleServerConnectionQualityAddedForcedSteps(&participant->inParty->quality, 1);
                     CLOG_C_VERBOSE(&participant->log,
                                    "no steps stored (party: %u). server is looking for %08X. using a forced step",
@@ -57,7 +67,11 @@ static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participant
                     CLOG_C_ERROR(&participant->log, "steps for participant is corrupt. error %d", readStepOctetCount)
                 }
             } else {
+                participants->providedStepCount++;
                 nimbleServerConnectionQualityProvidedUsableStep(&participant->inParty->quality);
+                if (useForcedStepPolicy) {
+                    nimbleServerForcedStepsReceived(forcedSteps, i, stepReadBuffer, (size_t) readStepOctetCount);
+                }
             }
             readStepOctetCountToUse = tc_convert_uint8_t_from_ssize(readStepOctetCount);
         }
@@ -83,6 +97,15 @@ static ssize_t composeOneAuthoritativeStep(NimbleServerParticipants* participant
                 break;
         }
 
+        if (stepType == NimbleSerializeStepTypeStepNotProvidedInTime && useForcedStepPolicy) {
+            int forcedOctetCount = nimbleServerForcedStepsCreate(forcedSteps, i, participant->id, lookingFor,
+                                                                 stepReadBuffer, sizeof(stepReadBuffer));
+            if (forcedOctetCount >= 0) {
+                stepType = NimbleSerializeStepTypeNormal;
+                readStepOctetCountToUse = (uint8_t) forcedOctetCount;
+            }
+        }
+
         if (stepType != NimbleSerializeStepTypeNormal) {
             mask = 0x80;
         }
@@ -133,8 +156,8 @@ static size_t maxPredictedStepContributionForParticipants(NimbleServerParticipan
             continue;
         }
         size_t participantCanAdvanceStepCount = 0;
-        if (participant->steps.stepsCount > 0u && participant->steps.expectedWriteId > lookingFor) {
-            participantCanAdvanceStepCount = (size_t) (participant->steps.expectedWriteId - lookingFor + 1u);
+        if (participant->steps->stepsCount > 0u && participant->steps->expectedWriteId > lookingFor) {
+            participantCanAdvanceStepCount = (size_t) (participant->steps->expectedWriteId - lookingFor + 1u);
         } else {
             participantCountThatCanNotContribute++;
         }
@@ -177,10 +200,34 @@ static bool canAdvanceDueToDistanceFromLastState(NbsSteps* authoritativeSteps)
     return allowed;
 }
 
-static bool shouldAdvanceAuthoritative(NimbleServerParticipants* participants, NbsSteps* authoritativeSteps)
+static bool shouldAdvanceAuthoritative(NimbleServerParticipants* participants, NbsSteps* authoritativeSteps,
+                                       bool isSimulatedOnServer)
 {
     return shouldComposeNewAuthoritativeStep(participants, authoritativeSteps->expectedWriteId) &&
-           canAdvanceDueToDistanceFromLastState(authoritativeSteps);
+           (isSimulatedOnServer || canAdvanceDueToDistanceFromLastState(authoritativeSteps));
+}
+
+/// Discards the oldest authoritative steps, so the window never holds more than a third of NBS_WINDOW_SIZE
+/// @param foundGame game
+/// @return negative on error
+int nimbleServerDiscardAuthoritativeStepsIfBufferGettingFull(NimbleServerGame* foundGame)
+{
+    size_t authoritativeStepCount = foundGame->authoritativeSteps.stepsCount;
+    size_t maxCapacity = NBS_WINDOW_SIZE / 3;
+
+    if (authoritativeStepCount > maxCapacity) {
+        size_t authoritativeToDrop = authoritativeStepCount - maxCapacity;
+        CLOG_C_VERBOSE(&foundGame->log, "discarding %zu old authoritative steps due to buffer getting full",
+                       authoritativeToDrop)
+        int err = nimbleServerGameDiscardAuthoritativeSteps(foundGame, authoritativeToDrop);
+        if (err < 0) {
+            return err;
+        }
+        CLOG_C_VERBOSE(&foundGame->log, "oldest step after discard is %04X with count %zu",
+                       foundGame->authoritativeSteps.expectedReadId, foundGame->authoritativeSteps.stepsCount)
+    }
+
+    return 0;
 }
 
 /// Compose as many authoritative steps as possible
@@ -195,12 +242,12 @@ int nimbleServerComposeAuthoritativeSteps(NimbleServerGame* game)
     StepId firstLookingFor = authoritativeSteps->expectedWriteId;
 #endif
 
-    while (shouldAdvanceAuthoritative(&game->participants, authoritativeSteps)) {
+    while (shouldAdvanceAuthoritative(&game->participants, authoritativeSteps, game->isSimulatedOnServer)) {
         StepId lookingFor = authoritativeSteps->expectedWriteId;
 
         uint8_t composeStepBuffer[1024];
-        ssize_t authoritativeStepOctetCount = composeOneAuthoritativeStep(&game->participants, lookingFor,
-                                                                          composeStepBuffer, 1024);
+        ssize_t authoritativeStepOctetCount = composeOneAuthoritativeStep(&game->participants, &game->forcedSteps,
+                                                                          lookingFor, composeStepBuffer, 1024);
         if (authoritativeStepOctetCount <= 0) {
             CLOG_C_SOFT_ERROR(&game->log, "authoritative: couldn't compose a authoritative step")
             return 0;
@@ -213,6 +260,11 @@ int nimbleServerComposeAuthoritativeSteps(NimbleServerGame* game)
             return octetsWritten;
         }
 
+        if (game->observer.stepComposedFn != 0) {
+            game->observer.stepComposedFn(game->observer.self, lookingFor, composeStepBuffer,
+                                          (size_t) authoritativeStepOctetCount);
+        }
+
         writtenAuthoritativeSteps++;
     }
 
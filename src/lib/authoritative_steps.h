@@ -14,5 +14,6 @@ struct NimbleServerGame;
 struct NimbleServerParticipants;
 
 int nimbleServerComposeAuthoritativeSteps(struct NimbleServerGame* game);
+int nimbleServerDiscardAuthoritativeStepsIfBufferGettingFull(struct NimbleServerGame* foundGame);
 
 #endif
@@ -0,0 +1,88 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <datagram-transport/transport.h>
+#include <nimble-server/datagram_run.h>
+
+/// Initializes an empty run
+/// @param self run
+void nimbleServerDatagramRunInit(NimbleServerDatagramRun* self)
+{
+    self->datagramCount = 0;
+    self->octetCount = 0;
+}
+
+/// Returns where the next datagram should be written. There is room for DATAGRAM_TRANSPORT_MAX_SIZE octets.
+/// @param self run
+/// @return the target for the next datagram, or NULL if the run is full
+uint8_t* nimbleServerDatagramRunNext(NimbleServerDatagramRun* self)
+{
+    if (self->datagramCount == NIMBLE_SERVER_DATAGRAM_RUN_MAX_COUNT) {
+        return 0;
+    }
+
+    return self->octets + self->octetCount;
+}
+
+/// Adds the datagram that was written to the target from nimbleServerDatagramRunNext()
+/// @param self run
+/// @param octetCount octet count of the datagram, at most DATAGRAM_TRANSPORT_MAX_SIZE
+void nimbleServerDatagramRunCommit(NimbleServerDatagramRun* self, size_t octetCount)
+{
+    self->octetCounts[self->datagramCount++] = octetCount;
+    self->octetCount += octetCount;
+}
+
+/// Sends all the datagrams in the run, and empties it. Consecutive datagrams of the same size, optionally followed by a
+/// shorter one, are sent with one runOut call. Everything else, or everything if runOut is NULL, is sent one datagram
+/// at a time through transportOut.
+/// @param self run
+/// @param transportOut transport for single datagrams
+/// @param runOut transport for runs of datagrams, can be NULL
+/// @return negative on error
+int nimbleServerDatagramRunFlush(NimbleServerDatagramRun* self, DatagramTransportOut* transportOut,
+                                 const NimbleServerDatagramRunOut* runOut)
+{
+    size_t offset = 0;
+    int result = 0;
+
+    for (size_t i = 0; i < self->datagramCount;) {
+        size_t segmentOctetCount = self->octetCounts[i];
+        size_t end = i + 1;
+        size_t runOctetCount = segmentOctetCount;
+        while (end < self->datagramCount && self->octetCounts[end] == segmentOctetCount) {
+            runOctetCount += self->octetCounts[end++];
+        }
+        if (end < self->datagramCount && self->octetCounts[end] < segmentOctetCount) {
+            runOctetCount += self->octetCounts[end++];
+        }
+
+        int err;
+        if (runOut != 0 && end - i > 1) {
+            err = runOut->sendRun(runOut->self, self->octets + offset, runOctetCount, segmentOctetCount);
+        } else {
+            err = 0;
+            size_t datagramOffset = offset;
+            for (size_t j = i; j < end; ++j) {
+                int sendErr = transportOut->send(transportOut->self, self->octets + datagramOffset,
+                                                 self->octetCounts[j]);
+                if (sendErr < 0) {
+                    err = sendErr;
+                }
+                datagramOffset += self->octetCounts[j];
+            }
+        }
+        if (err < 0) {
+            result = err;
+        }
+
+        offset += runOctetCount;
+        i = end;
+    }
+
+    nimbleServerDatagramRunInit(self);
+
+    return result;
+}
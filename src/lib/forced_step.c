@@ -3,68 +3,164 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
-#include <clog/clog.h>
+#include <imprint/allocator.h>
 #include <nimble-server/forced_step.h>
-#include <nimble-server/participant.h>
-#include <nimble-server/participant_connection.h>
-#include <nimble-steps-serialize/out_serialize.h>
+#include <nimble-server/memory_requirement.h>
+#include <tiny-libc/tiny_libc.h>
 
-static NimbleSerializeStepType forcedStateFromConnection(NimbleServerParticipantConnection* connection)
+/// Allocates room for the last received step of each participant slot. The zero policy allocates nothing, since
+/// the forced steps are composed as empty steps.
+/// @param self forced steps
+/// @param allocator allocator for the last received steps
+/// @param policy how to create forced steps
+/// @param participantCapacity maximum number of participants in the game
+/// @param maxStepOctetCount maximum octet count for a single participant step
+/// @param createFn creates the forced step for NimbleServerForcedStepPolicyCallback, otherwise ignored
+/// @param createSelf passed to createFn
+/// @param log target log
+void nimbleServerForcedStepsInit(NimbleServerForcedSteps* self, ImprintAllocator* allocator,
+                                 NimbleServerForcedStepPolicy policy, size_t participantCapacity,
+                                 size_t maxStepOctetCount, NimbleServerCreateForcedStepFn createFn, void* createSelf,
+                                 Clog log)
 {
-    NimbleSerializeStepType state = NimbleSerializeStepTypeStepNotProvidedInTime;
-    if (connection->state == NimbleServerParticipantConnectionStateWaitingForReconnect) {
-        state = NimbleSerializeStepTypeWaitingForReJoin;
+    self->log = log;
+    self->policy = policy;
+    self->createFn = createFn;
+    self->createSelf = createSelf;
+    self->participantCapacity = participantCapacity;
+    self->maxStepOctetCount = maxStepOctetCount;
+    self->participants = 0;
+    self->substitutedStepCount = 0;
+
+    if (policy == NimbleServerForcedStepPolicyCallback && createFn == 0) {
+        CLOG_C_NOTICE(&self->log, "forced step callback policy needs a create function, using empty forced steps")
+        self->policy = NimbleServerForcedStepPolicyZero;
+    }
+
+    if (self->policy == NimbleServerForcedStepPolicyZero) {
+        return;
     }
 
-    return state;
+    self->participants = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerForcedStepsParticipant, participantCapacity);
+    uint8_t* octets = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, participantCapacity * maxStepOctetCount);
+    for (size_t i = 0; i < participantCapacity; ++i) {
+        self->participants[i].lastOctets = &octets[i * maxStepOctetCount];
+        nimbleServerForcedStepsReset(self, i);
+    }
 }
 
-/// Creates a forced step for a participant connection participants.
-/// Forced steps are used for a participant connection that is too much behind
-/// of other participant connections.
-/// @note currently all applications must support a zero octet length step as a zero, "empty" step.
-/// @todo option to copy the last received step and also support application-specific rules for forced steps.
-/// @param connection participant connection
-/// @param forcedStepsBuffer buffer to write forced step to
-/// @param maxCount maximum count of forced step buffer
-/// @return negative on error
-ssize_t nimbleServerCreateForcedStep(NimbleServerParticipantConnection* connection, uint8_t* forcedStepsBuffer,
-                                     size_t maxCount)
+/// Checks if forced steps are created from the last received steps
+/// @param self forced steps
+/// @return true if the policy is not NimbleServerForcedStepPolicyZero
+bool nimbleServerForcedStepsIsEnabled(const NimbleServerForcedSteps* self)
 {
-    NimbleStepsOutSerializeLocalParticipants participants;
+    return self->policy != NimbleServerForcedStepPolicyZero;
+}
 
-    NimbleSerializeStepType state = forcedStateFromConnection(connection);
-    participants.participantCount = connection->participantReferences.participantReferenceCount;
-    for (size_t i = 0; i < participants.participantCount; ++i) {
-        participants.participants[i]
-            .participantId =  connection->participantReferences.participantReferences[i]->id;
-        participants.participants[i].stepType = state;
-        participants.participants[i].payload = 0;
-        participants.participants[i].payloadCount = 0;
+/// Forgets the last received step, e.g. when a new participant is using the slot
+/// @param self forced steps
+/// @param participantIndex index in the participants array
+void nimbleServerForcedStepsReset(NimbleServerForcedSteps* self, size_t participantIndex)
+{
+    NimbleServerForcedStepsParticipant* participant = &self->participants[participantIndex];
+    participant->lastOctetCount = 0;
+    participant->hasLastStep = false;
+    participant->forcedCountInRow = 0;
+}
+
+/// Remembers a step that was provided in time by a participant
+/// @param self forced steps
+/// @param participantIndex index in the participants array
+/// @param octets the predicted step
+/// @param octetCount octet count of the predicted step
+void nimbleServerForcedStepsReceived(NimbleServerForcedSteps* self, size_t participantIndex, const uint8_t* octets,
+                                     size_t octetCount)
+{
+    NimbleServerForcedStepsParticipant* participant = &self->participants[participantIndex];
+    if (octetCount > self->maxStepOctetCount) {
+        octetCount = self->maxStepOctetCount;
     }
-    return nbsStepsOutSerializeStep(&participants, forcedStepsBuffer, maxCount);
+    tc_memcpy_octets(participant->lastOctets, octets, octetCount);
+    participant->lastOctetCount = octetCount;
+    participant->hasLastStep = true;
+    participant->forcedCountInRow = 0;
 }
 
-/// Insert forced steps for a participant connection
-/// @param foundParticipantConnection connection to insert forced step to
-/// @param stepCount number of forced steps to insert
-/// @return negative value on error.
-int nimbleServerInsertForcedSteps(NimbleServerParticipantConnection* foundParticipantConnection, size_t stepCount)
+/// Halves each octet, as a signed value, once for every forced step in a row, so an analog axis moves toward zero
+static void decayOctets(const uint8_t* source, size_t octetCount, size_t forcedCountInRow, uint8_t* target)
 {
-    uint8_t forcedStepsBuffer[64];
-    StepId stepIdToWrite = foundParticipantConnection->steps.expectedWriteId;
-    ssize_t forcedStepOctetCount = nimbleServerCreateForcedStep(foundParticipantConnection, forcedStepsBuffer, 64);
-    if (forcedStepOctetCount < 0) {
-        return (int) forcedStepOctetCount;
+    size_t shift = forcedCountInRow < 8 ? forcedCountInRow : 8;
+    for (size_t i = 0; i < octetCount; ++i) {
+        int value = (int8_t) source[i];
+        target[i] = (uint8_t) (int8_t) (value / (1 << shift));
     }
-    CLOG_VERBOSE("nimbleServer: insert zero input as forced steps (0)")
-    for (size_t i = 0; i < stepCount; ++i) {
-        int errorCode = nbsStepsWrite(&foundParticipantConnection->steps, stepIdToWrite, forcedStepsBuffer,
-                                      (size_t) forcedStepOctetCount);
-        if (errorCode < 0) {
-            return errorCode;
-        }
-        stepIdToWrite++;
+}
+
+/// Creates the payload for a step that the participant did not provide in time
+/// @param self forced steps
+/// @param participantIndex index in the participants array
+/// @param participantId the participant that did not provide the step
+/// @param stepId the StepId that is composed
+/// @param target buffer to write the payload to
+/// @param maxOctetCount size of the target buffer
+/// @return octet count of the payload, negative if an empty StepNotProvidedInTime step should be used
+int nimbleServerForcedStepsCreate(NimbleServerForcedSteps* self, size_t participantIndex, uint8_t participantId,
+                                  StepId stepId, uint8_t* target, size_t maxOctetCount)
+{
+    NimbleServerForcedStepsParticipant* participant = &self->participants[participantIndex];
+    participant->forcedCountInRow++;
+
+    int octetCount = -1;
+    switch (self->policy) {
+        case NimbleServerForcedStepPolicyZero:
+            break;
+        case NimbleServerForcedStepPolicyRepeatLast:
+            if (participant->hasLastStep && participant->lastOctetCount <= maxOctetCount) {
+                tc_memcpy_octets(target, participant->lastOctets, participant->lastOctetCount);
+                octetCount = (int) participant->lastOctetCount;
+            }
+            break;
+        case NimbleServerForcedStepPolicyDecay:
+            if (participant->hasLastStep && participant->lastOctetCount <= maxOctetCount) {
+                decayOctets(participant->lastOctets, participant->lastOctetCount, participant->forcedCountInRow,
+                            target);
+                octetCount = (int) participant->lastOctetCount;
+            }
+            break;
+        case NimbleServerForcedStepPolicyCallback: {
+            size_t maxCreateOctetCount = maxOctetCount < self->maxStepOctetCount ? maxOctetCount
+                                                                                  : self->maxStepOctetCount;
+            octetCount = self->createFn(self->createSelf, participantId, stepId,
+                                        participant->hasLastStep ? participant->lastOctets : 0,
+                                        participant->lastOctetCount, participant->forcedCountInRow, target,
+                                        maxCreateOctetCount);
+            if (octetCount > (int) maxCreateOctetCount) {
+                CLOG_C_SOFT_ERROR(&self->log, "forced step callback wrote %d octets, max is %zu", octetCount,
+                                  maxCreateOctetCount)
+                octetCount = -1;
+            }
+        } break;
+    }
+
+    if (octetCount >= 0) {
+        self->substitutedStepCount++;
+    }
+
+    return octetCount;
+}
+
+/// Calculates the octet count that nimbleServerForcedStepsInit allocates
+/// @param policy how to create forced steps
+/// @param participantCapacity maximum number of participants in the game
+/// @param maxStepOctetCount maximum octet count for a single participant step
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerForcedStepsCalculateMemoryRequirement(NimbleServerForcedStepPolicy policy,
+                                                         size_t participantCapacity, size_t maxStepOctetCount)
+{
+    if (policy == NimbleServerForcedStepPolicyZero) {
+        return 0;
     }
-    return 0;
+
+    return nimbleServerAlignToCacheLine(participantCapacity * sizeof(NimbleServerForcedStepsParticipant)) +
+           nimbleServerAlignToCacheLine(participantCapacity * maxStepOctetCount);
 }
@@ -5,6 +5,8 @@
 
 #include <imprint/allocator.h>
 #include <nimble-server/game.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/steps_pool.h>
 #include <nimble-steps-serialize/out_serialize.h>
 
 /// Initializes and allocated memory for a game.
@@ -13,21 +15,182 @@
 /// @param allocator allocator
 /// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
 /// @param maxParticipantCount maximum number of participants in a game
+/// @param participantStepBudgetOctetCount total octet count for the participant step buffers, zero means one step
+/// buffer for each participant
 /// @param log target log
 void nimbleServerGameInit(NimbleServerGame* self, ImprintAllocator* allocator,
-                          size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount, Clog log)
+                          size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount,
+                          size_t participantStepBudgetOctetCount, Clog log)
+{
+    NimbleServerGameAllocators allocators = {
+        .authoritativeSteps = allocator,
+        .participants = allocator,
+        .participantSteps = allocator,
+    };
+
+    nimbleServerGameInitWithAllocators(self, allocators, maxSingleParticipantStepOctetCount, maxParticipantCount,
+                                       participantStepBudgetOctetCount, log);
+}
+
+/// Initializes a game, using separate allocators for the authoritative steps, participants and participant steps.
+/// @param self game
+/// @param allocators the allocators to use
+/// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
+/// @param maxParticipantCount maximum number of participants in a game
+/// @param participantStepBudgetOctetCount total octet count for the participant step buffers, zero means one step
+/// buffer for each participant
+/// @param log target log
+void nimbleServerGameInitWithAllocators(NimbleServerGame* self, NimbleServerGameAllocators allocators,
+                                        size_t maxSingleParticipantStepOctetCount, size_t maxParticipantCount,
+                                        size_t participantStepBudgetOctetCount, Clog log)
 {
     self->log = log;
     self->debugIsFrozen = false;
+    self->isSimulatedOnServer = false;
+    self->observer.stepComposedFn = 0;
+    self->observer.snapshotFn = 0;
+    self->observer.self = 0;
+    self->latestGameStateOctetCount = 0;
     size_t combinedStepOctetCount = nbsStepsOutSerializeCalculateCombinedSize(maxParticipantCount,
                                                                               maxSingleParticipantStepOctetCount);
-    nbsStepsInit(&self->authoritativeSteps, allocator, combinedStepOctetCount, log);
+    self->combinedStepOctetCount = combinedStepOctetCount;
+    nbsStepsInit(&self->authoritativeSteps, allocators.authoritativeSteps, combinedStepOctetCount, log);
+    nimbleServerStepHistoryInit(&self->history, 0, 0, 0, log);
+    nimbleServerStepValidationInit(&self->stepValidation, 0, maxSingleParticipantStepOctetCount, 0, 0, log);
+    nimbleServerForcedStepsInit(&self->forcedSteps, 0, NimbleServerForcedStepPolicyZero, maxParticipantCount,
+                                maxSingleParticipantStepOctetCount, 0, 0, log);
     nbsStepsReInit(&self->authoritativeSteps, 0);
     tc_snprintf(self->participants.debugPrefix, sizeof(self->participants.debugPrefix), "%s/participants",
                 self->log.constantPrefix);
 
-    nimbleServerParticipantsInit(&self->participants, allocator, maxParticipantCount,
-                                 maxSingleParticipantStepOctetCount, &self->log);
+    size_t stepsPoolCapacity = nimbleServerStepsPoolCapacityFromBudget(
+        participantStepBudgetOctetCount, maxSingleParticipantStepOctetCount, maxParticipantCount);
+
+    nimbleServerParticipantsInit(&self->participants, allocators.participants, allocators.participantSteps,
+                                 maxParticipantCount, maxSingleParticipantStepOctetCount, stepsPoolCapacity,
+                                 &self->log);
+}
+
+/// Enables the history for authoritative steps that are discarded from the authoritative window.
+/// @param self game
+/// @param allocator allocator for the history and the steps buffer used when catching up from it
+/// @param stepCapacity maximum number of steps in the history
+/// @param octetCapacity maximum number of step octets in the history
+void nimbleServerGameInitHistory(NimbleServerGame* self, ImprintAllocator* allocator, size_t stepCapacity,
+                                 size_t octetCapacity)
+{
+    nimbleServerStepHistoryInit(&self->history, allocator, stepCapacity, octetCapacity, self->log);
+    nbsStepsInit(&self->catchUpSteps, allocator, self->combinedStepOctetCount, self->log);
+}
+
+/// Enables the validation of predicted steps before they are inserted into the steps buffers of the participants.
+/// @param self game
+/// @param allocator allocator for the validation batch
+/// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
+/// @param validateFn called with each batch of new predicted steps
+/// @param validateSelf passed to validateFn
+void nimbleServerGameInitStepValidation(NimbleServerGame* self, ImprintAllocator* allocator,
+                                        size_t maxSingleParticipantStepOctetCount,
+                                        NimbleServerValidatePredictedStepsFn validateFn, void* validateSelf)
+{
+    nimbleServerStepValidationInit(&self->stepValidation, allocator, maxSingleParticipantStepOctetCount, validateFn,
+                                   validateSelf, self->log);
+}
+
+/// Sets how steps that participants did not provide in time are composed
+/// @param self game
+/// @param allocator allocator for the last received step of each participant
+/// @param policy how to create forced steps
+/// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
+/// @param createFn creates the forced step for NimbleServerForcedStepPolicyCallback
+/// @param createSelf passed to createFn
+void nimbleServerGameInitForcedSteps(NimbleServerGame* self, ImprintAllocator* allocator,
+                                     NimbleServerForcedStepPolicy policy, size_t maxSingleParticipantStepOctetCount,
+                                     NimbleServerCreateForcedStepFn createFn, void* createSelf)
+{
+    nimbleServerForcedStepsInit(&self->forcedSteps, allocator, policy, self->participants.participantCapacity,
+                                maxSingleParticipantStepOctetCount, createFn, createSelf, self->log);
+}
+
+/// Reuses the memory allocated in nimbleServerGameInit for a new game.
+/// Clears the authoritative steps and the history, and marks all participants as free.
+/// @param self game
+/// @param stepId the first authoritative StepId for the new game
+void nimbleServerGameReInit(NimbleServerGame* self, StepId stepId)
+{
+    self->debugIsFrozen = false;
+    self->latestGameStateOctetCount = 0;
+    nbsStepsReInit(&self->authoritativeSteps, stepId);
+    nimbleServerStepHistoryReInit(&self->history);
+    nimbleServerParticipantsReInit(&self->participants);
+}
+
+/// Discards the oldest authoritative steps, and moves them to the history if it is enabled
+/// @param self game
+/// @param stepCount number of steps to discard
+/// @return negative on error
+int nimbleServerGameDiscardAuthoritativeSteps(NimbleServerGame* self, size_t stepCount)
+{
+    if (nimbleServerStepHistoryIsEnabled(&self->history)) {
+        NbsSteps* authoritativeSteps = &self->authoritativeSteps;
+        uint8_t stepBuffer[1024];
+        for (size_t i = 0; i < stepCount; ++i) {
+            StepId stepId = (StepId) (authoritativeSteps->expectedReadId + i);
+            int index = nbsStepsGetIndexForStep(authoritativeSteps, stepId);
+            if (index < 0) {
+                return index;
+            }
+            int octetCount = nbsStepsReadAtIndex(authoritativeSteps, index, stepBuffer, sizeof(stepBuffer));
+            if (octetCount < 0) {
+                return octetCount;
+            }
+            int err = nimbleServerStepHistoryAdd(&self->history, stepId, stepBuffer, (size_t) octetCount);
+            if (err < 0) {
+                return err;
+            }
+        }
+    }
+
+    return nbsStepsDiscardCount(&self->authoritativeSteps, stepCount);
+}
+
+/// Calculates the octet count that nimbleServerGameInit allocates
+/// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
+/// @param maxParticipantCount maximum number of participants in a game
+/// @param participantStepBudgetOctetCount total octet count for the participant step buffers
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerGameCalculateMemoryRequirement(size_t maxSingleParticipantStepOctetCount,
+                                                  size_t maxParticipantCount, size_t participantStepBudgetOctetCount)
+{
+    size_t combinedStepOctetCount = nbsStepsOutSerializeCalculateCombinedSize(maxParticipantCount,
+                                                                              maxSingleParticipantStepOctetCount);
+    size_t stepsPoolCapacity = nimbleServerStepsPoolCapacityFromBudget(
+        participantStepBudgetOctetCount, maxSingleParticipantStepOctetCount, maxParticipantCount);
+
+    return nimbleServerStepsCalculateMemoryRequirement(combinedStepOctetCount) +
+           nimbleServerParticipantsCalculateMemoryRequirement(maxParticipantCount, maxSingleParticipantStepOctetCount,
+                                                              stepsPoolCapacity);
+}
+
+/// Calculates the octet count that nimbleServerGameInitHistory allocates
+/// @param maxSingleParticipantStepOctetCount maximum octet count for a single participant
+/// @param maxParticipantCount maximum number of participants in a game
+/// @param stepCapacity maximum number of steps in the history, zero if the history is disabled
+/// @param octetCapacity maximum number of step octets in the history
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerGameCalculateHistoryMemoryRequirement(size_t maxSingleParticipantStepOctetCount,
+                                                         size_t maxParticipantCount, size_t stepCapacity,
+                                                         size_t octetCapacity)
+{
+    if (stepCapacity == 0) {
+        return 0;
+    }
+
+    size_t combinedStepOctetCount = nbsStepsOutSerializeCalculateCombinedSize(maxParticipantCount,
+                                                                              maxSingleParticipantStepOctetCount);
+
+    return nimbleServerStepHistoryCalculateMemoryRequirement(stepCapacity, octetCapacity) +
+           nimbleServerStepsCalculateMemoryRequirement(combinedStepOctetCount);
 }
 
 #if 0
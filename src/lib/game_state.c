@@ -10,12 +10,15 @@
 /// @param self game state
 /// @param allocator allocator to use
 /// @param octetCount game state capacity in octet count
-void nimbleServerGameStateInit(NimbleServerGameState* self, ImprintAllocator* allocator, size_t octetCount)
+/// @return negative if the space could not be allocated
+int nimbleServerGameStateInit(NimbleServerGameState* self, ImprintAllocator* allocator, size_t octetCount)
 {
     self->state = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, octetCount);
-    self->capacity = octetCount;
+    self->capacity = self->state != 0 ? octetCount : 0;
     self->stepId = 0;
     self->octetCount = 0;
+
+    return self->state != 0 ? 0 : -1;
 }
 
 /// Copies a serialized game state
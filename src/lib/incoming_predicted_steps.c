@@ -36,22 +36,21 @@ int nimbleServerHandleIncomingSteps(NimbleServerGame* foundGame, FldInStream* in
 
     StepId clientWaitingForStepId;
 
-    (void) foundGame;
-
     int errorCode = nbsPendingStepsInSerializeHeader(inStream, &clientWaitingForStepId);
     if (errorCode < 0) {
-        CLOG_C_SOFT_ERROR(&transportConnection->log, "client step: couldn't in-serialize pending steps")
+        CLOG_C_SOFT_ERROR(&transportConnection->diagnostics->log, "client step: couldn't in-serialize pending steps")
         return errorCode;
     }
 
     *outClientWaitingForStepId = clientWaitingForStepId;
 
     CLOG_C_VERBOSE(
-        &transportConnection->log,
+        &transportConnection->diagnostics->log,
         "handleIncomingSteps: transport connection %d party: %hhu first predicted StepID %08X",
         transportConnection->transportConnectionId, party->id, clientWaitingForStepId)
 
-    int addedStepsCountOrError = nimbleServerLocalPartyDeserializePredictedSteps(party, inStream);
+    int addedStepsCountOrError = nimbleServerLocalPartyDeserializePredictedSteps(party, inStream,
+                                                                                  &foundGame->stepValidation);
 
     return addedStepsCountOrError;
 }
@@ -0,0 +1,210 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "authoritative_steps.h"
+#include <nimble-server/local_channel.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/server.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Joins the participants of the hosting client as a party, without going through a join game request.
+/// The transport connection index is reserved for the channel, the normal transport must never use it.
+/// @param self local channel
+/// @param server the server that is hosted in-process
+/// @param transportIndex transport connection index that is reserved for the channel
+/// @param players the local participants to join
+/// @param playerCount number of players
+/// @return negative on error
+int nimbleServerLocalChannelJoin(NimbleServerLocalChannel* self, NimbleServer* server, uint8_t transportIndex,
+                                 const NimbleSerializeJoinGameRequestPlayer* players, size_t playerCount)
+{
+    self->server = server;
+    self->log = server->log;
+    self->party = 0;
+    tc_mem_clear_type(&self->stats);
+
+    if (transportIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        CLOG_C_SOFT_ERROR(&self->log, "local channel transport index %hhu is out of range", transportIndex)
+        return -1;
+    }
+
+    NimbleServerTransportConnection* transportConnection = nimbleServerPrepareTransportConnection(server,
+                                                                                                    transportIndex);
+    if (transportConnection->assignedParty != 0 || transportConnection->spectator != 0) {
+        CLOG_C_NOTICE(&self->log, "transport connection %hhu is already in use, can not be used as a local channel",
+                      transportIndex)
+        return -2;
+    }
+
+    StepId latestAuthoritativeStepId = server->game.authoritativeSteps.expectedWriteId;
+
+    NimbleServerLocalParty* party;
+    int err = nimbleServerLocalPartiesCreate(&server->localParties, &server->game.participants, transportConnection,
+                                             players, latestAuthoritativeStepId, playerCount, &party);
+    if (err < 0) {
+        return err;
+    }
+    party->waitingForReconnectMaxTimer = server->setup.maxWaitingForReconnectTicks;
+
+    transportConnection->assignedParty = party;
+
+    self->transportConnection = transportConnection;
+    self->party = party;
+    self->nextReadStepId = latestAuthoritativeStepId;
+
+    CLOG_C_DEBUG(&self->log, "local channel joined party %hhu with %zu participants at %08X", party->id, playerCount,
+                 latestAuthoritativeStepId)
+
+    return 0;
+}
+
+/// Writes a predicted step for a participant of the party directly into the steps buffer of the participant.
+/// If the game validates predicted steps, the step is validated as a batch of one.
+/// @param self local channel
+/// @param participantId participant id that was assigned when joining
+/// @param stepId the stepId of the predicted step, must follow the previously added step for the participant
+/// @param octets the step payload
+/// @param octetCount number of octets in the step
+/// @return number of added steps (zero if the step is older than what is expected), negative on error
+int nimbleServerLocalChannelAddPredictedStep(NimbleServerLocalChannel* self, uint8_t participantId, StepId stepId,
+                                             const uint8_t* octets, size_t octetCount)
+{
+    NimbleServerLocalParty* party = self->party;
+    if (party == 0) {
+        return -1;
+    }
+
+    NimbleServerParticipant* participant = nimbleParticipantReferencesFind(&party->participantReferences,
+                                                                           participantId);
+    if (participant == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "tried to insert participant %hhu that is not in the party", participantId)
+        return -2;
+    }
+
+    NbsSteps* steps = participant->steps;
+    if ((int32_t) (stepId - steps->expectedWriteId) < 0) {
+        return 0;
+    }
+
+    if (stepId != steps->expectedWriteId) {
+        CLOG_C_NOTICE(&self->log, "local channel: gap in predicted steps. expected %08X, but got %08X",
+                      steps->expectedWriteId, stepId)
+        return -3;
+    }
+
+    int err;
+    NimbleServerStepValidation* validation = &self->server->game.stepValidation;
+    if (nimbleServerStepValidationIsEnabled(validation)) {
+        if (octetCount > validation->maxStepOctetCount) {
+            return -4;
+        }
+        NimbleServerValidatedStep* step = nimbleServerStepValidationAdd(validation, participantId, stepId);
+        tc_memcpy_octets(step->octets, octets, octetCount);
+        step->octetCount = octetCount;
+        nimbleServerStepValidationValidate(validation);
+        err = nbsStepsWrite(steps, stepId, step->octets, step->octetCount);
+        nimbleServerStepValidationClear(validation);
+    } else {
+        err = nbsStepsWrite(steps, stepId, octets, octetCount);
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    nimbleServerConnectionQualityAddedStepsToBuffer(&party->quality, 1);
+
+    StepId receivedUpToStepId = steps->expectedWriteId - 1;
+    if (receivedUpToStepId > party->highestReceivedStepId) {
+        party->highestReceivedStepId = receivedUpToStepId;
+        party->stepsInBufferCount = steps->stepsCount;
+    }
+
+    self->stats.insertedStepCount++;
+
+    return 1;
+}
+
+/// Composes as many authoritative steps as possible, the same way as when a step request is received over the
+/// transport. Should be called after the predicted steps for the tick have been added.
+/// @param self local channel
+/// @return number of composed steps, negative on error
+int nimbleServerLocalChannelCompose(NimbleServerLocalChannel* self)
+{
+    NimbleServer* server = self->server;
+    NimbleServerGame* game = &server->game;
+
+    int err = nimbleServerDiscardAuthoritativeStepsIfBufferGettingFull(game);
+    if (err < 0) {
+        return err;
+    }
+
+    if (game->debugIsFrozen) {
+        return 0;
+    }
+
+    int advanceCount = nimbleServerComposeAuthoritativeSteps(game);
+    if (advanceCount < 0) {
+        return advanceCount;
+    }
+
+    statsIntPerSecondAdd(&server->authoritativeStepsPerSecondStat, advanceCount);
+
+    return advanceCount;
+}
+
+/// Reads the next authoritative step directly from the game.
+/// If the channel has fallen behind the authoritative steps that are kept, it continues from the oldest one.
+/// @param self local channel
+/// @param[out] outStepId the stepId of the read step
+/// @param target the buffer to copy the step octets to
+/// @param maxOctetCount size of the target buffer
+/// @return number of octets in the step, zero if there is no new authoritative step, negative on error
+int nimbleServerLocalChannelReadAuthoritativeStep(NimbleServerLocalChannel* self, StepId* outStepId, uint8_t* target,
+                                                  size_t maxOctetCount)
+{
+    const NbsSteps* authoritativeSteps = &self->server->game.authoritativeSteps;
+
+    if (self->nextReadStepId == authoritativeSteps->expectedWriteId) {
+        return 0;
+    }
+
+    if ((int32_t) (self->nextReadStepId - authoritativeSteps->expectedReadId) < 0) {
+        CLOG_C_NOTICE(&self->log, "local channel fell behind. wanted %08X, but oldest authoritative step is %08X",
+                      self->nextReadStepId, authoritativeSteps->expectedReadId)
+        self->nextReadStepId = authoritativeSteps->expectedReadId;
+    }
+
+    int index = nbsStepsGetIndexForStep(authoritativeSteps, self->nextReadStepId);
+    if (index < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "local channel could not find authoritative step %08X", self->nextReadStepId)
+        return index;
+    }
+
+    int octetCount = nbsStepsReadAtIndex(authoritativeSteps, index, target, maxOctetCount);
+    if (octetCount < 0) {
+        return octetCount;
+    }
+
+    *outStepId = self->nextReadStepId++;
+    self->stats.readStepCount++;
+
+    return octetCount;
+}
+
+/// Disconnects the party of the channel. The participants will leave the same way as for a disconnected client.
+/// @param self local channel
+/// @return negative on error
+int nimbleServerLocalChannelLeave(NimbleServerLocalChannel* self)
+{
+    if (self->party == 0) {
+        return 0;
+    }
+
+    int err = nimbleServerConnectionDisconnected(self->server, self->transportConnection->transportIndex);
+    self->party = 0;
+
+    return err;
+}
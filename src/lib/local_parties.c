@@ -7,6 +7,7 @@
 #include <nimble-server/errors.h>
 #include <nimble-server/local_parties.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/memory_requirement.h>
 #include <nimble-server/participant.h>
 #include <nimble-server/transport_connection.h>
 #include <secure-random/secure_random.h>
@@ -22,7 +23,10 @@ void nimbleServerLocalPartiesInit(NimbleServerLocalParties* self, size_t maxCoun
                                   size_t maxLocalPartyParticipantCount, size_t maxSingleParticipantOctetCount, Clog log)
 {
     self->partiesCount = 0;
-    self->parties = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerLocalParty, maxCount);
+    uint8_t* partiesMemory = IMPRINT_ALLOC_TYPE_COUNT(
+        allocator, uint8_t, NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT + maxCount * sizeof(NimbleServerLocalParty));
+    self->parties = (NimbleServerLocalParty*) nimbleServerAlignPointerToCacheLine(partiesMemory);
+    self->diagnostics = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerLocalPartyDiagnostics, maxCount);
     self->capacityCount = maxCount;
     self->allocator = allocator;
     self->maxLocalPartyParticipantCount = maxLocalPartyParticipantCount;
@@ -30,20 +34,33 @@ void nimbleServerLocalPartiesInit(NimbleServerLocalParties* self, size_t maxCoun
     self->log = log;
 
     tc_mem_clear_type_n(self->parties, self->capacityCount);
+    tc_mem_clear_type_n(self->diagnostics, self->capacityCount);
 
     for (size_t i = 0; i < self->capacityCount; ++i) {
         NimbleServerLocalParty* party = &self->parties[i];
+        NimbleServerLocalPartyDiagnostics* diagnostics = &self->diagnostics[i];
         uint8_t id = (uint8_t) i;
 
         Clog subLog;
-        tc_snprintf(party->debugPrefix, sizeof(party->debugPrefix), "%s/party/%u", self->log.constantPrefix, id);
-        subLog.constantPrefix = party->debugPrefix;
+        tc_snprintf(diagnostics->debugPrefix, sizeof(diagnostics->debugPrefix), "%s/party/%u",
+                    self->log.constantPrefix, id);
+        subLog.constantPrefix = diagnostics->debugPrefix;
         subLog.config = log.config;
 
-        nimbleServerLocalPartyInit(party, id, subLog);
+        nimbleServerLocalPartyInit(party, diagnostics, id, subLog);
     }
 }
 
+/// Calculates the octet count that nimbleServerLocalPartiesInit allocates
+/// @param maxCount capacity for the collection
+/// @return octet count, including the padding for cache line alignment
+size_t nimbleServerLocalPartiesCalculateMemoryRequirement(size_t maxCount)
+{
+    return nimbleServerAlignToCacheLine(NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT +
+                                        maxCount * sizeof(NimbleServerLocalParty)) +
+           nimbleServerAlignToCacheLine(maxCount * sizeof(NimbleServerLocalPartyDiagnostics));
+}
+
 /// Resets the memory of the party collection
 /// @param self party collection
 void nimbleServerLocalPartiesReset(NimbleServerLocalParties* self)
@@ -11,30 +11,36 @@
 #include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/participant.h>
+#include <nimble-server/step_validation.h>
 #include <nimble-steps-serialize/in_serialize.h>
 #include <nimble-steps-serialize/out_serialize.h>
 
 /// Initializes a party.
 /// @param self the party
+/// @param diagnostics the out of line diagnostics for the party
 /// @param id the id for the party
 /// @param log the log to use for logging
 /// Need to create Participants to the game before associating them to the connection.
-void nimbleServerLocalPartyInit(NimbleServerLocalParty* self, NimbleSerializeLocalPartyId id, Clog log)
+void nimbleServerLocalPartyInit(NimbleServerLocalParty* self, NimbleServerLocalPartyDiagnostics* diagnostics,
+                                NimbleSerializeLocalPartyId id, Clog log)
 {
     self->log = log;
     CLOG_C_DEBUG(&self->log, "initialize local party")
 
     self->id = id;
+    self->diagnostics = diagnostics;
     self->participantReferences.participantReferenceCount = 0;
     self->waitingForReconnectMaxTimer = 62 * 20;
     self->isUsed = false;
     self->warningCount = 0;
 
-    self->quality.log.config = log.config;
-    tc_snprintf(self->quality.debugPrefix, sizeof(self->quality.debugPrefix), "%s/quality", self->log.constantPrefix);
-    self->quality.log.constantPrefix = self->quality.debugPrefix;
-    nimbleServerConnectionQualityInit(&self->quality, self->quality.log);
-    nimbleServerConnectionQualityDelayedInit(&self->delayedQuality, self->quality.log);
+    Clog qualityLog;
+    qualityLog.config = log.config;
+    tc_snprintf(diagnostics->qualityDebugPrefix, sizeof(diagnostics->qualityDebugPrefix), "%s/quality",
+                self->log.constantPrefix);
+    qualityLog.constantPrefix = diagnostics->qualityDebugPrefix;
+    nimbleServerConnectionQualityInit(&self->quality, qualityLog);
+    nimbleServerConnectionQualityDelayedInit(&self->delayedQuality, qualityLog);
 
     nimbleServerLocalPartyReInit(self, 0);
 }
@@ -47,7 +53,7 @@ void nimbleServerLocalPartyReInit(NimbleServerLocalParty* self, NimbleServerTran
     self->state = NimbleServerLocalPartyStateNormal;
     nimbleServerConnectionQualityReInit(&self->quality);
     nimbleServerConnectionQualityDelayedReset(&self->delayedQuality);
-    statsIntInit(&self->incomingStepCountInBufferStats, 60);
+    statsIntInit(&self->diagnostics->incomingStepCountInBufferStats, 60);
     // Expect that the client will add steps for the next authoritative step
     self->transportConnection = transportConnection;
     self->waitingForReconnectTimer = 0;
@@ -166,8 +172,134 @@ bool nimbleServerLocalPartyHasParticipantId(const NimbleServerLocalParty* self,
     return false;
 }
 
-int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, FldInStream* inStream)
+/// Updates the party statistics after predicted steps have been inserted for a participant
+/// @param self party
+/// @param participant the participant that got the steps
+/// @param addedStepsCount number of inserted steps
+static void addedPredictedSteps(NimbleServerLocalParty* self, const NimbleServerParticipant* participant,
+                                size_t addedStepsCount)
+{
+    nimbleServerConnectionQualityAddedStepsToBuffer(&self->quality, addedStepsCount);
+
+    StepId receivedUpToStepId = participant->steps->expectedWriteId - 1;
+    if (receivedUpToStepId > self->highestReceivedStepId) {
+        self->highestReceivedStepId = receivedUpToStepId;
+        self->stepsInBufferCount = participant->steps->stepsCount;
+    }
+}
+
+/// Validates the batch and inserts the (possibly rewritten) steps into the steps buffers of the participants.
+/// @param self party
+/// @param validation the batch of steps to validate
+/// @return negative on error
+static int insertValidatedSteps(NimbleServerLocalParty* self, NimbleServerStepValidation* validation)
 {
+    nimbleServerStepValidationValidate(validation);
+
+    size_t index = 0;
+    while (index < validation->stepCount) {
+        uint8_t participantId = validation->steps[index].participantId;
+        NimbleServerParticipant* participant = nimbleParticipantReferencesFind(&self->participantReferences,
+                                                                               participantId);
+        size_t addedStepsCount = 0;
+        for (; index < validation->stepCount && validation->steps[index].participantId == participantId; ++index) {
+            const NimbleServerValidatedStep* step = &validation->steps[index];
+            int err = nbsStepsWrite(participant->steps, step->stepId, step->octets, step->octetCount);
+            if (err < 0) {
+                CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't insert validated step %08X", step->stepId)
+                nimbleServerStepValidationClear(validation);
+                return err;
+            }
+            addedStepsCount++;
+        }
+        addedPredictedSteps(self, participant, addedStepsCount);
+    }
+
+    nimbleServerStepValidationClear(validation);
+
+    return 0;
+}
+
+/// Inserts the predicted steps of one participant, read with the nimble-steps-serialize reader. The reader drops the
+/// steps that are older than the steps buffer expects (clients resend the same window in every datagram).
+/// @param self party
+/// @param participant the participant that predicted the steps
+/// @param firstStepId StepId of the first step in the range
+/// @param stepCount number of steps in the range
+/// @param inStream stream to read the steps from
+/// @return number of added steps, negative on error
+static int ingestPredictedSteps(NimbleServerLocalParty* self, NimbleServerParticipant* participant,
+                                StepId firstStepId, size_t stepCount, FldInStream* inStream)
+{
+    size_t addedStepsCount = 0;
+
+    for (size_t i = 0; i < stepCount; ++i) {
+        StepId stepId = firstStepId + (StepId) i;
+        int addedCount = nimbleServerParticipantDeserializeSingleStep(participant, stepId, inStream);
+        if (addedCount < 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't read predicted step %08X (%d)", stepId, addedCount)
+            return NimbleServerErrSerialize;
+        }
+        addedStepsCount += (size_t) addedCount;
+    }
+
+    return (int) addedStepsCount;
+}
+
+/// Reads a single predicted step into the validation batch, instead of inserting it directly into the steps buffer.
+/// The step is read with the nimble-steps-serialize reader into the read steps of the validation. Steps that are
+/// older than the steps buffer expects are dropped.
+/// @param self party
+/// @param validation the batch to add the step to
+/// @param participant the participant that predicted the step
+/// @param stepId the StepId of the predicted step
+/// @param inStream stream to read the step from
+/// @return number of added steps, negative on error
+static int readStepForValidation(NimbleServerLocalParty* self, NimbleServerStepValidation* validation,
+                                 const NimbleServerParticipant* participant, StepId stepId, FldInStream* inStream)
+{
+    nbsStepsReInit(&validation->readSteps, stepId);
+    int readCount = nbsStepsInSerializeSinglePredictedStep(inStream, stepId, &validation->readSteps);
+    if (readCount < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't read predicted step %08X (%d)", stepId, readCount)
+        return NimbleServerErrSerialize;
+    }
+
+    if (stepId < participant->steps->expectedWriteId) {
+        return 0;
+    }
+
+    int err;
+    if (nimbleServerStepValidationIsFull(validation)) {
+        err = insertValidatedSteps(self, validation);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    NimbleServerValidatedStep* step = nimbleServerStepValidationAdd(validation, participant->id, stepId);
+    int octetCount = nbsStepsReadExactStepId(&validation->readSteps, stepId, step->octets, step->maxOctetCount);
+    if (octetCount < 0) {
+        return octetCount;
+    }
+    step->octetCount = (size_t) octetCount;
+
+    return 1;
+}
+
+/// Reads the predicted steps for all participants in the party from a datagram.
+/// Each step is read with the nimble-steps-serialize reader, which drops the redundant steps that the server already
+/// has.
+/// If validation is enabled, all the new steps are validated as one batch before they are inserted.
+/// @param self party
+/// @param inStream stream to read from
+/// @param validation the step validation of the game
+/// @return negative on error
+int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self, FldInStream* inStream,
+                                                    NimbleServerStepValidation* validation)
+{
+    bool isValidating = nimbleServerStepValidationIsEnabled(validation);
+
     uint32_t lowestCommonStepId;
     fldInStreamReadUInt32(inStream, &lowestCommonStepId);
 
@@ -181,10 +313,6 @@ int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self
         uint8_t participantId;
 
         fldInStreamReadUInt8(inStream, &participantId);
-        if (participantId >= self->participantReferences.participantReferenceCount) {
-            CLOG_C_SOFT_ERROR(&self->log, "illegal participant index %hhu", participantCount)
-            return -4;
-        }
 
         uint8_t deltaTicksFromCommonStepId;
         fldInStreamReadUInt8(inStream, &deltaTicksFromCommonStepId);
@@ -209,34 +337,47 @@ int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self
                        firstTickIdInArray, lastStepId, stepsThatFollow)
 
         // Drop old predicted steps if needed.
-        size_t dropped = nbsStepsDropped(&participant->steps, firstTickIdInArray);
+        size_t dropped = nbsStepsDropped(participant->steps, firstTickIdInArray);
         if (dropped > 0) {
             if (dropped > 60U) {
                 CLOG_C_WARN(&self->log, "client had a big gap in predicted steps %zu", dropped)
                 // return -3;
             }
             CLOG_C_WARN(&self->log, "client step: dropped %zu steps. expected %08X, but got range from %08X to %08X",
-                        dropped, participant->steps.expectedWriteId, firstTickIdInArray, lastStepId)
+                        dropped, participant->steps->expectedWriteId, firstTickIdInArray, lastStepId)
             // nimbleServerInsertForcedSteps(self, dropped);
         }
 
         size_t totalAddedStepsCount = 0;
         size_t totalOldStepsCount = 0;
+        StepId expectedWriteId = participant->steps->expectedWriteId;
+        if (expectedWriteId > firstTickIdInArray) {
+            totalOldStepsCount = expectedWriteId - firstTickIdInArray;
+            if (totalOldStepsCount > stepsThatFollow) {
+                totalOldStepsCount = stepsThatFollow;
+            }
+        }
 
-        for (size_t i = 0; i < stepsThatFollow; ++i) {
-            StepId stepId = firstTickIdInArray + (StepId) i;
+        if (isValidating) {
+            for (size_t i = 0; i < stepsThatFollow; ++i) {
+                StepId stepId = firstTickIdInArray + (StepId) i;
+                int addedStepsCount = readStepForValidation(self, validation, participant, stepId, inStream);
+                if (addedStepsCount < 0) {
+                    CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't in-serialize single step")
+                    return addedStepsCount;
+                }
 
-            if (stepId < participant->steps.expectedWriteId) {
-                totalOldStepsCount++;
+                totalAddedStepsCount += (size_t) addedStepsCount;
             }
-
-            int addedStepsCount = nimbleServerParticipantDeserializeSingleStep(participant, stepId, inStream);
+        } else {
+            int addedStepsCount = ingestPredictedSteps(self, participant, firstTickIdInArray, stepsThatFollow,
+                                                       inStream);
             if (addedStepsCount < 0) {
-                CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't in-serialize single step")
+                CLOG_C_SOFT_ERROR(&self->log, "client step: couldn't in-serialize predicted steps")
                 return addedStepsCount;
             }
 
-            totalAddedStepsCount += (size_t) addedStepsCount;
+            totalAddedStepsCount = (size_t) addedStepsCount;
         }
 
         if (totalAddedStepsCount == 0) {
@@ -254,16 +395,14 @@ int nimbleServerLocalPartyDeserializePredictedSteps(NimbleServerLocalParty* self
             }
         }
 
-        if (totalAddedStepsCount > 0) {
-            nimbleServerConnectionQualityAddedStepsToBuffer(&self->quality, (size_t) totalAddedStepsCount);
-
-            StepId receivedUpToStepId = participant->steps.expectedWriteId - 1;
-            if (receivedUpToStepId > self->highestReceivedStepId) {
-                self->highestReceivedStepId = receivedUpToStepId;
-                self->stepsInBufferCount = participant->steps.stepsCount;
-            }
+        if (totalAddedStepsCount > 0 && !isValidating) {
+            addedPredictedSteps(self, participant, totalAddedStepsCount);
         }
     }
 
+    if (isValidating) {
+        return insertValidatedSteps(self, validation);
+    }
+
     return 0;
 }
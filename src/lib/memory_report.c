@@ -0,0 +1,262 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/memory_report.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/server.h>
+
+/// Placed in front of every allocation made through NimbleServerTaggedAllocatorWithFree.
+/// The union keeps the returned pointer at the strictest fundamental alignment.
+typedef union TaggedAllocationHeader {
+    size_t octetCount;
+    long double alignLongDouble;
+    void* alignPointer;
+} TaggedAllocationHeader;
+
+static void* taggedAlloc(void* self_, size_t size, const char* sourceFile, size_t line, const char* description)
+{
+    NimbleServerTaggedAllocator* self = (NimbleServerTaggedAllocator*) self_;
+    if (self->alignToCacheLine) {
+        size = nimbleServerAlignToCacheLine(size);
+    }
+    void* memory = self->parent->allocDebugFn(self->parent, size, sourceFile, line, description);
+    if (memory != 0) {
+        self->counter->octetCount += size;
+        self->counter->allocationCount++;
+    }
+    return memory;
+}
+
+static void* taggedCalloc(void* self_, size_t size, const char* sourceFile, size_t line, const char* description)
+{
+    NimbleServerTaggedAllocator* self = (NimbleServerTaggedAllocator*) self_;
+    if (self->alignToCacheLine) {
+        size = nimbleServerAlignToCacheLine(size);
+    }
+    void* memory = self->parent->callocDebugFn(self->parent, size, sourceFile, line, description);
+    if (memory != 0) {
+        self->counter->octetCount += size;
+        self->counter->allocationCount++;
+    }
+    return memory;
+}
+
+static void* taggedWithFreeAddHeader(NimbleServerTaggedAllocatorWithFree* self, void* memory, size_t size)
+{
+    if (memory == 0) {
+        return 0;
+    }
+
+    TaggedAllocationHeader* header = (TaggedAllocationHeader*) memory;
+    header->octetCount = size;
+    self->counter->octetCount += size;
+    self->counter->allocationCount++;
+
+    return header + 1;
+}
+
+static void* taggedWithFreeAlloc(void* self_, size_t size, const char* sourceFile, size_t line,
+                                 const char* description)
+{
+    NimbleServerTaggedAllocatorWithFree* self = (NimbleServerTaggedAllocatorWithFree*) self_;
+    void* memory = self->parent->allocator.allocDebugFn(self->parent, size + sizeof(TaggedAllocationHeader),
+                                                         sourceFile, line, description);
+    return taggedWithFreeAddHeader(self, memory, size);
+}
+
+static void* taggedWithFreeCalloc(void* self_, size_t size, const char* sourceFile, size_t line,
+                                  const char* description)
+{
+    NimbleServerTaggedAllocatorWithFree* self = (NimbleServerTaggedAllocatorWithFree*) self_;
+    void* memory = self->parent->allocator.callocDebugFn(self->parent, size + sizeof(TaggedAllocationHeader),
+                                                          sourceFile, line, description);
+    return taggedWithFreeAddHeader(self, memory, size);
+}
+
+static void taggedWithFreeFree(void* self_, void* ptr, const char* sourceFile, size_t line, const char* description)
+{
+    NimbleServerTaggedAllocatorWithFree* self = (NimbleServerTaggedAllocatorWithFree*) self_;
+    if (ptr == 0) {
+        return;
+    }
+
+    TaggedAllocationHeader* header = ((TaggedAllocationHeader*) ptr) - 1;
+    CLOG_ASSERT(self->counter->octetCount >= header->octetCount, "freeing more octets than allocated for tag")
+    self->counter->octetCount -= header->octetCount;
+    self->counter->allocationCount--;
+
+    self->parent->freeDebugFn(self->parent, header, sourceFile, line, description);
+}
+
+/// Sets up one tagged allocator of each kind for every memory tag
+/// @param self memory tags
+/// @param fixedParent allocator for the allocations that are made once, during init. Each allocation is rounded up
+/// to a cache line.
+/// @param pageParent allocator for the blob stream bookkeeping
+/// @param withFreeParent allocator for the allocations that are freed again (game state copies and blob streams)
+void nimbleServerMemoryTagsInit(NimbleServerMemoryTags* self, ImprintAllocator* fixedParent,
+                                ImprintAllocator* pageParent, ImprintAllocatorWithFree* withFreeParent)
+{
+    for (size_t i = 0; i < NimbleServerMemoryTagCount; ++i) {
+        NimbleServerMemoryTagCounter* counter = &self->counters[i];
+        counter->octetCount = 0;
+        counter->allocationCount = 0;
+
+        NimbleServerTaggedAllocator* fixed = &self->fixed[i];
+        fixed->info.allocDebugFn = taggedAlloc;
+        fixed->info.callocDebugFn = taggedCalloc;
+        bool isPage = i == NimbleServerMemoryTagBlobStreams;
+        fixed->parent = isPage ? pageParent : fixedParent;
+        fixed->counter = counter;
+        fixed->alignToCacheLine = !isPage;
+
+        NimbleServerTaggedAllocatorWithFree* withFree = &self->withFree[i];
+        withFree->info.allocator.allocDebugFn = taggedWithFreeAlloc;
+        withFree->info.allocator.callocDebugFn = taggedWithFreeCalloc;
+        withFree->info.freeDebugFn = taggedWithFreeFree;
+        withFree->parent = withFreeParent;
+        withFree->counter = counter;
+    }
+}
+
+/// Returns the allocator to use for allocations that are never freed
+/// @param self memory tags
+/// @param tag the subsystem that allocates
+/// @return allocator
+ImprintAllocator* nimbleServerMemoryTagsFixed(NimbleServerMemoryTags* self, NimbleServerMemoryTag tag)
+{
+    return &self->fixed[tag].info;
+}
+
+/// Returns the allocator to use for allocations that are freed again
+/// @param self memory tags
+/// @param tag the subsystem that allocates
+/// @return allocator
+ImprintAllocatorWithFree* nimbleServerMemoryTagsWithFree(NimbleServerMemoryTags* self, NimbleServerMemoryTag tag)
+{
+    return &self->withFree[tag].info;
+}
+
+/// Returns a human readable name for the tag
+/// @param tag memory tag
+/// @return name of the tag
+const char* nimbleServerMemoryTagToString(NimbleServerMemoryTag tag)
+{
+    switch (tag) {
+        case NimbleServerMemoryTagAuthoritativeSteps:
+            return "authoritativeSteps";
+        case NimbleServerMemoryTagParticipantSteps:
+            return "participantSteps";
+        case NimbleServerMemoryTagParticipants:
+            return "participants";
+        case NimbleServerMemoryTagLocalParties:
+            return "localParties";
+        case NimbleServerMemoryTagTransportConnections:
+            return "transportConnections";
+        case NimbleServerMemoryTagStepHistory:
+            return "stepHistory";
+        case NimbleServerMemoryTagStepValidation:
+            return "stepValidation";
+        case NimbleServerMemoryTagForcedSteps:
+            return "forcedSteps";
+        case NimbleServerMemoryTagSpectators:
+            return "spectators";
+        case NimbleServerMemoryTagGameStateCopies:
+            return "gameStateCopies";
+        case NimbleServerMemoryTagBlobStreams:
+            return "blobStreams";
+        case NimbleServerMemoryTagCount:
+            break;
+    }
+
+    return "unknown";
+}
+
+static size_t proportionOf(size_t octetCount, size_t usedCount, size_t capacity)
+{
+    if (capacity == 0) {
+        return 0;
+    }
+
+    return (size_t) (((unsigned long long) octetCount * usedCount) / capacity);
+}
+
+static size_t usedTransportConnectionCount(const NimbleServer* self)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        if (self->transportConnections[i].isUsed) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/// Reports the octets reserved and in use for each subsystem.
+/// Reserved is what the tagged allocators have handed out. For the fixed size collections, in use is the part of the
+/// reserved memory that the used entries cover. Game state copies and blob streams are allocated on demand, so all
+/// of it is in use.
+/// @param self server
+/// @param[out] report the memory report
+void nimbleServerMemoryReport(const NimbleServer* self, NimbleServerMemoryReport* report)
+{
+    const NimbleServerMemoryTags* tags = &self->memoryTags;
+    const NimbleServerParticipants* participants = &self->game.participants;
+
+    report->reservedOctetCount = 0;
+    report->inUseOctetCount = 0;
+
+    for (size_t i = 0; i < NimbleServerMemoryTagCount; ++i) {
+        NimbleServerMemoryReportEntry* entry = &report->entries[i];
+        entry->name = nimbleServerMemoryTagToString((NimbleServerMemoryTag) i);
+        entry->reservedOctetCount = tags->counters[i].octetCount;
+        entry->inUseOctetCount = entry->reservedOctetCount;
+    }
+
+    NimbleServerMemoryReportEntry* entries = report->entries;
+
+    entries[NimbleServerMemoryTagAuthoritativeSteps].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagAuthoritativeSteps].reservedOctetCount,
+        self->game.authoritativeSteps.stepsCount, NBS_WINDOW_SIZE);
+    entries[NimbleServerMemoryTagParticipantSteps].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagParticipantSteps].reservedOctetCount, participants->stepsPool.usedCount,
+        participants->stepsPool.capacity);
+    entries[NimbleServerMemoryTagParticipants].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagParticipants].reservedOctetCount, participants->participantCount,
+        participants->participantCapacity);
+    entries[NimbleServerMemoryTagLocalParties].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagLocalParties].reservedOctetCount, self->localParties.partiesCount,
+        self->localParties.capacityCount);
+    entries[NimbleServerMemoryTagTransportConnections].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagTransportConnections].reservedOctetCount, usedTransportConnectionCount(self),
+        NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+    entries[NimbleServerMemoryTagStepHistory].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagStepHistory].reservedOctetCount, self->game.history.stepCount,
+        self->game.history.entryCapacity);
+    entries[NimbleServerMemoryTagSpectators].inUseOctetCount = proportionOf(
+        entries[NimbleServerMemoryTagSpectators].reservedOctetCount, self->spectators.count,
+        self->spectators.capacity);
+
+    for (size_t i = 0; i < NimbleServerMemoryTagCount; ++i) {
+        report->reservedOctetCount += entries[i].reservedOctetCount;
+        report->inUseOctetCount += entries[i].inUseOctetCount;
+    }
+}
+
+/// Logs the memory report
+/// @param self memory report
+/// @param log target log
+void nimbleServerMemoryReportDebugOutput(const NimbleServerMemoryReport* self, Clog* log)
+{
+    for (size_t i = 0; i < NimbleServerMemoryTagCount; ++i) {
+        const NimbleServerMemoryReportEntry* entry = &self->entries[i];
+        CLOG_C_INFO(log, "memory %s: %zu octets in use of %zu reserved", entry->name, entry->inUseOctetCount,
+                    entry->reservedOctetCount)
+    }
+    CLOG_C_INFO(log, "memory total: %zu octets in use of %zu reserved", self->inUseOctetCount,
+                self->reservedOctetCount)
+}
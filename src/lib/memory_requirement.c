@@ -0,0 +1,36 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server/memory_requirement.h>
+#include <nimble-steps/steps.h>
+
+/// Rounds an octet count up to the next cache line boundary
+/// @param octetCount octet count to round up
+/// @return octet count that is a multiple of the cache line size
+size_t nimbleServerAlignToCacheLine(size_t octetCount)
+{
+    return (octetCount + NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT - 1) &
+           ~((size_t) NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT - 1);
+}
+
+/// Moves a pointer forward to the next cache line boundary
+/// @param memory pointer to align
+/// @return aligned pointer, at most NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT - 1 octets after memory
+uint8_t* nimbleServerAlignPointerToCacheLine(uint8_t* memory)
+{
+    uintptr_t address = (uintptr_t) memory;
+    uintptr_t alignedAddress = (address + NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT - 1) &
+                               ~((uintptr_t) NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT - 1);
+    return memory + (alignedAddress - address);
+}
+
+/// Calculates the octet count that nbsStepsInit reserves for a steps buffer
+/// NbsSteps reserves room for NBS_WINDOW_SIZE steps, each with the maximum combined step size.
+/// @param maxCombinedStepOctetCount maximum octet count for a single (combined) step
+/// @return octet count, rounded up to a cache line
+size_t nimbleServerStepsCalculateMemoryRequirement(size_t maxCombinedStepOctetCount)
+{
+    return nimbleServerAlignToCacheLine(NBS_WINDOW_SIZE * maxCombinedStepOctetCount);
+}
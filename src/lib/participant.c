@@ -4,39 +4,57 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include <nimble-server/local_party.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/participant.h>
+#include <nimble-server/steps_pool.h>
 #include <nimble-steps-serialize/in_serialize.h>
 
-/// Prepares, initializes and allocates memory for a participant
+/// Prepares and initializes a participant.
+/// The participant does not own any step buffer until it joins.
 /// @param self the participant to initialize
-/// @param setup the parameter for the participant (allocator and max step octet size).
+/// @param setup the parameter for the participant (id and the pool to get step buffers from).
 void nimbleServerParticipantInit(NimbleServerParticipant* self, NimbleServerParticipantSetup setup)
 {
     self->log = setup.log;
     self->id = setup.id;
     self->isUsed = false;
     self->state = NimbleServerParticipantStateDestroyed;
-    nbsStepsInit(&self->steps, setup.connectionAllocator, setup.maxStepOctetSizeForOneParticipant, setup.log);
+    self->steps = 0;
+    self->stepsPool = setup.stepsPool;
 }
 
-/// ReInitializes the same allocated memory
+/// ReInitializes the participant and acquires a step buffer from the steps pool
 /// @param self the participant to reinitialize
 /// @param party the party that the participant is assigned to. can not be NULL.
 /// @param currentAuthoritativeStepId the last composed authoritative step
-void nimbleServerParticipantReInit(NimbleServerParticipant* self, NimbleServerLocalParty* party,
-                                   StepId currentAuthoritativeStepId)
+/// @return negative on error
+int nimbleServerParticipantReInit(NimbleServerParticipant* self, NimbleServerLocalParty* party,
+                                  StepId currentAuthoritativeStepId)
 {
     CLOG_ASSERT(party != 0, "party must be valid")
-    nbsStepsReInit(&self->steps, currentAuthoritativeStepId);
+    if (self->steps == 0) {
+        self->steps = nimbleServerStepsPoolAcquire(self->stepsPool);
+        if (self->steps == 0) {
+            CLOG_C_NOTICE(&self->log, "could not join, the step budget is used up")
+            return NimbleServerErrOutOfParticipantMemory;
+        }
+    }
+    nbsStepsReInit(self->steps, currentAuthoritativeStepId);
     self->inParty = party;
     self->isUsed = true;
     self->state = NimbleServerParticipantStateJustJoined;
+
+    return 0;
 }
 
-/// Destroys the participant (marks the memory as not used)
+/// Destroys the participant (marks the memory as not used) and returns the step buffer to the steps pool
 /// @param self participant to mark as not used.
 void nimbleServerParticipantDestroy(NimbleServerParticipant* self)
 {
+    if (self->steps != 0) {
+        nimbleServerStepsPoolRelease(self->stepsPool, self->steps);
+        self->steps = 0;
+    }
     self->isUsed = false;
     self->inParty = 0;
     self->localIndex = 0;
@@ -53,5 +71,5 @@ void nimbleServerParticipantMarkAsLeaving(NimbleServerParticipant* self)
 int nimbleServerParticipantDeserializeSingleStep(NimbleServerParticipant* self, StepId stepId,
                                                  struct FldInStream* inStream)
 {
-    return nbsStepsInSerializeSinglePredictedStep(inStream, stepId, &self->steps);
+    return nbsStepsInSerializeSinglePredictedStep(inStream, stepId, self->steps);
 }
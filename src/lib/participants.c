@@ -6,15 +6,21 @@
 #include <clog/clog.h>
 #include <imprint/allocator.h>
 #include <nimble-server/errors.h>
+#include <nimble-server/memory_requirement.h>
 #include <nimble-server/participant.h>
 #include <nimble-server/participants.h>
 
 /// Initializes and allocates memory the participant collection
 /// @param self participants collection
 /// @param allocator allocator to pre-alloc the collection
+/// @param stepsAllocator allocator for the shared step buffers
 /// @param maxCount maximum number of participants to pre-alloc
-void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocator* allocator, size_t maxCount,
-                                  size_t maxStepOctetSize, Clog* log)
+/// @param maxStepOctetSize maximum octet count for a single participant step
+/// @param stepsPoolCapacity number of step buffers shared between all the participants
+/// @param log target log
+void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocator* allocator,
+                                  ImprintAllocator* stepsAllocator, size_t maxCount, size_t maxStepOctetSize,
+                                  size_t stepsPoolCapacity, Clog* log)
 {
     CLOG_ASSERT(maxCount > 0, "must allocate at least one participant")
     self->log = *log;
@@ -24,6 +30,10 @@ void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocat
     self->participantCapacity = maxCount;
     self->participants = IMPRINT_CALLOC_TYPE_COUNT(allocator, NimbleServerParticipant, maxCount);
     self->participantCount = 0;
+    self->forcedStepCount = 0;
+    self->providedStepCount = 0;
+
+    nimbleServerStepsPoolInit(&self->stepsPool, stepsAllocator, stepsPoolCapacity, maxStepOctetSize, self->log);
 
     nimbleServerCircularBufferInit(&self->freeList);
 
@@ -40,8 +50,7 @@ void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocat
         CLOG_C_DEBUG(&self->log, "preparing participant %hhu", i)
         NimbleServerParticipantSetup setup = {
             .id = i,
-            .maxStepOctetSizeForOneParticipant = maxStepOctetSize,
-            .connectionAllocator = allocator,
+            .stepsPool = &self->stepsPool,
         };
 
         tc_snprintf(participant->debugPrefix, sizeof(participant->debugPrefix), "%s/%u", self->log.constantPrefix,
@@ -55,6 +64,49 @@ void nimbleServerParticipantsInit(NimbleServerParticipants* self, ImprintAllocat
     CLOG_ASSERT(self->participants[0].isUsed == false, "CALLOC did not work")
 }
 
+/// Reuses the already allocated participants and marks all of them as free
+/// @param self participants collection
+void nimbleServerParticipantsReInit(NimbleServerParticipants* self)
+{
+    self->participantCount = 0;
+    self->forcedStepCount = 0;
+    self->providedStepCount = 0;
+    nimbleServerCircularBufferInit(&self->freeList);
+
+    for (size_t i = 0; i < self->participantCapacity; ++i) {
+        nimbleServerCircularBufferWrite(&self->freeList, (uint8_t) i);
+        nimbleServerParticipantDestroy(&self->participants[i]);
+    }
+}
+
+/// Calculates the octet count that nimbleServerParticipantsInit allocates
+/// @param maxCount maximum number of participants
+/// @param maxStepOctetSize maximum octet count for a single participant step
+/// @param stepsPoolCapacity number of step buffers shared between all the participants
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerParticipantsCalculateMemoryRequirement(size_t maxCount, size_t maxStepOctetSize,
+                                                          size_t stepsPoolCapacity)
+{
+    size_t participantsOctetCount = nimbleServerAlignToCacheLine(maxCount * sizeof(NimbleServerParticipant));
+
+    return participantsOctetCount +
+           nimbleServerStepsPoolCalculateMemoryRequirement(stepsPoolCapacity, maxStepOctetSize);
+}
+
+/// Logs the memory reserved for participant steps, and how much of it each active participant uses
+/// @param self participants collection
+void nimbleServerParticipantsDebugOutputMemory(const NimbleServerParticipants* self)
+{
+    const NimbleServerStepsPool* pool = &self->stepsPool;
+    size_t octetCountPerParticipant = nimbleServerStepsPoolOctetCountPerEntry(pool);
+
+    CLOG_C_INFO(&self->log,
+                "participant steps: %zu/%zu step buffers in use, %zu octets per active participant, %zu octets in use "
+                "of %zu reserved",
+                pool->usedCount, pool->capacity, octetCountPerParticipant, pool->usedCount * octetCountPerParticipant,
+                pool->capacity * octetCountPerParticipant)
+}
+
 /// Marks the participant as not used anymore
 /// @param self participants collection
 /// @param participantId the participant to mark as not used anymore (destroyed).
@@ -99,7 +151,10 @@ int nimbleServerParticipantsPrepare(NimbleServerParticipants* self, NimbleSerial
         CLOG_SOFT_ERROR("could not prepare for host migration, participant already used")
         return -2;
     }
-    nimbleServerParticipantReInit(participant, party, currentAuthoritativeStepId);
+    int reInitErr = nimbleServerParticipantReInit(participant, party, currentAuthoritativeStepId);
+    if (reInitErr < 0) {
+        return reInitErr;
+    }
 
     participant->localIndex = 0;
     participant->isUsed = true;
@@ -156,7 +211,11 @@ int nimbleServerParticipantsJoin(NimbleServerParticipants* self,
         CLOG_ERROR("internal error, participant is already used, even if the index came from the free list")
     }
 
-    nimbleServerParticipantReInit(participant, party, expectedStepId);
+    int reInitErr = nimbleServerParticipantReInit(participant, party, expectedStepId);
+    if (reInitErr < 0) {
+        nimbleServerCircularBufferWrite(&self->freeList, participantId);
+        return reInitErr;
+    }
 
     const NimbleSerializeJoinGameRequestPlayer* localPlayer = &localPlayers[joinIndex];
     participant->localIndex = localPlayer->localIndex;
@@ -0,0 +1,307 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <flood/out_stream.h>
+#include <nimble-server/recorder.h>
+#include <nimble-server/server.h>
+
+/// FNV-1a, only used to compare the datagrams that the server sends with the recorded ones
+/// @param octets octets to hash
+/// @param octetCount number of octets
+/// @return hash
+uint64_t nimbleServerRecordingHash(const uint8_t* octets, size_t octetCount)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < octetCount; ++i) {
+        hash ^= octets[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/// Writes the fixed size part of a record, and optionally a payload
+/// @param self recorder
+/// @param outStream the fixed size part
+/// @param payload payload that follows, or NULL
+/// @param payloadOctetCount octet count of payload
+static void writeRecord(NimbleServerRecorder* self, const FldOutStream* outStream, const uint8_t* payload,
+                        size_t payloadOctetCount)
+{
+    if (self->writeError < 0) {
+        return;
+    }
+
+    int err = self->write(self->writeSelf, outStream->octets, outStream->pos);
+    if (err >= 0 && payloadOctetCount > 0) {
+        err = self->write(self->writeSelf, payload, payloadOctetCount);
+    }
+
+    if (err < 0) {
+        // The rest of the recording would not make sense without this record, so stop recording
+        CLOG_SOFT_ERROR("recorder: could not write record, stopping the recording. error %d", err)
+        self->writeError = err;
+        return;
+    }
+
+    self->recordCount++;
+    self->octetCount += outStream->pos + payloadOctetCount;
+}
+
+/// Writes more octets of the record that was started with writeRecord(), for records that are too large for a
+/// single buffer
+/// @param self recorder
+/// @param octets octets to write
+/// @param octetCount number of octets
+static void writeRecordContinuation(NimbleServerRecorder* self, const uint8_t* octets, size_t octetCount)
+{
+    if (self->writeError < 0 || octetCount == 0) {
+        return;
+    }
+
+    int err = self->write(self->writeSelf, octets, octetCount);
+    if (err < 0) {
+        CLOG_SOFT_ERROR("recorder: could not write record, stopping the recording. error %d", err)
+        self->writeError = err;
+        return;
+    }
+
+    self->octetCount += octetCount;
+}
+
+/// Starts to record a server. Must be called directly after nimbleServerInit() (or nimbleServerReInitWithGame()),
+/// before anything is fed to the server. Writes the header with the server setup.
+/// @param self recorder
+/// @param server server to record
+/// @param write function that receives the recorded octets
+/// @param writeSelf passed to write
+/// @return negative on error
+int nimbleServerRecorderInit(NimbleServerRecorder* self, NimbleServer* server, NimbleServerRecorderWriteFn write,
+                             void* writeSelf)
+{
+    self->write = write;
+    self->writeSelf = writeSelf;
+    self->feedTransportOut = 0;
+    self->feedTransportIndex = 0;
+    self->recordCount = 0;
+    self->octetCount = 0;
+    self->writeError = 0;
+
+    const NimbleServerSetup* setup = &server->setup;
+
+    uint8_t buf[80];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    fldOutStreamWriteUInt32(&outStream, NIMBLE_SERVER_RECORDING_MAGIC);
+    fldOutStreamWriteUInt8(&outStream, NIMBLE_SERVER_RECORDING_FORMAT_VERSION);
+    fldOutStreamWriteUInt16(&outStream, server->applicationVersion.major);
+    fldOutStreamWriteUInt16(&outStream, server->applicationVersion.minor);
+    fldOutStreamWriteUInt16(&outStream, server->applicationVersion.patch);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxConnectionCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxParticipantCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxSingleParticipantStepOctetCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxParticipantCountForEachConnection);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxWaitingForReconnectTicks);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxGameStateOctetCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->participantStepBudgetOctetCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->targetTickTimeMs);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->historyStepCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->historyOctetCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->maxSpectatorCount);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) setup->spectatorRedundancyStepCount);
+    fldOutStreamWriteUInt8(&outStream, setup->useSingleArena ? 1 : 0);
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) setup->forcedStepPolicy);
+    fldOutStreamWriteUInt8(&outStream, server->game.isSimulatedOnServer ? 1 : 0);
+    fldOutStreamWriteUInt8(&outStream, nimbleServerStepValidationIsEnabled(&server->game.stepValidation) ? 1 : 0);
+    fldOutStreamWriteUInt64(&outStream, (uint64_t) server->now);
+    fldOutStreamWriteUInt32(&outStream, server->game.authoritativeSteps.expectedWriteId);
+
+    int err = write(writeSelf, outStream.octets, outStream.pos);
+    if (err < 0) {
+        return err;
+    }
+    self->octetCount = outStream.pos;
+
+    server->recorder = self;
+    server->game.stepValidation.recorder = self;
+
+    return 0;
+}
+
+/// Records a datagram that the server sends
+/// @param self recorder
+/// @param transportIndex transport index the datagram is sent to
+/// @param data datagram octets
+/// @param octetCount octet count of data
+void nimbleServerRecorderOutput(NimbleServerRecorder* self, uint8_t transportIndex, const uint8_t* data,
+                                size_t octetCount)
+{
+    uint8_t buf[16];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeOutput);
+    fldOutStreamWriteUInt8(&outStream, transportIndex);
+    fldOutStreamWriteUInt16(&outStream, (uint16_t) octetCount);
+    fldOutStreamWriteUInt64(&outStream, nimbleServerRecordingHash(data, octetCount));
+    writeRecord(self, &outStream, 0, 0);
+}
+
+static int recordingSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerRecorder* self = (NimbleServerRecorder*) _self;
+
+    nimbleServerRecorderOutput(self, self->feedTransportIndex, data, octetCount);
+
+    return self->feedTransportOut->send(self->feedTransportOut->self, data, octetCount);
+}
+
+/// Records a datagram that is fed to the server, and sets up recordingResponse so the replies are recorded.
+/// @param self recorder
+/// @param type NimbleServerRecordTypeFeed for nimbleServerFeed(), NimbleServerRecordTypeReceive if the server read it
+/// from the multi transport
+/// @param transportIndex transport index the datagram was received on
+/// @param data datagram octets
+/// @param octetCount octet count of data
+/// @param response the response that the server would have used
+/// @param[out] recordingResponse response to use instead, that records and forwards to response
+void nimbleServerRecorderFeed(NimbleServerRecorder* self, NimbleServerRecordType type, uint8_t transportIndex,
+                              const uint8_t* data, size_t octetCount, NimbleServerResponse* response,
+                              NimbleServerResponse* recordingResponse)
+{
+    uint8_t buf[8];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) type);
+    fldOutStreamWriteUInt8(&outStream, transportIndex);
+    fldOutStreamWriteUInt16(&outStream, (uint16_t) octetCount);
+    writeRecord(self, &outStream, data, octetCount);
+
+    self->feedTransportIndex = transportIndex;
+    self->feedTransportOut = response->transportOut;
+    self->recordingTransportOut.self = self;
+    self->recordingTransportOut.send = recordingSend;
+    recordingResponse->transportOut = &self->recordingTransportOut;
+    // Every reply is recorded as its own datagram
+    recordingResponse->runOut = 0;
+}
+
+/// Records a nimbleServerUpdate() call
+/// @param self recorder
+/// @param now the time passed to nimbleServerUpdate()
+void nimbleServerRecorderUpdate(NimbleServerRecorder* self, MonotonicTimeMs now)
+{
+    uint8_t buf[16];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeUpdate);
+    fldOutStreamWriteUInt64(&outStream, (uint64_t) now);
+    writeRecord(self, &outStream, 0, 0);
+}
+
+/// Records that a connection was connected or disconnected on the transport layer
+/// @param self recorder
+/// @param type NimbleServerRecordTypeConnectionConnected or NimbleServerRecordTypeConnectionDisconnected
+/// @param transportIndex the transport connection index
+void nimbleServerRecorderConnection(NimbleServerRecorder* self, NimbleServerRecordType type, uint8_t transportIndex)
+{
+    uint8_t buf[4];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) type);
+    fldOutStreamWriteUInt8(&outStream, transportIndex);
+    writeRecord(self, &outStream, 0, 0);
+}
+
+/// Records a nimbleServerReInitWithGame() call
+/// @param self recorder
+/// @param stepId the StepId that the new game starts at
+/// @param now the time passed to nimbleServerReInitWithGame()
+void nimbleServerRecorderReInitWithGame(NimbleServerRecorder* self, StepId stepId, MonotonicTimeMs now)
+{
+    uint8_t buf[16];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeReInitWithGame);
+    fldOutStreamWriteUInt32(&outStream, stepId);
+    fldOutStreamWriteUInt64(&outStream, (uint64_t) now);
+    writeRecord(self, &outStream, 0, 0);
+}
+
+/// Records a nimbleServerHostMigration() call
+/// @param self recorder
+/// @param localPartyInfos the parties to prepare
+/// @param localPartyCount number of parties in localPartyInfos
+void nimbleServerRecorderHostMigration(NimbleServerRecorder* self, const NimbleSerializeLocalPartyInfo* localPartyInfos,
+                                       size_t localPartyCount)
+{
+    uint8_t buf[2 + NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS * (1 + NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS)];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeHostMigration);
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) localPartyCount);
+    for (size_t i = 0; i < localPartyCount; ++i) {
+        const NimbleSerializeLocalPartyInfo* info = &localPartyInfos[i];
+        fldOutStreamWriteUInt8(&outStream, (uint8_t) info->participantCount);
+        for (size_t j = 0; j < info->participantCount; ++j) {
+            fldOutStreamWriteUInt8(&outStream, info->participantIds[j]);
+        }
+    }
+    writeRecord(self, &outStream, 0, 0);
+}
+
+/// Records the game state that the application returned from authoritativeStateSerializeFn
+/// @param self recorder
+/// @param state the serialized game state
+void nimbleServerRecorderSerializedGameState(NimbleServerRecorder* self, const NimbleServerSerializedGameState* state)
+{
+    uint8_t buf[24];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeSerializedGameState);
+    fldOutStreamWriteUInt32(&outStream, state->stepId);
+    fldOutStreamWriteUInt64(&outStream, state->hash);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) state->gameStateOctetCount);
+    writeRecord(self, &outStream, state->gameState, state->gameStateOctetCount);
+}
+
+/// Records the result of a predicted steps validation, the (possibly rewritten) octets of every step in the batch.
+/// The application validator is not called in a replay, the recorded result is used instead.
+/// @param self recorder
+/// @param steps the validated steps
+/// @param stepCount number of steps
+void nimbleServerRecorderValidatedSteps(NimbleServerRecorder* self, const NimbleServerValidatedStep* steps,
+                                        size_t stepCount)
+{
+    uint8_t buf[8];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeValidatedSteps);
+    fldOutStreamWriteUInt16(&outStream, (uint16_t) stepCount);
+    writeRecord(self, &outStream, 0, 0);
+
+    for (size_t i = 0; i < stepCount; ++i) {
+        const NimbleServerValidatedStep* step = &steps[i];
+        uint8_t stepHeader[2];
+        stepHeader[0] = step->isRejected ? 1 : 0;
+        stepHeader[1] = (uint8_t) step->octetCount;
+        writeRecordContinuation(self, stepHeader, sizeof(stepHeader));
+        writeRecordContinuation(self, step->octets, step->octetCount);
+    }
+}
+
+/// Records a secret that the server generated
+/// @param self recorder
+/// @param secret the generated secret
+void nimbleServerRecorderSecret(NimbleServerRecorder* self, uint64_t secret)
+{
+    uint8_t buf[16];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRecordTypeSecret);
+    fldOutStreamWriteUInt64(&outStream, secret);
+    writeRecord(self, &outStream, 0, 0);
+}
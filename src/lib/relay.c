@@ -0,0 +1,1163 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include "authoritative_steps.h"
+#include <datagram-transport/transport.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
+#include <imprint/allocator.h>
+#include <nimble-serialize/commands.h>
+#include <nimble-serialize/server_in.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/relay.h>
+#include <nimble-server/transport_connection.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define NIMBLE_SERVER_RELAY_ACK_FLAG_HAS_STARTED (0x01)
+#define NIMBLE_SERVER_RELAY_ACK_FLAG_WANTS_SNAPSHOT (0x02)
+#define NIMBLE_SERVER_RELAY_STEPS_HEADER_OCTET_COUNT (1 + 4 + 4 + 8 + 1)
+#define NIMBLE_SERVER_RELAY_MAX_STEP_COUNT_IN_FRAME (255)
+#define NIMBLE_SERVER_RELAY_MAX_STEPS_DATAGRAMS_PER_UPDATE (4)
+#define NIMBLE_SERVER_RELAY_SNAPSHOT_CHUNK_OCTET_COUNT (DATAGRAM_TRANSPORT_MAX_SIZE - 32)
+#define NIMBLE_SERVER_RELAY_MAX_DATAGRAMS_PER_UPDATE (64)
+
+/// Sends a client datagram inside a tunnel frame
+static int sendTunnelFrame(DatagramTransportMulti* transport, int connectionId, uint8_t clientConnectionId,
+                           const uint8_t* data, size_t octetCount)
+{
+    uint8_t frame[DATAGRAM_TRANSPORT_MAX_SIZE + 4];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, frame, sizeof(frame));
+
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRelayFrameTypeTunnel);
+    fldOutStreamWriteUInt8(&outStream, clientConnectionId);
+    fldOutStreamWriteUInt16(&outStream, (uint16_t) octetCount);
+    int err = fldOutStreamWriteOctets(&outStream, data, octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    return transport->sendTo(transport->self, connectionId, frame, outStream.pos);
+}
+
+/// Tells the other side of the link that the tunnel of a client is closed
+static int sendTunnelClosedFrame(DatagramTransportMulti* transport, int connectionId, uint8_t clientConnectionId)
+{
+    uint8_t frame[2];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, frame, sizeof(frame));
+
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRelayFrameTypeTunnelClosed);
+    int err = fldOutStreamWriteUInt8(&outStream, clientConnectionId);
+    if (err < 0) {
+        return err;
+    }
+
+    return transport->sendTo(transport->self, connectionId, frame, outStream.pos);
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// Upstream
+// ---------------------------------------------------------------------------------------------------------------
+
+/// Initializes the upstream side, that serves the authoritative steps of the server to the edge relays
+/// @param self upstream
+/// @param setup the server, the link transport and the transport connection indices that are reserved for tunnels
+/// @return negative on error
+int nimbleServerRelayUpstreamInit(NimbleServerRelayUpstream* self, NimbleServerRelayUpstreamSetup setup)
+{
+    if (setup.tunnelCount > NIMBLE_SERVER_RELAY_MAX_TUNNEL_COUNT ||
+        setup.firstTunnelTransportIndex + setup.tunnelCount > NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        CLOG_C_SOFT_ERROR(&setup.log, "relay tunnels do not fit in the transport connections (%u + %zu)",
+                          setup.firstTunnelTransportIndex, setup.tunnelCount)
+        return -1;
+    }
+
+    self->server = setup.server;
+    self->linkTransport = setup.linkTransport;
+    self->firstTunnelTransportIndex = setup.firstTunnelTransportIndex;
+    self->tunnelCount = setup.tunnelCount;
+    self->redundancyStepCount = setup.redundancyStepCount == 0 ? NIMBLE_SERVER_RELAY_DEFAULT_REDUNDANCY_STEP_COUNT
+                                                               : setup.redundancyStepCount;
+    self->log = setup.log;
+    tc_mem_clear_type_n(self->links, NIMBLE_SERVER_RELAY_MAX_LINK_COUNT);
+    tc_mem_clear_type_n(self->tunnels, NIMBLE_SERVER_RELAY_MAX_TUNNEL_COUNT);
+    tc_mem_clear_type_n(self->composedAtMs, NBS_WINDOW_SIZE);
+    tc_mem_clear_type(&self->stats);
+    self->seenUpToStepId = self->server->game.authoritativeSteps.expectedWriteId;
+
+    self->snapshotOctets = 0;
+    self->snapshotOctetCount = 0;
+    self->snapshotStepId = 0;
+    self->snapshotCapacity = self->server->setup.maxGameStateOctetCount;
+    const NimbleServerCallbackObjectVtbl* vtbl = self->server->callbackObject.vtbl;
+    if (vtbl != 0 && vtbl->authoritativeStateSerializeFn != 0 && self->snapshotCapacity > 0) {
+        self->snapshotOctets = IMPRINT_ALLOC_TYPE_COUNT(setup.allocator, uint8_t, self->snapshotCapacity);
+    }
+
+    return 0;
+}
+
+/// Remembers when each new authoritative step was seen, so the edges can measure the latency of the hop
+static void rememberComposedSteps(NimbleServerRelayUpstream* self)
+{
+    const NbsSteps* steps = &self->server->game.authoritativeSteps;
+
+    if ((int32_t) (self->seenUpToStepId - steps->expectedReadId) < 0 ||
+        (int32_t) (steps->expectedWriteId - self->seenUpToStepId) < 0) {
+        self->seenUpToStepId = steps->expectedReadId;
+    }
+
+    for (; self->seenUpToStepId != steps->expectedWriteId; ++self->seenUpToStepId) {
+        self->composedAtMs[self->seenUpToStepId % NBS_WINDOW_SIZE] = self->server->now;
+    }
+}
+
+/// Serializes the game state of the server into the snapshot that is sent to the edges
+static int serializeSnapshot(NimbleServerRelayUpstream* self)
+{
+    const NimbleServerCallbackObjectVtbl* vtbl = self->server->callbackObject.vtbl;
+    if (vtbl == 0 || vtbl->authoritativeStateSerializeFn == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "relay snapshot needs a game state serialize function")
+        return NimbleServerErrSerialize;
+    }
+
+    NimbleServerSerializedGameState serializedGameState;
+    vtbl->authoritativeStateSerializeFn(self->server->callbackObject.self, &serializedGameState);
+    if (serializedGameState.gameStateOctetCount > self->snapshotCapacity) {
+        CLOG_C_SOFT_ERROR(&self->log, "relay snapshot is too large (%zu octets)",
+                          serializedGameState.gameStateOctetCount)
+        return NimbleServerErrSerialize;
+    }
+
+    tc_memcpy_octets(self->snapshotOctets, serializedGameState.gameState, serializedGameState.gameStateOctetCount);
+    self->snapshotOctetCount = serializedGameState.gameStateOctetCount;
+    self->snapshotStepId = serializedGameState.stepId;
+
+    return 0;
+}
+
+/// Starts a snapshot transfer to the link. The latest snapshot is shared with the other links that are in the middle
+/// of a transfer, otherwise a fresh one is serialized.
+static int startSnapshot(NimbleServerRelayUpstream* self, NimbleServerRelayLink* link)
+{
+    bool isShared = false;
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_LINK_COUNT; ++i) {
+        const NimbleServerRelayLink* other = &self->links[i];
+        if (other != link && other->isUsed && other->snapshot.isActive) {
+            isShared = true;
+            break;
+        }
+    }
+
+    if (!isShared) {
+        int err = serializeSnapshot(self);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    link->snapshot.isActive = true;
+    link->snapshot.stepId = self->snapshotStepId;
+    link->snapshot.ackedOctetCount = 0;
+    link->snapshot.sentOctetCount = 0;
+
+    CLOG_C_DEBUG(&self->log, "relay link %d: starting snapshot %08X (%zu octets)", link->connectionId,
+                 self->snapshotStepId, self->snapshotOctetCount)
+
+    return 0;
+}
+
+static int handleAck(NimbleServerRelayUpstream* self, NimbleServerRelayLink* link, FldInStream* inStream)
+{
+    uint8_t flags;
+    uint32_t waitingForStepId;
+    uint32_t snapshotStepId;
+    uint32_t snapshotReceivedOctetCount;
+
+    fldInStreamReadUInt8(inStream, &flags);
+    fldInStreamReadUInt32(inStream, &waitingForStepId);
+    fldInStreamReadUInt32(inStream, &snapshotStepId);
+    int err = fldInStreamReadUInt32(inStream, &snapshotReceivedOctetCount);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    if (flags & NIMBLE_SERVER_RELAY_ACK_FLAG_HAS_STARTED) {
+        // Go back to the step the edge is waiting for, if it is further back than what the redundancy covers
+        if (!link->hasStarted || (int32_t) (waitingForStepId - link->pushedUpToStepId) > 0 ||
+            (size_t) (StepId) (link->pushedUpToStepId - waitingForStepId) > self->redundancyStepCount) {
+            link->pushedUpToStepId = waitingForStepId;
+        }
+        link->waitingForStepId = waitingForStepId;
+        link->hasStarted = true;
+    } else {
+        link->hasStarted = false;
+    }
+
+    NimbleServerRelaySnapshotTransfer* transfer = &link->snapshot;
+    if (!(flags & NIMBLE_SERVER_RELAY_ACK_FLAG_WANTS_SNAPSHOT) || self->snapshotOctets == 0) {
+        transfer->isActive = false;
+        return 0;
+    }
+
+    if (!transfer->isActive) {
+        return startSnapshot(self, link);
+    }
+
+    if (snapshotStepId == transfer->stepId && snapshotReceivedOctetCount > transfer->ackedOctetCount) {
+        transfer->ackedOctetCount = snapshotReceivedOctetCount;
+        if (transfer->ackedOctetCount >= self->snapshotOctetCount) {
+            transfer->isActive = false;
+        } else if (transfer->sentOctetCount < transfer->ackedOctetCount) {
+            transfer->sentOctetCount = transfer->ackedOctetCount;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct NimbleServerRelayTunnelResponse {
+    NimbleServerRelayUpstream* upstream;
+    int linkConnectionId;
+    uint8_t clientConnectionId;
+} NimbleServerRelayTunnelResponse;
+
+static int sendThroughTunnel(void* _self, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerRelayTunnelResponse* self = (NimbleServerRelayTunnelResponse*) _self;
+
+    self->upstream->stats.tunnelDatagramCount++;
+
+    return sendTunnelFrame(&self->upstream->linkTransport, self->linkConnectionId, self->clientConnectionId, data,
+                           octetCount);
+}
+
+static NimbleServerRelayUpstreamTunnel* findOrAllocateTunnel(NimbleServerRelayUpstream* self, size_t linkIndex,
+                                                             uint8_t clientConnectionId)
+{
+    NimbleServerRelayUpstreamTunnel* freeTunnel = 0;
+
+    for (size_t i = 0; i < self->tunnelCount; ++i) {
+        NimbleServerRelayUpstreamTunnel* tunnel = &self->tunnels[i];
+        if (!tunnel->isUsed) {
+            if (freeTunnel == 0) {
+                freeTunnel = tunnel;
+                freeTunnel->transportIndex = (uint8_t) (self->firstTunnelTransportIndex + i);
+            }
+            continue;
+        }
+        if (tunnel->linkIndex == linkIndex && tunnel->clientConnectionId == clientConnectionId) {
+            return tunnel;
+        }
+    }
+
+    if (freeTunnel != 0) {
+        freeTunnel->isUsed = true;
+        freeTunnel->linkIndex = linkIndex;
+        freeTunnel->clientConnectionId = clientConnectionId;
+        CLOG_C_DEBUG(&self->log, "relay link %d: tunnel for client %u uses transport connection %u",
+                     self->links[linkIndex].connectionId, clientConnectionId, freeTunnel->transportIndex)
+    }
+
+    return freeTunnel;
+}
+
+static NimbleServerRelayUpstreamTunnel* findTunnel(NimbleServerRelayUpstream* self, size_t linkIndex,
+                                                   uint8_t clientConnectionId)
+{
+    for (size_t i = 0; i < self->tunnelCount; ++i) {
+        NimbleServerRelayUpstreamTunnel* tunnel = &self->tunnels[i];
+        if (tunnel->isUsed && tunnel->linkIndex == linkIndex && tunnel->clientConnectionId == clientConnectionId) {
+            return tunnel;
+        }
+    }
+
+    return 0;
+}
+
+/// Frees the tunnel and disconnects its transport connection on the server, so the participants of the client leave
+/// the game and the transport connection can be used by the next tunneled client.
+static void closeTunnel(NimbleServerRelayUpstream* self, NimbleServerRelayUpstreamTunnel* tunnel)
+{
+    CLOG_C_DEBUG(&self->log, "relay link %d: closing tunnel for client %u on transport connection %u",
+                 self->links[tunnel->linkIndex].connectionId, tunnel->clientConnectionId, tunnel->transportIndex)
+
+    int err = nimbleServerConnectionDisconnected(self->server, tunnel->transportIndex);
+    if (err < 0) {
+        CLOG_C_NOTICE(&self->log, "relay: could not disconnect transport connection %u: error %d",
+                      tunnel->transportIndex, err)
+    }
+
+    tunnel->isUsed = false;
+    self->stats.closedTunnelCount++;
+}
+
+/// Frees the link and all the tunnels that go through it
+static void closeLink(NimbleServerRelayUpstream* self, size_t linkIndex)
+{
+    for (size_t i = 0; i < self->tunnelCount; ++i) {
+        NimbleServerRelayUpstreamTunnel* tunnel = &self->tunnels[i];
+        if (tunnel->isUsed && tunnel->linkIndex == linkIndex) {
+            closeTunnel(self, tunnel);
+        }
+    }
+
+    NimbleServerRelayLink* link = &self->links[linkIndex];
+    CLOG_C_DEBUG(&self->log, "relay link %d disconnected", link->connectionId)
+    link->isUsed = false;
+    link->hasStarted = false;
+    link->snapshot.isActive = false;
+}
+
+static int handleTunnelClosed(NimbleServerRelayUpstream* self, size_t linkIndex, FldInStream* inStream)
+{
+    uint8_t clientConnectionId;
+    int err = fldInStreamReadUInt8(inStream, &clientConnectionId);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    NimbleServerRelayUpstreamTunnel* tunnel = findTunnel(self, linkIndex, clientConnectionId);
+    if (tunnel != 0) {
+        closeTunnel(self, tunnel);
+    }
+
+    return 0;
+}
+
+/// Feeds a datagram from a client of an edge to the server, as if the client was connected to the server directly
+static int handleTunnel(NimbleServerRelayUpstream* self, size_t linkIndex, FldInStream* inStream)
+{
+    uint8_t clientConnectionId;
+    uint16_t octetCount;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    fldInStreamReadUInt8(inStream, &clientConnectionId);
+    int err = fldInStreamReadUInt16(inStream, &octetCount);
+    if (err < 0 || octetCount > sizeof(datagram)) {
+        return NimbleServerErrSerialize;
+    }
+    err = fldInStreamReadOctets(inStream, datagram, octetCount);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    NimbleServerRelayUpstreamTunnel* tunnel = findOrAllocateTunnel(self, linkIndex, clientConnectionId);
+    if (tunnel == 0) {
+        CLOG_C_NOTICE(&self->log, "relay: no free tunnel for client %u", clientConnectionId)
+        return NimbleServerErrSessionFull;
+    }
+    tunnel->lastReceivedAtMs = self->server->now;
+
+    NimbleServerRelayTunnelResponse tunnelResponse;
+    tunnelResponse.upstream = self;
+    tunnelResponse.linkConnectionId = self->links[linkIndex].connectionId;
+    tunnelResponse.clientConnectionId = clientConnectionId;
+
+    DatagramTransportOut transportOut;
+    transportOut.self = &tunnelResponse;
+    transportOut.send = sendThroughTunnel;
+
+    NimbleServerResponse response;
+    response.transportOut = &transportOut;
+    response.runOut = 0;
+
+    self->stats.tunnelDatagramCount++;
+
+    return nimbleServerFeed(self->server, tunnel->transportIndex, datagram, octetCount, &response);
+}
+
+static NimbleServerRelayLink* findOrAllocateLink(NimbleServerRelayUpstream* self, int connectionId,
+                                                 size_t* outLinkIndex)
+{
+    NimbleServerRelayLink* freeLink = 0;
+    size_t freeLinkIndex = 0;
+
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_LINK_COUNT; ++i) {
+        NimbleServerRelayLink* link = &self->links[i];
+        if (link->isUsed && link->connectionId == connectionId) {
+            *outLinkIndex = i;
+            return link;
+        }
+        if (!link->isUsed && freeLink == 0) {
+            freeLink = link;
+            freeLinkIndex = i;
+        }
+    }
+
+    if (freeLink != 0) {
+        tc_mem_clear_type(freeLink);
+        freeLink->isUsed = true;
+        freeLink->connectionId = connectionId;
+        *outLinkIndex = freeLinkIndex;
+        CLOG_C_DEBUG(&self->log, "relay link %d connected", connectionId)
+    }
+
+    return freeLink;
+}
+
+static int readFromLinks(NimbleServerRelayUpstream* self)
+{
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE + 8];
+
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_DATAGRAMS_PER_UPDATE; ++i) {
+        int connectionId;
+        ssize_t octetCount = self->linkTransport.receiveFrom(self->linkTransport.self, &connectionId, datagram,
+                                                             sizeof(datagram));
+        if (octetCount <= 0) {
+            return (int) octetCount;
+        }
+
+        size_t linkIndex;
+        NimbleServerRelayLink* link = findOrAllocateLink(self, connectionId, &linkIndex);
+        if (link == 0) {
+            CLOG_C_NOTICE(&self->log, "relay: no free link for connection %d", connectionId)
+            continue;
+        }
+        link->lastReceivedAtMs = self->server->now;
+
+        FldInStream inStream;
+        fldInStreamInit(&inStream, datagram, (size_t) octetCount);
+
+        uint8_t frameType;
+        fldInStreamReadUInt8(&inStream, &frameType);
+
+        int err;
+        switch (frameType) {
+            case NimbleServerRelayFrameTypeAck:
+                err = handleAck(self, link, &inStream);
+                break;
+            case NimbleServerRelayFrameTypeTunnel:
+                err = handleTunnel(self, linkIndex, &inStream);
+                break;
+            case NimbleServerRelayFrameTypeTunnelClosed:
+                err = handleTunnelClosed(self, linkIndex, &inStream);
+                break;
+            default:
+                CLOG_C_SOFT_ERROR(&self->log, "relay: unknown frame type %02X from link %d", frameType, connectionId)
+                err = NimbleServerErrSerialize;
+                break;
+        }
+
+        if (err < 0 && !nimbleServerIsErrorExternal(err)) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/// Sends as many steps from startStepId as fit in a datagram
+/// @return negative on error, otherwise the number of steps in the datagram
+static int sendStepsFrame(NimbleServerRelayUpstream* self, const NimbleServerRelayLink* link, StepId startStepId)
+{
+    const NbsSteps* steps = &self->server->game.authoritativeSteps;
+    uint8_t payload[DATAGRAM_TRANSPORT_MAX_SIZE];
+    uint8_t stepBuffer[1024];
+
+    FldOutStream payloadStream;
+    fldOutStreamInit(&payloadStream, payload, sizeof(payload) - NIMBLE_SERVER_RELAY_STEPS_HEADER_OCTET_COUNT);
+
+    size_t stepCount = 0;
+    for (StepId stepId = startStepId;
+         stepId != steps->expectedWriteId && stepCount < NIMBLE_SERVER_RELAY_MAX_STEP_COUNT_IN_FRAME; ++stepId) {
+        int index = nbsStepsGetIndexForStep(steps, stepId);
+        if (index < 0) {
+            return index;
+        }
+        int octetCount = nbsStepsReadAtIndex(steps, index, stepBuffer, sizeof(stepBuffer));
+        if (octetCount < 0) {
+            return octetCount;
+        }
+        if (payloadStream.pos + 2 + (size_t) octetCount > payloadStream.size) {
+            break;
+        }
+        fldOutStreamWriteUInt16(&payloadStream, (uint16_t) octetCount);
+        fldOutStreamWriteOctets(&payloadStream, stepBuffer, (size_t) octetCount);
+        stepCount++;
+    }
+
+    if (stepCount == 0) {
+        return 0;
+    }
+
+    StepId lastStepId = (StepId) (startStepId + stepCount - 1);
+
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRelayFrameTypeSteps);
+    fldOutStreamWriteUInt32(&outStream, steps->expectedReadId);
+    fldOutStreamWriteUInt32(&outStream, startStepId);
+    fldOutStreamWriteUInt64(&outStream, (uint64_t) self->composedAtMs[lastStepId % NBS_WINDOW_SIZE]);
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) stepCount);
+    int err = fldOutStreamWriteOctets(&outStream, payload, payloadStream.pos);
+    if (err < 0) {
+        return err;
+    }
+
+    self->linkTransport.sendTo(self->linkTransport.self, link->connectionId, datagram, outStream.pos);
+    self->stats.stepsDatagramCount++;
+    self->stats.stepsOctetCount += outStream.pos;
+
+    return (int) stepCount;
+}
+
+/// Pushes the steps that the link has not received, including some already pushed steps for redundancy.
+/// A link that has not started gets the steps from the oldest step in the window, unless it must start from a
+/// snapshot.
+static int pushSteps(NimbleServerRelayUpstream* self, NimbleServerRelayLink* link)
+{
+    const NbsSteps* steps = &self->server->game.authoritativeSteps;
+    if (steps->stepsCount == 0) {
+        return 0;
+    }
+
+    StepId startStepId;
+    if (!link->hasStarted) {
+        if (self->snapshotOctets != 0) {
+            return 0;
+        }
+        startStepId = steps->expectedReadId;
+    } else {
+        if ((int32_t) (steps->expectedWriteId - link->pushedUpToStepId) <= 0) {
+            return 0;
+        }
+        startStepId = (StepId) (link->pushedUpToStepId - self->redundancyStepCount);
+        if ((int32_t) (link->waitingForStepId - startStepId) > 0) {
+            startStepId = link->waitingForStepId;
+        }
+    }
+    if ((int32_t) (steps->expectedReadId - startStepId) > 0) {
+        startStepId = steps->expectedReadId;
+    }
+
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_STEPS_DATAGRAMS_PER_UPDATE && startStepId != steps->expectedWriteId;
+         ++i) {
+        int stepCount = sendStepsFrame(self, link, startStepId);
+        if (stepCount <= 0) {
+            return stepCount;
+        }
+        startStepId = (StepId) (startStepId + (StepId) stepCount);
+        link->pushedUpToStepId = startStepId;
+    }
+
+    return 0;
+}
+
+/// Sends the next chunks of the snapshot. When all chunks have been sent, it starts over from the octet that the
+/// edge has acked.
+static int pushSnapshot(NimbleServerRelayUpstream* self, NimbleServerRelayLink* link)
+{
+    NimbleServerRelaySnapshotTransfer* transfer = &link->snapshot;
+    if (!transfer->isActive) {
+        return 0;
+    }
+
+    if (transfer->sentOctetCount >= self->snapshotOctetCount) {
+        transfer->sentOctetCount = transfer->ackedOctetCount;
+    }
+
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE + 32];
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_SNAPSHOT_CHUNKS_PER_UPDATE; ++i) {
+        size_t octetCount = self->snapshotOctetCount - transfer->sentOctetCount;
+        if (octetCount > NIMBLE_SERVER_RELAY_SNAPSHOT_CHUNK_OCTET_COUNT) {
+            octetCount = NIMBLE_SERVER_RELAY_SNAPSHOT_CHUNK_OCTET_COUNT;
+        }
+
+        FldOutStream outStream;
+        fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+        fldOutStreamWriteUInt8(&outStream, NimbleServerRelayFrameTypeSnapshotChunk);
+        fldOutStreamWriteUInt32(&outStream, transfer->stepId);
+        fldOutStreamWriteUInt32(&outStream, (uint32_t) self->snapshotOctetCount);
+        fldOutStreamWriteUInt32(&outStream, (uint32_t) transfer->sentOctetCount);
+        fldOutStreamWriteUInt16(&outStream, (uint16_t) octetCount);
+        int err = fldOutStreamWriteOctets(&outStream, self->snapshotOctets + transfer->sentOctetCount, octetCount);
+        if (err < 0) {
+            return err;
+        }
+
+        self->linkTransport.sendTo(self->linkTransport.self, link->connectionId, datagram, outStream.pos);
+        self->stats.snapshotChunkCount++;
+
+        transfer->sentOctetCount += octetCount;
+        if (transfer->sentOctetCount >= self->snapshotOctetCount) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/// Frees the tunnels and the links that have not received anything for NIMBLE_SERVER_RELAY_IDLE_TIMEOUT_MS.
+/// The edge is told about an expired tunnel, so it stops tunneling that client.
+static void expireIdle(NimbleServerRelayUpstream* self)
+{
+    MonotonicTimeMs now = self->server->now;
+
+    for (size_t i = 0; i < self->tunnelCount; ++i) {
+        NimbleServerRelayUpstreamTunnel* tunnel = &self->tunnels[i];
+        if (!tunnel->isUsed || now - tunnel->lastReceivedAtMs < NIMBLE_SERVER_RELAY_IDLE_TIMEOUT_MS) {
+            continue;
+        }
+        sendTunnelClosedFrame(&self->linkTransport, self->links[tunnel->linkIndex].connectionId,
+                              tunnel->clientConnectionId);
+        closeTunnel(self, tunnel);
+    }
+
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_LINK_COUNT; ++i) {
+        const NimbleServerRelayLink* link = &self->links[i];
+        if (!link->isUsed || now - link->lastReceivedAtMs < NIMBLE_SERVER_RELAY_IDLE_TIMEOUT_MS) {
+            continue;
+        }
+        closeLink(self, i);
+        self->stats.expiredLinkCount++;
+    }
+}
+
+/// Handles the acks and the tunneled datagrams from the edges, and pushes the new steps and snapshot chunks to them.
+/// Links and tunnels that have been idle for too long are freed.
+/// Should be called after every nimbleServerUpdate() of the server.
+/// @param self upstream
+/// @return negative on error
+int nimbleServerRelayUpstreamUpdate(NimbleServerRelayUpstream* self)
+{
+    rememberComposedSteps(self);
+
+    int err = readFromLinks(self);
+    if (err < 0) {
+        return err;
+    }
+
+    expireIdle(self);
+
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_LINK_COUNT; ++i) {
+        NimbleServerRelayLink* link = &self->links[i];
+        if (!link->isUsed) {
+            continue;
+        }
+
+        err = pushSnapshot(self, link);
+        if (err < 0) {
+            return err;
+        }
+
+        err = pushSteps(self, link);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/// Notify the upstream that the transport of an edge has disconnected.
+/// The link and all the tunnels that go through it are freed.
+/// @param self upstream
+/// @param connectionId the connection of the edge on the link transport
+/// @return negative on error
+int nimbleServerRelayUpstreamLinkDisconnected(NimbleServerRelayUpstream* self, int connectionId)
+{
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_LINK_COUNT; ++i) {
+        const NimbleServerRelayLink* link = &self->links[i];
+        if (link->isUsed && link->connectionId == connectionId) {
+            closeLink(self, i);
+            return 0;
+        }
+    }
+
+    return -2;
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// Edge
+// ---------------------------------------------------------------------------------------------------------------
+
+/// Checks if the datagram is a join request with participants. Only the upstream server can accept participants.
+static bool isJoinWithParticipants(const uint8_t* data, size_t octetCount)
+{
+    FldInStream inStream;
+    fldInStreamInit(&inStream, data, octetCount);
+    inStream.readDebugInfo = true;
+
+    OrderedDatagramInLogic inLogic;
+    orderedDatagramInLogicInit(&inLogic);
+    if (orderedDatagramInLogicReceive(&inLogic, &inStream) < 0) {
+        return false;
+    }
+
+    uint8_t cmd;
+    if (fldInStreamReadUInt8(&inStream, &cmd) < 0 || cmd != NimbleSerializeCmdJoinGameRequest) {
+        return false;
+    }
+
+    NimbleSerializeJoinGameRequest request;
+    if (nimbleSerializeServerInJoinGameRequest(&inStream, &request) < 0) {
+        return false;
+    }
+
+    return request.playerCount > 0;
+}
+
+static int edgeSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerRelay* self = (NimbleServerRelay*) _self;
+
+    return self->localTransport.sendTo(self->localTransport.self, connectionId, data, octetCount);
+}
+
+/// Receives the datagrams from the local clients. The datagrams from tunneled clients are forwarded to the upstream
+/// server, and are never seen by the edge server.
+static ssize_t edgeReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerRelay* self = (NimbleServerRelay*) _self;
+
+    while (true) {
+        int localConnectionId;
+        ssize_t octetCount = self->localTransport.receiveFrom(self->localTransport.self, &localConnectionId, data,
+                                                              maxOctetCount);
+        if (octetCount <= 0 || localConnectionId < 0 ||
+            localConnectionId >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+            *connectionId = localConnectionId;
+            return octetCount;
+        }
+
+        NimbleServerRelayTunnel* tunnel = &self->tunnels[localConnectionId];
+        if (!tunnel->isTunneled && isJoinWithParticipants(data, (size_t) octetCount)) {
+            CLOG_C_DEBUG(&self->log, "relay: client %d joins with participants, tunneling it upstream",
+                         localConnectionId)
+            tunnel->isTunneled = true;
+            orderedDatagramInLogicInit(&tunnel->fromUpstream);
+        }
+
+        if (!tunnel->isTunneled) {
+            *connectionId = localConnectionId;
+            return octetCount;
+        }
+
+        int err = sendTunnelFrame(&self->upstreamTransport, self->upstreamConnectionId, (uint8_t) localConnectionId,
+                                  data, (size_t) octetCount);
+        if (err < 0) {
+            return err;
+        }
+        self->stats.tunnelDatagramCount++;
+    }
+}
+
+static void serializeEdgeSnapshot(void* _self, NimbleServerSerializedGameState* state)
+{
+    NimbleServerRelay* self = (NimbleServerRelay*) _self;
+
+    state->gameState = self->snapshotOctets;
+    state->gameStateOctetCount = self->snapshotOctetCount;
+    state->stepId = self->snapshotStepId;
+    state->hash = 0;
+}
+
+/// Initializes an edge relay and its edge server.
+/// The multiTransport in the edgeSetup is the transport for the local clients. The edge must use the same
+/// maxParticipantCount and maxSingleParticipantStepOctetCount as the upstream server, so the authoritative steps fit.
+/// @param self relay
+/// @param edgeSetup setup for the edge server
+/// @param setup the link to the upstream server
+/// @return negative on error
+int nimbleServerRelayInit(NimbleServerRelay* self, NimbleServerSetup edgeSetup, NimbleServerRelaySetup setup)
+{
+    self->localTransport = edgeSetup.multiTransport;
+    self->upstreamTransport = setup.upstreamTransport;
+    self->upstreamConnectionId = setup.upstreamConnectionId;
+    self->useSnapshots = setup.useSnapshots;
+    self->hasStarted = false;
+    self->log = setup.log;
+    tc_mem_clear_type_n(self->tunnels, NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+    tc_mem_clear_type(&self->stats);
+
+    self->snapshotCapacity = edgeSetup.maxGameStateOctetCount;
+    self->snapshotOctets = 0;
+    self->snapshotOctetCount = 0;
+    self->snapshotStepId = 0;
+    self->hasSnapshot = false;
+    self->receivingSnapshotOctets = 0;
+    self->receivingSnapshotOctetCount = 0;
+    self->receivingSnapshotStepId = 0;
+
+    if (setup.useSnapshots) {
+        self->snapshotOctets = IMPRINT_ALLOC_TYPE_COUNT(setup.allocator, uint8_t, self->snapshotCapacity);
+        self->receivingSnapshotOctets = IMPRINT_ALLOC_TYPE_COUNT(setup.allocator, uint8_t, self->snapshotCapacity);
+        self->callbackVtbl.authoritativeStateSerializeFn = serializeEdgeSnapshot;
+        self->callbackVtbl.authoritativeStepsComposedFn = 0;
+        self->callbackVtbl.predictedStepsValidateFn = 0;
+        self->callbackVtbl.forcedStepCreateFn = 0;
+        edgeSetup.callbackObject.vtbl = &self->callbackVtbl;
+        edgeSetup.callbackObject.self = self;
+    } else {
+        edgeSetup.callbackObject.vtbl = 0;
+        edgeSetup.callbackObject.self = 0;
+    }
+
+    edgeSetup.multiTransport.self = self;
+    edgeSetup.multiTransport.sendTo = edgeSendTo;
+    edgeSetup.multiTransport.receiveFrom = edgeReceiveFrom;
+
+    return nimbleServerInit(&self->edge, edgeSetup);
+}
+
+/// Starts the edge game over at the StepId
+static void restartAt(NimbleServerRelay* self, StepId stepId)
+{
+    CLOG_C_DEBUG(&self->log, "relay: starting at step %08X", stepId)
+    nimbleServerGameReInit(&self->edge.game, stepId);
+    self->hasStarted = true;
+}
+
+static int writeStep(NimbleServerRelay* self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    NimbleServerGame* game = &self->edge.game;
+
+    int err = nbsStepsWrite(&game->authoritativeSteps, stepId, octets, octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    if (game->observer.stepComposedFn != 0) {
+        game->observer.stepComposedFn(game->observer.self, stepId, octets, octetCount);
+    }
+
+    return 0;
+}
+
+static int handleSteps(NimbleServerRelay* self, FldInStream* inStream, MonotonicTimeMs now)
+{
+    uint32_t oldestStepId;
+    uint32_t firstStepId;
+    uint64_t composedAtMs;
+    uint8_t stepCount;
+
+    fldInStreamReadUInt32(inStream, &oldestStepId);
+    fldInStreamReadUInt32(inStream, &firstStepId);
+    fldInStreamReadUInt64(inStream, &composedAtMs);
+    int err = fldInStreamReadUInt8(inStream, &stepCount);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    NbsSteps* steps = &self->edge.game.authoritativeSteps;
+
+    if (!self->hasStarted) {
+        if (self->useSnapshots) {
+            return 0;
+        }
+        restartAt(self, firstStepId);
+    } else if ((int32_t) (firstStepId - steps->expectedWriteId) > 0 &&
+               (int32_t) (oldestStepId - steps->expectedWriteId) > 0) {
+        // The upstream server does not have the steps we are waiting for anymore
+        CLOG_C_NOTICE(&self->log, "relay: fell behind, waiting for %08X but oldest upstream step is %08X",
+                      steps->expectedWriteId, oldestStepId)
+        restartAt(self, firstStepId);
+        self->hasSnapshot = false;
+        self->stats.restartCount++;
+    }
+
+    uint8_t stepBuffer[1024];
+    for (size_t i = 0; i < stepCount; ++i) {
+        uint16_t octetCount;
+        err = fldInStreamReadUInt16(inStream, &octetCount);
+        if (err < 0 || octetCount > sizeof(stepBuffer)) {
+            return NimbleServerErrSerialize;
+        }
+        err = fldInStreamReadOctets(inStream, stepBuffer, octetCount);
+        if (err < 0) {
+            return NimbleServerErrSerialize;
+        }
+
+        StepId stepId = (StepId) (firstStepId + i);
+        if (stepId != steps->expectedWriteId) {
+            continue;
+        }
+
+        err = writeStep(self, stepId, stepBuffer, octetCount);
+        if (err < 0) {
+            return err;
+        }
+        self->stats.receivedStepCount++;
+
+        if (i + 1 == stepCount && now >= (MonotonicTimeMs) composedAtMs) {
+            uint64_t latencyMs = (uint64_t) (now - (MonotonicTimeMs) composedAtMs);
+            self->stats.hopLatencySampleCount++;
+            self->stats.hopLatencyTotalMs += latencyMs;
+            if (latencyMs > self->stats.hopLatencyMaxMs) {
+                self->stats.hopLatencyMaxMs = latencyMs;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int handleSnapshotChunk(NimbleServerRelay* self, FldInStream* inStream)
+{
+    uint32_t stepId;
+    uint32_t totalOctetCount;
+    uint32_t offset;
+    uint16_t octetCount;
+
+    fldInStreamReadUInt32(inStream, &stepId);
+    fldInStreamReadUInt32(inStream, &totalOctetCount);
+    fldInStreamReadUInt32(inStream, &offset);
+    int err = fldInStreamReadUInt16(inStream, &octetCount);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    if (!self->useSnapshots) {
+        return 0;
+    }
+
+    if (totalOctetCount > self->snapshotCapacity || (size_t) offset + octetCount > totalOctetCount) {
+        CLOG_C_SOFT_ERROR(&self->log, "relay: snapshot %08X does not fit (%u octets)", stepId, totalOctetCount)
+        return NimbleServerErrSerialize;
+    }
+
+    if (stepId != self->receivingSnapshotStepId) {
+        if (offset != 0) {
+            return 0;
+        }
+        self->receivingSnapshotStepId = stepId;
+        self->receivingSnapshotOctetCount = 0;
+    }
+
+    if (offset != self->receivingSnapshotOctetCount) {
+        return 0;
+    }
+
+    err = fldInStreamReadOctets(inStream, self->receivingSnapshotOctets + offset, octetCount);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+    self->receivingSnapshotOctetCount += octetCount;
+
+    if (self->receivingSnapshotOctetCount != totalOctetCount ||
+        (self->hasSnapshot && self->snapshotStepId == stepId)) {
+        return 0;
+    }
+
+    // The receiving octet count is kept, so the completed transfer is still acked
+    tc_memcpy_octets(self->snapshotOctets, self->receivingSnapshotOctets, totalOctetCount);
+    self->snapshotOctetCount = totalOctetCount;
+    self->snapshotStepId = stepId;
+    self->hasSnapshot = true;
+
+    CLOG_C_DEBUG(&self->log, "relay: received snapshot %08X (%u octets)", stepId, totalOctetCount)
+
+    if (!self->hasStarted) {
+        restartAt(self, stepId);
+    }
+
+    return 0;
+}
+
+/// Forwards a reply from the upstream server to a tunneled local client. The ordered datagram header from the
+/// upstream server is replaced with the header of the local transport connection.
+static int handleTunnelReply(NimbleServerRelay* self, FldInStream* inStream)
+{
+    uint8_t clientConnectionId;
+    uint16_t octetCount;
+    uint8_t reply[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    fldInStreamReadUInt8(inStream, &clientConnectionId);
+    int err = fldInStreamReadUInt16(inStream, &octetCount);
+    if (err < 0 || octetCount > sizeof(reply)) {
+        return NimbleServerErrSerialize;
+    }
+    err = fldInStreamReadOctets(inStream, reply, octetCount);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    if (clientConnectionId >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS ||
+        !self->tunnels[clientConnectionId].isTunneled) {
+        return 0;
+    }
+
+    FldInStream replyStream;
+    fldInStreamInit(&replyStream, reply, octetCount);
+    if (orderedDatagramInLogicReceive(&self->tunnels[clientConnectionId].fromUpstream, &replyStream) < 0) {
+        return 0;
+    }
+
+    NimbleServerTransportConnection* transportConnection = &self->edge.transportConnections[clientConnectionId];
+
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+    err = transportConnectionWriteHeader(transportConnection, &outStream);
+    if (err < 0) {
+        return err;
+    }
+    err = fldOutStreamWriteOctets(&outStream, reply + replyStream.pos, octetCount - replyStream.pos);
+    if (err < 0) {
+        return err;
+    }
+    transportConnectionCommitHeader(transportConnection);
+
+    self->stats.tunnelDatagramCount++;
+
+    return self->localTransport.sendTo(self->localTransport.self, clientConnectionId, datagram, outStream.pos);
+}
+
+/// The upstream server has expired the tunnel of a local client, so a new join from the client is tunneled again
+static int handleTunnelClosedFromUpstream(NimbleServerRelay* self, FldInStream* inStream)
+{
+    uint8_t clientConnectionId;
+    int err = fldInStreamReadUInt8(inStream, &clientConnectionId);
+    if (err < 0) {
+        return NimbleServerErrSerialize;
+    }
+
+    if (clientConnectionId >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS ||
+        !self->tunnels[clientConnectionId].isTunneled) {
+        return 0;
+    }
+
+    CLOG_C_DEBUG(&self->log, "relay: upstream closed the tunnel for client %u", clientConnectionId)
+    self->tunnels[clientConnectionId].isTunneled = false;
+    self->stats.closedTunnelCount++;
+
+    return 0;
+}
+
+static int readFromUpstream(NimbleServerRelay* self, MonotonicTimeMs now)
+{
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE + 32];
+
+    for (size_t i = 0; i < NIMBLE_SERVER_RELAY_MAX_DATAGRAMS_PER_UPDATE; ++i) {
+        int connectionId;
+        ssize_t octetCount = self->upstreamTransport.receiveFrom(self->upstreamTransport.self, &connectionId,
+                                                                 datagram, sizeof(datagram));
+        if (octetCount <= 0) {
+            return (int) octetCount;
+        }
+
+        if (connectionId != self->upstreamConnectionId) {
+            continue;
+        }
+
+        FldInStream inStream;
+        fldInStreamInit(&inStream, datagram, (size_t) octetCount);
+
+        uint8_t frameType;
+        fldInStreamReadUInt8(&inStream, &frameType);
+
+        int err;
+        switch (frameType) {
+            case NimbleServerRelayFrameTypeSteps:
+                err = handleSteps(self, &inStream, now);
+                break;
+            case NimbleServerRelayFrameTypeSnapshotChunk:
+                err = handleSnapshotChunk(self, &inStream);
+                break;
+            case NimbleServerRelayFrameTypeTunnel:
+                err = handleTunnelReply(self, &inStream);
+                break;
+            case NimbleServerRelayFrameTypeTunnelClosed:
+                err = handleTunnelClosedFromUpstream(self, &inStream);
+                break;
+            default:
+                CLOG_C_SOFT_ERROR(&self->log, "relay: unknown frame type %02X from upstream", frameType)
+                err = NimbleServerErrSerialize;
+                break;
+        }
+
+        if (err < 0 && !nimbleServerIsErrorExternal(err)) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/// Tells the upstream server which step the edge is waiting for, and if it needs a (newer) snapshot
+static int sendAck(NimbleServerRelay* self)
+{
+    const NbsSteps* steps = &self->edge.game.authoritativeSteps;
+
+    uint8_t flags = 0;
+    if (self->hasStarted) {
+        flags |= NIMBLE_SERVER_RELAY_ACK_FLAG_HAS_STARTED;
+    }
+    bool snapshotIsTooOld = self->hasStarted && (int32_t) (self->snapshotStepId - steps->expectedReadId) < 0;
+    if (self->useSnapshots && (!self->hasSnapshot || snapshotIsTooOld)) {
+        flags |= NIMBLE_SERVER_RELAY_ACK_FLAG_WANTS_SNAPSHOT;
+    }
+
+    uint8_t datagram[32];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+    fldOutStreamWriteUInt8(&outStream, NimbleServerRelayFrameTypeAck);
+    fldOutStreamWriteUInt8(&outStream, flags);
+    fldOutStreamWriteUInt32(&outStream, self->hasStarted ? steps->expectedWriteId : 0);
+    fldOutStreamWriteUInt32(&outStream, self->receivingSnapshotStepId);
+    fldOutStreamWriteUInt32(&outStream, (uint32_t) self->receivingSnapshotOctetCount);
+
+    return self->upstreamTransport.sendTo(self->upstreamTransport.self, self->upstreamConnectionId, datagram,
+                                          outStream.pos);
+}
+
+/// Handles the frames from the upstream server, updates the edge server (that pushes the steps to the local
+/// spectators) and acks the upstream server.
+/// @param self relay
+/// @param now current local time
+/// @return negative on error
+int nimbleServerRelayUpdate(NimbleServerRelay* self, MonotonicTimeMs now)
+{
+    int err = readFromUpstream(self, now);
+    if (err < 0) {
+        return err;
+    }
+
+    // The edge never composes any steps, so the window is trimmed here instead of when steps are received
+    err = nimbleServerDiscardAuthoritativeStepsIfBufferGettingFull(&self->edge.game);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerUpdate(&self->edge, now);
+    if (err < 0) {
+        return err;
+    }
+
+    return sendAck(self);
+}
+
+/// Notify the relay that a local client has disconnected on the transport layer.
+/// The tunnel of a tunneled client is closed on the upstream server, so its participants leave the game there.
+/// Other clients are disconnected from the edge server.
+/// @param self relay
+/// @param connectionIndex local transport connection index that disconnected
+/// @return negative on error
+int nimbleServerRelayConnectionDisconnected(NimbleServerRelay* self, uint8_t connectionIndex)
+{
+    if (connectionIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        return -1;
+    }
+
+    NimbleServerRelayTunnel* tunnel = &self->tunnels[connectionIndex];
+    if (!tunnel->isTunneled) {
+        return nimbleServerConnectionDisconnected(&self->edge, connectionIndex);
+    }
+
+    CLOG_C_DEBUG(&self->log, "relay: tunneled client %u disconnected", connectionIndex)
+    tunnel->isTunneled = false;
+    self->stats.closedTunnelCount++;
+
+    NimbleServerTransportConnection* transportConnection = &self->edge.transportConnections[connectionIndex];
+    if (transportConnection->isUsed) {
+        transportConnectionDisconnect(transportConnection);
+    }
+
+    // If the frame is lost, the upstream server expires the tunnel when it has been idle for too long
+    return sendTunnelClosedFrame(&self->upstreamTransport, self->upstreamConnectionId, connectionIndex);
+}
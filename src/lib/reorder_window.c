@@ -0,0 +1,71 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <flood/in_stream.h>
+#include <nimble-server/reorder_window.h>
+
+/// Initializes the window, the next datagram is always accepted as newer
+/// @param self reorder window
+void nimbleServerReorderWindowInit(NimbleServerReorderWindow* self)
+{
+    self->newestSequenceId = 0;
+    self->receivedMask = 0;
+    self->hasReceivedInitialDatagram = false;
+    self->lateCount = 0;
+    self->duplicateCount = 0;
+    self->tooOldCount = 0;
+}
+
+/// Reads the sequence id of the datagram and classifies it against the datagrams received before
+/// @param self reorder window
+/// @param inStream stream positioned at the sequence id, it is positioned after it on return
+/// @param result newer, late, duplicate or too old
+/// @return negative if the sequence id could not be read
+int nimbleServerReorderWindowReceive(NimbleServerReorderWindow* self, FldInStream* inStream,
+                                     NimbleServerReorderWindowResult* result)
+{
+    uint16_t sequenceId;
+    int err = fldInStreamReadUInt16(inStream, &sequenceId);
+    if (err < 0) {
+        return err;
+    }
+
+    if (!self->hasReceivedInitialDatagram) {
+        self->hasReceivedInitialDatagram = true;
+        self->newestSequenceId = sequenceId;
+        self->receivedMask = 1;
+        *result = NimbleServerReorderWindowNewer;
+        return 0;
+    }
+
+    int16_t distance = (int16_t) (uint16_t) (sequenceId - self->newestSequenceId);
+    if (distance > 0) {
+        self->receivedMask = distance >= NIMBLE_SERVER_REORDER_WINDOW_SIZE ? 0 : self->receivedMask << distance;
+        self->receivedMask |= 1;
+        self->newestSequenceId = sequenceId;
+        *result = NimbleServerReorderWindowNewer;
+        return 0;
+    }
+
+    int behindCount = -(int) distance;
+    if (behindCount >= NIMBLE_SERVER_REORDER_WINDOW_SIZE) {
+        self->tooOldCount++;
+        *result = NimbleServerReorderWindowTooOld;
+        return 0;
+    }
+
+    uint64_t bit = (uint64_t) 1 << behindCount;
+    if (self->receivedMask & bit) {
+        self->duplicateCount++;
+        *result = NimbleServerReorderWindowDuplicate;
+        return 0;
+    }
+
+    self->receivedMask |= bit;
+    self->lateCount++;
+    *result = NimbleServerReorderWindowLate;
+
+    return 0;
+}
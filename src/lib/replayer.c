@@ -0,0 +1,550 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <datagram-transport/types.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/recorder.h>
+#include <nimble-server/replayer.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Checks the type of the next record without reading it
+/// @param self replayer
+/// @param type type to check for
+/// @return true if the next record is of that type
+static bool nextRecordIs(const NimbleServerReplayer* self, NimbleServerRecordType type)
+{
+    return self->inStream.pos < self->inStream.size && self->inStream.octets[self->inStream.pos] == (uint8_t) type;
+}
+
+/// Returns a pointer to the payload in the recording and skips past it
+/// @param self replayer
+/// @param octetCount payload octet count
+/// @return the payload, or NULL if the recording is truncated
+static const uint8_t* readPayload(NimbleServerReplayer* self, size_t octetCount)
+{
+    FldInStream* inStream = &self->inStream;
+    if (inStream->pos + octetCount > inStream->size) {
+        CLOG_C_SOFT_ERROR(&self->log, "replay: recording is truncated")
+        return 0;
+    }
+
+    const uint8_t* payload = inStream->octets + inStream->pos;
+    inStream->p += octetCount;
+    inStream->pos += octetCount;
+
+    return payload;
+}
+
+/// Compares a datagram that the server sends with the next output in the recording.
+/// An output that is not in the recording is counted as a mismatch and the recording is not advanced.
+/// @param self replayer
+/// @param transportIndex the transport index the datagram is sent to
+/// @param data datagram octets
+/// @param octetCount octet count of data
+static void checkOutput(NimbleServerReplayer* self, uint8_t transportIndex, const uint8_t* data, size_t octetCount)
+{
+    self->stats.outputCount++;
+
+    if (!nextRecordIs(self, NimbleServerRecordTypeOutput)) {
+        CLOG_C_NOTICE(&self->log, "replay: server sent %zu octets to %u, but the recording has no output here",
+                      octetCount, transportIndex)
+        self->stats.mismatchCount++;
+        return;
+    }
+
+    uint8_t type;
+    uint8_t recordedTransportIndex;
+    uint16_t recordedOctetCount;
+    uint64_t recordedHash;
+    fldInStreamReadUInt8(&self->inStream, &type);
+    fldInStreamReadUInt8(&self->inStream, &recordedTransportIndex);
+    fldInStreamReadUInt16(&self->inStream, &recordedOctetCount);
+    fldInStreamReadUInt64(&self->inStream, &recordedHash);
+    self->stats.recordCount++;
+
+    if (recordedTransportIndex != transportIndex || recordedOctetCount != octetCount ||
+        recordedHash != nimbleServerRecordingHash(data, octetCount)) {
+        CLOG_C_NOTICE(&self->log, "replay: output to %u (%zu octets) differs from the recorded output to %u (%u octets)",
+                      transportIndex, octetCount, recordedTransportIndex, recordedOctetCount)
+        self->stats.mismatchCount++;
+    }
+}
+
+static int checkingSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerReplayer* self = (NimbleServerReplayer*) _self;
+
+    checkOutput(self, self->feedTransportIndex, data, octetCount);
+
+    return 0;
+}
+
+static int checkingSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerReplayer* self = (NimbleServerReplayer*) _self;
+
+    checkOutput(self, (uint8_t) connectionId, data, octetCount);
+
+    return 0;
+}
+
+/// Reads the fixed part of a feed or receive record
+/// @param self replayer
+/// @param[out] transportIndex the transport index the datagram was received on
+/// @param[out] data the datagram octets, in the recording
+/// @return negative on error, otherwise the octet count of the datagram
+static ssize_t readFeed(NimbleServerReplayer* self, uint8_t* transportIndex, const uint8_t** data)
+{
+    uint8_t type;
+    uint16_t octetCount;
+    fldInStreamReadUInt8(&self->inStream, &type);
+    fldInStreamReadUInt8(&self->inStream, transportIndex);
+    fldInStreamReadUInt16(&self->inStream, &octetCount);
+
+    *data = readPayload(self, octetCount);
+    if (*data == 0) {
+        return -1;
+    }
+
+    self->stats.recordCount++;
+    self->stats.feedCount++;
+    self->stats.feedOctetCount += octetCount;
+    self->feedTransportIndex = *transportIndex;
+
+    return (ssize_t) octetCount;
+}
+
+/// The server reads from the recording when it reads from the multi transport. Only the datagrams that the server
+/// read from the transport are returned, the ones that were fed directly with nimbleServerFeed() are fed by
+/// nimbleServerReplayerNext() in the same order as they were recorded.
+static ssize_t replayReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerReplayer* self = (NimbleServerReplayer*) _self;
+
+    if (!nextRecordIs(self, NimbleServerRecordTypeReceive)) {
+        return 0;
+    }
+
+    uint8_t transportIndex;
+    const uint8_t* recordedData;
+    ssize_t octetCount = readFeed(self, &transportIndex, &recordedData);
+    if (octetCount < 0) {
+        return octetCount;
+    }
+
+    if ((size_t) octetCount > maxOctetCount) {
+        return -2;
+    }
+
+    *connectionId = transportIndex;
+    tc_memcpy_octets(data, recordedData, (size_t) octetCount);
+
+    return octetCount;
+}
+
+/// The composed steps are not passed on to an application during a replay
+static void replayStepsComposed(void* _self, const NbsSteps* steps, StepId firstStepId, size_t stepCount)
+{
+    (void) _self;
+    (void) steps;
+    (void) firstStepId;
+    (void) stepCount;
+}
+
+static void replaySerializeState(void* _self, NimbleServerSerializedGameState* state)
+{
+    NimbleServerReplayer* self = (NimbleServerReplayer*) _self;
+
+    state->gameState = 0;
+    state->gameStateOctetCount = 0;
+    state->stepId = 0;
+    state->hash = 0;
+
+    if (!nextRecordIs(self, NimbleServerRecordTypeSerializedGameState)) {
+        CLOG_C_NOTICE(&self->log, "replay: server asked for the game state, but the recording has no game state here")
+        self->stats.mismatchCount++;
+        return;
+    }
+
+    uint8_t type;
+    uint32_t stepId;
+    uint64_t hash;
+    uint32_t octetCount;
+    fldInStreamReadUInt8(&self->inStream, &type);
+    fldInStreamReadUInt32(&self->inStream, &stepId);
+    fldInStreamReadUInt64(&self->inStream, &hash);
+    fldInStreamReadUInt32(&self->inStream, &octetCount);
+    self->stats.recordCount++;
+
+    state->gameState = readPayload(self, octetCount);
+    state->gameStateOctetCount = state->gameState != 0 ? octetCount : 0;
+    state->stepId = (StepId) stepId;
+    state->hash = hash;
+}
+
+/// Reads the steps of a validated steps record, after the type octet, and copies the recorded result to the steps
+/// @param self replayer
+/// @param steps the steps to update, or NULL to only skip the record
+/// @param stepCount number of steps
+/// @return negative if the recording is truncated
+static int readValidatedSteps(NimbleServerReplayer* self, NimbleServerValidatedStep* steps, size_t stepCount)
+{
+    uint16_t recordedStepCount;
+    fldInStreamReadUInt16(&self->inStream, &recordedStepCount);
+    if (steps != 0 && recordedStepCount != stepCount) {
+        CLOG_C_NOTICE(&self->log, "replay: validated %zu predicted steps, but the recording has %u", stepCount,
+                      recordedStepCount)
+        self->stats.mismatchCount++;
+    }
+
+    for (size_t i = 0; i < recordedStepCount; ++i) {
+        uint8_t isRejected;
+        uint8_t octetCount;
+        fldInStreamReadUInt8(&self->inStream, &isRejected);
+        fldInStreamReadUInt8(&self->inStream, &octetCount);
+        const uint8_t* octets = readPayload(self, octetCount);
+        if (octets == 0) {
+            return NimbleServerErrSerialize;
+        }
+
+        if (steps == 0 || i >= stepCount) {
+            continue;
+        }
+
+        NimbleServerValidatedStep* step = &steps[i];
+        if (octetCount > step->maxOctetCount) {
+            self->stats.mismatchCount++;
+            step->isRejected = true;
+            continue;
+        }
+        step->isRejected = isRejected != 0;
+        tc_memcpy_octets(step->octets, octets, octetCount);
+        step->octetCount = octetCount;
+    }
+
+    return 0;
+}
+
+/// Uses the recorded validation result instead of calling the validator of the application, so the replay inserts
+/// the same predicted steps as the recorded session
+static void replayValidateSteps(void* _self, NimbleServerValidatedStep* steps, size_t stepCount)
+{
+    NimbleServerReplayer* self = (NimbleServerReplayer*) _self;
+
+    if (!nextRecordIs(self, NimbleServerRecordTypeValidatedSteps)) {
+        CLOG_C_NOTICE(&self->log, "replay: server validated predicted steps, but the recording has no validation here")
+        self->stats.mismatchCount++;
+        return;
+    }
+
+    uint8_t type;
+    fldInStreamReadUInt8(&self->inStream, &type);
+    self->stats.recordCount++;
+
+    readValidatedSteps(self, steps, stepCount);
+}
+
+/// Returns the recorded secret, called by the server instead of generating a new secret
+/// @param self replayer
+/// @return the recorded secret, or zero if the recording has no secret here
+uint64_t nimbleServerReplayerSecret(NimbleServerReplayer* self)
+{
+    if (!nextRecordIs(self, NimbleServerRecordTypeSecret)) {
+        CLOG_C_NOTICE(&self->log, "replay: server generated a secret, but the recording has no secret here")
+        self->stats.mismatchCount++;
+        return 0;
+    }
+
+    uint8_t type;
+    uint64_t secret;
+    fldInStreamReadUInt8(&self->inStream, &type);
+    fldInStreamReadUInt64(&self->inStream, &secret);
+    self->stats.recordCount++;
+
+    return secret;
+}
+
+/// Reads the header of the recording and initializes a server with the same setup
+/// @param self replayer
+/// @param recording the recording, must be kept in memory while replaying
+/// @param octetCount octet count of recording
+/// @param memory memory for the server
+/// @param blobAllocator blob allocator for the server
+/// @param log log to use for the replayer and the server
+/// @return negative on error
+int nimbleServerReplayerInit(NimbleServerReplayer* self, const uint8_t* recording, size_t octetCount,
+                             ImprintAllocator* memory, ImprintAllocatorWithFree* blobAllocator, Clog log)
+{
+    self->log = log;
+    self->feedTransportIndex = 0;
+    tc_mem_clear_type(&self->stats);
+
+    fldInStreamInit(&self->inStream, recording, octetCount);
+
+    uint32_t magic;
+    uint8_t formatVersion;
+    int err = fldInStreamReadUInt32(&self->inStream, &magic);
+    if (err < 0) {
+        return err;
+    }
+    fldInStreamReadUInt8(&self->inStream, &formatVersion);
+    if (magic != NIMBLE_SERVER_RECORDING_MAGIC || formatVersion != NIMBLE_SERVER_RECORDING_FORMAT_VERSION) {
+        CLOG_C_SOFT_ERROR(&self->log, "replay: not a recording, or the wrong format version (%u)", formatVersion)
+        return -1;
+    }
+
+    NimbleServerSetup setup;
+    tc_mem_clear_type(&setup);
+
+    uint32_t values[12];
+    uint8_t useSingleArena;
+    uint8_t forcedStepPolicy;
+    uint8_t isSimulatedOnServer;
+    uint8_t usesStepValidation;
+    uint64_t now;
+    uint32_t stepId;
+    fldInStreamReadUInt16(&self->inStream, &setup.applicationVersion.major);
+    fldInStreamReadUInt16(&self->inStream, &setup.applicationVersion.minor);
+    fldInStreamReadUInt16(&self->inStream, &setup.applicationVersion.patch);
+    for (size_t i = 0; i < 12; ++i) {
+        fldInStreamReadUInt32(&self->inStream, &values[i]);
+    }
+    fldInStreamReadUInt8(&self->inStream, &useSingleArena);
+    fldInStreamReadUInt8(&self->inStream, &forcedStepPolicy);
+    fldInStreamReadUInt8(&self->inStream, &isSimulatedOnServer);
+    fldInStreamReadUInt8(&self->inStream, &usesStepValidation);
+    fldInStreamReadUInt64(&self->inStream, &now);
+    err = fldInStreamReadUInt32(&self->inStream, &stepId);
+    if (err < 0) {
+        return err;
+    }
+
+    self->callbackVtbl.authoritativeStateSerializeFn = replaySerializeState;
+    self->callbackVtbl.authoritativeStepsComposedFn = replayStepsComposed;
+    // A validated session is replayed with the recorded validation results
+    self->callbackVtbl.predictedStepsValidateFn = usesStepValidation != 0 ? replayValidateSteps : 0;
+    self->callbackVtbl.forcedStepCreateFn = 0;
+    self->checkingTransportOut.self = self;
+    self->checkingTransportOut.send = checkingSend;
+
+    setup.memory = memory;
+    setup.blobAllocator = blobAllocator;
+    setup.maxConnectionCount = values[0];
+    setup.maxParticipantCount = values[1];
+    setup.maxSingleParticipantStepOctetCount = values[2];
+    setup.maxParticipantCountForEachConnection = values[3];
+    setup.maxWaitingForReconnectTicks = values[4];
+    setup.maxGameStateOctetCount = values[5];
+    setup.participantStepBudgetOctetCount = values[6];
+    setup.targetTickTimeMs = values[7];
+    setup.historyStepCount = values[8];
+    setup.historyOctetCount = values[9];
+    setup.maxSpectatorCount = values[10];
+    setup.spectatorRedundancyStepCount = values[11];
+    setup.useSingleArena = useSingleArena != 0;
+    setup.forcedStepPolicy = (NimbleServerForcedStepPolicy) forcedStepPolicy;
+    if (setup.forcedStepPolicy == NimbleServerForcedStepPolicyCallback) {
+        CLOG_C_NOTICE(&self->log, "the forced steps were created by the application, they are replayed as empty steps")
+        setup.forcedStepPolicy = NimbleServerForcedStepPolicyZero;
+    }
+    setup.now = (MonotonicTimeMs) now;
+    setup.callbackObject.vtbl = &self->callbackVtbl;
+    setup.callbackObject.self = self;
+    setup.multiTransport.self = self;
+    setup.multiTransport.receiveFrom = replayReceiveFrom;
+    setup.multiTransport.sendTo = checkingSendTo;
+    setup.log = log;
+
+    err = nimbleServerInit(&self->server, setup);
+    if (err < 0) {
+        return err;
+    }
+    self->server.replayer = self;
+    // The recorded server decides if composing waits for a game state, not the callbacks of the replayer
+    self->server.game.isSimulatedOnServer = isSimulatedOnServer != 0;
+
+    if (self->server.game.authoritativeSteps.expectedWriteId != (StepId) stepId) {
+        nimbleServerReInitWithGame(&self->server, (StepId) stepId, (MonotonicTimeMs) now);
+    }
+
+    return 0;
+}
+
+/// Reads the local party infos for a host migration record
+/// @param self replayer
+/// @param[out] localPartyInfos target for the party infos
+/// @param maxLocalPartyCount maximum number of party infos
+/// @return negative on error, otherwise the number of parties
+static int readHostMigration(NimbleServerReplayer* self, NimbleSerializeLocalPartyInfo* localPartyInfos,
+                             size_t maxLocalPartyCount)
+{
+    uint8_t partyCount;
+    fldInStreamReadUInt8(&self->inStream, &partyCount);
+    if (partyCount > maxLocalPartyCount) {
+        return NimbleServerErrSerialize;
+    }
+
+    const size_t maxParticipantCount = sizeof(localPartyInfos[0].participantIds) /
+                                       sizeof(localPartyInfos[0].participantIds[0]);
+
+    for (size_t i = 0; i < partyCount; ++i) {
+        uint8_t participantCount;
+        fldInStreamReadUInt8(&self->inStream, &participantCount);
+        if (participantCount > maxParticipantCount) {
+            return NimbleServerErrSerialize;
+        }
+        localPartyInfos[i].participantCount = participantCount;
+        for (size_t j = 0; j < participantCount; ++j) {
+            uint8_t participantId;
+            fldInStreamReadUInt8(&self->inStream, &participantId);
+            localPartyInfos[i].participantIds[j] = (NimbleSerializeParticipantId) participantId;
+        }
+    }
+
+    return partyCount;
+}
+
+/// Replays the next input in the recording. The outputs, secrets and game states that the server asks for are read
+/// while the server handles the input.
+/// @param self replayer
+/// @return negative if the recording is corrupt
+int nimbleServerReplayerNext(NimbleServerReplayer* self)
+{
+    if (nimbleServerReplayerIsDone(self)) {
+        return 0;
+    }
+
+    uint8_t type = self->inStream.octets[self->inStream.pos];
+
+    if (type == NimbleServerRecordTypeFeed) {
+        uint8_t transportIndex;
+        const uint8_t* data;
+        ssize_t octetCount = readFeed(self, &transportIndex, &data);
+        if (octetCount < 0) {
+            return (int) octetCount;
+        }
+
+        NimbleServerResponse response;
+        response.transportOut = &self->checkingTransportOut;
+        response.runOut = 0;
+
+        // The errors from feed are part of the recorded behavior, the outputs show if they differ
+        nimbleServerFeed(&self->server, transportIndex, data, (size_t) octetCount, &response);
+
+        return 0;
+    }
+
+    if (type == NimbleServerRecordTypeReceive) {
+        // The application called nimbleServerReadFromMultiTransport() outside of nimbleServerUpdate()
+        int err = nimbleServerReadFromMultiTransport(&self->server);
+        if (err < 0 && !nimbleServerIsErrorExternal(err)) {
+            CLOG_C_NOTICE(&self->log, "replay: reading from the transport failed %d", err)
+        }
+
+        return 0;
+    }
+
+    fldInStreamReadUInt8(&self->inStream, &type);
+    self->stats.recordCount++;
+
+    switch (type) {
+        case NimbleServerRecordTypeUpdate: {
+            uint64_t now;
+            fldInStreamReadUInt64(&self->inStream, &now);
+            self->stats.updateCount++;
+            nimbleServerUpdate(&self->server, (MonotonicTimeMs) now);
+        } break;
+        case NimbleServerRecordTypeConnectionConnected:
+        case NimbleServerRecordTypeConnectionDisconnected: {
+            uint8_t transportIndex;
+            fldInStreamReadUInt8(&self->inStream, &transportIndex);
+            if (type == NimbleServerRecordTypeConnectionConnected) {
+                nimbleServerConnectionConnected(&self->server, transportIndex);
+            } else {
+                nimbleServerConnectionDisconnected(&self->server, transportIndex);
+            }
+        } break;
+        case NimbleServerRecordTypeReInitWithGame: {
+            uint32_t stepId;
+            uint64_t now;
+            fldInStreamReadUInt32(&self->inStream, &stepId);
+            fldInStreamReadUInt64(&self->inStream, &now);
+            nimbleServerReInitWithGame(&self->server, (StepId) stepId, (MonotonicTimeMs) now);
+        } break;
+        case NimbleServerRecordTypeHostMigration: {
+            NimbleSerializeLocalPartyInfo localPartyInfos[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+            int partyCount = readHostMigration(self, localPartyInfos, NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+            if (partyCount < 0) {
+                return partyCount;
+            }
+            nimbleServerHostMigration(&self->server, localPartyInfos, (size_t) partyCount);
+        } break;
+        case NimbleServerRecordTypeOutput: {
+            uint8_t transportIndex;
+            uint16_t octetCount;
+            uint64_t hash;
+            fldInStreamReadUInt8(&self->inStream, &transportIndex);
+            fldInStreamReadUInt16(&self->inStream, &octetCount);
+            fldInStreamReadUInt64(&self->inStream, &hash);
+            CLOG_C_NOTICE(&self->log, "replay: recorded output to %u (%u octets) was not sent", transportIndex,
+                          octetCount)
+            self->stats.mismatchCount++;
+        } break;
+        case NimbleServerRecordTypeSecret: {
+            uint64_t secret;
+            fldInStreamReadUInt64(&self->inStream, &secret);
+            CLOG_C_NOTICE(&self->log, "replay: recorded secret was not used")
+            self->stats.mismatchCount++;
+        } break;
+        case NimbleServerRecordTypeSerializedGameState: {
+            uint32_t stepId;
+            uint64_t hash;
+            uint32_t octetCount;
+            fldInStreamReadUInt32(&self->inStream, &stepId);
+            fldInStreamReadUInt64(&self->inStream, &hash);
+            fldInStreamReadUInt32(&self->inStream, &octetCount);
+            if (readPayload(self, octetCount) == 0) {
+                return NimbleServerErrSerialize;
+            }
+            CLOG_C_NOTICE(&self->log, "replay: recorded game state was not asked for")
+            self->stats.mismatchCount++;
+        } break;
+        case NimbleServerRecordTypeValidatedSteps: {
+            if (readValidatedSteps(self, 0, 0) < 0) {
+                return NimbleServerErrSerialize;
+            }
+            CLOG_C_NOTICE(&self->log, "replay: recorded validation of predicted steps was not asked for")
+            self->stats.mismatchCount++;
+        } break;
+        default:
+            CLOG_C_SOFT_ERROR(&self->log, "replay: unknown record type %u at octet %zu", type, self->inStream.pos - 1)
+            return NimbleServerErrSerialize;
+    }
+
+    return 0;
+}
+
+/// Replays all the inputs in the recording
+/// @param self replayer
+/// @return negative if the recording is corrupt
+int nimbleServerReplayerRun(NimbleServerReplayer* self)
+{
+    while (!nimbleServerReplayerIsDone(self)) {
+        int err = nimbleServerReplayerNext(self);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/// Checks if all the records have been replayed
+/// @param self replayer
+/// @return true if the end of the recording has been reached
+bool nimbleServerReplayerIsDone(const NimbleServerReplayer* self)
+{
+    return self->inStream.pos >= self->inStream.size;
+}
@@ -13,24 +13,20 @@
 #include <nimble-server/local_party.h>
 #include <nimble-server/req_connect.h>
 #include <nimble-server/server.h>
-#include <secure-random/secure_random.h>
 
 // TODO: Also check the time since the connection was last requested
 
+/// Returns the transport connection if it has already been connected by a connect request with the same request id
 static NimbleServerTransportConnection*
 findExistingConnectionRequest(NimbleServer* self, uint8_t transportConnectionIndex, NimbleSerializeClientRequestId connectionRequestId)
 {
-    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
-        NimbleServerTransportConnection* connection = &self->transportConnections[i];
-        if (!connection->isUsed) {
-            continue;
-        }
-        if (connection->transportIndex == transportConnectionIndex &&
-            connection->connectedFromConnectRequestId == connectionRequestId) {
-            return connection;
-        }
+    NimbleServerTransportConnection* connection = &self->transportConnections[transportConnectionIndex];
+    if (!connection->isUsed || !connection->isIdFromFreeList ||
+        connection->connectedFromConnectRequestId != connectionRequestId) {
+        return 0;
     }
-    return 0;
+
+    return connection;
 }
 
 int nimbleServerReqConnect(NimbleServer* self, uint8_t transportConnectionIndex, FldInStream* inStream,
@@ -52,28 +48,24 @@ int nimbleServerReqConnect(NimbleServer* self, uint8_t transportConnectionIndex,
                                                                                          connectOptions.clientRequestId);
     if (!transportConnection) {
         CLOG_C_DEBUG(&self->log, "request for a new connection")
+
+        // The datagram has already prepared the transport connection for the transport index. A new connect request
+        // on the same transport index gives up the id of the previous one.
+        transportConnection = nimbleServerPrepareTransportConnection(self, transportConnectionIndex);
+        if (transportConnection->isIdFromFreeList) {
+            nimbleServerCircularBufferWrite(&self->freeTransportConnectionList, transportConnection->id);
+            transportConnection->isIdFromFreeList = false;
+        }
+
         if (nimbleServerCircularBufferIsEmpty(&self->freeTransportConnectionList)) {
             CLOG_C_NOTICE(&self->log, "no free transport connection")
             return NimbleServerErrSerialize;
         }
 
-        uint8_t freeTransportIndex = nimbleServerCircularBufferRead(&self->freeTransportConnectionList);
-        transportConnection = &self->transportConnections[freeTransportIndex];
-        if (transportConnection->isUsed) {
-            CLOG_C_ERROR(&self->log, "the transport index from free list was not free")
-            // return -2;
-        }
-
-        transportConnection->isUsed = true;
-        transportConnection->transportIndex = transportConnectionIndex;
+        transportConnection->id = nimbleServerCircularBufferRead(&self->freeTransportConnectionList);
+        transportConnection->isIdFromFreeList = true;
         transportConnection->connectedFromConnectRequestId = connectOptions.clientRequestId;
-        transportConnection->secret = secureRandomUInt64();
-        transportConnection->useDebugStreams = connectOptions.useDebugStreams;
-        transportConnection->phase = NbTransportConnectionPhaseConnected;
-        transportConnection->id = freeTransportIndex;
-
-        transportConnectionInit(transportConnection, self->blobAllocator, self->setup.maxGameStateOctetCount,
-                                self->log);
+        transportConnection->secret = nimbleServerGenerateSecret(self);
 
     } else {
         CLOG_C_DEBUG(&self->log, "return existing connection with client request id %02X", connectOptions.clientRequestId)
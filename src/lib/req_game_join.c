@@ -15,6 +15,7 @@
 #include <nimble-server/participant.h>
 #include <nimble-server/req_join_game.h>
 #include <nimble-server/server.h>
+#include <nimble-server/spectators.h>
 
 static int joinLocalParty(NimbleServerLocalParties* parties, NimbleServerParticipants* gameParticipants,
                           NimbleServerTransportConnection* transportConnection,
@@ -83,7 +84,45 @@ static int nimbleServerReadAndJoinParticipants(NimbleServerLocalParties* parties
     return 0;
 }
 
+/// Adds the transport connection as a spectator. The reply is a join game response without any participants.
+/// @param self server
+/// @param transportConnection transport connection that wants to spectate
+/// @param request the join request
+/// @param outStream writes reply to out stream
+/// @return negative on error
+static int joinAsSpectator(NimbleServer* self, NimbleServerTransportConnection* transportConnection,
+                           const NimbleSerializeJoinGameRequest* request, FldOutStream* outStream)
+{
+    if (transportConnection->assignedParty != 0) {
+        CLOG_C_NOTICE(&self->log, "transport connection %hhu already has a party, can not spectate",
+                      transportConnection->transportConnectionId)
+        return NimbleServerErrSerialize;
+    }
+
+    if (transportConnection->spectator == 0) {
+        int spectatorIndex = nimbleServerSpectatorsAdd(&self->spectators, transportConnection->transportIndex,
+                                                       transportConnection,
+                                                       self->game.authoritativeSteps.expectedWriteId);
+        if (spectatorIndex < 0) {
+            nimbleSerializeServerOutJoinGameOutOfParticipantSlotsResponse(outStream, request->requestId, &self->log);
+            return spectatorIndex;
+        }
+    }
+
+    NimbleSerializeJoinGameResponse gameResponse;
+    gameResponse.requestId = request->requestId;
+    gameResponse.participantCount = 0;
+    gameResponse.partyAndSessionSecret.partyId = 0xff;
+    gameResponse.partyAndSessionSecret.sessionSecret = self->sessionSecret;
+
+    CLOG_C_DEBUG(&self->log, "join game response for spectator on transport connection %hhu stateID: %04X",
+                 transportConnection->transportConnectionId, self->game.authoritativeSteps.expectedWriteId - 1)
+
+    return nimbleSerializeServerOutJoinGameResponse(outStream, &gameResponse, &self->log);
+}
+
 /// Handles a join request from the client
+/// A request without any players joins as a spectator.
 /// @param self server
 /// @param transportConnection transport connection that wants to join
 /// @param inStream read join request from this stream
@@ -99,6 +138,10 @@ int nimbleServerReqGameJoin(NimbleServer* self, NimbleServerTransportConnection*
         return err;
     }
 
+    if (request.playerCount == 0) {
+        return joinAsSpectator(self, transportConnection, &request, outStream);
+    }
+
     NimbleServerLocalParty* party;
     int errorCode = nimbleServerReadAndJoinParticipants(&self->localParties, &self->game.participants,
                                                         transportConnection, &request,
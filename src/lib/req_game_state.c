@@ -9,51 +9,81 @@
 #include <inttypes.h>
 #include <nimble-serialize/commands.h>
 #include <nimble-serialize/server_out.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/recorder.h>
 #include <nimble-server/req_download_game_state.h>
 #include <nimble-server/req_download_game_state_ack.h>
 /// Handles a request from the client to download the latest game state.
 /// @param transportConnection transport connection that request to download the latest game state
 /// @param inStream stream to read the request from
+/// @param response the transport to send the reply and the first blob stream chunks to
 /// @return negative on error
 int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportConnection* transportConnection,
-                                     FldInStream* inStream, DatagramTransportOut* transportOut)
+                                     FldInStream* inStream, NimbleServerResponse* response)
 {
     uint8_t downloadClientRequestId;
     fldInStreamReadUInt8(inStream, &downloadClientRequestId);
     CLOG_ASSERT(downloadClientRequestId != 0, "download client request can not be zero")
 
     if (downloadClientRequestId == transportConnection->blobStreamOutClientRequestId) {
-        CLOG_C_VERBOSE(&transportConnection->log,
+        CLOG_C_VERBOSE(&transportConnection->diagnostics->log,
                        "already sent download game state response. resending same information again. connection %d, "
                        "requestId %02X with blobStreamChannel %02X",
                        transportConnection->transportConnectionId, transportConnection->blobStreamOutClientRequestId,
-                       transportConnection->blobStreamLogicOut.transferId)
+                       transportConnection->download->blobStreamLogicOut.transferId)
 
     } else {
+        const NimbleServerCallbackObjectVtbl* vtbl = self->callbackObject.vtbl;
+        if (vtbl == 0 || vtbl->authoritativeStateSerializeFn == 0) {
+            CLOG_C_SOFT_ERROR(&transportConnection->diagnostics->log,
+                              "can not download game state without a game state serialize function")
+            return NimbleServerErrSerialize;
+        }
+
+        int downloadErr = transportConnectionStartDownload(transportConnection);
+        if (downloadErr < 0) {
+            CLOG_C_WARN(&transportConnection->diagnostics->log, "could not allocate memory for the game state download")
+            return downloadErr;
+        }
+
+        NimbleServerTransportConnectionDownload* download = transportConnection->download;
+
         /// Fetch state and copy it to the transport connection
         /// Initialize the outgoing blob stream with the state
         {
             NimbleServerSerializedGameState serializedGameState;
 
-            self->callbackObject.vtbl->authoritativeStateSerializeFn(self->callbackObject.self, &serializedGameState);
+            vtbl->authoritativeStateSerializeFn(self->callbackObject.self, &serializedGameState);
+            if (self->recorder != 0) {
+                nimbleServerRecorderSerializedGameState(self->recorder, &serializedGameState);
+            }
+            self->game.latestGameStateOctetCount = serializedGameState.gameStateOctetCount;
+            if (self->game.observer.snapshotFn != 0) {
+                self->game.observer.snapshotFn(self->game.observer.self, serializedGameState.stepId,
+                                               serializedGameState.gameState, serializedGameState.gameStateOctetCount);
+            }
 
             CLOG_C_VERBOSE(&self->log, "download game state request stepId:%04X octetSize:%zu, hash:%08" PRIX64,
                            serializedGameState.stepId, serializedGameState.gameStateOctetCount,
                            serializedGameState.hash)
 
-            nimbleServerGameStateSet(&transportConnection->gameState, serializedGameState.stepId,
+            nimbleServerGameStateSet(&download->gameState, serializedGameState.stepId,
                                      serializedGameState.gameState, serializedGameState.gameStateOctetCount,
-                                     &transportConnection->log);
+                                     &transportConnection->diagnostics->log);
         }
 
         {
-            const NimbleServerGameState* copiedGameState = &transportConnection->gameState;
-
-            blobStreamOutInit(&transportConnection->blobStreamOut, self->pageAllocator,
-                              transportConnection->blobStreamOutAllocator, copiedGameState->state,
-                              copiedGameState->octetCount, BLOB_STREAM_CHUNK_SIZE, transportConnection->log);
-            blobStreamLogicOutInit(&transportConnection->blobStreamLogicOut, &transportConnection->blobStreamOut,
+            const NimbleServerGameState* copiedGameState = &download->gameState;
+
+            // A connection can download again, e.g. after falling too far behind
+            transportConnectionDestroyBlobStream(transportConnection);
+            blobStreamOutInit(&download->blobStreamOut, &transportConnection->blobStreamOutAllocator->allocator,
+                              transportConnection->blobStreamOutAllocator,
+                              copiedGameState->state, copiedGameState->octetCount, BLOB_STREAM_CHUNK_SIZE,
+                              transportConnection->diagnostics->log);
+            download->hasBlobStream = true;
+            blobStreamLogicOutInit(&download->blobStreamLogicOut, &download->blobStreamOut,
                                    transportConnection->nextBlobStreamOutChannel);
 
             ++transportConnection->nextBlobStreamOutChannel;
@@ -61,16 +91,17 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
             transportConnectionSetGameStateTickId(transportConnection);
 
             CLOG_C_DEBUG(
-                &transportConnection->log,
+                &transportConnection->diagnostics->log,
                 "start download state for connection %d, requestId %02X with blobStreamChannel %02X octetCount:%zu",
                 transportConnection->transportConnectionId, transportConnection->blobStreamOutClientRequestId,
-                transportConnection->blobStreamLogicOut.transferId, copiedGameState->octetCount)
+                download->blobStreamLogicOut.transferId, copiedGameState->octetCount)
         }
     }
 
     // No matter if it is a resend or first time response, send out the information we have
     // in the transport connection
-    const NimbleServerGameState* latestState = &transportConnection->gameState;
+    NimbleServerTransportConnectionDownload* download = transportConnection->download;
+    const NimbleServerGameState* latestState = &download->gameState;
 
     SerializeGameState outGameState;
     outGameState.stepId = latestState->stepId;
@@ -78,7 +109,7 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
     outGameState.gameState = latestState->state;
 
     {
-        static uint8_t buf[256];
+        uint8_t buf[256];
         FldOutStream outStream;
         fldOutStreamInit(&outStream, buf, sizeof(buf));
 
@@ -86,21 +117,21 @@ int nimbleServerReqDownloadGameState(NimbleServer* self, NimbleServerTransportCo
 
         int err = nimbleSerializeServerOutGameStateResponse(
             &outStream, outGameState, transportConnection->blobStreamOutClientRequestId,
-            transportConnection->blobStreamLogicOut.transferId, &transportConnection->log);
+            download->blobStreamLogicOut.transferId, &transportConnection->diagnostics->log);
         if (err < 0) {
             return err;
         }
 
         // Start transfer should be in the same datagram as the game state response
-        nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdServerOutBlobStream, &transportConnection->log);
-        err = blobStreamLogicOutStartTransfer(&transportConnection->blobStreamLogicOut, &outStream);
+        nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdServerOutBlobStream, &transportConnection->diagnostics->log);
+        err = blobStreamLogicOutStartTransfer(&download->blobStreamLogicOut, &outStream);
         if (err < 0) {
             return err;
         }
 
         transportConnectionCommitHeader(transportConnection);
-        transportOut->send(transportOut->self, outStream.octets, outStream.pos);
+        response->transportOut->send(response->transportOut->self, outStream.octets, outStream.pos);
     }
 
-    return nimbleServerSendBlobStream(transportConnection, transportOut);
+    return nimbleServerSendBlobStream(transportConnection, response, self->now);
 }
@@ -11,20 +11,24 @@
 #include <flood/out_stream.h>
 #include <nimble-serialize/commands.h>
 #include <nimble-serialize/serialize.h>
+#include <nimble-server/datagram_run.h>
 #include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/req_download_game_state_ack.h>
 #include <nimble-server/server.h>
 
+#define NIMBLE_SERVER_BLOB_STREAM_MAX_ENTRIES_FOR_EACH_SEND (4)
+
 /// Handles a download state progress ack from the client
 /// @param transportConnection transportConnection
 /// @param foundGame the game to send
 /// @param inStream stream to read game state ack from
-/// @param transportOut the transport to send reply to
+/// @param response the transport to send reply to
+/// @param now the server time, used for resending blob stream chunks
 /// @return negative on error
 int nimbleServerReqBlobStream(NimbleServerGame* foundGame,
                                         NimbleServerTransportConnection* transportConnection, FldInStream* inStream,
-                                        DatagramTransportOut* transportOut)
+                                        NimbleServerResponse* response, MonotonicTimeMs now)
 {
     (void) foundGame;
 
@@ -37,13 +41,18 @@ int nimbleServerReqBlobStream(NimbleServerGame* foundGame,
     //   return errorCode;
     // }
 
-    int receiveResult = blobStreamLogicOutReceive(&transportConnection->blobStreamLogicOut, inStream);
+    if (transportConnection->download == 0) {
+        CLOG_C_NOTICE(&transportConnection->diagnostics->log, "received blob stream ack, but no download has been started")
+        return NimbleServerErrSerialize;
+    }
+
+    int receiveResult = blobStreamLogicOutReceive(&transportConnection->download->blobStreamLogicOut, inStream);
     if (receiveResult < 0) {
         CLOG_SOFT_ERROR("nimbleServerReqJoinGameStateAck: could not receive blobStreamLogicOut")
         return receiveResult;
     }
 
-    return nimbleServerSendBlobStream(transportConnection, transportOut);
+    return nimbleServerSendBlobStream(transportConnection, response, now);
 }
 
 /*
@@ -58,19 +67,19 @@ int sendAuthoritativeSteps() {
         return error;
     }
 
-    CLOG_C_VERBOSE(&transportConnection->log,
+    CLOG_C_VERBOSE(&transportConnection->diagnostics->log,
                    "download of game state is probably done, send a few authoritative steps as well from %08X",
-                   transportConnection->gameState.stepId)
+                   transportConnection->download->gameState.stepId)
 
     ssize_t err = nimbleServerSendStepRanges(&stream, transportConnection, foundGame,
-                                             transportConnection->gameState.stepId, 0);
+                                             transportConnection->download->gameState.stepId, 0);
     if (err < 0) {
-        CLOG_C_SOFT_ERROR(&transportConnection->log, "could not send ranges")
+        CLOG_C_SOFT_ERROR(&transportConnection->diagnostics->log, "could not send ranges")
         return (int) err;
     }
 
     if (stream.pos > datagramTransportMaxSize) {
-        CLOG_C_SOFT_ERROR(&transportConnection->log,
+        CLOG_C_SOFT_ERROR(&transportConnection->diagnostics->log,
                           "trying to send auth steps datagram that has too many octets: %zu out of %zu. Discarding it",
                           stream.pos, datagramTransportMaxSize)
         return NimbleServerErrSerialize;
@@ -80,13 +89,22 @@ int sendAuthoritativeSteps() {
 }
 */
 
-int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnection, DatagramTransportOut* transportOut)
+/// Sends the blob stream chunks that are due. The chunks have the same size (except the last one in the blob), so
+/// they are written back to back and sent as one run if the response has a runOut.
+/// @param transportConnection the transport connection that downloads the blob
+/// @param response the transport to send the chunks to
+/// @param now the server time, used for resending blob stream chunks
+/// @return negative on error
+int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnection, NimbleServerResponse* response,
+                               MonotonicTimeMs now)
 {
-    MonotonicTimeMs now = monotonicTimeMsNow();
-    const BlobStreamOutEntry* entries[4];
+    const BlobStreamOutEntry* entries[NIMBLE_SERVER_BLOB_STREAM_MAX_ENTRIES_FOR_EACH_SEND];
+    BlobStreamLogicOut* blobStreamLogicOut = &transportConnection->download->blobStreamLogicOut;
 
-    int entriesFound = blobStreamLogicOutPrepareSend(&transportConnection->blobStreamLogicOut, now, entries, 4);
-    static uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    int entriesFound = blobStreamLogicOutPrepareSend(blobStreamLogicOut, now, entries,
+                                                     NIMBLE_SERVER_BLOB_STREAM_MAX_ENTRIES_FOR_EACH_SEND);
+    NimbleServerDatagramRun* run = &transportConnection->download->chunkRun;
+    nimbleServerDatagramRunInit(run);
     FldOutStream stream;
 
     for (int i = 0; i < entriesFound; ++i) {
@@ -94,33 +112,36 @@ int nimbleServerSendBlobStream(NimbleServerTransportConnection* transportConnect
 
         // CLOG_DEBUG("sending state %08X (octet count :%zu)", options.stepId, options.gameStateOctetCount);
 
-        fldOutStreamInit(&stream, buf, DATAGRAM_TRANSPORT_MAX_SIZE);
+        fldOutStreamInit(&stream, nimbleServerDatagramRunNext(run), DATAGRAM_TRANSPORT_MAX_SIZE);
         stream.writeDebugInfo = true; // transportConnection->useDebugStreams;
 
         transportConnectionWriteHeader(transportConnection, &stream);
 
         // Signals that it is a blob stream command that follows
-        nimbleSerializeWriteCommand(&stream, NimbleSerializeCmdServerOutBlobStream, &transportConnection->log);
+        nimbleSerializeWriteCommand(&stream, NimbleSerializeCmdServerOutBlobStream, &transportConnection->diagnostics->log);
 
-        blobStreamLogicOutSendEntry(&stream, entry, transportConnection->blobStreamLogicOut.transferId);
+        blobStreamLogicOutSendEntry(&stream, entry, blobStreamLogicOut->transferId);
 
         transportConnectionCommitHeader(transportConnection);
 
         if (stream.pos > datagramTransportMaxSize) {
             CLOG_C_SOFT_ERROR(
-                &transportConnection->log,
+                &transportConnection->diagnostics->log,
                 "trying to send game state part datagram that has too many octets: %zu out of %zu. Discarding it",
                 stream.pos, datagramTransportMaxSize)
+            nimbleServerDatagramRunFlush(run, response->transportOut, response->runOut);
             return NimbleServerErrSerialize;
         }
 
-        transportOut->send(transportOut->self, stream.octets, stream.pos);
+        nimbleServerDatagramRunCommit(run, stream.pos);
     }
 
-    if (!blobStreamLogicOutIsAllSent(&transportConnection->blobStreamLogicOut)) {
+    nimbleServerDatagramRunFlush(run, response->transportOut, response->runOut);
+
+    if (!blobStreamLogicOutIsAllSent(blobStreamLogicOut)) {
         return 0;
     }
 
-    CLOG_C_DEBUG(&transportConnection->log, "sent all outgoing blob stream")
+    CLOG_C_DEBUG(&transportConnection->diagnostics->log, "sent all outgoing blob stream")
     return 0;
 }
@@ -10,35 +10,18 @@
 #include "transport_connection_stats.h"
 #include <flood/in_stream.h>
 #include <inttypes.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/local_party.h>
 #include <nimble-server/req_step.h>
-
-static int discardAuthoritativeStepsIfBufferGettingFull(NimbleServerGame* foundGame)
-{
-    size_t authoritativeStepCount = foundGame->authoritativeSteps.stepsCount;
-    size_t maxCapacity = NBS_WINDOW_SIZE / 3;
-
-    if (authoritativeStepCount > maxCapacity) {
-        size_t authoritativeToDrop = authoritativeStepCount - maxCapacity;
-        CLOG_C_VERBOSE(&foundGame->log, "discarding %zu old authoritative steps due to buffer getting full",
-                       authoritativeToDrop)
-        int err = nbsStepsDiscardCount(&foundGame->authoritativeSteps, authoritativeToDrop);
-        if (err < 0) {
-            return err;
-        }
-        CLOG_C_VERBOSE(&foundGame->log, "oldest step after discard is %04X with count %zu",
-                       foundGame->authoritativeSteps.expectedReadId, foundGame->authoritativeSteps.stepsCount)
-    }
-
-    return 0;
-}
+#include <nimble-server/spectators.h>
+#include <nimble-steps-serialize/pending_in_serialize.h>
 
 static int readIncomingStepsAndCreateAuthoritativeSteps(NimbleServerGame* foundGame, FldInStream* inStream,
                                                         NimbleServerTransportConnection* transportConnection,
                                                         StatsIntPerSecond* authoritativeStepsPerSecondStat,
                                                         StepId* outClientWaitingForStepId)
 {
-    int discardErr = discardAuthoritativeStepsIfBufferGettingFull(foundGame);
+    int discardErr = nimbleServerDiscardAuthoritativeStepsIfBufferGettingFull(foundGame);
     if (discardErr < 0) {
         return discardErr;
     }
@@ -81,7 +64,7 @@ int nimbleServerReqGameStep(NimbleServerGame* foundGame, NimbleServerTransportCo
                                                                  &clientWaitingForStepId);
     if (errorCode < 0) {
         if (!nimbleServerIsErrorExternal(errorCode)) {
-            CLOG_C_SOFT_ERROR(&transportConnection->log, "problem handling incoming step:%d", errorCode)
+            CLOG_C_SOFT_ERROR(&transportConnection->diagnostics->log, "problem handling incoming step:%d", errorCode)
         }
         return errorCode;
     }
@@ -90,3 +73,44 @@ int nimbleServerReqGameStep(NimbleServerGame* foundGame, NimbleServerTransportCo
 
     return (int) nimbleServerSendStepRanges(outStream, transportConnection, foundGame, clientWaitingForStepId);
 }
+
+/// Handles a step request from a spectator. The spectator does not provide any predicted steps, the request only
+/// tells us which step the spectator is waiting for. Nothing is composed, so a spectator never affects when
+/// authoritative steps are composed or forced.
+/// @param foundGame game
+/// @param spectators spectators
+/// @param transportConnection transport connection of the spectator
+/// @param inStream stream to read from
+/// @param outStream out stream for reply
+/// @return negative on error
+int nimbleServerReqSpectatorStep(NimbleServerGame* foundGame, NimbleServerSpectators* spectators,
+                                 NimbleServerTransportConnection* transportConnection, FldInStream* inStream,
+                                 FldOutStream* outStream)
+{
+    StepId clientWaitingForStepId;
+    int errorCode = nbsPendingStepsInSerializeHeader(inStream, &clientWaitingForStepId);
+    if (errorCode < 0) {
+        CLOG_C_SOFT_ERROR(&transportConnection->diagnostics->log, "spectator step: couldn't in-serialize pending steps")
+        return errorCode;
+    }
+
+    uint32_t lowestCommonStepId;
+    fldInStreamReadUInt32(inStream, &lowestCommonStepId);
+    uint8_t participantCount;
+    errorCode = fldInStreamReadUInt8(inStream, &participantCount);
+    if (errorCode < 0) {
+        return errorCode;
+    }
+
+    if (participantCount != 0) {
+        CLOG_C_NOTICE(&transportConnection->diagnostics->log, "spectator sent steps for %hhu participants, ignoring them",
+                      participantCount)
+        return NimbleServerErrSerialize;
+    }
+
+    nimbleServerSpectatorsAck(spectators, transportConnection->spectator, clientWaitingForStepId);
+
+    nimbleServerTransportConnectionUpdateStats(transportConnection, foundGame, clientWaitingForStepId);
+
+    return (int) nimbleServerSendStepRanges(outStream, transportConnection, foundGame, clientWaitingForStepId);
+}
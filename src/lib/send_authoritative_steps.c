@@ -10,7 +10,62 @@
 #include <nimble-server/transport_connection.h>
 #include <nimble-steps-serialize/pending_out_serialize.h>
 
+/// Checks if a client that waits for a step that is no longer in the authoritative window should catch up from the
+/// history. It should, if the steps are in the history and they are smaller than a new game state.
+/// @param game the game
+/// @param stepId the step the client is waiting for
+/// @return true if the steps should be sent from the history
+static bool shouldCatchUpFromHistory(const NimbleServerGame* game, StepId stepId)
+{
+    if (!nimbleServerStepHistoryHasStep(&game->history, stepId)) {
+        return false;
+    }
+
+    if (game->latestGameStateOctetCount == 0) {
+        return true;
+    }
+
+    return nimbleServerStepHistoryOctetCountFrom(&game->history, stepId) < game->latestGameStateOctetCount;
+}
+
+/// Copies the steps from the history (and from the authoritative window, for the later steps) to the catch up
+/// steps buffer, so they can be serialized as a normal range.
+/// @param game the game
+/// @param startStepId first step to copy
+/// @param stepCount number of steps to copy
+/// @return negative on error
+static int fillCatchUpSteps(NimbleServerGame* game, StepId startStepId, size_t stepCount)
+{
+    nbsStepsReInit(&game->catchUpSteps, startStepId);
+
+    uint8_t stepBuffer[1024];
+    for (size_t i = 0; i < stepCount; ++i) {
+        StepId stepId = (StepId) (startStepId + i);
+        int octetCount;
+        if (nimbleServerStepHistoryHasStep(&game->history, stepId)) {
+            octetCount = nimbleServerStepHistoryRead(&game->history, stepId, stepBuffer, sizeof(stepBuffer));
+        } else {
+            int index = nbsStepsGetIndexForStep(&game->authoritativeSteps, stepId);
+            if (index < 0) {
+                return index;
+            }
+            octetCount = nbsStepsReadAtIndex(&game->authoritativeSteps, index, stepBuffer, sizeof(stepBuffer));
+        }
+        if (octetCount < 0) {
+            return octetCount;
+        }
+
+        int err = nbsStepsWrite(&game->catchUpSteps, stepId, stepBuffer, (size_t) octetCount);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
 /// Send authoritative steps to a transport connection using a client provided receiveMask.
+/// Steps before the authoritative window are sent from the history, if they are in it.
 /// @param outStream stream to send step ranges to
 /// @param transportConnection transport connection that wants the steps
 /// @param foundGame the game to send steps from
@@ -22,13 +77,18 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
     NbsPendingRange range;
 
     StepId startTickId = clientWaitingForStepId;
+    bool isCatchingUp = false;
 
     if (startTickId >= foundGame->authoritativeSteps.expectedWriteId) {
         startTickId = foundGame->authoritativeSteps.expectedWriteId - 1;
     }
 
-    if (startTickId < foundGame->authoritativeSteps.expectedReadId) {
-        CLOG_C_VERBOSE(&transportConnection->log,
+    if (startTickId < foundGame->authoritativeSteps.expectedReadId && shouldCatchUpFromHistory(foundGame, startTickId)) {
+        CLOG_C_VERBOSE(&transportConnection->diagnostics->log, "client wants to get authoritative %08X, sending it from the history",
+                       startTickId)
+        isCatchingUp = true;
+    } else if (startTickId < foundGame->authoritativeSteps.expectedReadId) {
+        CLOG_C_VERBOSE(&transportConnection->diagnostics->log,
                        "client wants to get authoritative %08X, but we only can provide the earliest %08X", startTickId,
                        foundGame->authoritativeSteps.expectedReadId)
         startTickId = foundGame->authoritativeSteps.expectedReadId;
@@ -45,7 +105,7 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
     range.startId = startTickId;
     range.count = authStepCountToSend;
 
-    CLOG_C_VERBOSE(&transportConnection->log, "send auth range %08X-%08zX, %zu", range.startId,
+    CLOG_C_VERBOSE(&transportConnection->diagnostics->log, "send auth range %08X-%08zX, %zu", range.startId,
                    range.startId + authStepCountToSend - 1, range.count)
 
     if (authStepCountToSend == 0) {
@@ -53,7 +113,7 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
         if (transportConnection->noRangesToSendCounter > 8) {
             int noticeTime = transportConnection->noRangesToSendCounter % 20;
             if (noticeTime == 0) {
-                CLOG_C_NOTICE(&transportConnection->log, "no ranges to send for %d ticks, suspicious",
+                CLOG_C_NOTICE(&transportConnection->diagnostics->log, "no ranges to send for %d ticks, suspicious",
                               transportConnection->noRangesToSendCounter)
             }
         }
@@ -80,14 +140,22 @@ ssize_t nimbleServerSendStepRanges(FldOutStream* outStream, NimbleServerTranspor
             authoritativeTickDelta = (int8_t) tickDelta;
         }
     }
-    CLOG_C_VERBOSE(&transportConnection->log, "send auth header tick_id:%08X tick-delta: %hhd, buffer-size:%zu",
+    CLOG_C_VERBOSE(&transportConnection->diagnostics->log, "send auth header tick_id:%08X tick-delta: %hhd, buffer-size:%zu",
                    lastReceivedStepFromClient, authoritativeTickDelta, bufferStepCount)
 
     int serializeErr = nimbleSerializeServerOutStepHeader(outStream, lastReceivedStepFromClient, bufferStepCount,
-                                                          authoritativeTickDelta, &transportConnection->log);
+                                                          authoritativeTickDelta, &transportConnection->diagnostics->log);
     if (serializeErr < 0) {
         return serializeErr;
     }
 
+    if (isCatchingUp) {
+        int fillErr = fillCatchUpSteps(foundGame, range.startId, range.count);
+        if (fillErr < 0) {
+            return fillErr;
+        }
+        return nbsPendingStepsSerializeOutRanges(outStream, &foundGame->catchUpSteps, &range, 1);
+    }
+
     return nbsPendingStepsSerializeOutRanges(outStream, &foundGame->authoritativeSteps, &range, 1);
 }
@@ -3,6 +3,7 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include "tick_parties.h"
 #include <clog/clog.h>
 #include <datagram-transport/transport.h>
 #include <datagram-transport/types.h>
@@ -14,13 +15,17 @@
 #include <nimble-server/errors.h>
 #include <nimble-server/game.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/memory_requirement.h>
 #include <nimble-server/participant.h>
+#include <nimble-server/recorder.h>
+#include <nimble-server/replayer.h>
 #include <nimble-server/req_connect.h>
 #include <nimble-server/req_download_game_state.h>
 #include <nimble-server/req_download_game_state_ack.h>
 #include <nimble-server/req_join_game.h>
 #include <nimble-server/req_ping.h>
 #include <nimble-server/req_step.h>
+#include <secure-random/secure_random.h>
 
 /// Clean up participant references
 /// @param participantReferences the participant references that should be removed.
@@ -44,16 +49,37 @@ static void destroyParty(NimbleServerLocalParties* parties, NimbleServerLocalPar
     nimbleServerLocalPartiesRemove(parties, party);
 }
 
+/// Returns the id of the transport connection to the free list, if a connect request took it from there
+/// @param self server
+/// @param transportConnection transport connection
+static void releaseTransportConnectionId(NimbleServer* self, NimbleServerTransportConnection* transportConnection)
+{
+    if (!transportConnection->isIdFromFreeList) {
+        return;
+    }
+
+    nimbleServerCircularBufferWrite(&self->freeTransportConnectionList, transportConnection->id);
+    transportConnection->isIdFromFreeList = false;
+}
+
+/// Frees the transport connection and returns its id to the free list
+/// @param self server
+/// @param transportConnection transport connection to free
 static void disconnectTransportConnection(NimbleServer* self, NimbleServerTransportConnection* transportConnection)
 {
-    nimbleServerCircularBufferWrite(&self->freeTransportConnectionList, (uint8_t) transportConnection->id);
+    if (transportConnection->spectator != 0) {
+        nimbleServerSpectatorsRemove(&self->spectators, transportConnection->spectator);
+        transportConnection->spectator = 0;
+    }
+
+    releaseTransportConnectionId(self, transportConnection);
     transportConnectionDisconnect(transportConnection);
 }
 
 /// Iterates over all parties in the server, performs a tick update, and disconnects parties
 /// that are recommended to be dissolved.
 /// @param self Pointer to an instance of NimbleServer.
-static void tickParties(NimbleServer* self)
+void nimbleServerTickParties(NimbleServer* self)
 {
     for (size_t i = 0; i < self->localParties.capacityCount; ++i) {
         NimbleServerLocalParty* party = &self->localParties.parties[i];
@@ -73,6 +99,58 @@ static void tickParties(NimbleServer* self)
     }
 }
 
+static int recordingSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServer* self = (NimbleServer*) _self;
+
+    nimbleServerRecorderOutput(self->recorder, (uint8_t) connectionId, data, octetCount);
+
+    return self->multiTransport.sendTo(self->multiTransport.self, connectionId, data, octetCount);
+}
+
+/// Pushes the latest authoritative steps to the spectators. The datagrams are recorded, if there is a recorder.
+/// @param self server
+static void pushToSpectators(NimbleServer* self)
+{
+    DatagramTransportMulti transport = self->multiTransport;
+    if (self->recorder != 0) {
+        transport.self = self;
+        transport.sendTo = recordingSendTo;
+    }
+
+    int err = nimbleServerSpectatorsPush(&self->spectators, &self->game, &transport);
+    if (err < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not push steps to spectators %d", err)
+    }
+}
+
+/// Calls authoritativeStepsComposedFn once with all the steps that were composed since the previous update
+/// @param self server
+static void notifyComposedSteps(NimbleServer* self)
+{
+    if (!self->game.isSimulatedOnServer) {
+        return;
+    }
+
+    const NbsSteps* authoritativeSteps = &self->game.authoritativeSteps;
+    StepId firstStepId = self->stepsComposedCallbackStepId;
+    if ((int32_t) (firstStepId - authoritativeSteps->expectedReadId) < 0) {
+        CLOG_C_WARN(&self->log, "composed steps %08X to %08X were discarded before the application got them",
+                    firstStepId, authoritativeSteps->expectedReadId - 1)
+        firstStepId = authoritativeSteps->expectedReadId;
+    }
+
+    if ((int32_t) (authoritativeSteps->expectedWriteId - firstStepId) <= 0) {
+        self->stepsComposedCallbackStepId = authoritativeSteps->expectedWriteId;
+        return;
+    }
+    size_t stepCount = (size_t) (authoritativeSteps->expectedWriteId - firstStepId);
+
+    self->callbackObject.vtbl->authoritativeStepsComposedFn(self->callbackObject.self, authoritativeSteps, firstStepId,
+                                                            stepCount);
+    self->stepsComposedCallbackStepId = authoritativeSteps->expectedWriteId;
+}
+
 /// Updates the server
 /// Mostly for keeping track of stats and book-keeping.
 /// @param self server
@@ -80,21 +158,31 @@ static void tickParties(NimbleServer* self)
 /// @return negative one error
 int nimbleServerUpdate(NimbleServer* self, MonotonicTimeMs now)
 {
+    if (self->recorder != 0) {
+        nimbleServerRecorderUpdate(self->recorder, now);
+    }
+    self->now = now;
+
     int qualityError = nimbleServerUpdateQualityTick(&self->updateQuality);
     if (qualityError < 0) {
         CLOG_C_SOFT_ERROR(&self->log, "quality error %d", qualityError)
         return qualityError;
     }
 
-    tickParties(self);
+    nimbleServerTickParties(self);
 
     nimbleServerReadFromMultiTransport(self);
 
+    notifyComposedSteps(self);
+
+    pushToSpectators(self);
+
     statsIntPerSecondUpdate(&self->authoritativeStepsPerSecondStat, now);
 
     self->statsCounter++;
     if ((self->statsCounter % 3000) == 0) {
         statsIntPerSecondDebugOutput(&self->authoritativeStepsPerSecondStat, &self->log, "composedSteps", "steps/s");
+        nimbleServerParticipantsDebugOutputMemory(&self->game.participants);
     }
 
     return 0;
@@ -109,20 +197,60 @@ int nimbleServerUpdate(NimbleServer* self, MonotonicTimeMs now)
 bool nimbleServerIsErrorExternal(int err)
 {
     return err == NimbleServerErrSerialize || err == NimbleServerErrSessionFull ||
-           err == NimbleServerErrDatagramFromDisconnectedConnection || err == NimbleServerErrOutOfParticipantMemory;
+           err == NimbleServerErrDatagramFromDisconnectedConnection || err == NimbleServerErrOutOfParticipantMemory ||
+           err == NimbleServerErrOutOfBlobMemory;
 }
 
-/// Handle an incoming request from a client identified by the connectionIndex
-/// It uses the NimbleServerResponse to send datagrams back to the client
+/// Returns the transport connection for the index, and initializes it if it has not been used before
+/// @param self server
+/// @param transportIndex transport connection index, must be less than NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS
+/// @return the transport connection
+NimbleServerTransportConnection* nimbleServerPrepareTransportConnection(NimbleServer* self, uint8_t transportIndex)
+{
+    NimbleServerTransportConnection* transportConnection = &self->transportConnections[transportIndex];
+
+    if (!transportConnection->isUsed) {
+        transportConnection->isUsed = true;
+        transportConnection->transportIndex = transportIndex;
+        transportConnection->connectedFromConnectRequestId = 0; // TODO: connectOptions.nonce;
+        transportConnection->secret = 0;                        // TODO: secureRandomUInt64();
+        transportConnection->useDebugStreams = false;           // TODO: connectOptions.useDebugStreams;
+        transportConnection->phase = NbTransportConnectionPhaseConnected;
+        transportConnection->id = transportIndex;
+
+        transportConnectionInit(transportConnection,
+                                nimbleServerMemoryTagsWithFree(&self->memoryTags, NimbleServerMemoryTagGameStateCopies),
+                                nimbleServerMemoryTagsWithFree(&self->memoryTags, NimbleServerMemoryTagBlobStreams),
+                                self->setup.maxGameStateOctetCount, self->log);
+    }
+
+    return transportConnection;
+}
+
+/// Game steps carry redundant predicted steps that are addressed by StepId, so they can be applied in any order.
+/// All other commands must arrive in order.
+static bool isReorderTolerant(uint8_t cmd)
+{
+    return cmd == NimbleSerializeCmdGameStep;
+}
+
+/// Handles a datagram, see nimbleServerFeed()
 /// @param self server
+/// @param recordType how the datagram is recorded, NimbleServerRecordTypeFeed or NimbleServerRecordTypeReceive
 /// @param transportIndex transport connection index that we received datagram from
 /// @param data datagram payload
 /// @param len octet count of data
 /// @param response info on how to make a response
 /// @return negative on error
-int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t* data, size_t len,
-                     NimbleServerResponse* response)
+static int feed(NimbleServer* self, NimbleServerRecordType recordType, uint8_t transportIndex, const uint8_t* data,
+                size_t len, NimbleServerResponse* response)
 {
+    NimbleServerResponse recordingResponse;
+    if (self->recorder != 0) {
+        nimbleServerRecorderFeed(self->recorder, recordType, transportIndex, data, len, response, &recordingResponse);
+        response = &recordingResponse;
+    }
+
 #if CONFIGURATION_DEBUG || true
     {
         char temp[256];
@@ -142,7 +270,8 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
         return NimbleServerErrSerialize;
     }
 
-    NimbleServerTransportConnection* transportConnection = &self->transportConnections[transportIndex];
+    NimbleServerTransportConnection* transportConnection = nimbleServerPrepareTransportConnection(self,
+                                                                                                    transportIndex);
 
     /* TODO:
     if (!transportConnection->isUsed) {
@@ -156,28 +285,19 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
     }
      */
 
-    if (!transportConnection->isUsed) {
-        transportConnection->isUsed = true;
-        transportConnection->transportIndex = transportIndex;
-        transportConnection->connectedFromConnectRequestId = 0; // TODO: connectOptions.nonce;
-        transportConnection->secret = 0;                        // TODO: secureRandomUInt64();
-        transportConnection->useDebugStreams = false;           // TODO: connectOptions.useDebugStreams;
-        transportConnection->phase = NbTransportConnectionPhaseConnected;
-        transportConnection->id = transportIndex;
-
-        transportConnectionInit(transportConnection, self->blobAllocator, self->setup.maxGameStateOctetCount,
-                                self->log);
-    }
-
     if (transportConnection->transportIndex != transportIndex) {
         CLOG_C_VERBOSE(&self->log, "we received a datagram from wrong transport index. Expected %hhu but received %hhu",
                        transportConnection->transportIndex, transportIndex)
         return NimbleServerErrSerialize;
     }
 
-    int error = orderedDatagramInLogicReceive(&transportConnection->orderedDatagramInLogic, &inStream);
+    NimbleServerReorderWindowResult order;
+    int error = nimbleServerReorderWindowReceive(&transportConnection->reorderWindow, &inStream, &order);
     if (error < 0) {
-        CLOG_C_VERBOSE(&self->log, "we received an out of order datagram, discarding")
+        return NimbleServerErrSerialize;
+    }
+    if (order == NimbleServerReorderWindowDuplicate || order == NimbleServerReorderWindowTooOld) {
+        CLOG_C_VERBOSE(&self->log, "we received a duplicate or too old datagram, discarding")
         return NimbleServerErrSerialize;
     }
 
@@ -187,16 +307,22 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
 
         CLOG_C_VERBOSE(&self->log, "received cmd: %s (connection: %d)", nimbleSerializeCmdToString(cmd), transportIndex)
 
+        if (order == NimbleServerReorderWindowLate && !isReorderTolerant(cmd)) {
+            CLOG_C_VERBOSE(&self->log, "we received an out of order %s, discarding the rest of the datagram",
+                           nimbleSerializeCmdToString(cmd))
+            return NimbleServerErrSerialize;
+        }
+
         if (cmd == NimbleSerializeCmdClientOutBlobStream) {
             // Special case, blob streams can send multiple datagrams as reply
-            int err = nimbleServerReqBlobStream(&self->game, transportConnection, &inStream, response->transportOut);
+            int err = nimbleServerReqBlobStream(&self->game, transportConnection, &inStream, response, self->now);
             if (err < 0) {
                 return err;
             }
             continue;
         }
 
-        static uint8_t buf[MAX_SEND_OCTET_SIZE];
+        uint8_t buf[MAX_SEND_OCTET_SIZE];
         FldOutStream outStream;
         fldOutStreamInit(&outStream, buf, sizeof(buf));
         outStream.writeDebugInfo = false; // transportConnection->useDebugStreams;
@@ -215,14 +341,19 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
                 result = nimbleServerReqPing(&inStream, &outStream, &self->log);
                 break;
             case NimbleSerializeCmdGameStep:
-                result = nimbleServerReqGameStep(&self->game, transportConnection,
-                                                 &self->authoritativeStepsPerSecondStat, &inStream, &outStream);
+                if (transportConnection->spectator != 0) {
+                    result = nimbleServerReqSpectatorStep(&self->game, &self->spectators, transportConnection,
+                                                          &inStream, &outStream);
+                } else {
+                    result = nimbleServerReqGameStep(&self->game, transportConnection,
+                                                     &self->authoritativeStepsPerSecondStat, &inStream, &outStream);
+                }
                 break;
             case NimbleSerializeCmdJoinGameRequest:
                 result = nimbleServerReqGameJoin(self, transportConnection, &inStream, &outStream);
                 break;
             case NimbleSerializeCmdDownloadGameStateRequest:
-                result = nimbleServerReqDownloadGameState(self, transportConnection, &inStream, response->transportOut);
+                result = nimbleServerReqDownloadGameState(self, transportConnection, &inStream, response);
                 break;
             default:
                 CLOG_SOFT_ERROR("nimbleServerFeed: unknown command %02X", data[0])
@@ -262,6 +393,107 @@ int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t*
     return 0;
 }
 
+/// Handle an incoming request from a client identified by the connectionIndex
+/// It uses the NimbleServerResponse to send datagrams back to the client
+/// Duplicates and datagrams older than the reorder window are discarded. A datagram that arrives after a newer one
+/// is only handled if it contains game steps.
+/// @param self server
+/// @param transportIndex transport connection index that we received datagram from
+/// @param data datagram payload
+/// @param len octet count of data
+/// @param response info on how to make a response
+/// @return negative on error
+int nimbleServerFeed(NimbleServer* self, uint8_t transportIndex, const uint8_t* data, size_t len,
+                     NimbleServerResponse* response)
+{
+    return feed(self, NimbleServerRecordTypeFeed, transportIndex, data, len, response);
+}
+
+/// Calculates the octet count needed for the transport connections array, including the padding for alignment
+/// @return octet count
+static size_t transportConnectionsCalculateMemoryRequirement(void)
+{
+    return NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT +
+           nimbleServerAlignToCacheLine(sizeof(NimbleServerTransportConnection) *
+                                        NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) +
+           nimbleServerAlignToCacheLine(sizeof(NimbleServerTransportConnectionDiagnostics) *
+                                        NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+}
+
+/// Allocates the transport connections as a dense, cache line aligned, array.
+/// Only the state that is needed for every datagram is stored in the array. The diagnostics are stored in an array of
+/// their own, and the blob transfer state is allocated when a download starts.
+/// @param allocator allocator to use
+/// @param log log for the transport connections until they are initialized
+/// @return the transport connections array
+static NimbleServerTransportConnection* allocateTransportConnections(ImprintAllocator* allocator, Clog log)
+{
+    uint8_t* memory = IMPRINT_ALLOC_TYPE_COUNT(
+        allocator, uint8_t,
+        NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT +
+            sizeof(NimbleServerTransportConnection) * NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+    NimbleServerTransportConnection* transportConnections =
+        (NimbleServerTransportConnection*) nimbleServerAlignPointerToCacheLine(memory);
+    NimbleServerTransportConnectionDiagnostics* diagnostics = IMPRINT_ALLOC_TYPE_COUNT(
+        allocator, NimbleServerTransportConnectionDiagnostics, NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+
+    tc_mem_clear_type_n(transportConnections, NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+    tc_mem_clear_type_n(diagnostics, NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS);
+
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        diagnostics[i].log = log;
+        transportConnections[i].diagnostics = &diagnostics[i];
+    }
+
+    return transportConnections;
+}
+
+static bool hasStepValidation(const NimbleServerSetup* setup)
+{
+    return setup->callbackObject.vtbl != 0 && setup->callbackObject.vtbl->predictedStepsValidateFn != 0;
+}
+
+/// Calculates the total octet count that nimbleServerInit and nimbleServerReInitWithGame allocates from setup.memory.
+/// The blob streams and the game state copies for each transport connection are allocated on demand when a client
+/// downloads the game state, and are not included.
+/// @param setup the server setup to calculate for
+/// @return octet count, including the padding needed for cache line alignment
+size_t nimbleServerCalculateMemoryRequirement(NimbleServerSetup setup)
+{
+    return NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT +
+           nimbleServerLocalPartiesCalculateMemoryRequirement(setup.maxConnectionCount) +
+           nimbleServerGameCalculateMemoryRequirement(setup.maxSingleParticipantStepOctetCount,
+                                                      setup.maxParticipantCount,
+                                                      setup.participantStepBudgetOctetCount) +
+           nimbleServerGameCalculateHistoryMemoryRequirement(setup.maxSingleParticipantStepOctetCount,
+                                                             setup.maxParticipantCount, setup.historyStepCount,
+                                                             setup.historyOctetCount) +
+           (hasStepValidation(&setup)
+                ? nimbleServerStepValidationCalculateMemoryRequirement(setup.maxSingleParticipantStepOctetCount)
+                : 0) +
+           nimbleServerForcedStepsCalculateMemoryRequirement(setup.forcedStepPolicy, setup.maxParticipantCount,
+                                                             setup.maxSingleParticipantStepOctetCount) +
+           nimbleServerSpectatorsCalculateMemoryRequirement(setup.maxSpectatorCount) +
+           transportConnectionsCalculateMemoryRequirement();
+}
+
+/// Reserves one contiguous, cache line aligned, block from setup.memory.
+/// All fixed size allocations (local parties and the game) are made from that block.
+/// @param self server
+/// @param setup the initial server values
+static void initSingleArena(NimbleServer* self, const NimbleServerSetup* setup)
+{
+    size_t reservedOctetCount = nimbleServerCalculateMemoryRequirement(*setup);
+    uint8_t* reservedMemory = IMPRINT_ALLOC_TYPE_COUNT(setup->memory, uint8_t, reservedOctetCount);
+
+    self->arenaMemory = nimbleServerAlignPointerToCacheLine(reservedMemory);
+    self->arenaOctetCount = reservedOctetCount - (size_t) (self->arenaMemory - reservedMemory);
+    imprintLinearAllocatorInit(&self->arena, self->arenaMemory, self->arenaOctetCount, "nimble server arena");
+    self->fixedAllocator = &self->arena.info;
+
+    CLOG_C_DEBUG(&self->log, "reserved a single arena of %zu octets", reservedOctetCount)
+}
+
 /// Initialize nimble server
 /// @param self server
 /// @param setup the initial server values
@@ -293,21 +525,72 @@ int nimbleServerInit(NimbleServer* self, NimbleServerSetup setup)
         // return -1;
     }
 
-    nimbleServerLocalPartiesInit(&self->localParties, setup.maxConnectionCount, setup.memory,
-                                 setup.maxParticipantCountForEachConnection, setup.maxSingleParticipantStepOctetCount,
-                                 setup.log);
+    size_t stepsPoolCapacity = nimbleServerStepsPoolCapacityFromBudget(setup.participantStepBudgetOctetCount,
+                                                                       setup.maxSingleParticipantStepOctetCount,
+                                                                       setup.maxParticipantCount);
+    if (stepsPoolCapacity == 0) {
+        CLOG_C_ERROR(&self->log, "nimbleServerInit. participant step budget %zu is too small for a single participant",
+                     setup.participantStepBudgetOctetCount)
+        return NimbleServerErrOutOfParticipantMemory;
+    }
+
     self->pageAllocator = setup.memory;
+    self->fixedAllocator = setup.memory;
     self->blobAllocator = setup.blobAllocator;
     self->applicationVersion = setup.applicationVersion;
     self->callbackObject = setup.callbackObject;
     self->setup = setup;
+    self->stepsComposedCallbackStepId = 0;
+
+    if (setup.useSingleArena) {
+        initSingleArena(self, &setup);
+    }
+
+    nimbleServerMemoryTagsInit(&self->memoryTags, self->fixedAllocator, self->pageAllocator, self->blobAllocator);
+
+    nimbleServerLocalPartiesInit(&self->localParties, setup.maxConnectionCount,
+                                 nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagLocalParties),
+                                 setup.maxParticipantCountForEachConnection, setup.maxSingleParticipantStepOctetCount,
+                                 setup.log);
+
+    NimbleServerGameAllocators gameAllocators = {
+        .authoritativeSteps = nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagAuthoritativeSteps),
+        .participants = nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagParticipants),
+        .participantSteps = nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagParticipantSteps),
+    };
+    nimbleServerGameInitWithAllocators(&self->game, gameAllocators, setup.maxSingleParticipantStepOctetCount,
+                                       setup.maxParticipantCount, setup.participantStepBudgetOctetCount, setup.log);
+    if (setup.historyStepCount > 0) {
+        nimbleServerGameInitHistory(&self->game,
+                                    nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagStepHistory),
+                                    setup.historyStepCount, setup.historyOctetCount);
+    }
+    if (hasStepValidation(&setup)) {
+        nimbleServerGameInitStepValidation(
+            &self->game, nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagStepValidation),
+            setup.maxSingleParticipantStepOctetCount, setup.callbackObject.vtbl->predictedStepsValidateFn,
+            setup.callbackObject.self);
+    }
+    if (setup.forcedStepPolicy != NimbleServerForcedStepPolicyZero) {
+        NimbleServerCreateForcedStepFn createFn = setup.callbackObject.vtbl != 0
+                                                      ? setup.callbackObject.vtbl->forcedStepCreateFn
+                                                      : 0;
+        nimbleServerGameInitForcedSteps(
+            &self->game, nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagForcedSteps),
+            setup.forcedStepPolicy, setup.maxSingleParticipantStepOctetCount, createFn, setup.callbackObject.self);
+    }
+
+    nimbleServerSpectatorsInit(&self->spectators,
+                               nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagSpectators),
+                               setup.maxSpectatorCount, setup.spectatorRedundancyStepCount, setup.log);
+
+    self->transportConnections = allocateTransportConnections(
+        nimbleServerMemoryTagsFixed(&self->memoryTags, NimbleServerMemoryTagTransportConnections), setup.log);
 
     self->transportConnections[0].assignedParty = 0;
     self->transportConnections[0].transportConnectionId = (uint8_t) 0;
     self->transportConnections[0].isUsed = false;
 
-    self->lastAdvancedMonotonic = setup.now;
-
     nimbleServerCircularBufferInit(&self->freeTransportConnectionList);
     for (size_t i = 1; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
         self->transportConnections[i].assignedParty = 0;
@@ -318,6 +601,13 @@ int nimbleServerInit(NimbleServer* self, NimbleServerSetup setup)
 
     statsIntPerSecondInit(&self->authoritativeStepsPerSecondStat, setup.now, 1000);
 
+    self->game.isSimulatedOnServer = setup.callbackObject.vtbl != 0 &&
+                                     setup.callbackObject.vtbl->authoritativeStepsComposedFn != 0;
+
+    self->now = setup.now;
+    self->recorder = 0;
+    self->replayer = 0;
+
     nimbleServerUpdateQualityInit(&self->updateQuality, self->setup.targetTickTimeMs);
 
     return 0;
@@ -359,6 +649,10 @@ int nimbleServerHostMigration(NimbleServer* self, NimbleSerializeLocalPartyInfo
                               size_t localPartyCount)
 {
     CLOG_C_INFO(&self->log, "prepare new host for migration")
+    if (self->recorder != 0) {
+        nimbleServerRecorderHostMigration(self->recorder, localPartyInfos, localPartyCount);
+    }
+
     nimbleServerLocalPartiesReset(&self->localParties);
 
     for (size_t i = 0; i < localPartyCount; ++i) {
@@ -383,15 +677,22 @@ int nimbleServerHostMigration(NimbleServer* self, NimbleSerializeLocalPartyInfo
 }
 
 /// Reinitialize (reuse the memory) and set a new game state.
+/// The game memory is allocated once in nimbleServerInit and is reset in place, so back-to-back matches do not
+/// allocate any more memory.
 /// The gameState must be present for the first client that connects to the game.
 /// @param self server
+/// @param stepId the StepId that the new game starts at
+/// @param now current local server time
 /// @return negative on error
 int nimbleServerReInitWithGame(NimbleServer* self, StepId stepId, MonotonicTimeMs now)
 {
-    nimbleServerGameInit(&self->game, self->pageAllocator, self->setup.maxSingleParticipantStepOctetCount,
-                         self->setup.maxParticipantCount, self->log);
-
-    nbsStepsReInit(&self->game.authoritativeSteps, stepId);
+    if (self->recorder != 0) {
+        nimbleServerRecorderReInitWithGame(self->recorder, stepId, now);
+    }
+    self->now = now;
+    nimbleServerGameReInit(&self->game, stepId);
+    self->stepsComposedCallbackStepId = stepId;
+    nimbleServerSpectatorsReInit(&self->spectators);
     statsIntPerSecondInit(&self->authoritativeStepsPerSecondStat, now, 1000);
     nimbleServerLocalPartiesReset(&self->localParties);
     nimbleServerUpdateQualityReInit(&self->updateQuality);
@@ -400,11 +701,21 @@ int nimbleServerReInitWithGame(NimbleServer* self, StepId stepId, MonotonicTimeM
 }
 
 /// Notify the server that a connection has been connected on the transport layer.
+/// The transport connection is initialized the same way as for the first datagram that is fed on it.
 /// @param self server
 /// @param connectionIndex connectionIndex that connected
 /// @return negative on error
 int nimbleServerConnectionConnected(NimbleServer* self, uint8_t connectionIndex)
 {
+    if (self->recorder != 0) {
+        nimbleServerRecorderConnection(self->recorder, NimbleServerRecordTypeConnectionConnected, connectionIndex);
+    }
+
+    if (connectionIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal connection index : %u", connectionIndex)
+        return NimbleServerErrSerialize;
+    }
+
     NimbleServerTransportConnection* transportConnection = &self->transportConnections[connectionIndex];
     if (transportConnection->isUsed) {
         CLOG_C_SOFT_ERROR(&self->log, "connection %d already connected", connectionIndex)
@@ -413,35 +724,62 @@ int nimbleServerConnectionConnected(NimbleServer* self, uint8_t connectionIndex)
 
     CLOG_C_DEBUG(&self->log, "connection %d connected", connectionIndex)
 
-    transportConnection->isUsed = true;
+    nimbleServerPrepareTransportConnection(self, connectionIndex);
 
     return 0;
 }
 
 /// Notify the server that a connection has been disconnected on the transport layer.
+/// The party of the connection is destroyed, if it has joined, and its participants leave in the next composed step.
+/// A spectator stops receiving the pushed steps.
+/// The transport connection is free to be used again, also if the client never joined the game, and the connection id
+/// that the connect request got is returned to the free list.
 /// @param self server
 /// @param connectionIndex transport connection index that disconnected
 /// @return negative on error
 int nimbleServerConnectionDisconnected(NimbleServer* self, uint8_t connectionIndex)
 {
-    NimbleServerLocalParty* foundConnection = nimbleServerLocalPartiesFindParty(&self->localParties, connectionIndex);
-    if (!foundConnection) {
-        return -2;
+    if (self->recorder != 0) {
+        nimbleServerRecorderConnection(self->recorder, NimbleServerRecordTypeConnectionDisconnected, connectionIndex);
     }
 
-    if (!foundConnection->isUsed) {
-        return -4;
+    if (connectionIndex >= NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS) {
+        CLOG_C_SOFT_ERROR(&self->log, "illegal connection index : %u", connectionIndex)
+        return NimbleServerErrSerialize;
     }
 
-    foundConnection->id = 0xff;
-    foundConnection->isUsed = false;
-
     NimbleServerTransportConnection* transportConnection = &self->transportConnections[connectionIndex];
-    transportConnection->orderedDatagramInLogic.hasReceivedInitialDatagram = false;
+    if (!transportConnection->isUsed) {
+        CLOG_C_SOFT_ERROR(&self->log, "connection %d is not connected", connectionIndex)
+        return -2;
+    }
+
+    NimbleServerLocalParty* party = transportConnection->assignedParty;
+    if (party != 0 && party->isUsed) {
+        destroyParty(&self->localParties, party);
+    }
+
+    transportConnection->assignedParty = 0;
+    transportConnection->reorderWindow.hasReceivedInitialDatagram = false;
+    disconnectTransportConnection(self, transportConnection);
 
     return 0;
 }
 
+/// Generates a secret, e.g. for a new transport connection.
+/// When replaying, the recorded secret is used instead, so the replies are the same as in the recorded session.
+/// @param self server
+/// @return the secret
+uint64_t nimbleServerGenerateSecret(NimbleServer* self)
+{
+    uint64_t secret = self->replayer != 0 ? nimbleServerReplayerSecret(self->replayer) : secureRandomUInt64();
+    if (self->recorder != 0) {
+        nimbleServerRecorderSecret(self->recorder, secret);
+    }
+
+    return secret;
+}
+
 /// Resets the server
 /// @param self server
 void nimbleServerReset(NimbleServer* self)
@@ -465,7 +803,9 @@ static int sendOnlyToSpecifiedTransport(void* _self, const uint8_t* data, size_t
 }
 
 /// Read all datagrams from the multi-transport
+/// Datagrams that fail with an external error, see nimbleServerIsErrorExternal(), are skipped.
 /// @param self server
+/// @return negative on error
 int nimbleServerReadFromMultiTransport(NimbleServer* self)
 {
     int connectionId;
@@ -501,13 +841,16 @@ int nimbleServerReadFromMultiTransport(NimbleServer* self)
 
         NimbleServerResponse response;
         response.transportOut = &responseTransport;
+        response.runOut = 0;
 
-        int errorCode = nimbleServerFeed(self, (uint8_t) connectionId, datagram, (size_t) octetCountReceived,
-                                         &response);
+        int errorCode = feed(self, NimbleServerRecordTypeReceive, (uint8_t) connectionId, datagram,
+                             (size_t) octetCountReceived, &response);
         if (errorCode < 0) {
-            if (!nimbleServerIsErrorExternal(errorCode)) {
-                CLOG_C_SOFT_ERROR(&self->log, "error on feed %d", errorCode)
+            // A bad datagram from one client should not keep the datagrams from the other clients from being read
+            if (nimbleServerIsErrorExternal(errorCode)) {
+                continue;
             }
+            CLOG_C_SOFT_ERROR(&self->log, "error on feed %d", errorCode)
             return errorCode;
         }
     }
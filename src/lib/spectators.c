@@ -0,0 +1,271 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <flood/out_stream.h>
+#include <imprint/allocator.h>
+#include <nimble-serialize/server_out.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/game.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/spectators.h>
+#include <nimble-server/transport_connection.h>
+#include <nimble-steps-serialize/pending_out_serialize.h>
+#include <tiny-libc/tiny_libc.h>
+
+#define NIMBLE_SERVER_SPECTATORS_MAX_STEP_COUNT_IN_PUSH (20)
+
+/// Allocates the spectator slots. A capacity of zero disables spectators and allocates nothing.
+/// @param self spectators
+/// @param allocator allocator for the spectator slots
+/// @param capacity maximum number of spectators
+/// @param redundancyStepCount number of already pushed steps that are pushed again, zero uses the default
+/// @param log target log
+void nimbleServerSpectatorsInit(NimbleServerSpectators* self, ImprintAllocator* allocator, size_t capacity,
+                                size_t redundancyStepCount, Clog log)
+{
+    self->log = log;
+    self->capacity = capacity;
+    self->spectators = 0;
+    self->redundancyStepCount = redundancyStepCount == 0 ? NIMBLE_SERVER_SPECTATORS_DEFAULT_REDUNDANCY_STEP_COUNT
+                                                         : redundancyStepCount;
+    if (self->redundancyStepCount > NIMBLE_SERVER_SPECTATORS_MAX_STEP_COUNT_IN_PUSH) {
+        self->redundancyStepCount = NIMBLE_SERVER_SPECTATORS_MAX_STEP_COUNT_IN_PUSH;
+    }
+
+    if (capacity > 0) {
+        self->spectators = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerSpectator, capacity);
+        tc_mem_clear_type_n(self->spectators, capacity);
+    }
+
+    nimbleServerSpectatorsReInit(self);
+}
+
+/// Removes all spectators, keeps the memory
+/// @param self spectators
+void nimbleServerSpectatorsReInit(NimbleServerSpectators* self)
+{
+    for (size_t i = 0; i < self->capacity; ++i) {
+        NimbleServerSpectator* spectator = &self->spectators[i];
+        if (spectator->isUsed) {
+            nimbleServerSpectatorsRemove(self, spectator);
+        }
+    }
+
+    self->count = 0;
+    self->payloadCount = 0;
+    tc_mem_clear_type(&self->stats);
+}
+
+/// Adds a spectator
+/// @param self spectators
+/// @param connectionId the connectionId that is used for sendTo()
+/// @param transportConnection transport connection of the spectator, or NULL
+/// @param waitingForStepId the first step that the spectator needs, usually the StepId of the downloaded game state
+/// @return negative on error, otherwise the index of the spectator
+int nimbleServerSpectatorsAdd(NimbleServerSpectators* self, int connectionId,
+                              NimbleServerTransportConnection* transportConnection, StepId waitingForStepId)
+{
+    for (size_t i = 0; i < self->capacity; ++i) {
+        NimbleServerSpectator* spectator = &self->spectators[i];
+        if (spectator->isUsed) {
+            continue;
+        }
+
+        spectator->isUsed = true;
+        spectator->hasAcked = false;
+        spectator->connectionId = connectionId;
+        spectator->waitingForStepId = waitingForStepId;
+        spectator->pushedUpToStepId = waitingForStepId;
+        spectator->transportConnection = transportConnection;
+        orderedDatagramOutLogicInit(&spectator->orderedDatagramOutLogic);
+        if (transportConnection != 0) {
+            transportConnection->spectator = spectator;
+        }
+        self->count++;
+
+        CLOG_C_DEBUG(&self->log, "added spectator %zu for connection %d (%zu spectators)", i, connectionId,
+                     self->count)
+
+        return (int) i;
+    }
+
+    CLOG_C_NOTICE(&self->log, "no free spectator slot for connection %d (capacity %zu)", connectionId,
+                  self->capacity)
+
+    return NimbleServerErrSessionFull;
+}
+
+/// Removes a spectator and detaches it from the transport connection
+/// @param self spectators
+/// @param spectator spectator to remove
+void nimbleServerSpectatorsRemove(NimbleServerSpectators* self, NimbleServerSpectator* spectator)
+{
+    if (!spectator->isUsed) {
+        return;
+    }
+
+    if (spectator->transportConnection != 0) {
+        spectator->transportConnection->spectator = 0;
+        spectator->transportConnection = 0;
+    }
+    spectator->isUsed = false;
+    self->count--;
+}
+
+/// The spectator has told us which step it is waiting for
+/// @param self spectators
+/// @param spectator spectator that acked
+/// @param waitingForStepId the first step that the spectator does not have
+void nimbleServerSpectatorsAck(NimbleServerSpectators* self, NimbleServerSpectator* spectator,
+                               StepId waitingForStepId)
+{
+    (void) self;
+
+    spectator->waitingForStepId = waitingForStepId;
+    if (!spectator->hasAcked || (int32_t) (waitingForStepId - spectator->pushedUpToStepId) > 0) {
+        spectator->pushedUpToStepId = waitingForStepId;
+    }
+    spectator->hasAcked = true;
+}
+
+/// Finds the serialized payload for the range, or serializes it if no other spectator has needed it this push
+/// @param self spectators
+/// @param steps authoritative steps
+/// @param startStepId first step in the range
+/// @param stepCount number of steps in the range
+/// @return the payload or NULL on error
+static const NimbleServerSpectatorsPayload* payloadForRange(NimbleServerSpectators* self, const NbsSteps* steps,
+                                                            StepId startStepId, size_t stepCount)
+{
+    for (size_t i = 0; i < self->payloadCount; ++i) {
+        const NimbleServerSpectatorsPayload* payload = &self->payloads[i];
+        if (payload->startStepId == startStepId && payload->stepCount == stepCount) {
+            return payload;
+        }
+    }
+
+    size_t index = self->payloadCount;
+    if (index < NIMBLE_SERVER_SPECTATORS_PAYLOAD_CACHE_COUNT) {
+        self->payloadCount++;
+    } else {
+        index = NIMBLE_SERVER_SPECTATORS_PAYLOAD_CACHE_COUNT - 1;
+    }
+    NimbleServerSpectatorsPayload* payload = &self->payloads[index];
+
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, payload->octets, sizeof(payload->octets));
+
+    // Spectators do not send any steps, so there is no information about their incoming buffer
+    int err = nimbleSerializeServerOutStepHeader(&outStream, 0, 0, 0, &self->log);
+    if (err < 0) {
+        self->payloadCount = index;
+        return 0;
+    }
+
+    NbsPendingRange range;
+    range.startId = startStepId;
+    range.count = stepCount;
+    err = nbsPendingStepsSerializeOutRanges(&outStream, steps, &range, 1);
+    if (err < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not serialize spectator range %08X (%zu steps)", startStepId, stepCount)
+        self->payloadCount = index;
+        return 0;
+    }
+
+    payload->startStepId = startStepId;
+    payload->stepCount = stepCount;
+    payload->octetCount = outStream.pos;
+    self->stats.serializeCount++;
+
+    return payload;
+}
+
+/// Pushes the authoritative steps that the spectators have not received yet, including some of the already pushed
+/// steps for redundancy. Should be called once every update, after the incoming datagrams have been handled.
+/// @param self spectators
+/// @param game game with the authoritative steps
+/// @param transport transport to send the datagrams with
+/// @return negative on error, otherwise the number of datagrams sent
+int nimbleServerSpectatorsPush(NimbleServerSpectators* self, const NimbleServerGame* game,
+                               DatagramTransportMulti* transport)
+{
+    const NbsSteps* steps = &game->authoritativeSteps;
+
+    self->payloadCount = 0;
+
+    if (self->count == 0 || steps->stepsCount == 0) {
+        return 0;
+    }
+
+    int sentCount = 0;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    for (size_t i = 0; i < self->capacity; ++i) {
+        NimbleServerSpectator* spectator = &self->spectators[i];
+        if (!spectator->isUsed || !spectator->hasAcked) {
+            continue;
+        }
+
+        if ((int32_t) (steps->expectedWriteId - spectator->pushedUpToStepId) <= 0) {
+            continue;
+        }
+
+        StepId startStepId = (StepId) (spectator->pushedUpToStepId - self->redundancyStepCount);
+        if ((int32_t) (spectator->waitingForStepId - startStepId) > 0) {
+            startStepId = spectator->waitingForStepId;
+        }
+        if ((int32_t) (steps->expectedReadId - startStepId) > 0) {
+            startStepId = steps->expectedReadId;
+        }
+
+        size_t stepCount = (size_t) (StepId) (steps->expectedWriteId - startStepId);
+        if (stepCount > NIMBLE_SERVER_SPECTATORS_MAX_STEP_COUNT_IN_PUSH) {
+            stepCount = NIMBLE_SERVER_SPECTATORS_MAX_STEP_COUNT_IN_PUSH;
+        }
+
+        const NimbleServerSpectatorsPayload* payload = payloadForRange(self, steps, startStepId, stepCount);
+        if (payload == 0) {
+            return NimbleServerErrSerialize;
+        }
+
+        OrderedDatagramOutLogic* orderedDatagramOutLogic = spectator->transportConnection != 0
+                                                               ? &spectator->transportConnection->orderedDatagramOutLogic
+                                                               : &spectator->orderedDatagramOutLogic;
+
+        FldOutStream outStream;
+        fldOutStreamInit(&outStream, datagram, sizeof(datagram));
+        int err = orderedDatagramOutLogicPrepare(orderedDatagramOutLogic, &outStream);
+        if (err < 0) {
+            return err;
+        }
+        err = fldOutStreamWriteOctets(&outStream, payload->octets, payload->octetCount);
+        if (err < 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "spectator datagram is too large (%zu octets)", payload->octetCount)
+            return err;
+        }
+        orderedDatagramOutLogicCommit(orderedDatagramOutLogic);
+
+        transport->sendTo(transport->self, spectator->connectionId, datagram, outStream.pos);
+
+        spectator->pushedUpToStepId = (StepId) (startStepId + stepCount);
+        self->stats.pushDatagramCount++;
+        self->stats.pushOctetCount += outStream.pos;
+        sentCount++;
+    }
+
+    return sentCount;
+}
+
+/// Calculates the octet count that nimbleServerSpectatorsInit allocates
+/// @param capacity maximum number of spectators
+/// @return octet count, rounded up to a cache line
+size_t nimbleServerSpectatorsCalculateMemoryRequirement(size_t capacity)
+{
+    if (capacity == 0) {
+        return 0;
+    }
+
+    return nimbleServerAlignToCacheLine(capacity * sizeof(NimbleServerSpectator));
+}
@@ -0,0 +1,184 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <imprint/allocator.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/step_history.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Allocates the step history. A stepCapacity of zero disables the history and allocates nothing.
+/// @param self step history
+/// @param allocator allocator for the entries and the octet ring
+/// @param stepCapacity maximum number of steps to keep
+/// @param octetCapacity maximum number of step octets to keep
+/// @param log target log
+void nimbleServerStepHistoryInit(NimbleServerStepHistory* self, ImprintAllocator* allocator, size_t stepCapacity,
+                                 size_t octetCapacity, Clog log)
+{
+    self->log = log;
+    self->entryCapacity = stepCapacity;
+    self->octetCapacity = octetCapacity;
+    self->entries = 0;
+    self->octets = 0;
+
+    if (stepCapacity > 0) {
+        CLOG_ASSERT(octetCapacity > 0, "step history must have room for octets")
+        self->entries = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerStepHistoryEntry, stepCapacity);
+        self->octets = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, octetCapacity);
+    }
+
+    nimbleServerStepHistoryReInit(self);
+}
+
+/// Forgets all the steps, keeps the memory
+/// @param self step history
+void nimbleServerStepHistoryReInit(NimbleServerStepHistory* self)
+{
+    self->firstStepId = 0;
+    self->stepCount = 0;
+    self->firstEntryIndex = 0;
+    self->writePosition = 0;
+}
+
+/// Checks if the history was initialized with a capacity
+/// @param self step history
+/// @return true if steps are kept
+bool nimbleServerStepHistoryIsEnabled(const NimbleServerStepHistory* self)
+{
+    return self->entryCapacity > 0;
+}
+
+static void discardOldest(NimbleServerStepHistory* self)
+{
+    self->firstEntryIndex = (self->firstEntryIndex + 1) % self->entryCapacity;
+    self->firstStepId++;
+    self->stepCount--;
+}
+
+static const NimbleServerStepHistoryEntry* entryForStep(const NimbleServerStepHistory* self, StepId stepId)
+{
+    size_t offset = (StepId) (stepId - self->firstStepId);
+
+    return &self->entries[(self->firstEntryIndex + offset) % self->entryCapacity];
+}
+
+/// Adds the step after the latest step in the history. If the StepId does not follow the latest step, the history
+/// starts over from this step. The oldest steps are discarded to make room.
+/// @param self step history
+/// @param stepId StepId of the authoritative step
+/// @param octets the serialized authoritative step
+/// @param octetCount octet count of the step
+/// @return negative on error
+int nimbleServerStepHistoryAdd(NimbleServerStepHistory* self, StepId stepId, const uint8_t* octets,
+                               size_t octetCount)
+{
+    if (!nimbleServerStepHistoryIsEnabled(self)) {
+        return 0;
+    }
+
+    if (octetCount > self->octetCapacity || octetCount > UINT16_MAX) {
+        CLOG_C_SOFT_ERROR(&self->log, "step %08X is too large for the history (%zu octets)", stepId, octetCount)
+        return -1;
+    }
+
+    if (self->stepCount > 0 && stepId != (StepId) (self->firstStepId + self->stepCount)) {
+        CLOG_C_NOTICE(&self->log, "step %08X does not follow %08X, starting the history over", stepId,
+                      (StepId) (self->firstStepId + self->stepCount - 1))
+        nimbleServerStepHistoryReInit(self);
+    }
+
+    if (self->stepCount == 0) {
+        self->firstStepId = stepId;
+    }
+
+    while (self->stepCount == self->entryCapacity ||
+           (self->stepCount > 0 &&
+            self->writePosition + octetCount - self->entries[self->firstEntryIndex].position > self->octetCapacity)) {
+        discardOldest(self);
+    }
+
+    size_t start = (size_t) (self->writePosition % self->octetCapacity);
+    size_t firstOctetCount = self->octetCapacity - start;
+    if (firstOctetCount > octetCount) {
+        firstOctetCount = octetCount;
+    }
+    tc_memcpy_octets(self->octets + start, octets, firstOctetCount);
+    tc_memcpy_octets(self->octets, octets + firstOctetCount, octetCount - firstOctetCount);
+
+    NimbleServerStepHistoryEntry* entry =
+        &self->entries[(self->firstEntryIndex + self->stepCount) % self->entryCapacity];
+    entry->position = self->writePosition;
+    entry->octetCount = (uint16_t) octetCount;
+
+    self->stepCount++;
+    self->writePosition += octetCount;
+
+    return 0;
+}
+
+/// Checks if the step is in the history
+/// @param self step history
+/// @param stepId StepId to check
+/// @return true if the step can be read
+bool nimbleServerStepHistoryHasStep(const NimbleServerStepHistory* self, StepId stepId)
+{
+    return self->stepCount > 0 && (size_t) (StepId) (stepId - self->firstStepId) < self->stepCount;
+}
+
+/// Reads a step from the history
+/// @param self step history
+/// @param stepId StepId to read
+/// @param target target buffer
+/// @param maxOctetCount capacity of target
+/// @return the octet count of the step, or negative on error
+int nimbleServerStepHistoryRead(const NimbleServerStepHistory* self, StepId stepId, uint8_t* target,
+                                size_t maxOctetCount)
+{
+    if (!nimbleServerStepHistoryHasStep(self, stepId)) {
+        return -1;
+    }
+
+    const NimbleServerStepHistoryEntry* entry = entryForStep(self, stepId);
+    if (entry->octetCount > maxOctetCount) {
+        return -2;
+    }
+
+    size_t start = (size_t) (entry->position % self->octetCapacity);
+    size_t firstOctetCount = self->octetCapacity - start;
+    if (firstOctetCount > entry->octetCount) {
+        firstOctetCount = entry->octetCount;
+    }
+    tc_memcpy_octets(target, self->octets + start, firstOctetCount);
+    tc_memcpy_octets(target + firstOctetCount, self->octets, entry->octetCount - firstOctetCount);
+
+    return entry->octetCount;
+}
+
+/// Calculates the octet count for all the steps from stepId to the latest step in the history
+/// @param self step history
+/// @param stepId the first StepId
+/// @return octet count, zero if the step is not in the history
+size_t nimbleServerStepHistoryOctetCountFrom(const NimbleServerStepHistory* self, StepId stepId)
+{
+    if (!nimbleServerStepHistoryHasStep(self, stepId)) {
+        return 0;
+    }
+
+    return (size_t) (self->writePosition - entryForStep(self, stepId)->position);
+}
+
+/// Calculates the octet count that nimbleServerStepHistoryInit allocates
+/// @param stepCapacity maximum number of steps to keep
+/// @param octetCapacity maximum number of step octets to keep
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerStepHistoryCalculateMemoryRequirement(size_t stepCapacity, size_t octetCapacity)
+{
+    if (stepCapacity == 0) {
+        return 0;
+    }
+
+    return nimbleServerAlignToCacheLine(stepCapacity * sizeof(NimbleServerStepHistoryEntry)) +
+           nimbleServerAlignToCacheLine(octetCapacity);
+}
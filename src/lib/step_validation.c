@@ -0,0 +1,131 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <imprint/allocator.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/recorder.h>
+#include <nimble-server/step_validation.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Allocates the batch, and the steps buffer that the predicted steps are read into, for the step validation.
+/// A validateFn of zero disables the validation and allocates nothing.
+/// @param self step validation
+/// @param allocator allocator for the batch
+/// @param maxStepOctetCount maximum octet count for a single participant step
+/// @param validateFn the application function that validates a batch of steps
+/// @param validateSelf passed to validateFn
+/// @param log target log
+void nimbleServerStepValidationInit(NimbleServerStepValidation* self, ImprintAllocator* allocator,
+                                    size_t maxStepOctetCount, NimbleServerValidatePredictedStepsFn validateFn,
+                                    void* validateSelf, Clog log)
+{
+    self->log = log;
+    self->validateFn = validateFn;
+    self->validateSelf = validateSelf;
+    self->maxStepOctetCount = maxStepOctetCount;
+    self->steps = 0;
+    self->octets = 0;
+    self->stepCount = 0;
+    self->recorder = 0;
+    tc_mem_clear_type(&self->stats);
+
+    if (validateFn != 0) {
+        self->steps = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerValidatedStep,
+                                               NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT);
+        self->octets = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t,
+                                                NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT * maxStepOctetCount);
+        nbsStepsInit(&self->readSteps, allocator, maxStepOctetCount, log);
+    }
+}
+
+/// Checks if a validation function was provided
+/// @param self step validation
+/// @return true if the predicted steps should be validated
+bool nimbleServerStepValidationIsEnabled(const NimbleServerStepValidation* self)
+{
+    return self->validateFn != 0;
+}
+
+/// Checks if the batch must be validated before more steps can be added
+/// @param self step validation
+/// @return true if the batch is full
+bool nimbleServerStepValidationIsFull(const NimbleServerStepValidation* self)
+{
+    return self->stepCount == NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT;
+}
+
+/// Adds a step to the batch. The caller copies the received octets to the returned step.
+/// @param self step validation
+/// @param participantId the participant that predicted the step
+/// @param stepId the StepId of the predicted step
+/// @return the step to fill in, or zero if the batch is full
+NimbleServerValidatedStep* nimbleServerStepValidationAdd(NimbleServerStepValidation* self, uint8_t participantId,
+                                                         StepId stepId)
+{
+    if (nimbleServerStepValidationIsFull(self)) {
+        return 0;
+    }
+
+    size_t index = self->stepCount++;
+    NimbleServerValidatedStep* step = &self->steps[index];
+    step->participantId = participantId;
+    step->stepId = stepId;
+    step->octets = &self->octets[index * self->maxStepOctetCount];
+    step->octetCount = 0;
+    step->maxOctetCount = self->maxStepOctetCount;
+    step->isRejected = false;
+
+    return step;
+}
+
+/// Calls the validation function once for all the steps in the batch. Rejected steps are left in the batch, but
+/// without any octets. The result is recorded, if the server is recorded.
+/// @param self step validation
+void nimbleServerStepValidationValidate(NimbleServerStepValidation* self)
+{
+    if (self->stepCount == 0) {
+        return;
+    }
+
+    self->validateFn(self->validateSelf, self->steps, self->stepCount);
+
+    for (size_t i = 0; i < self->stepCount; ++i) {
+        NimbleServerValidatedStep* step = &self->steps[i];
+        if (step->octetCount > step->maxOctetCount) {
+            CLOG_C_SOFT_ERROR(&self->log, "validator wrote %zu octets for step %08X, but max is %zu. rejecting it",
+                              step->octetCount, step->stepId, step->maxOctetCount)
+            step->isRejected = true;
+        }
+        if (step->isRejected) {
+            step->octetCount = 0;
+            self->stats.rejectedStepCount++;
+        }
+    }
+
+    if (self->recorder != 0) {
+        nimbleServerRecorderValidatedSteps(self->recorder, self->steps, self->stepCount);
+    }
+
+    self->stats.batchCount++;
+    self->stats.validatedStepCount += self->stepCount;
+}
+
+/// Empties the batch, after the steps have been inserted into the steps buffers
+/// @param self step validation
+void nimbleServerStepValidationClear(NimbleServerStepValidation* self)
+{
+    self->stepCount = 0;
+}
+
+/// Calculates the octet count that nimbleServerStepValidationInit allocates if validation is enabled
+/// @param maxStepOctetCount maximum octet count for a single participant step
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerStepValidationCalculateMemoryRequirement(size_t maxStepOctetCount)
+{
+    return nimbleServerAlignToCacheLine(NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT *
+                                        sizeof(NimbleServerValidatedStep)) +
+           nimbleServerAlignToCacheLine(NIMBLE_SERVER_STEP_VALIDATION_MAX_STEP_COUNT * maxStepOctetCount) +
+           nimbleServerStepsCalculateMemoryRequirement(maxStepOctetCount);
+}
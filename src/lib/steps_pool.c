@@ -0,0 +1,101 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <imprint/allocator.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/steps_pool.h>
+
+/// Allocates all the step buffers in the pool up front
+/// @param self steps pool
+/// @param allocator allocator for the step buffers
+/// @param capacity number of step buffers
+/// @param maxStepOctetCount maximum octet count for a single step
+/// @param log target log
+void nimbleServerStepsPoolInit(NimbleServerStepsPool* self, ImprintAllocator* allocator, size_t capacity,
+                               size_t maxStepOctetCount, Clog log)
+{
+    CLOG_ASSERT(capacity > 0, "steps pool must have at least one entry")
+    CLOG_ASSERT(capacity <= NIMBLE_SERVER_CIRCULAR_BUFFER_SIZE, "steps pool capacity is too large %zu", capacity)
+
+    self->log = log;
+    self->capacity = capacity;
+    self->usedCount = 0;
+    self->maxStepOctetCount = maxStepOctetCount;
+    self->entries = IMPRINT_ALLOC_TYPE_COUNT(allocator, NbsSteps, capacity);
+
+    nimbleServerCircularBufferInit(&self->freeList);
+    for (size_t i = 0; i < capacity; ++i) {
+        nbsStepsInit(&self->entries[i], allocator, maxStepOctetCount, log);
+        nimbleServerCircularBufferWrite(&self->freeList, (uint8_t) i);
+    }
+
+    CLOG_C_DEBUG(&self->log, "allocated %zu step buffers (%zu octets each)", capacity,
+                 nimbleServerStepsPoolOctetCountPerEntry(self))
+}
+
+/// Takes a step buffer from the pool
+/// @param self steps pool
+/// @return the step buffer or NULL if all buffers are in use
+NbsSteps* nimbleServerStepsPoolAcquire(NimbleServerStepsPool* self)
+{
+    if (nimbleServerCircularBufferIsEmpty(&self->freeList)) {
+        CLOG_C_NOTICE(&self->log, "out of step buffers, all %zu are in use", self->capacity)
+        return 0;
+    }
+
+    uint8_t index = nimbleServerCircularBufferRead(&self->freeList);
+    self->usedCount++;
+
+    return &self->entries[index];
+}
+
+/// Returns a step buffer to the pool
+/// @param self steps pool
+/// @param steps step buffer previously acquired from the same pool
+void nimbleServerStepsPoolRelease(NimbleServerStepsPool* self, NbsSteps* steps)
+{
+    size_t index = (size_t) (steps - self->entries);
+    CLOG_ASSERT(index < self->capacity, "step buffer is not from this pool")
+    CLOG_ASSERT(self->usedCount > 0, "releasing a step buffer, but none is in use")
+
+    self->usedCount--;
+    nimbleServerCircularBufferWrite(&self->freeList, (uint8_t) index);
+}
+
+/// Calculates how many step buffers fit into a step budget
+/// @param stepBudgetOctetCount total octet count for all the participant step buffers. Zero means one step buffer for
+/// each participant slot.
+/// @param maxStepOctetCount maximum octet count for a single step
+/// @param maxParticipantCount maximum number of participants in a game
+/// @return number of step buffers, at most maxParticipantCount. Zero if the budget is too small for a single one.
+size_t nimbleServerStepsPoolCapacityFromBudget(size_t stepBudgetOctetCount, size_t maxStepOctetCount,
+                                               size_t maxParticipantCount)
+{
+    if (stepBudgetOctetCount == 0) {
+        return maxParticipantCount;
+    }
+
+    size_t capacity = stepBudgetOctetCount / nimbleServerStepsCalculateMemoryRequirement(maxStepOctetCount);
+
+    return capacity < maxParticipantCount ? capacity : maxParticipantCount;
+}
+
+/// Calculates the octet count that nimbleServerStepsPoolInit allocates
+/// @param capacity number of step buffers
+/// @param maxStepOctetCount maximum octet count for a single step
+/// @return octet count, each allocation rounded up to a cache line
+size_t nimbleServerStepsPoolCalculateMemoryRequirement(size_t capacity, size_t maxStepOctetCount)
+{
+    return nimbleServerAlignToCacheLine(capacity * sizeof(NbsSteps)) +
+           capacity * nimbleServerStepsCalculateMemoryRequirement(maxStepOctetCount);
+}
+
+/// The octet count used by a single participant step buffer
+/// @param self steps pool
+/// @return octet count
+size_t nimbleServerStepsPoolOctetCountPerEntry(const NimbleServerStepsPool* self)
+{
+    return sizeof(NbsSteps) + nimbleServerStepsCalculateMemoryRequirement(self->maxStepOctetCount);
+}
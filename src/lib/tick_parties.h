@@ -0,0 +1,13 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_TICK_PARTIES_H
+#define NIMBLE_SERVER_TICK_PARTIES_H
+
+struct NimbleServer;
+
+void nimbleServerTickParties(struct NimbleServer* self);
+
+#endif
@@ -3,40 +3,110 @@
  *  Licensed under the MIT License. See LICENSE in the project root for license information.
  *--------------------------------------------------------------------------------------------------------*/
 
+#include <imprint/allocator.h>
+#include <nimble-server/errors.h>
 #include <nimble-server/transport_connection.h>
 
+/// Frees the blob stream of the download and its chunk entries, if one has been started
+/// @param self transport connection
+void transportConnectionDestroyBlobStream(NimbleServerTransportConnection* self)
+{
+    NimbleServerTransportConnectionDownload* download = self->download;
+    if (download == 0 || !download->hasBlobStream) {
+        return;
+    }
+
+    blobStreamOutDestroy(&download->blobStreamOut);
+    IMPRINT_FREE(self->blobStreamOutAllocator, download->blobStreamOut.entries);
+    download->hasBlobStream = false;
+}
+
+/// Frees the blob transfer state and its blob stream, if any
+/// @param self transport connection
+static void freeDownload(NimbleServerTransportConnection* self)
+{
+    if (self->download == 0) {
+        return;
+    }
+
+    transportConnectionDestroyBlobStream(self);
+    IMPRINT_FREE(self->gameStateAllocator, self->download->gameState.state);
+    IMPRINT_FREE(self->gameStateAllocator, self->download);
+    self->download = 0;
+}
+
 /// Initializes a transport connection
-/// Holds information for a specified connection in the transport
+/// Holds information for a specified connection in the transport.
+/// The blob transfer state is not allocated until the client requests to download the game state.
 /// @param self transport connection
+/// @param gameStateAllocator allocator for the blob transfer state and the game state copy
 /// @param blobStreamAllocator allocator for the blob stream
+/// @param maxGameStateOctetSize maximum octet count of a game state
 /// @param log target logging
-void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* blobStreamAllocator,
-                             size_t maxGameStateOctetSize, Clog log)
+void transportConnectionInit(NimbleServerTransportConnection* self, ImprintAllocatorWithFree* gameStateAllocator,
+                             ImprintAllocatorWithFree* blobStreamAllocator, size_t maxGameStateOctetSize, Clog log)
 {
-    self->log = log;
+    self->diagnostics->log = log;
+    statsIntInit(&self->diagnostics->stepsBehindStats, 60);
+    self->diagnostics->debugCounter = 0;
 
     orderedDatagramOutLogicInit(&self->orderedDatagramOutLogic);
-    orderedDatagramInLogicInit(&self->orderedDatagramInLogic);
-    CLOG_C_DEBUG(&self->log, "transport connection allocating for maxGameState: %zu", maxGameStateOctetSize)
-    nimbleServerGameStateInit(&self->gameState, &blobStreamAllocator->allocator, maxGameStateOctetSize);
+    nimbleServerReorderWindowInit(&self->reorderWindow);
 
+    freeDownload(self);
+
+    self->gameStateAllocator = gameStateAllocator;
     self->nextBlobStreamOutChannel = 127;
     self->blobStreamOutAllocator = blobStreamAllocator;
-    self->debugCounter = 0;
+    self->maxGameStateOctetCount = maxGameStateOctetSize;
     self->isUsed = true;
+    self->isIdFromFreeList = false;
     self->noRangesToSendCounter = 0;
     self->phase = NbTransportConnectionPhaseIdle;
     self->blobStreamOutClientRequestId = 0;
     self->useDebugStreams = true;
-
-    statsIntInit(&self->stepsBehindStats, 60);
+    self->spectator = 0;
 }
 
+/// Marks the transport connection as disconnected and frees the blob transfer state
+/// @param self transport connection
 void transportConnectionDisconnect(NimbleServerTransportConnection* self)
 {
-    CLOG_C_DEBUG(&self->log, "disconnecting transport connection %hhu", self->id)
+    CLOG_C_DEBUG(&self->diagnostics->log, "disconnecting transport connection %hhu", self->id)
     self->isUsed = false;
     self->phase = NbTransportConnectionPhaseDisconnected;
+    freeDownload(self);
+}
+
+/// Makes sure that the blob transfer state is allocated.
+/// It is allocated on the first download request and reused for later downloads on the same connection.
+/// @param self transport connection
+/// @return negative on error
+int transportConnectionStartDownload(NimbleServerTransportConnection* self)
+{
+    if (self->download != 0) {
+        return 0;
+    }
+
+    CLOG_C_DEBUG(&self->diagnostics->log, "transport connection allocating download for maxGameState: %zu",
+                 self->maxGameStateOctetCount)
+
+    self->download = IMPRINT_ALLOC_TYPE(&self->gameStateAllocator->allocator, NimbleServerTransportConnectionDownload);
+    if (self->download == 0) {
+        return NimbleServerErrOutOfBlobMemory;
+    }
+    tc_mem_clear_type(self->download);
+    int err = nimbleServerGameStateInit(&self->download->gameState, &self->gameStateAllocator->allocator,
+                                        self->maxGameStateOctetCount);
+    if (err < 0) {
+        CLOG_C_NOTICE(&self->diagnostics->log, "could not allocate the game state copy (%zu octets)",
+                      self->maxGameStateOctetCount)
+        IMPRINT_FREE(self->gameStateAllocator, self->download);
+        self->download = 0;
+        return NimbleServerErrOutOfBlobMemory;
+    }
+
+    return 0;
 }
 /// sets the latest authoritative state tick id
 /// @param self transport connection
@@ -48,7 +118,7 @@ void transportConnectionSetGameStateTickId(NimbleServerTransportConnection* self
 
 int transportConnectionWriteHeader(NimbleServerTransportConnection* self, FldOutStream* outStream)
 {
-    CLOG_C_VERBOSE(&self->log, "prepare transport connection header %02X", self->id)
+    CLOG_C_VERBOSE(&self->diagnostics->log, "prepare transport connection header %02X", self->id)
     return orderedDatagramOutLogicPrepare(&self->orderedDatagramOutLogic, outStream);
 }
 
@@ -16,12 +16,12 @@ static void showStats(NimbleServerTransportConnection* transportConnection)
 
     if (party) {
         tc_snprintf(debug, DEBUG_COUNT, "server: conn %u step count in incoming buffer", party->id);
-        statsIntDebug(&party->incomingStepCountInBufferStats, &transportConnection->log, debug, "steps");
+        statsIntDebug(&party->diagnostics->incomingStepCountInBufferStats, &transportConnection->diagnostics->log, debug, "steps");
     }
 
     tc_snprintf(debug, DEBUG_COUNT, "server: conn %d steps behind authoritative (latency)",
                 transportConnection->transportConnectionId);
-    statsIntDebug(&transportConnection->stepsBehindStats, &transportConnection->log, debug, "steps");
+    statsIntDebug(&transportConnection->diagnostics->stepsBehindStats, &transportConnection->diagnostics->log, debug, "steps");
 }
 
 /// Update stats for the transport connection.
@@ -33,13 +33,13 @@ void nimbleServerTransportConnectionUpdateStats(NimbleServerTransportConnection*
 {
     NimbleServerLocalParty* party = transportConnection->assignedParty;
     if (party != 0) {
-        statsIntAdd(&party->incomingStepCountInBufferStats, (int) party->stepsInBufferCount);
+        statsIntAdd(&party->diagnostics->incomingStepCountInBufferStats, (int) party->stepsInBufferCount);
     }
 
     size_t stepsBehindForClient = foundGame->authoritativeSteps.expectedWriteId - clientWaitingForStepId;
-    statsIntAdd(&transportConnection->stepsBehindStats, (int) stepsBehindForClient);
+    statsIntAdd(&transportConnection->diagnostics->stepsBehindStats, (int) stepsBehindForClient);
 
-    if ((transportConnection->debugCounter++ % 3000) == 0) {
+    if ((transportConnection->diagnostics->debugCounter++ % 3000) == 0) {
         showStats(transportConnection);
     }
 }
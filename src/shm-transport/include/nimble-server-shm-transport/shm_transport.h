@@ -0,0 +1,120 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SHM_TRANSPORT_SHM_TRANSPORT_H
+#define NIMBLE_SERVER_SHM_TRANSPORT_SHM_TRANSPORT_H
+
+#include <clog/clog.h>
+#include <datagram-transport/multi.h>
+#include <datagram-transport/transport.h>
+#include <datagram-transport/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define NIMBLE_SERVER_SHM_TRANSPORT_MAGIC (0x4E53484D)
+#define NIMBLE_SERVER_SHM_TRANSPORT_FORMAT_VERSION (1)
+#define NIMBLE_SERVER_SHM_TRANSPORT_MAX_CONNECTION_COUNT (64)
+#define NIMBLE_SERVER_SHM_TRANSPORT_MAX_NAME_OCTET_COUNT (64)
+
+/// The shared memory starts with this header. All the shared structures use the host byte order, the server and
+/// the clients must run on the same machine with the same build.
+typedef struct NimbleServerShmTransportHeader {
+    uint32_t magic;
+    uint32_t formatVersion;
+    uint32_t connectionCount;
+    uint32_t slotCount;
+    uint32_t serverWakeup;    ///< futex word, incremented by a client that sends while the server is waiting
+    uint32_t serverIsWaiting;
+    uint8_t padding[40];
+} NimbleServerShmTransportHeader;
+
+typedef struct NimbleServerShmTransportSlot {
+    uint32_t octetCount;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerShmTransportSlot;
+
+/// Single producer, single consumer ring of datagrams. head and tail are on separate cache lines, so the producer
+/// and the consumer never write to the same cache line. The slots are stored after all the connections.
+typedef struct NimbleServerShmTransportRing {
+    uint64_t head; ///< only written by the producer
+    uint64_t droppedCount; ///< datagrams that were dropped since the ring was full
+    uint8_t headPadding[48];
+    uint64_t tail; ///< only written by the consumer
+    uint8_t tailPadding[56];
+} NimbleServerShmTransportRing;
+
+/// One client process. The connection index is the connectionId that the server sees in receiveFrom() and uses in
+/// sendTo().
+typedef struct NimbleServerShmTransportConnection {
+    uint32_t isAttached; ///< claimed by a client with compare and swap
+    uint32_t clientWakeup; ///< futex word, incremented by the server when it sends while the client is waiting
+    uint32_t clientIsWaiting;
+    uint8_t padding[52];
+    NimbleServerShmTransportRing toServer;
+    NimbleServerShmTransportRing toClient;
+} NimbleServerShmTransportConnection;
+
+typedef struct NimbleServerShmTransportSetup {
+    const char* name; ///< name of the POSIX shared memory object, e.g. "/nimble-server"
+    size_t connectionCount;
+    size_t slotCount; ///< datagrams in flight in each direction for each connection, must be a power of two
+    Clog log;
+} NimbleServerShmTransportSetup;
+
+typedef struct NimbleServerShmTransportStats {
+    uint64_t receivedDatagramCount;
+    uint64_t sentDatagramCount;
+    uint64_t droppedDatagramCount;
+    uint64_t wakeupCount;
+} NimbleServerShmTransportStats;
+
+/// The server side of a shared memory DatagramTransportMulti, for clients that run on the same machine as the server
+/// (e.g. bots or test rigs). Each connection has one ring in each direction, so sending and receiving a datagram is
+/// a copy into or out of the shared memory, without any system call. The receiving side is only woken up (futex on
+/// Linux) if it is waiting.
+typedef struct NimbleServerShmTransport {
+    uint8_t* mapped;
+    size_t mappedOctetCount;
+    NimbleServerShmTransportHeader* header;
+    NimbleServerShmTransportConnection* connections;
+    NimbleServerShmTransportSlot* slots;
+    size_t connectionCount;
+    size_t slotCount;
+    size_t nextReadIndex;
+    char name[NIMBLE_SERVER_SHM_TRANSPORT_MAX_NAME_OCTET_COUNT];
+    DatagramTransportMulti multiTransport;
+    NimbleServerShmTransportStats stats;
+    Clog log;
+} NimbleServerShmTransport;
+
+int nimbleServerShmTransportCreate(NimbleServerShmTransport* self, NimbleServerShmTransportSetup setup);
+int nimbleServerShmTransportWait(NimbleServerShmTransport* self, int timeoutMs);
+void nimbleServerShmTransportDestroy(NimbleServerShmTransport* self);
+
+/// The client side of the shared memory transport. Attaches to a free connection of a server that has been created
+/// with nimbleServerShmTransportCreate().
+typedef struct NimbleServerShmTransportClient {
+    uint8_t* mapped;
+    size_t mappedOctetCount;
+    NimbleServerShmTransportHeader* header;
+    NimbleServerShmTransportConnection* connection;
+    NimbleServerShmTransportSlot* toServerSlots;
+    NimbleServerShmTransportSlot* toClientSlots;
+    size_t slotCount;
+    int connectionId;
+    DatagramTransport transport;
+    NimbleServerShmTransportStats stats;
+    Clog log;
+} NimbleServerShmTransportClient;
+
+int nimbleServerShmTransportClientAttach(NimbleServerShmTransportClient* self, const char* name, Clog log);
+int nimbleServerShmTransportClientSend(NimbleServerShmTransportClient* self, const uint8_t* data, size_t octetCount);
+ssize_t nimbleServerShmTransportClientReceive(NimbleServerShmTransportClient* self, uint8_t* data,
+                                              size_t maxOctetCount);
+int nimbleServerShmTransportClientWait(NimbleServerShmTransportClient* self, int timeoutMs);
+void nimbleServerShmTransportClientDetach(NimbleServerShmTransportClient* self);
+
+#endif
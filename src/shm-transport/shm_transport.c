@@ -0,0 +1,472 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if defined TORNADO_OS_LINUX && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#elif !defined TORNADO_OS_WINDOWS && !defined _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <nimble-server-shm-transport/shm_transport.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined TORNADO_OS_LINUX
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static size_t mappedOctetCount(size_t connectionCount, size_t slotCount)
+{
+    return sizeof(NimbleServerShmTransportHeader) + connectionCount * sizeof(NimbleServerShmTransportConnection) +
+           connectionCount * 2 * slotCount * sizeof(NimbleServerShmTransportSlot);
+}
+
+static NimbleServerShmTransportSlot* toServerSlots(NimbleServerShmTransportSlot* slots, size_t connectionIndex,
+                                                   size_t slotCount)
+{
+    return &slots[connectionIndex * 2 * slotCount];
+}
+
+static NimbleServerShmTransportSlot* toClientSlots(NimbleServerShmTransportSlot* slots, size_t connectionIndex,
+                                                   size_t slotCount)
+{
+    return &slots[(connectionIndex * 2 + 1) * slotCount];
+}
+
+/// Wakes up the waiting side, if it has told us that it is waiting. The sender has already published the head with
+/// a sequentially consistent store, so either the waiting side sees the new datagram before it sleeps, or we see
+/// that it is waiting.
+static bool wakeIfWaiting(uint32_t* wakeup, uint32_t* isWaiting)
+{
+    if (!__atomic_load_n(isWaiting, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+
+    __atomic_add_fetch(wakeup, 1, __ATOMIC_SEQ_CST);
+#if defined TORNADO_OS_LINUX
+    syscall(SYS_futex, wakeup, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#endif
+
+    return true;
+}
+
+/// Sleeps until the wakeup word is changed or the timeout expires. Without futex support it only sleeps for a
+/// short while, and the caller has to check the rings again.
+static void waitForWakeup(uint32_t* wakeup, uint32_t seenWakeup, int timeoutMs)
+{
+#if defined TORNADO_OS_LINUX
+    struct timespec timeout = {timeoutMs / 1000, (long) (timeoutMs % 1000) * 1000000L};
+    syscall(SYS_futex, wakeup, FUTEX_WAIT, seenWakeup, &timeout, 0, 0);
+#else
+    (void) wakeup;
+    (void) seenWakeup;
+    struct timespec pollTime = {0, timeoutMs > 0 ? 1000000L : 0};
+    nanosleep(&pollTime, 0);
+#endif
+}
+
+/// Copies the datagram into the next free slot. If the ring is full, the datagram is dropped, the same way as a
+/// full socket buffer would.
+/// @return number of written datagrams (zero if dropped)
+static int ringWrite(NimbleServerShmTransportRing* ring, NimbleServerShmTransportSlot* slots, size_t slotCount,
+                     const uint8_t* data, size_t octetCount)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= slotCount) {
+        __atomic_store_n(&ring->droppedCount, ring->droppedCount + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    NimbleServerShmTransportSlot* slot = &slots[head & (slotCount - 1)];
+    slot->octetCount = (uint32_t) octetCount;
+    memcpy(slot->octets, data, octetCount);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    return 1;
+}
+
+/// Copies the oldest datagram out of the ring
+/// @return number of octets in the datagram, zero if the ring is empty, negative on error
+static ssize_t ringRead(NimbleServerShmTransportRing* ring, NimbleServerShmTransportSlot* slots, size_t slotCount,
+                        uint8_t* data, size_t maxOctetCount)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+
+    const NimbleServerShmTransportSlot* slot = &slots[tail & (slotCount - 1)];
+    // The other side is another process, so the octet count is not trusted
+    size_t octetCount = slot->octetCount;
+    if (octetCount == 0 || octetCount > DATAGRAM_TRANSPORT_MAX_SIZE || octetCount > maxOctetCount) {
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    memcpy(data, slot->octets, octetCount);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return (ssize_t) octetCount;
+}
+
+static bool ringIsEmpty(NimbleServerShmTransportRing* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail;
+}
+
+static int serverSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerShmTransport* self = (NimbleServerShmTransport*) _self;
+    if (connectionId < 0 || (size_t) connectionId >= self->connectionCount || octetCount == 0 ||
+        octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        return -1;
+    }
+
+    NimbleServerShmTransportConnection* connection = &self->connections[connectionId];
+    int writtenCount = ringWrite(&connection->toClient,
+                                 toClientSlots(self->slots, (size_t) connectionId, self->slotCount), self->slotCount,
+                                 data, octetCount);
+    if (writtenCount == 0) {
+        self->stats.droppedDatagramCount++;
+        return 0;
+    }
+
+    self->stats.sentDatagramCount++;
+    if (wakeIfWaiting(&connection->clientWakeup, &connection->clientIsWaiting)) {
+        self->stats.wakeupCount++;
+    }
+
+    return 0;
+}
+
+static ssize_t serverReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerShmTransport* self = (NimbleServerShmTransport*) _self;
+
+    for (size_t i = 0; i < self->connectionCount; ++i) {
+        size_t index = (self->nextReadIndex + i) % self->connectionCount;
+        NimbleServerShmTransportConnection* connection = &self->connections[index];
+        ssize_t octetCount = ringRead(&connection->toServer, toServerSlots(self->slots, index, self->slotCount),
+                                      self->slotCount, data, maxOctetCount);
+        if (octetCount < 0) {
+            CLOG_C_NOTICE(&self->log, "connection %zu wrote an illegal datagram, skipping it", index)
+            continue;
+        }
+        if (octetCount > 0) {
+            // Continue with the next connection, so a busy connection can not starve the others
+            self->nextReadIndex = (index + 1) % self->connectionCount;
+            *connectionId = (int) index;
+            self->stats.receivedDatagramCount++;
+            return octetCount;
+        }
+    }
+
+    return 0;
+}
+
+/// Creates (truncates) the shared memory object and initializes all the connections.
+/// The clients can attach as soon as this returns.
+/// @param self shared memory transport
+/// @param setup name, connection count and slot count
+/// @return negative on error
+int nimbleServerShmTransportCreate(NimbleServerShmTransport* self, NimbleServerShmTransportSetup setup)
+{
+    self->log = setup.log;
+    self->mapped = 0;
+
+    if (setup.connectionCount == 0 || setup.connectionCount > NIMBLE_SERVER_SHM_TRANSPORT_MAX_CONNECTION_COUNT ||
+        setup.slotCount == 0 || (setup.slotCount & (setup.slotCount - 1)) != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "shm transport: illegal connection count %zu or slot count %zu",
+                          setup.connectionCount, setup.slotCount)
+        return -1;
+    }
+
+    int printedCount = snprintf(self->name, sizeof(self->name), "%s", setup.name);
+    if (printedCount < 0 || (size_t) printedCount >= sizeof(self->name)) {
+        return -ENAMETOOLONG;
+    }
+
+    int fileDescriptor = shm_open(self->name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fileDescriptor < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "shm transport: could not create '%s' (%d)", self->name, errno)
+        return -errno;
+    }
+
+    size_t octetCount = mappedOctetCount(setup.connectionCount, setup.slotCount);
+    if (ftruncate(fileDescriptor, (off_t) octetCount) < 0) {
+        int err = -errno;
+        close(fileDescriptor);
+        shm_unlink(self->name);
+        return err;
+    }
+
+    void* mapped = mmap(0, octetCount, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (mapped == MAP_FAILED) {
+        int err = -errno;
+        shm_unlink(self->name);
+        return err;
+    }
+
+    self->mapped = (uint8_t*) mapped;
+    self->mappedOctetCount = octetCount;
+    self->connectionCount = setup.connectionCount;
+    self->slotCount = setup.slotCount;
+    self->nextReadIndex = 0;
+    self->header = (NimbleServerShmTransportHeader*) self->mapped;
+    self->connections = (NimbleServerShmTransportConnection*) (self->mapped + sizeof(NimbleServerShmTransportHeader));
+    self->slots = (NimbleServerShmTransportSlot*) (self->connections + setup.connectionCount);
+    memset(&self->stats, 0, sizeof(self->stats));
+
+    memset(self->mapped, 0, sizeof(NimbleServerShmTransportHeader) +
+                                setup.connectionCount * sizeof(NimbleServerShmTransportConnection));
+    self->header->formatVersion = NIMBLE_SERVER_SHM_TRANSPORT_FORMAT_VERSION;
+    self->header->connectionCount = (uint32_t) setup.connectionCount;
+    self->header->slotCount = (uint32_t) setup.slotCount;
+    // The magic is written last, a client that sees it can rely on the rest of the header
+    __atomic_store_n(&self->header->magic, NIMBLE_SERVER_SHM_TRANSPORT_MAGIC, __ATOMIC_RELEASE);
+
+    self->multiTransport.self = self;
+    self->multiTransport.sendTo = serverSendTo;
+    self->multiTransport.receiveFrom = serverReceiveFrom;
+
+    CLOG_C_DEBUG(&self->log, "shm transport '%s' created with %zu connections (%zu octets)", self->name,
+                 setup.connectionCount, octetCount)
+
+    return 0;
+}
+
+static int hasDatagramFromAnyClient(NimbleServerShmTransport* self)
+{
+    for (size_t i = 0; i < self->connectionCount; ++i) {
+        if (!ringIsEmpty(&self->connections[i].toServer)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/// Waits until any of the clients has sent a datagram, or the timeout expires
+/// @param self shared memory transport
+/// @param timeoutMs maximum time to wait
+/// @return 1 if there is a datagram to receive, zero on timeout
+int nimbleServerShmTransportWait(NimbleServerShmTransport* self, int timeoutMs)
+{
+    uint32_t seenWakeup = __atomic_load_n(&self->header->serverWakeup, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->header->serverIsWaiting, 1, __ATOMIC_SEQ_CST);
+
+    int hasDatagram = hasDatagramFromAnyClient(self);
+    if (!hasDatagram) {
+        waitForWakeup(&self->header->serverWakeup, seenWakeup, timeoutMs);
+        hasDatagram = hasDatagramFromAnyClient(self);
+    }
+
+    __atomic_store_n(&self->header->serverIsWaiting, 0, __ATOMIC_SEQ_CST);
+
+    return hasDatagram;
+}
+
+/// Unmaps and removes the shared memory object. Attached clients keep their mapping, but will not receive anything
+/// more.
+/// @param self shared memory transport
+void nimbleServerShmTransportDestroy(NimbleServerShmTransport* self)
+{
+    if (self->mapped == 0) {
+        return;
+    }
+
+    munmap(self->mapped, self->mappedOctetCount);
+    shm_unlink(self->name);
+    self->mapped = 0;
+}
+
+static int clientSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    return nimbleServerShmTransportClientSend((NimbleServerShmTransportClient*) _self, data, octetCount);
+}
+
+static ssize_t clientReceive(void* _self, uint8_t* data, size_t maxOctetCount)
+{
+    return nimbleServerShmTransportClientReceive((NimbleServerShmTransportClient*) _self, data, maxOctetCount);
+}
+
+/// Maps the shared memory of a server and claims the first free connection
+/// @param self client
+/// @param name name of the POSIX shared memory object that the server created
+/// @param log log
+/// @return the connection id, negative on error
+int nimbleServerShmTransportClientAttach(NimbleServerShmTransportClient* self, const char* name, Clog log)
+{
+    self->log = log;
+    self->mapped = 0;
+    self->connectionId = -1;
+
+    int fileDescriptor = shm_open(name, O_RDWR, 0600);
+    if (fileDescriptor < 0) {
+        CLOG_C_NOTICE(&self->log, "shm transport: could not open '%s' (%d)", name, errno)
+        return -errno;
+    }
+
+    struct stat fileStat;
+    if (fstat(fileDescriptor, &fileStat) < 0 || (size_t) fileStat.st_size < sizeof(NimbleServerShmTransportHeader)) {
+        close(fileDescriptor);
+        return -1;
+    }
+
+    size_t octetCount = (size_t) fileStat.st_size;
+    void* mapped = mmap(0, octetCount, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (mapped == MAP_FAILED) {
+        return -errno;
+    }
+
+    self->mapped = (uint8_t*) mapped;
+    self->mappedOctetCount = octetCount;
+    self->header = (NimbleServerShmTransportHeader*) self->mapped;
+
+    const NimbleServerShmTransportHeader* header = self->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != NIMBLE_SERVER_SHM_TRANSPORT_MAGIC ||
+        header->formatVersion != NIMBLE_SERVER_SHM_TRANSPORT_FORMAT_VERSION || header->slotCount == 0 ||
+        (header->slotCount & (header->slotCount - 1)) != 0 ||
+        header->connectionCount > NIMBLE_SERVER_SHM_TRANSPORT_MAX_CONNECTION_COUNT ||
+        mappedOctetCount(header->connectionCount, header->slotCount) != octetCount) {
+        CLOG_C_NOTICE(&self->log, "shm transport: '%s' is not a shared memory transport of this version", name)
+        nimbleServerShmTransportClientDetach(self);
+        return -1;
+    }
+
+    NimbleServerShmTransportConnection* connections = (NimbleServerShmTransportConnection*) (self->mapped +
+                                                                                             sizeof(*header));
+    NimbleServerShmTransportSlot* slots = (NimbleServerShmTransportSlot*) (connections + header->connectionCount);
+
+    for (size_t i = 0; i < header->connectionCount; ++i) {
+        uint32_t expected = 0;
+        if (!__atomic_compare_exchange_n(&connections[i].isAttached, &expected, 1, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        self->connectionId = (int) i;
+        self->connection = &connections[i];
+        self->slotCount = header->slotCount;
+        self->toServerSlots = toServerSlots(slots, i, self->slotCount);
+        self->toClientSlots = toClientSlots(slots, i, self->slotCount);
+        break;
+    }
+
+    if (self->connectionId < 0) {
+        CLOG_C_NOTICE(&self->log, "shm transport: all %u connections in '%s' are in use", header->connectionCount,
+                      name)
+        nimbleServerShmTransportClientDetach(self);
+        return -1;
+    }
+
+    // Skip whatever the server sent to the previous client on this connection
+    __atomic_store_n(&self->connection->toClient.tail,
+                     __atomic_load_n(&self->connection->toClient.head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+    memset(&self->stats, 0, sizeof(self->stats));
+    self->transport.self = self;
+    self->transport.send = clientSend;
+    self->transport.receive = clientReceive;
+
+    return self->connectionId;
+}
+
+/// Sends a datagram to the server
+/// @param self client
+/// @param data datagram
+/// @param octetCount number of octets in the datagram
+/// @return negative on error
+int nimbleServerShmTransportClientSend(NimbleServerShmTransportClient* self, const uint8_t* data, size_t octetCount)
+{
+    if (octetCount == 0 || octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        return -1;
+    }
+
+    int writtenCount = ringWrite(&self->connection->toServer, self->toServerSlots, self->slotCount, data,
+                                 octetCount);
+    if (writtenCount == 0) {
+        self->stats.droppedDatagramCount++;
+        return 0;
+    }
+
+    self->stats.sentDatagramCount++;
+    if (wakeIfWaiting(&self->header->serverWakeup, &self->header->serverIsWaiting)) {
+        self->stats.wakeupCount++;
+    }
+
+    return 0;
+}
+
+/// Receives a datagram from the server
+/// @param self client
+/// @param data target buffer
+/// @param maxOctetCount octet capacity of data
+/// @return number of octets in the datagram, zero if there is nothing to receive, negative on error
+ssize_t nimbleServerShmTransportClientReceive(NimbleServerShmTransportClient* self, uint8_t* data,
+                                              size_t maxOctetCount)
+{
+    ssize_t octetCount = ringRead(&self->connection->toClient, self->toClientSlots, self->slotCount, data,
+                                  maxOctetCount);
+    if (octetCount > 0) {
+        self->stats.receivedDatagramCount++;
+    }
+
+    return octetCount;
+}
+
+/// Waits until the server has sent a datagram, or the timeout expires
+/// @param self client
+/// @param timeoutMs maximum time to wait
+/// @return 1 if there is a datagram to receive, zero on timeout
+int nimbleServerShmTransportClientWait(NimbleServerShmTransportClient* self, int timeoutMs)
+{
+    NimbleServerShmTransportConnection* connection = self->connection;
+
+    uint32_t seenWakeup = __atomic_load_n(&connection->clientWakeup, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&connection->clientIsWaiting, 1, __ATOMIC_SEQ_CST);
+
+    int hasDatagram = !ringIsEmpty(&connection->toClient);
+    if (!hasDatagram) {
+        waitForWakeup(&connection->clientWakeup, seenWakeup, timeoutMs);
+        hasDatagram = !ringIsEmpty(&connection->toClient);
+    }
+
+    __atomic_store_n(&connection->clientIsWaiting, 0, __ATOMIC_SEQ_CST);
+
+    return hasDatagram;
+}
+
+/// Releases the connection, so another client can attach to it, and unmaps the shared memory
+/// @param self client
+void nimbleServerShmTransportClientDetach(NimbleServerShmTransportClient* self)
+{
+    if (self->mapped == 0) {
+        return;
+    }
+
+    if (self->connectionId >= 0) {
+        __atomic_store_n(&self->connection->isAttached, 0, __ATOMIC_RELEASE);
+        self->connectionId = -1;
+    }
+
+    munmap(self->mapped, self->mappedOctetCount);
+    self->mapped = 0;
+}
@@ -0,0 +1,300 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <clog/clog.h>
+#include <imprint/allocator.h>
+#include <nimble-server-simulation/impaired_transport.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// xorshift64*, good enough for simulating a network and the same on all platforms
+/// @param self impaired transport
+/// @return a pseudo random number
+static uint64_t nextRandom(NimbleServerImpairedTransport* self)
+{
+    uint64_t x = self->randomState;
+    x ^= x >> 12u;
+    x ^= x << 25u;
+    x ^= x >> 27u;
+    self->randomState = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/// Only draws a random number if the chance is not zero, so adding an impairment to one connection does not
+/// change the outcome for the other connections.
+static bool chancePerMille(NimbleServerImpairedTransport* self, size_t perMille)
+{
+    if (perMille == 0) {
+        return false;
+    }
+
+    return (nextRandom(self) % 1000u) < perMille;
+}
+
+static size_t randomUpTo(NimbleServerImpairedTransport* self, size_t maxValue)
+{
+    if (maxValue == 0) {
+        return 0;
+    }
+
+    return (size_t) (nextRandom(self) % (maxValue + 1u));
+}
+
+static void directionInit(NimbleServerImpairedTransportDirection* self, ImprintAllocator* allocator, size_t capacity,
+                          NimbleServerImpairment impairment)
+{
+    self->queue.datagrams = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerImpairedTransportDatagram, capacity);
+    self->queue.capacity = capacity;
+    self->queue.count = 0;
+
+    for (size_t i = 0; i < NIMBLE_SERVER_IMPAIRED_TRANSPORT_MAX_CONNECTIONS; ++i) {
+        self->impairments[i] = impairment;
+        self->linkFreeAtMicroseconds[i] = 0;
+    }
+
+    tc_mem_clear_type(&self->stats);
+}
+
+/// Finds the datagram that should be delivered first
+/// @param self queue
+/// @return index of the datagram, or -1 if the queue is empty
+static int queueFindFirst(const NimbleServerImpairedTransportQueue* self)
+{
+    int foundIndex = -1;
+
+    for (size_t i = 0; i < self->count; ++i) {
+        const NimbleServerImpairedTransportDatagram* datagram = &self->datagrams[i];
+        if (foundIndex < 0) {
+            foundIndex = (int) i;
+            continue;
+        }
+        const NimbleServerImpairedTransportDatagram* found = &self->datagrams[foundIndex];
+        if (datagram->deliverAtMs < found->deliverAtMs ||
+            (datagram->deliverAtMs == found->deliverAtMs && datagram->sequence < found->sequence)) {
+            foundIndex = (int) i;
+        }
+    }
+
+    return foundIndex;
+}
+
+/// Removes the datagram that should be delivered first, if it is due
+/// @param self queue
+/// @param now current time
+/// @param[out] target the removed datagram
+/// @return true if a datagram was removed
+static bool queuePopDue(NimbleServerImpairedTransportQueue* self, MonotonicTimeMs now,
+                        NimbleServerImpairedTransportDatagram* target)
+{
+    int index = queueFindFirst(self);
+    if (index < 0 || self->datagrams[index].deliverAtMs > now) {
+        return false;
+    }
+
+    *target = self->datagrams[index];
+    self->count--;
+    if ((size_t) index != self->count) {
+        self->datagrams[index] = self->datagrams[self->count];
+    }
+
+    return true;
+}
+
+/// Applies the impairment for the connection and direction, and puts the surviving copies in the delay queue
+/// @param self impaired transport
+/// @param direction direction to impair
+/// @param connectionId connection the datagram is for
+/// @param data datagram payload
+/// @param octetCount octet count of data
+/// @return negative on error
+static int impair(NimbleServerImpairedTransport* self, NimbleServerImpairedTransportDirection* direction,
+                  int connectionId, const uint8_t* data, size_t octetCount)
+{
+    if (connectionId < 0 || connectionId >= NIMBLE_SERVER_IMPAIRED_TRANSPORT_MAX_CONNECTIONS ||
+        octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        CLOG_SOFT_ERROR("impaired transport: illegal datagram for connection %d (octet count %zu)", connectionId,
+                        octetCount)
+        return -2;
+    }
+
+    direction->stats.sentCount++;
+
+    const NimbleServerImpairment* impairment = &direction->impairments[connectionId];
+    if (chancePerMille(self, impairment->lossPerMille)) {
+        direction->stats.lostCount++;
+        return 0;
+    }
+
+    MonotonicTimeMs sendAtMs = self->nowMs;
+
+    if (impairment->bandwidthOctetsPerSecond > 0) {
+        uint64_t nowMicroseconds = (uint64_t) self->nowMs * 1000u;
+        uint64_t* linkFreeAtMicroseconds = &direction->linkFreeAtMicroseconds[connectionId];
+        if (*linkFreeAtMicroseconds < nowMicroseconds) {
+            *linkFreeAtMicroseconds = nowMicroseconds;
+        }
+        if (*linkFreeAtMicroseconds - nowMicroseconds > (uint64_t) impairment->maxQueueDelayMs * 1000u) {
+            direction->stats.bandwidthDroppedCount++;
+            return 0;
+        }
+        *linkFreeAtMicroseconds += (uint64_t) octetCount * 1000000u / impairment->bandwidthOctetsPerSecond;
+        sendAtMs = (MonotonicTimeMs) (*linkFreeAtMicroseconds / 1000u);
+    }
+
+    size_t copyCount = 1;
+    if (chancePerMille(self, impairment->duplicatePerMille)) {
+        direction->stats.duplicatedCount++;
+        copyCount++;
+    }
+
+    for (size_t i = 0; i < copyCount; ++i) {
+        size_t delayMs = impairment->latencyMs + randomUpTo(self, impairment->jitterMs);
+        if (chancePerMille(self, impairment->reorderPerMille)) {
+            direction->stats.reorderedCount++;
+            delayMs += impairment->reorderExtraDelayMs;
+        }
+
+        NimbleServerImpairedTransportQueue* queue = &direction->queue;
+        if (queue->count == queue->capacity) {
+            direction->stats.queueFullDroppedCount++;
+            continue;
+        }
+
+        NimbleServerImpairedTransportDatagram* datagram = &queue->datagrams[queue->count++];
+        datagram->deliverAtMs = sendAtMs + (MonotonicTimeMs) delayMs;
+        datagram->sequence = self->nextSequence++;
+        datagram->connectionId = connectionId;
+        datagram->octetCount = octetCount;
+        tc_memcpy_octets(datagram->octets, data, octetCount);
+    }
+
+    return 0;
+}
+
+/// Sends all the datagrams to the clients that are due
+/// @param self impaired transport
+/// @return negative on error
+static int flushToClients(NimbleServerImpairedTransport* self)
+{
+    NimbleServerImpairedTransportDatagram datagram;
+
+    while (queuePopDue(&self->toClients.queue, self->nowMs, &datagram)) {
+        self->toClients.stats.deliveredCount++;
+        int err = self->inner.sendTo(self->inner.self, datagram.connectionId, datagram.octets, datagram.octetCount);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int impairedSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerImpairedTransport* self = (NimbleServerImpairedTransport*) _self;
+
+    int err = impair(self, &self->toClients, connectionId, data, octetCount);
+    if (err < 0) {
+        return err;
+    }
+
+    return flushToClients(self);
+}
+
+static ssize_t impairedReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerImpairedTransport* self = (NimbleServerImpairedTransport*) _self;
+
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    while (true) {
+        int receivedConnectionId;
+        ssize_t octetCount = self->inner.receiveFrom(self->inner.self, &receivedConnectionId, buf, sizeof(buf));
+        if (octetCount < 0) {
+            return octetCount;
+        }
+        if (octetCount == 0) {
+            break;
+        }
+        impair(self, &self->toServer, receivedConnectionId, buf, (size_t) octetCount);
+    }
+
+    NimbleServerImpairedTransportDatagram datagram;
+    if (!queuePopDue(&self->toServer.queue, self->nowMs, &datagram)) {
+        return 0;
+    }
+
+    if (datagram.octetCount > maxOctetCount) {
+        return -2;
+    }
+
+    self->toServer.stats.deliveredCount++;
+    *connectionId = datagram.connectionId;
+    tc_memcpy_octets(data, datagram.octets, datagram.octetCount);
+
+    return (ssize_t) datagram.octetCount;
+}
+
+/// Initializes the impaired transport. Use the multiTransport field as the transport for the server.
+/// @param self impaired transport
+/// @param inner the transport to decorate
+/// @param allocator allocator for the delay queues
+/// @param capacity maximum number of delayed datagrams in each direction
+/// @param seed seed for the random number generator
+/// @param impairment the impairment for all connections, in both directions
+void nimbleServerImpairedTransportInit(NimbleServerImpairedTransport* self, DatagramTransportMulti inner,
+                                       ImprintAllocator* allocator, size_t capacity, uint64_t seed,
+                                       NimbleServerImpairment impairment)
+{
+    self->inner = inner;
+    self->multiTransport.self = self;
+    self->multiTransport.sendTo = impairedSendTo;
+    self->multiTransport.receiveFrom = impairedReceiveFrom;
+    self->nowMs = 0;
+    self->nextSequence = 0;
+    // xorshift must not have a zero state
+    self->randomState = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL;
+
+    directionInit(&self->toServer, allocator, capacity, impairment);
+    directionInit(&self->toClients, allocator, capacity, impairment);
+}
+
+/// Sets the impairment for a single connection
+/// @param self impaired transport
+/// @param connectionId connection to set the impairment for
+/// @param toServer impairment for the datagrams from the client to the server
+/// @param toClient impairment for the datagrams from the server to the client
+void nimbleServerImpairedTransportSetImpairment(NimbleServerImpairedTransport* self, int connectionId,
+                                                NimbleServerImpairment toServer, NimbleServerImpairment toClient)
+{
+    CLOG_ASSERT(connectionId >= 0 && connectionId < NIMBLE_SERVER_IMPAIRED_TRANSPORT_MAX_CONNECTIONS,
+                "illegal connection id %d", connectionId)
+
+    self->toServer.impairments[connectionId] = toServer;
+    self->toClients.impairments[connectionId] = toClient;
+}
+
+/// Advances the time and sends the datagrams to the clients that are due.
+/// The datagrams to the server are delivered when the server reads from the transport.
+/// @param self impaired transport
+/// @param now the current (simulated) time
+/// @return negative on error
+int nimbleServerImpairedTransportUpdate(NimbleServerImpairedTransport* self, MonotonicTimeMs now)
+{
+    CLOG_ASSERT(now >= self->nowMs, "time can not go backwards")
+    self->nowMs = now;
+
+    return flushToClients(self);
+}
+
+/// Checks if there are datagrams to the server that are due. Datagrams that the decorated transport holds are not
+/// considered, they are moved over when the server reads.
+/// @param self impaired transport
+/// @return true if the server can read a datagram now
+bool nimbleServerImpairedTransportHasDueToServer(const NimbleServerImpairedTransport* self)
+{
+    int index = queueFindFirst(&self->toServer.queue);
+
+    return index >= 0 && self->toServer.queue.datagrams[index].deliverAtMs <= self->nowMs;
+}
@@ -0,0 +1,85 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SIMULATION_IMPAIRED_TRANSPORT_H
+#define NIMBLE_SERVER_SIMULATION_IMPAIRED_TRANSPORT_H
+
+#include <datagram-transport/multi.h>
+#include <datagram-transport/types.h>
+#include <monotonic-time/monotonic_time.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+
+#define NIMBLE_SERVER_IMPAIRED_TRANSPORT_MAX_CONNECTIONS (64)
+
+/// How a connection is impaired, in one direction. The probabilities are in per mille (1/1000).
+typedef struct NimbleServerImpairment {
+    size_t latencyMs;
+    size_t jitterMs;
+    size_t lossPerMille;
+    size_t duplicatePerMille;
+    size_t reorderPerMille;
+    size_t reorderExtraDelayMs;
+    size_t bandwidthOctetsPerSecond; ///< zero means no bandwidth cap
+    size_t maxQueueDelayMs;          ///< datagrams that would be queued longer due to the bandwidth cap are dropped
+} NimbleServerImpairment;
+
+typedef struct NimbleServerImpairedTransportDatagram {
+    MonotonicTimeMs deliverAtMs;
+    uint64_t sequence;
+    int connectionId;
+    size_t octetCount;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerImpairedTransportDatagram;
+
+/// Datagrams that are delayed, delivered in deliverAtMs order (and sequence order for the same deliverAtMs)
+typedef struct NimbleServerImpairedTransportQueue {
+    NimbleServerImpairedTransportDatagram* datagrams;
+    size_t capacity;
+    size_t count;
+} NimbleServerImpairedTransportQueue;
+
+typedef struct NimbleServerImpairedTransportStats {
+    uint64_t sentCount;
+    uint64_t deliveredCount;
+    uint64_t lostCount;
+    uint64_t duplicatedCount;
+    uint64_t reorderedCount;
+    uint64_t bandwidthDroppedCount;
+    uint64_t queueFullDroppedCount;
+} NimbleServerImpairedTransportStats;
+
+typedef struct NimbleServerImpairedTransportDirection {
+    NimbleServerImpairedTransportQueue queue;
+    NimbleServerImpairment impairments[NIMBLE_SERVER_IMPAIRED_TRANSPORT_MAX_CONNECTIONS];
+    uint64_t linkFreeAtMicroseconds[NIMBLE_SERVER_IMPAIRED_TRANSPORT_MAX_CONNECTIONS];
+    NimbleServerImpairedTransportStats stats;
+} NimbleServerImpairedTransportDirection;
+
+/// Decorates a DatagramTransportMulti and adds latency, jitter, loss, duplication, reordering and bandwidth caps,
+/// for each connection and each direction. The random numbers come from a seeded generator and the time is set
+/// explicitly, so the same seed and the same calls gives exactly the same datagrams.
+typedef struct NimbleServerImpairedTransport {
+    DatagramTransportMulti inner;
+    DatagramTransportMulti multiTransport;
+    NimbleServerImpairedTransportDirection toServer;
+    NimbleServerImpairedTransportDirection toClients;
+    MonotonicTimeMs nowMs;
+    uint64_t randomState;
+    uint64_t nextSequence;
+} NimbleServerImpairedTransport;
+
+void nimbleServerImpairedTransportInit(NimbleServerImpairedTransport* self, DatagramTransportMulti inner,
+                                       struct ImprintAllocator* allocator, size_t capacity, uint64_t seed,
+                                       NimbleServerImpairment impairment);
+void nimbleServerImpairedTransportSetImpairment(NimbleServerImpairedTransport* self, int connectionId,
+                                                NimbleServerImpairment toServer, NimbleServerImpairment toClient);
+int nimbleServerImpairedTransportUpdate(NimbleServerImpairedTransport* self, MonotonicTimeMs now);
+bool nimbleServerImpairedTransportHasDueToServer(const NimbleServerImpairedTransport* self);
+
+#endif
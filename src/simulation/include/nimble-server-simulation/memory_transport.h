@@ -0,0 +1,55 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SIMULATION_MEMORY_TRANSPORT_H
+#define NIMBLE_SERVER_SIMULATION_MEMORY_TRANSPORT_H
+
+#include <datagram-transport/multi.h>
+#include <datagram-transport/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct ImprintAllocator;
+
+typedef struct NimbleServerMemoryTransportDatagram {
+    int connectionId;
+    size_t octetCount;
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+} NimbleServerMemoryTransportDatagram;
+
+/// First in, first out queue of datagrams with a fixed capacity
+typedef struct NimbleServerMemoryTransportQueue {
+    NimbleServerMemoryTransportDatagram* datagrams;
+    size_t capacity;
+    size_t readIndex;
+    size_t count;
+    size_t droppedCount;
+} NimbleServerMemoryTransportQueue;
+
+/// In-memory DatagramTransportMulti. The clients write to the queue that the server reads from, and the server
+/// replies into a queue that the clients read from.
+/// clientMultiTransport is the client side as a DatagramTransportMulti, so two servers can be connected in-process
+/// (e.g. an upstream server and an edge relay).
+typedef struct NimbleServerMemoryTransport {
+    NimbleServerMemoryTransportQueue toServer;
+    NimbleServerMemoryTransportQueue toClients;
+    DatagramTransportMulti multiTransport;
+    DatagramTransportMulti clientMultiTransport;
+    uint64_t datagramsToServerCount;
+    uint64_t datagramsToClientsCount;
+    uint64_t octetsToServerCount;
+    uint64_t octetsToClientsCount;
+} NimbleServerMemoryTransport;
+
+void nimbleServerMemoryTransportInit(NimbleServerMemoryTransport* self, struct ImprintAllocator* allocator,
+                                          size_t capacity);
+int nimbleServerMemoryTransportClientSend(NimbleServerMemoryTransport* self, int connectionId,
+                                               const uint8_t* data, size_t octetCount);
+ssize_t nimbleServerMemoryTransportClientReceive(NimbleServerMemoryTransport* self, int* connectionId,
+                                                      uint8_t* data, size_t maxOctetCount);
+size_t nimbleServerMemoryTransportPendingToServer(const NimbleServerMemoryTransport* self);
+
+#endif
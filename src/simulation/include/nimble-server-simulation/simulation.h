@@ -0,0 +1,90 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SIMULATION_SIMULATION_H
+#define NIMBLE_SERVER_SIMULATION_SIMULATION_H
+
+#include <clog/clog.h>
+#include <nimble-server-simulation/impaired_transport.h>
+#include <nimble-server-simulation/memory_transport.h>
+#include <nimble-server-simulation/synthetic_client.h>
+#include <nimble-server/server.h>
+#include <stdbool.h>
+
+struct ImprintAllocator;
+struct ImprintAllocatorWithFree;
+
+typedef struct NimbleServerSimulationSetup {
+    size_t clientCount;
+    size_t participantsPerClient;
+    size_t stepOctetCount;
+    size_t redundancyCount;
+    size_t tickTimeMs;
+    uint64_t seed;
+    NimbleServerImpairment impairment;
+    struct ImprintAllocator* allocator;
+    struct ImprintAllocatorWithFree* blobAllocator;
+    NimbleServerCallbackObject callbackObject; ///< optional, passed on to the server
+    NimbleServerForcedStepPolicy forcedStepPolicy; ///< passed on to the server
+    size_t inputHoldStepCount; ///< steps that the synthetic input stays the same, zero changes it every step
+    Clog log;
+} NimbleServerSimulationSetup;
+
+typedef struct NimbleServerSimulationStats {
+    uint64_t tickCount;
+    uint64_t authoritativeStepCount;
+    uint64_t forcedStepCount;
+    uint64_t providedStepCount;
+    uint64_t rollbackStepCount; ///< participant steps that were composed with another input than the client created
+    uint64_t stepLatencySampleCount;
+    uint64_t stepLatencyTotalMs;
+    uint64_t stepLatencyMaxMs;
+    uint64_t replyDatagramCount;
+    uint64_t replyOctetCount;
+    size_t joinedClientCount;
+    uint64_t joinTimeMaxMs;
+} NimbleServerSimulationStats;
+
+/// The synthetic client that owns a participant, to know what input the participant created
+typedef struct NimbleServerSimulationParticipantOwner {
+    bool isUsed;
+    uint8_t clientIndex;
+    uint8_t participantIndex;
+} NimbleServerSimulationParticipantOwner;
+
+typedef struct NimbleServerSimulationCreatedStep {
+    StepId stepId;
+    MonotonicTimeMs createdAtMs;
+} NimbleServerSimulationCreatedStep;
+
+/// A server with synthetic clients, connected through an in-memory transport that can be impaired.
+/// Everything is driven by a simulated clock, so a run only depends on the setup and the seed.
+typedef struct NimbleServerSimulation {
+    NimbleServer server;
+    NimbleServerMemoryTransport memoryTransport;
+    NimbleServerImpairedTransport impairedTransport;
+    NimbleServerSyntheticClient clients[NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS];
+    size_t clientCount;
+    NimbleSerializeVersion applicationVersion;
+    MonotonicTimeMs nowMs;
+    MonotonicTimeMs startedAtMs;
+    size_t tickTimeMs;
+    NimbleServerSimulationCreatedStep createdSteps[NBS_WINDOW_SIZE];
+    NimbleServerSimulationParticipantOwner participantOwners[256];
+    StepId checkedForRollbackStepId;
+    NimbleServerSimulationStats stats;
+    Clog log;
+} NimbleServerSimulation;
+
+int nimbleServerSimulationInit(NimbleServerSimulation* self, NimbleServerSimulationSetup setup);
+int nimbleServerSimulationTickClients(NimbleServerSimulation* self);
+int nimbleServerSimulationTickServer(NimbleServerSimulation* self);
+void nimbleServerSimulationDeliverToClients(NimbleServerSimulation* self);
+int nimbleServerSimulationTick(NimbleServerSimulation* self);
+int nimbleServerSimulationJoinAll(NimbleServerSimulation* self, size_t maxTickCount);
+bool nimbleServerSimulationAllClientsArePlaying(const NimbleServerSimulation* self);
+void nimbleServerSimulationResetStats(NimbleServerSimulation* self);
+
+#endif
@@ -0,0 +1,62 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_SIMULATION_SYNTHETIC_CLIENT_H
+#define NIMBLE_SERVER_SIMULATION_SYNTHETIC_CLIENT_H
+
+#include <clog/clog.h>
+#include <nimble-serialize/types.h>
+#include <nimble-serialize/version.h>
+#include <nimble-steps/steps.h>
+#include <ordered-datagram/out_logic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct NimbleServerMemoryTransport;
+
+#define NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_PARTICIPANTS (8)
+#define NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_STEP_OCTET_COUNT (64)
+
+typedef enum NimbleServerSyntheticClientPhase {
+    NimbleServerSyntheticClientPhaseConnecting,
+    NimbleServerSyntheticClientPhaseJoining,
+    NimbleServerSyntheticClientPhasePlaying,
+} NimbleServerSyntheticClientPhase;
+
+/// A client that speaks the connect, join and step protocol, without any game logic.
+/// The replies are only counted, so the StepID to start predicting from and the assigned participant IDs are
+/// provided by the simulation (a real client would download the game state to get them).
+typedef struct NimbleServerSyntheticClient {
+    int connectionId;
+    NimbleServerSyntheticClientPhase phase;
+    OrderedDatagramOutLogic orderedDatagramOutLogic;
+    NimbleSerializeClientRequestId requestId;
+    size_t participantCount;
+    NimbleSerializeParticipantId participantIds[NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_PARTICIPANTS];
+    size_t stepOctetCount;
+    size_t redundancyCount;
+    size_t inputHoldStepCount; ///< number of steps that the input stays the same, like a held button
+    StepId firstPredictedStepId;
+    StepId nextPredictedStepId;
+    size_t createdStepCountThisTick;
+    bool hasReceivedReply;
+    size_t ticksSinceRequest;
+    uint64_t replyDatagramCount;
+    uint64_t replyOctetCount;
+    Clog log;
+} NimbleServerSyntheticClient;
+
+void nimbleServerSyntheticClientInit(NimbleServerSyntheticClient* self, int connectionId, size_t participantCount,
+                                     size_t stepOctetCount, size_t redundancyCount, Clog log);
+void nimbleServerSyntheticClientStartPlaying(NimbleServerSyntheticClient* self, StepId firstPredictedStepId,
+                                             const NimbleSerializeParticipantId* participantIds);
+void nimbleServerSyntheticClientInputPayload(const NimbleServerSyntheticClient* self, size_t participantIndex,
+                                             StepId stepId, uint8_t* target);
+void nimbleServerSyntheticClientReceive(NimbleServerSyntheticClient* self, const uint8_t* data, size_t octetCount);
+int nimbleServerSyntheticClientTick(NimbleServerSyntheticClient* self, NimbleSerializeVersion applicationVersion,
+                                    StepId receivedAuthoritativeStepId, struct NimbleServerMemoryTransport* transport);
+
+#endif
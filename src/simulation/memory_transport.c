@@ -0,0 +1,158 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <imprint/allocator.h>
+#include <nimble-server-simulation/memory_transport.h>
+#include <tiny-libc/tiny_libc.h>
+
+static void queueInit(NimbleServerMemoryTransportQueue* self, ImprintAllocator* allocator, size_t capacity)
+{
+    self->datagrams = IMPRINT_ALLOC_TYPE_COUNT(allocator, NimbleServerMemoryTransportDatagram, capacity);
+    self->capacity = capacity;
+    self->readIndex = 0;
+    self->count = 0;
+    self->droppedCount = 0;
+}
+
+/// Adds a datagram to the end of the queue. If the queue is full, the datagram is dropped, the same way as a
+/// full socket receive buffer would.
+/// @param self queue
+/// @param connectionId connection that the datagram is sent to or received from
+/// @param data datagram payload
+/// @param octetCount octet count of data
+/// @return negative on error
+static int queueWrite(NimbleServerMemoryTransportQueue* self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    if (octetCount > DATAGRAM_TRANSPORT_MAX_SIZE) {
+        return -2;
+    }
+
+    if (self->count == self->capacity) {
+        self->droppedCount++;
+        return 0;
+    }
+
+    NimbleServerMemoryTransportDatagram* datagram = &self->datagrams[(self->readIndex + self->count) % self->capacity];
+    datagram->connectionId = connectionId;
+    datagram->octetCount = octetCount;
+    tc_memcpy_octets(datagram->octets, data, octetCount);
+    self->count++;
+
+    return 0;
+}
+
+/// Removes the oldest datagram from the queue
+/// @param self queue
+/// @param[out] connectionId connection that the datagram was sent to or received from
+/// @param[out] data target buffer
+/// @param maxOctetCount octet capacity of data
+/// @return the octet count of the datagram, zero if the queue is empty, or negative on error
+static ssize_t queueRead(NimbleServerMemoryTransportQueue* self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    if (self->count == 0) {
+        return 0;
+    }
+
+    const NimbleServerMemoryTransportDatagram* datagram = &self->datagrams[self->readIndex];
+    if (datagram->octetCount > maxOctetCount) {
+        return -2;
+    }
+
+    *connectionId = datagram->connectionId;
+    tc_memcpy_octets(data, datagram->octets, datagram->octetCount);
+
+    self->readIndex = (self->readIndex + 1) % self->capacity;
+    self->count--;
+
+    return (ssize_t) datagram->octetCount;
+}
+
+static int serverSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    NimbleServerMemoryTransport* self = (NimbleServerMemoryTransport*) _self;
+
+    self->datagramsToClientsCount++;
+    self->octetsToClientsCount += octetCount;
+
+    return queueWrite(&self->toClients, connectionId, data, octetCount);
+}
+
+static ssize_t serverReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    NimbleServerMemoryTransport* self = (NimbleServerMemoryTransport*) _self;
+
+    return queueRead(&self->toServer, connectionId, data, maxOctetCount);
+}
+
+static int clientSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    return nimbleServerMemoryTransportClientSend((NimbleServerMemoryTransport*) _self, connectionId, data,
+                                                 octetCount);
+}
+
+static ssize_t clientReceiveFrom(void* _self, int* connectionId, uint8_t* data, size_t maxOctetCount)
+{
+    return nimbleServerMemoryTransportClientReceive((NimbleServerMemoryTransport*) _self, connectionId, data,
+                                                    maxOctetCount);
+}
+
+/// Initializes an in-memory transport, the multiTransport field can be used as the server transport
+/// @param self memory transport
+/// @param allocator allocator for the datagram queues
+/// @param capacity maximum number of datagrams in flight in each direction
+void nimbleServerMemoryTransportInit(NimbleServerMemoryTransport* self, ImprintAllocator* allocator,
+                                          size_t capacity)
+{
+    queueInit(&self->toServer, allocator, capacity);
+    queueInit(&self->toClients, allocator, capacity);
+
+    self->multiTransport.self = self;
+    self->multiTransport.sendTo = serverSendTo;
+    self->multiTransport.receiveFrom = serverReceiveFrom;
+
+    self->clientMultiTransport.self = self;
+    self->clientMultiTransport.sendTo = clientSendTo;
+    self->clientMultiTransport.receiveFrom = clientReceiveFrom;
+
+    self->datagramsToServerCount = 0;
+    self->datagramsToClientsCount = 0;
+    self->octetsToServerCount = 0;
+    self->octetsToClientsCount = 0;
+}
+
+/// Sends a datagram from a client to the server
+/// @param self memory transport
+/// @param connectionId the connection the client is using
+/// @param data datagram payload
+/// @param octetCount octet count of data
+/// @return negative on error
+int nimbleServerMemoryTransportClientSend(NimbleServerMemoryTransport* self, int connectionId,
+                                               const uint8_t* data, size_t octetCount)
+{
+    self->datagramsToServerCount++;
+    self->octetsToServerCount += octetCount;
+
+    return queueWrite(&self->toServer, connectionId, data, octetCount);
+}
+
+/// Receives the oldest datagram that the server has sent to any of the clients
+/// @param self memory transport
+/// @param[out] connectionId the connection the datagram is for
+/// @param[out] data target buffer
+/// @param maxOctetCount octet capacity of data
+/// @return the octet count of the datagram, zero if there are no datagrams, or negative on error
+ssize_t nimbleServerMemoryTransportClientReceive(NimbleServerMemoryTransport* self, int* connectionId,
+                                                      uint8_t* data, size_t maxOctetCount)
+{
+    return queueRead(&self->toClients, connectionId, data, maxOctetCount);
+}
+
+/// Returns the number of datagrams that the server has not yet read
+/// @param self memory transport
+/// @return datagram count
+size_t nimbleServerMemoryTransportPendingToServer(const NimbleServerMemoryTransport* self)
+{
+    return self->toServer.count;
+}
@@ -0,0 +1,358 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <nimble-server-simulation/simulation.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/local_party.h>
+#include <nimble-server/participant.h>
+#include <tiny-libc/tiny_libc.h>
+
+/// Initializes the server, the transports and the clients. The clients start to connect on the first tick.
+/// @param self simulation
+/// @param setup client count, step sizes, tick time and impairment
+/// @return negative on error
+int nimbleServerSimulationInit(NimbleServerSimulation* self, NimbleServerSimulationSetup setup)
+{
+    if (setup.clientCount == 0 || setup.clientCount > NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS ||
+        setup.participantsPerClient == 0 ||
+        setup.participantsPerClient > NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_PARTICIPANTS ||
+        setup.stepOctetCount > NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_STEP_OCTET_COUNT || setup.tickTimeMs == 0) {
+        CLOG_C_SOFT_ERROR(&setup.log, "illegal simulation setup")
+        return -1;
+    }
+
+    self->clientCount = setup.clientCount;
+    self->tickTimeMs = setup.tickTimeMs;
+    self->nowMs = 0;
+    self->startedAtMs = 0;
+    self->applicationVersion.major = 0;
+    self->applicationVersion.minor = 0;
+    self->applicationVersion.patch = 0;
+    self->log = setup.log;
+    tc_mem_clear_type(&self->stats);
+    tc_mem_clear_type_n(self->createdSteps, NBS_WINDOW_SIZE);
+    tc_mem_clear_type_n(self->participantOwners, 256);
+    self->checkedForRollbackStepId = 0;
+
+    size_t queueCapacity = setup.clientCount * (setup.redundancyCount + 4) + 64;
+    nimbleServerMemoryTransportInit(&self->memoryTransport, setup.allocator, queueCapacity);
+    nimbleServerImpairedTransportInit(&self->impairedTransport, self->memoryTransport.multiTransport, setup.allocator,
+                                      queueCapacity * 8, setup.seed, setup.impairment);
+
+    NimbleServerSetup serverSetup = {.applicationVersion = self->applicationVersion,
+                                     .memory = setup.allocator,
+                                     .blobAllocator = setup.blobAllocator,
+                                     .maxConnectionCount = setup.clientCount,
+                                     .maxParticipantCount = setup.clientCount * setup.participantsPerClient,
+                                     .maxSingleParticipantStepOctetCount = setup.stepOctetCount,
+                                     .maxParticipantCountForEachConnection = setup.participantsPerClient,
+                                     .maxWaitingForReconnectTicks = 32,
+                                     .maxGameStateOctetCount = 1024,
+                                     .callbackObject = setup.callbackObject,
+                                     .forcedStepPolicy = setup.forcedStepPolicy,
+                                     .multiTransport = self->impairedTransport.multiTransport,
+                                     .now = self->nowMs,
+                                     .targetTickTimeMs = setup.tickTimeMs,
+                                     .log = setup.log};
+
+    int err = nimbleServerInit(&self->server, serverSetup);
+    if (err < 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < setup.clientCount; ++i) {
+        nimbleServerSyntheticClientInit(&self->clients[i], (int) i, setup.participantsPerClient, setup.stepOctetCount,
+                                        setup.redundancyCount, setup.log);
+        self->clients[i].inputHoldStepCount = setup.inputHoldStepCount > 0 ? setup.inputHoldStepCount : 1;
+    }
+
+    return 0;
+}
+
+/// Remembers when a predicted step was first created by any client, to measure the step delivery latency
+static void rememberCreatedSteps(NimbleServerSimulation* self, const NimbleServerSyntheticClient* client)
+{
+    for (size_t i = 0; i < client->createdStepCountThisTick; ++i) {
+        StepId stepId = (StepId) (client->nextPredictedStepId - client->createdStepCountThisTick + i);
+        NimbleServerSimulationCreatedStep* createdStep = &self->createdSteps[stepId % NBS_WINDOW_SIZE];
+        if (createdStep->stepId == stepId && createdStep->createdAtMs != 0) {
+            continue;
+        }
+        createdStep->stepId = stepId;
+        createdStep->createdAtMs = self->nowMs;
+    }
+}
+
+/// Lets every client send the datagram for the current phase.
+/// The clients assume that they have received all the authoritative steps that the server has composed.
+/// @param self simulation
+/// @return negative on error
+int nimbleServerSimulationTickClients(NimbleServerSimulation* self)
+{
+    StepId receivedAuthoritativeStepId = self->server.game.authoritativeSteps.expectedWriteId;
+
+    for (size_t i = 0; i < self->clientCount; ++i) {
+        NimbleServerSyntheticClient* client = &self->clients[i];
+        int err = nimbleServerSyntheticClientTick(client, self->applicationVersion, receivedAuthoritativeStepId,
+                                                  &self->memoryTransport);
+        if (err < 0) {
+            return err;
+        }
+        if (client->phase == NimbleServerSyntheticClientPhasePlaying) {
+            rememberCreatedSteps(self, client);
+        }
+    }
+
+    return 0;
+}
+
+/// Measures the latency from a predicted step was created until the authoritative step was composed
+static void sampleComposedSteps(NimbleServerSimulation* self, StepId fromStepId, StepId toStepId)
+{
+    for (StepId stepId = fromStepId; stepId != toStepId; ++stepId) {
+        NimbleServerSimulationCreatedStep* createdStep = &self->createdSteps[stepId % NBS_WINDOW_SIZE];
+        if (createdStep->stepId != stepId || createdStep->createdAtMs == 0) {
+            continue;
+        }
+        uint64_t latencyMs = (uint64_t) (self->nowMs - createdStep->createdAtMs);
+        self->stats.stepLatencySampleCount++;
+        self->stats.stepLatencyTotalMs += latencyMs;
+        if (latencyMs > self->stats.stepLatencyMaxMs) {
+            self->stats.stepLatencyMaxMs = latencyMs;
+        }
+        createdStep->createdAtMs = 0;
+    }
+}
+
+/// Advances the time one tick, lets the server read all the datagrams that are due and updates the server
+/// @param self simulation
+/// @return negative on error
+int nimbleServerSimulationTickServer(NimbleServerSimulation* self)
+{
+    self->nowMs += (MonotonicTimeMs) self->tickTimeMs;
+
+    int err = nimbleServerImpairedTransportUpdate(&self->impairedTransport, self->nowMs);
+    if (err < 0) {
+        return err;
+    }
+
+    StepId authoritativeStepIdBefore = self->server.game.authoritativeSteps.expectedWriteId;
+    uint64_t forcedStepCountBefore = self->server.game.participants.forcedStepCount;
+    uint64_t providedStepCountBefore = self->server.game.participants.providedStepCount;
+
+    // nimbleServerReadFromMultiTransport() reads a limited number of datagrams, and stops at the first error
+    do {
+        nimbleServerReadFromMultiTransport(&self->server);
+    } while (nimbleServerMemoryTransportPendingToServer(&self->memoryTransport) > 0 ||
+             nimbleServerImpairedTransportHasDueToServer(&self->impairedTransport));
+
+    err = nimbleServerUpdate(&self->server, self->nowMs);
+    if (err < 0) {
+        return err;
+    }
+
+    StepId authoritativeStepIdAfter = self->server.game.authoritativeSteps.expectedWriteId;
+    sampleComposedSteps(self, authoritativeStepIdBefore, authoritativeStepIdAfter);
+
+    self->stats.tickCount++;
+    self->stats.authoritativeStepCount += (uint64_t) (authoritativeStepIdAfter - authoritativeStepIdBefore);
+    self->stats.forcedStepCount += self->server.game.participants.forcedStepCount - forcedStepCountBefore;
+    self->stats.providedStepCount += self->server.game.participants.providedStepCount - providedStepCountBefore;
+
+    return 0;
+}
+
+/// Checks if the payload of a participant in an authoritative step is the input that the client created.
+/// A step that was not provided in time, or was replaced with another input, makes the client roll back.
+/// @return true if the client must roll back
+static bool isRollbackStep(const NimbleServerSimulation* self, const NimbleServerSimulationParticipantOwner* owner,
+                           StepId stepId, const uint8_t* payload, size_t payloadOctetCount)
+{
+    const NimbleServerSyntheticClient* client = &self->clients[owner->clientIndex];
+    if (payloadOctetCount != client->stepOctetCount) {
+        return true;
+    }
+
+    uint8_t expected[NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_STEP_OCTET_COUNT];
+    nimbleServerSyntheticClientInputPayload(client, owner->participantIndex, stepId, expected);
+
+    return tc_memcmp(expected, payload, payloadOctetCount) != 0;
+}
+
+/// Compares the composed authoritative steps with the input that the clients created
+/// @param self simulation
+static void countRollbackSteps(NimbleServerSimulation* self)
+{
+    const NbsSteps* authoritativeSteps = &self->server.game.authoritativeSteps;
+    if ((int32_t) (self->checkedForRollbackStepId - authoritativeSteps->expectedReadId) < 0) {
+        self->checkedForRollbackStepId = authoritativeSteps->expectedReadId;
+    }
+
+    uint8_t step[1024];
+    for (; self->checkedForRollbackStepId != authoritativeSteps->expectedWriteId; ++self->checkedForRollbackStepId) {
+        StepId stepId = self->checkedForRollbackStepId;
+        int index = nbsStepsGetIndexForStep(authoritativeSteps, stepId);
+        if (index < 0) {
+            continue;
+        }
+        int octetCount = nbsStepsReadAtIndex(authoritativeSteps, index, step, sizeof(step));
+        if (octetCount <= 0) {
+            continue;
+        }
+
+        size_t pos = 1;
+        for (size_t i = 0; i < step[0] && pos < (size_t) octetCount; ++i) {
+            uint8_t maskAndId = step[pos++];
+            const NimbleServerSimulationParticipantOwner* owner = &self->participantOwners[maskAndId & 0x7f];
+            NimbleSerializeStepType stepType = NimbleSerializeStepTypeNormal;
+            if (maskAndId & 0x80) {
+                stepType = (NimbleSerializeStepType) step[pos++];
+                if (stepType == NimbleSerializeStepTypeJoined) {
+                    pos++;
+                }
+            }
+            if (stepType != NimbleSerializeStepTypeNormal && stepType != NimbleSerializeStepTypeJoined) {
+                if (stepType == NimbleSerializeStepTypeStepNotProvidedInTime && owner->isUsed) {
+                    self->stats.rollbackStepCount++;
+                }
+                continue;
+            }
+
+            uint8_t payloadOctetCount = step[pos++];
+            if (owner->isUsed && stepType == NimbleSerializeStepTypeNormal &&
+                isRollbackStep(self, owner, stepId, &step[pos], payloadOctetCount)) {
+                self->stats.rollbackStepCount++;
+            }
+            pos += payloadOctetCount;
+        }
+    }
+}
+
+/// Hands the datagrams that has reached the clients to the clients. When a client that is joining has received
+/// the join reply, it is given the StepID and participant IDs that it would have found in the join response and
+/// the game state. The new authoritative steps are checked for steps that would make a client roll back.
+/// @param self simulation
+void nimbleServerSimulationDeliverToClients(NimbleServerSimulation* self)
+{
+    int connectionId;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+
+    while (true) {
+        ssize_t octetCount = nimbleServerMemoryTransportClientReceive(&self->memoryTransport, &connectionId, datagram,
+                                                                      sizeof(datagram));
+        if (octetCount <= 0) {
+            break;
+        }
+        if (connectionId < 0 || (size_t) connectionId >= self->clientCount) {
+            continue;
+        }
+
+        NimbleServerSyntheticClient* client = &self->clients[connectionId];
+        nimbleServerSyntheticClientReceive(client, datagram, (size_t) octetCount);
+        self->stats.replyDatagramCount++;
+        self->stats.replyOctetCount += (uint64_t) octetCount;
+
+        if (client->phase != NimbleServerSyntheticClientPhaseJoining || !client->hasReceivedReply) {
+            continue;
+        }
+
+        const NimbleServerLocalParty* party = self->server.transportConnections[connectionId].assignedParty;
+        if (party == 0) {
+            continue;
+        }
+
+        NimbleSerializeParticipantId participantIds[NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_PARTICIPANTS];
+        for (size_t i = 0; i < party->participantReferences.participantReferenceCount; ++i) {
+            participantIds[i] = party->participantReferences.participantReferences[i]->id;
+        }
+
+        for (size_t i = 0; i < party->participantReferences.participantReferenceCount; ++i) {
+            NimbleServerSimulationParticipantOwner* owner = &self->participantOwners[participantIds[i]];
+            owner->isUsed = true;
+            owner->clientIndex = (uint8_t) connectionId;
+            owner->participantIndex = (uint8_t) i;
+        }
+
+        const NimbleServerParticipant* firstParticipant = party->participantReferences.participantReferences[0];
+        nimbleServerSyntheticClientStartPlaying(client, firstParticipant->steps->expectedWriteId, participantIds);
+
+        uint64_t joinTimeMs = (uint64_t) (self->nowMs - self->startedAtMs);
+        self->stats.joinedClientCount++;
+        if (joinTimeMs > self->stats.joinTimeMaxMs) {
+            self->stats.joinTimeMaxMs = joinTimeMs;
+        }
+    }
+
+    countRollbackSteps(self);
+}
+
+/// Ticks the clients and the server, and delivers the replies to the clients
+/// @param self simulation
+/// @return negative on error
+int nimbleServerSimulationTick(NimbleServerSimulation* self)
+{
+    int err = nimbleServerSimulationTickClients(self);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationTickServer(self);
+    if (err < 0) {
+        return err;
+    }
+
+    nimbleServerSimulationDeliverToClients(self);
+
+    return 0;
+}
+
+/// Checks if all clients have joined and are sending predicted steps
+/// @param self simulation
+/// @return true if all clients are playing
+bool nimbleServerSimulationAllClientsArePlaying(const NimbleServerSimulation* self)
+{
+    for (size_t i = 0; i < self->clientCount; ++i) {
+        if (self->clients[i].phase != NimbleServerSyntheticClientPhasePlaying) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Ticks until all clients have joined
+/// @param self simulation
+/// @param maxTickCount maximum number of ticks to wait
+/// @return negative on error, or if all clients could not join in time
+int nimbleServerSimulationJoinAll(NimbleServerSimulation* self, size_t maxTickCount)
+{
+    for (size_t i = 0; i < maxTickCount && !nimbleServerSimulationAllClientsArePlaying(self); ++i) {
+        int err = nimbleServerSimulationTick(self);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    if (!nimbleServerSimulationAllClientsArePlaying(self)) {
+        CLOG_C_NOTICE(&self->log, "all clients could not join in %zu ticks", maxTickCount)
+        return NimbleServerErrSessionFull;
+    }
+
+    return 0;
+}
+
+/// Clears the stats, e.g. when all clients have joined, to only measure the steady state.
+/// The join stats are kept.
+/// @param self simulation
+void nimbleServerSimulationResetStats(NimbleServerSimulation* self)
+{
+    size_t joinedClientCount = self->stats.joinedClientCount;
+    uint64_t joinTimeMaxMs = self->stats.joinTimeMaxMs;
+
+    tc_mem_clear_type(&self->stats);
+
+    self->stats.joinedClientCount = joinedClientCount;
+    self->stats.joinTimeMaxMs = joinTimeMaxMs;
+}
@@ -0,0 +1,250 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#include <datagram-transport/types.h>
+#include <flood/out_stream.h>
+#include <nimble-serialize/client_out.h>
+#include <nimble-serialize/commands.h>
+#include <nimble-serialize/serialize.h>
+#include <nimble-server-simulation/memory_transport.h>
+#include <nimble-server-simulation/synthetic_client.h>
+#include <nimble-steps-serialize/pending_out_serialize.h>
+
+#define NIMBLE_SERVER_SYNTHETIC_CLIENT_RESEND_TICK_COUNT (30)
+#define NIMBLE_SERVER_SYNTHETIC_CLIENT_TARGET_PREDICTED_STEP_COUNT (4)
+#define NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_CREATED_STEP_COUNT_PER_TICK (8)
+
+/// Initializes a synthetic client
+/// @param self client
+/// @param connectionId the connection id to use on the memory transport
+/// @param participantCount number of local participants to join with
+/// @param stepOctetCount octet count of each predicted step, for each participant
+/// @param redundancyCount number of predicted steps to send in each datagram, for each participant
+/// @param log logging
+void nimbleServerSyntheticClientInit(NimbleServerSyntheticClient* self, int connectionId, size_t participantCount,
+                                 size_t stepOctetCount, size_t redundancyCount, Clog log)
+{
+    CLOG_ASSERT(participantCount > 0 && participantCount <= NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_PARTICIPANTS,
+                "illegal participant count %zu", participantCount)
+    CLOG_ASSERT(stepOctetCount <= NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_STEP_OCTET_COUNT, "illegal step octet count %zu",
+                stepOctetCount)
+
+    self->connectionId = connectionId;
+    self->phase = NimbleServerSyntheticClientPhaseConnecting;
+    orderedDatagramOutLogicInit(&self->orderedDatagramOutLogic);
+    self->requestId = (NimbleSerializeClientRequestId) (connectionId + 1);
+    self->participantCount = participantCount;
+    self->stepOctetCount = stepOctetCount;
+    self->redundancyCount = redundancyCount > 0 ? redundancyCount : 1;
+    self->inputHoldStepCount = 1;
+    self->firstPredictedStepId = 0;
+    self->nextPredictedStepId = 0;
+    self->createdStepCountThisTick = 0;
+    self->hasReceivedReply = false;
+    self->ticksSinceRequest = 0;
+    self->replyDatagramCount = 0;
+    self->replyOctetCount = 0;
+    self->log = log;
+}
+
+/// Starts sending predicted steps
+/// @param self client
+/// @param firstPredictedStepId the StepID that the server expects as the first predicted step
+/// @param participantIds the participant IDs that the server assigned to the local participants
+void nimbleServerSyntheticClientStartPlaying(NimbleServerSyntheticClient* self, StepId firstPredictedStepId,
+                                         const NimbleSerializeParticipantId* participantIds)
+{
+    for (size_t i = 0; i < self->participantCount; ++i) {
+        self->participantIds[i] = participantIds[i];
+    }
+    self->firstPredictedStepId = firstPredictedStepId;
+    self->nextPredictedStepId = firstPredictedStepId;
+    self->phase = NimbleServerSyntheticClientPhasePlaying;
+}
+
+/// Creates the input for a participant, the same for every client and run. The input changes every
+/// inputHoldStepCount steps.
+/// @param self client
+/// @param participantIndex local index of the participant
+/// @param stepId the StepID of the step
+/// @param target buffer for stepOctetCount octets
+void nimbleServerSyntheticClientInputPayload(const NimbleServerSyntheticClient* self, size_t participantIndex,
+                                             StepId stepId, uint8_t* target)
+{
+    StepId inputId = (StepId) (stepId / self->inputHoldStepCount);
+    for (size_t octetIndex = 0; octetIndex < self->stepOctetCount; ++octetIndex) {
+        target[octetIndex] = (uint8_t) (inputId + participantIndex + octetIndex);
+    }
+}
+
+/// Handles a datagram that the server sent to this client. The reply is only counted.
+/// @param self client
+/// @param data datagram payload
+/// @param octetCount octet count of data
+void nimbleServerSyntheticClientReceive(NimbleServerSyntheticClient* self, const uint8_t* data, size_t octetCount)
+{
+    (void) data;
+
+    self->replyDatagramCount++;
+    self->replyOctetCount += octetCount;
+    self->hasReceivedReply = true;
+}
+
+static int writeConnectRequest(NimbleServerSyntheticClient* self, FldOutStream* outStream,
+                               NimbleSerializeVersion applicationVersion)
+{
+    NimbleSerializeConnectRequest request;
+    request.applicationVersion = applicationVersion;
+    request.useDebugStreams = false;
+    request.clientRequestId = self->requestId;
+
+    return nimbleSerializeClientOutConnect(outStream, &request, &self->log);
+}
+
+static int writeJoinRequest(NimbleServerSyntheticClient* self, FldOutStream* outStream)
+{
+    NimbleSerializeJoinGameRequest request;
+    request.joinGameType = NimbleSerializeJoinGameTypeNoSecret;
+    request.playerCount = self->participantCount;
+    for (size_t i = 0; i < self->participantCount; ++i) {
+        request.players[i].localIndex = (uint8_t) i;
+    }
+    request.requestId = self->requestId;
+
+    return nimbleSerializeClientOutGameJoin(outStream, &request, &self->log);
+}
+
+/// Creates one predicted step each tick, and more if needed to stay
+/// NIMBLE_SERVER_SYNTHETIC_CLIENT_TARGET_PREDICTED_STEP_COUNT steps ahead of the authoritative steps.
+/// A real client adjusts its prediction rate in the same way, which is what keeps all the participants
+/// contributing to the same authoritative steps.
+/// @param self client
+/// @param receivedAuthoritativeStepId the authoritative StepID the client is waiting for
+static void predictSteps(NimbleServerSyntheticClient* self, StepId receivedAuthoritativeStepId)
+{
+    if (self->nextPredictedStepId < receivedAuthoritativeStepId) {
+        // The server has already composed (forced) these steps, so there is no point in sending them
+        CLOG_C_VERBOSE(&self->log, "skipping ahead from %08X to %08X", self->nextPredictedStepId,
+                       receivedAuthoritativeStepId)
+        self->nextPredictedStepId = receivedAuthoritativeStepId;
+        self->firstPredictedStepId = receivedAuthoritativeStepId;
+    }
+
+    size_t createdCount = 1;
+    self->nextPredictedStepId++;
+
+    while (createdCount < NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_CREATED_STEP_COUNT_PER_TICK &&
+           (size_t) (self->nextPredictedStepId - receivedAuthoritativeStepId) <
+               NIMBLE_SERVER_SYNTHETIC_CLIENT_TARGET_PREDICTED_STEP_COUNT) {
+        self->nextPredictedStepId++;
+        createdCount++;
+    }
+
+    self->createdStepCountThisTick = createdCount;
+}
+
+/// Writes the predicted steps in the same layout as nimbleServerLocalPartyDeserializePredictedSteps reads them.
+/// The steps created this tick, and the redundancyCount - 1 steps before them, are included for each participant,
+/// so a lost datagram does not stall the game.
+/// @param self client
+/// @param outStream stream to write to
+/// @param receivedAuthoritativeStepId the authoritative StepID the client is waiting for
+/// @return negative on error
+static int writePredictedSteps(NimbleServerSyntheticClient* self, FldOutStream* outStream,
+                               StepId receivedAuthoritativeStepId)
+{
+    int err = nimbleSerializeWriteCommand(outStream, NimbleSerializeCmdGameStep, &self->log);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nbsPendingStepsSerializeOutHeader(outStream, receivedAuthoritativeStepId);
+    if (err < 0) {
+        return err;
+    }
+
+    size_t availableCount = (size_t) (self->nextPredictedStepId - self->firstPredictedStepId);
+    size_t wantedCount = self->createdStepCountThisTick + self->redundancyCount - 1;
+    size_t stepCount = availableCount < wantedCount ? availableCount : wantedCount;
+    StepId firstStepId = (StepId) (self->nextPredictedStepId - stepCount);
+
+    fldOutStreamWriteUInt32(outStream, firstStepId);
+    fldOutStreamWriteUInt8(outStream, (uint8_t) self->participantCount);
+
+    uint8_t payload[NIMBLE_SERVER_SYNTHETIC_CLIENT_MAX_STEP_OCTET_COUNT];
+
+    for (size_t participantIndex = 0; participantIndex < self->participantCount; ++participantIndex) {
+        fldOutStreamWriteUInt8(outStream, self->participantIds[participantIndex]);
+        fldOutStreamWriteUInt8(outStream, 0);
+        fldOutStreamWriteUInt8(outStream, (uint8_t) stepCount);
+
+        for (size_t i = 0; i < stepCount; ++i) {
+            StepId stepId = (StepId) (firstStepId + i);
+            nimbleServerSyntheticClientInputPayload(self, participantIndex, stepId, payload);
+            fldOutStreamWriteUInt8(outStream, (uint8_t) self->stepOctetCount);
+            err = fldOutStreamWriteOctets(outStream, payload, self->stepOctetCount);
+            if (err < 0) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/// Sends the next datagram for the current phase: connect and join requests are resent until a reply is
+/// received, and when playing, the predicted steps are sent every tick.
+/// @param self client
+/// @param applicationVersion the application version to connect with
+/// @param receivedAuthoritativeStepId the authoritative StepID the client is waiting for
+/// @param transport transport to send on
+/// @return negative on error
+int nimbleServerSyntheticClientTick(NimbleServerSyntheticClient* self, NimbleSerializeVersion applicationVersion,
+                                StepId receivedAuthoritativeStepId, NimbleServerMemoryTransport* transport)
+{
+    if (self->phase == NimbleServerSyntheticClientPhaseConnecting && self->hasReceivedReply) {
+        self->phase = NimbleServerSyntheticClientPhaseJoining;
+        self->hasReceivedReply = false;
+        self->ticksSinceRequest = 0;
+    }
+
+    bool isRequestPhase = self->phase != NimbleServerSyntheticClientPhasePlaying;
+    if (isRequestPhase) {
+        if (self->ticksSinceRequest++ % NIMBLE_SERVER_SYNTHETIC_CLIENT_RESEND_TICK_COUNT != 0) {
+            return 0;
+        }
+    }
+
+    uint8_t buf[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, buf, sizeof(buf));
+
+    int err = orderedDatagramOutLogicPrepare(&self->orderedDatagramOutLogic, &outStream);
+    if (err < 0) {
+        return err;
+    }
+
+    switch (self->phase) {
+        case NimbleServerSyntheticClientPhaseConnecting:
+            err = writeConnectRequest(self, &outStream, applicationVersion);
+            break;
+        case NimbleServerSyntheticClientPhaseJoining:
+            err = writeJoinRequest(self, &outStream);
+            break;
+        case NimbleServerSyntheticClientPhasePlaying:
+            predictSteps(self, receivedAuthoritativeStepId);
+            err = writePredictedSteps(self, &outStream, receivedAuthoritativeStepId);
+            break;
+    }
+
+    if (err < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not write datagram %d", err)
+        return err;
+    }
+
+    orderedDatagramOutLogicCommit(&self->orderedDatagramOutLogic);
+
+    return nimbleServerMemoryTransportClientSend(transport, self->connectionId, buf, outStream.pos);
+}
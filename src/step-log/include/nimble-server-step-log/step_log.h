@@ -0,0 +1,122 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEP_LOG_STEP_LOG_H
+#define NIMBLE_SERVER_STEP_LOG_STEP_LOG_H
+
+#include <clog/clog.h>
+#include <nimble-steps/steps.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImprintAllocator;
+struct NimbleServer;
+
+#define NIMBLE_SERVER_STEP_LOG_MAGIC (0x4E53544C)
+#define NIMBLE_SERVER_STEP_LOG_FORMAT_VERSION (1)
+#define NIMBLE_SERVER_STEP_LOG_MAX_PATH_OCTET_COUNT (256)
+#define NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT (12)
+#define NIMBLE_SERVER_STEP_LOG_MAX_PENDING_INDEX_COUNT (1024)
+
+typedef enum NimbleServerStepLogRecordType {
+    NimbleServerStepLogRecordTypeStep = 1,
+    NimbleServerStepLogRecordTypeSnapshot,
+} NimbleServerStepLogRecordType;
+
+/// The index file starts with this header, followed by one entry for each StepId from firstStepId.
+/// The index is memory mapped and uses the host byte order.
+typedef struct NimbleServerStepLogIndexHeader {
+    uint32_t magic;
+    uint32_t formatVersion;
+    uint32_t firstStepId;
+    uint32_t isFirstStepIdSet;
+    uint64_t entryCount;
+    uint64_t reserved;
+} NimbleServerStepLogIndexHeader;
+
+/// Offsets into the segment file, zero means that there is no record
+typedef struct NimbleServerStepLogIndexEntry {
+    uint64_t stepOffset;
+    uint64_t snapshotOffset; ///< the latest snapshot that was written before the step
+} NimbleServerStepLogIndexEntry;
+
+typedef struct NimbleServerStepLogSetup {
+    const char* basePath; ///< ".steps" and ".index" are appended
+    size_t ringOctetCount; ///< must be a power of two
+    size_t writeBufferOctetCount;
+    size_t initialIndexCapacity;
+    size_t snapshotIntervalStepCount; ///< serializes and logs a snapshot every interval steps, zero to only log the
+                                      ///< initial snapshot and the game states that clients download
+    Clog log;
+} NimbleServerStepLogSetup;
+
+/// Only updated by the writer thread, read them after nimbleServerStepLogClose()
+typedef struct NimbleServerStepLogStats {
+    uint64_t stepCount;
+    uint64_t snapshotCount;
+    uint64_t octetCount;
+    uint64_t writeCallCount;
+    uint64_t busyNanoseconds;
+} NimbleServerStepLogStats;
+
+typedef struct NimbleServerStepLogPendingIndex {
+    StepId stepId;
+    NimbleServerStepLogRecordType type;
+    uint64_t offset;
+} NimbleServerStepLogPendingIndex;
+
+/// Appends every composed authoritative step and every game state (snapshot) to a segment file, and keeps a
+/// memory mapped StepId to offset index. The compose path only copies the step into a single producer, single
+/// consumer ring buffer. A background thread writes the segment and updates the index. If the writer can not
+/// keep up, records are dropped (and counted) instead of blocking the server.
+/// head and tail are on separate cache lines, so the server thread and the writer thread never write to the same
+/// cache line.
+typedef struct NimbleServerStepLog {
+    uint64_t head; ///< only written by the server thread
+    uint64_t droppedCount;
+    uint8_t headPadding[48];
+    uint64_t tail; ///< only written by the writer thread
+    uint8_t tailPadding[56];
+    uint8_t* ring;
+    size_t ringCapacity;
+    int shouldStop;
+
+    struct NimbleServer* server; ///< serializes the snapshots, set by nimbleServerStepLogAttach()
+    size_t snapshotIntervalStepCount;
+    size_t stepCountSinceSnapshot;
+
+    uint8_t* writeBuffer;
+    size_t writeBufferCapacity;
+    size_t writeBufferOctetCount;
+    NimbleServerStepLogPendingIndex pendingIndex[NIMBLE_SERVER_STEP_LOG_MAX_PENDING_INDEX_COUNT];
+    size_t pendingIndexCount;
+
+    int segmentFileDescriptor;
+    uint64_t segmentOctetCount;
+    uint64_t lastSnapshotOffset;
+
+    int indexFileDescriptor;
+    NimbleServerStepLogIndexHeader* indexHeader;
+    NimbleServerStepLogIndexEntry* indexEntries;
+    size_t indexCapacity;
+
+    pthread_t thread;
+    bool isRunning;
+    int writeError;
+    NimbleServerStepLogStats stats;
+    Clog log;
+} NimbleServerStepLog;
+
+int nimbleServerStepLogInit(NimbleServerStepLog* self, NimbleServerStepLogSetup setup,
+                            struct ImprintAllocator* allocator);
+void nimbleServerStepLogAttach(NimbleServerStepLog* self, struct NimbleServer* server);
+void nimbleServerStepLogAddStep(NimbleServerStepLog* self, StepId stepId, const uint8_t* octets, size_t octetCount);
+void nimbleServerStepLogAddSnapshot(NimbleServerStepLog* self, StepId stepId, const uint8_t* octets,
+                                    size_t octetCount);
+int nimbleServerStepLogClose(NimbleServerStepLog* self);
+
+#endif
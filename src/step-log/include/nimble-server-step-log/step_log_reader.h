@@ -0,0 +1,38 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#ifndef NIMBLE_SERVER_STEP_LOG_STEP_LOG_READER_H
+#define NIMBLE_SERVER_STEP_LOG_STEP_LOG_READER_H
+
+#include <nimble-server-step-log/step_log.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct NimbleServerStepLogRecord {
+    NimbleServerStepLogRecordType type;
+    StepId stepId;
+    const uint8_t* octets; ///< points into the memory mapped segment file
+    size_t octetCount;
+} NimbleServerStepLogRecord;
+
+/// Memory maps a step log that was written by NimbleServerStepLog, and looks up steps and snapshots by StepId
+/// without reading the whole segment file.
+typedef struct NimbleServerStepLogReader {
+    const uint8_t* segment;
+    size_t segmentOctetCount;
+    const NimbleServerStepLogIndexHeader* indexHeader;
+    const NimbleServerStepLogIndexEntry* indexEntries;
+    size_t indexOctetCount;
+    size_t entryCount;
+} NimbleServerStepLogReader;
+
+int nimbleServerStepLogReaderOpen(NimbleServerStepLogReader* self, const char* basePath);
+void nimbleServerStepLogReaderClose(NimbleServerStepLogReader* self);
+int nimbleServerStepLogReaderReadStep(const NimbleServerStepLogReader* self, StepId stepId,
+                                      NimbleServerStepLogRecord* record);
+int nimbleServerStepLogReaderFindSnapshot(const NimbleServerStepLogReader* self, StepId stepId,
+                                          NimbleServerStepLogRecord* record);
+
+#endif
@@ -0,0 +1,555 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if defined TORNADO_OS_LINUX && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#elif !defined TORNADO_OS_WINDOWS && !defined _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <imprint/allocator.h>
+#include <inttypes.h>
+#include <nimble-server-step-log/step_log.h>
+#include <nimble-server/server.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NIMBLE_SERVER_STEP_LOG_SEGMENT_HEADER_OCTET_COUNT (8)
+
+static uint64_t monotonicNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void writeUInt32LittleEndian(uint8_t* target, uint32_t value)
+{
+    target[0] = (uint8_t) value;
+    target[1] = (uint8_t) (value >> 8);
+    target[2] = (uint8_t) (value >> 16);
+    target[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t readUInt32LittleEndian(const uint8_t* source)
+{
+    return (uint32_t) source[0] | ((uint32_t) source[1] << 8) | ((uint32_t) source[2] << 16) |
+           ((uint32_t) source[3] << 24);
+}
+
+static size_t indexOctetCount(size_t capacity)
+{
+    return sizeof(NimbleServerStepLogIndexHeader) + capacity * sizeof(NimbleServerStepLogIndexEntry);
+}
+
+/// Writes all octets, retries on partial writes and interrupts
+/// @param fileDescriptor file to write to
+/// @param octets octets to write
+/// @param octetCount number of octets
+/// @return negative on error
+static int writeAll(int fileDescriptor, const uint8_t* octets, size_t octetCount)
+{
+    while (octetCount > 0) {
+        ssize_t written = write(fileDescriptor, octets, octetCount);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        octets += written;
+        octetCount -= (size_t) written;
+    }
+
+    return 0;
+}
+
+static void ringCopyIn(NimbleServerStepLog* self, uint64_t position, const uint8_t* octets, size_t octetCount)
+{
+    size_t start = (size_t) (position & (self->ringCapacity - 1));
+    size_t firstOctetCount = self->ringCapacity - start;
+    if (firstOctetCount > octetCount) {
+        firstOctetCount = octetCount;
+    }
+
+    memcpy(self->ring + start, octets, firstOctetCount);
+    memcpy(self->ring, octets + firstOctetCount, octetCount - firstOctetCount);
+}
+
+static void ringCopyOut(const NimbleServerStepLog* self, uint64_t position, uint8_t* target, size_t octetCount)
+{
+    size_t start = (size_t) (position & (self->ringCapacity - 1));
+    size_t firstOctetCount = self->ringCapacity - start;
+    if (firstOctetCount > octetCount) {
+        firstOctetCount = octetCount;
+    }
+
+    memcpy(target, self->ring + start, firstOctetCount);
+    memcpy(target + firstOctetCount, self->ring, octetCount - firstOctetCount);
+}
+
+/// Writes a range of the ring directly to the segment file, used for records that are larger than the write buffer
+static int writeRingRange(NimbleServerStepLog* self, uint64_t position, size_t octetCount)
+{
+    size_t start = (size_t) (position & (self->ringCapacity - 1));
+    size_t firstOctetCount = self->ringCapacity - start;
+    if (firstOctetCount > octetCount) {
+        firstOctetCount = octetCount;
+    }
+
+    int err = writeAll(self->segmentFileDescriptor, self->ring + start, firstOctetCount);
+    if (err < 0) {
+        return err;
+    }
+    self->stats.writeCallCount++;
+
+    if (octetCount > firstOctetCount) {
+        err = writeAll(self->segmentFileDescriptor, self->ring, octetCount - firstOctetCount);
+        self->stats.writeCallCount++;
+    }
+
+    return err;
+}
+
+/// Copies a record into the ring. Only called from the server thread.
+static void addRecord(NimbleServerStepLog* self, NimbleServerStepLogRecordType type, StepId stepId,
+                      const uint8_t* octets, size_t octetCount)
+{
+    size_t recordOctetCount = NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT + octetCount;
+    uint64_t head = self->head;
+    uint64_t tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+
+    if (recordOctetCount > self->ringCapacity - (size_t) (head - tail)) {
+        // Never block the server, it is better to have a hole in the log
+        self->droppedCount++;
+        return;
+    }
+
+    uint8_t header[NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT];
+    header[0] = (uint8_t) type;
+    header[1] = 0;
+    header[2] = 0;
+    header[3] = 0;
+    writeUInt32LittleEndian(&header[4], stepId);
+    writeUInt32LittleEndian(&header[8], (uint32_t) octetCount);
+
+    ringCopyIn(self, head, header, sizeof(header));
+    ringCopyIn(self, head + sizeof(header), octets, octetCount);
+
+    __atomic_store_n(&self->head, head + recordOctetCount, __ATOMIC_RELEASE);
+}
+
+/// Doubles the index file until it can hold capacity entries, and maps it again
+static int growIndex(NimbleServerStepLog* self, size_t capacity)
+{
+    size_t newCapacity = self->indexCapacity;
+    while (newCapacity < capacity) {
+        newCapacity *= 2;
+    }
+
+    munmap(self->indexHeader, indexOctetCount(self->indexCapacity));
+    self->indexHeader = 0;
+    self->indexEntries = 0;
+
+    if (ftruncate(self->indexFileDescriptor, (off_t) indexOctetCount(newCapacity)) < 0) {
+        return -errno;
+    }
+
+    void* mapped = mmap(0, indexOctetCount(newCapacity), PROT_READ | PROT_WRITE, MAP_SHARED,
+                        self->indexFileDescriptor, 0);
+    if (mapped == MAP_FAILED) {
+        return -errno;
+    }
+
+    self->indexHeader = (NimbleServerStepLogIndexHeader*) mapped;
+    self->indexEntries = (NimbleServerStepLogIndexEntry*) (self->indexHeader + 1);
+    self->indexCapacity = newCapacity;
+
+    return 0;
+}
+
+/// Adds the step to the index. StepIds that are skipped keep a zero entry, StepIds before the
+/// first one can not be indexed.
+static int indexStep(NimbleServerStepLog* self, StepId stepId, uint64_t offset)
+{
+    NimbleServerStepLogIndexHeader* header = self->indexHeader;
+    if (!header->isFirstStepIdSet) {
+        header->firstStepId = stepId;
+        header->isFirstStepIdSet = 1;
+    }
+
+    StepId delta = (StepId) (stepId - header->firstStepId);
+    if (delta >= 0x80000000u) {
+        CLOG_C_NOTICE(&self->log, "step %08X is before the first indexed step %08X, not indexed", stepId,
+                      header->firstStepId)
+        return 0;
+    }
+
+    size_t index = (size_t) delta;
+    if (index >= self->indexCapacity) {
+        int err = growIndex(self, index + 1);
+        if (err < 0) {
+            return err;
+        }
+        header = self->indexHeader;
+    }
+
+    self->indexEntries[index].stepOffset = offset;
+    self->indexEntries[index].snapshotOffset = self->lastSnapshotOffset;
+
+    if (index + 1 > header->entryCount) {
+        __atomic_store_n(&header->entryCount, (uint64_t) index + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/// Writes the write buffer to the segment file and updates the index for the records in it.
+/// The index is only updated after the records are written, so an index entry always points to complete data.
+static int flush(NimbleServerStepLog* self)
+{
+    if (self->writeBufferOctetCount > 0) {
+        int err = writeAll(self->segmentFileDescriptor, self->writeBuffer, self->writeBufferOctetCount);
+        if (err < 0) {
+            return err;
+        }
+        self->stats.writeCallCount++;
+        self->segmentOctetCount += self->writeBufferOctetCount;
+        self->writeBufferOctetCount = 0;
+    }
+
+    for (size_t i = 0; i < self->pendingIndexCount; ++i) {
+        const NimbleServerStepLogPendingIndex* pending = &self->pendingIndex[i];
+        if (pending->type == NimbleServerStepLogRecordTypeSnapshot) {
+            self->lastSnapshotOffset = pending->offset;
+            continue;
+        }
+        int err = indexStep(self, pending->stepId, pending->offset);
+        if (err < 0) {
+            return err;
+        }
+    }
+    self->pendingIndexCount = 0;
+
+    return 0;
+}
+
+/// Moves one record from the ring to the write buffer (or directly to the file, if it is too large)
+static int consumeRecord(NimbleServerStepLog* self)
+{
+    uint64_t tail = self->tail;
+    uint8_t header[NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT];
+    ringCopyOut(self, tail, header, sizeof(header));
+
+    NimbleServerStepLogRecordType type = (NimbleServerStepLogRecordType) header[0];
+    StepId stepId = readUInt32LittleEndian(&header[4]);
+    size_t recordOctetCount = sizeof(header) + readUInt32LittleEndian(&header[8]);
+
+    if (self->writeBufferOctetCount + recordOctetCount > self->writeBufferCapacity ||
+        self->pendingIndexCount == NIMBLE_SERVER_STEP_LOG_MAX_PENDING_INDEX_COUNT) {
+        int err = flush(self);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    NimbleServerStepLogPendingIndex* pending = &self->pendingIndex[self->pendingIndexCount++];
+    pending->type = type;
+    pending->stepId = stepId;
+    pending->offset = self->segmentOctetCount + self->writeBufferOctetCount;
+
+    if (recordOctetCount > self->writeBufferCapacity) {
+        int err = writeRingRange(self, tail, recordOctetCount);
+        if (err < 0) {
+            return err;
+        }
+        self->segmentOctetCount += recordOctetCount;
+        err = flush(self);
+        if (err < 0) {
+            return err;
+        }
+    } else {
+        ringCopyOut(self, tail, self->writeBuffer + self->writeBufferOctetCount, recordOctetCount);
+        self->writeBufferOctetCount += recordOctetCount;
+    }
+
+    if (type == NimbleServerStepLogRecordTypeSnapshot) {
+        self->stats.snapshotCount++;
+    } else {
+        self->stats.stepCount++;
+    }
+    self->stats.octetCount += recordOctetCount;
+
+    __atomic_store_n(&self->tail, tail + recordOctetCount, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void* writerThread(void* _self)
+{
+    NimbleServerStepLog* self = (NimbleServerStepLog*) _self;
+    const struct timespec idleTime = {0, 1000000};
+
+    while (true) {
+        int shouldStop = __atomic_load_n(&self->shouldStop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+        if (head == self->tail) {
+            if (shouldStop) {
+                break;
+            }
+            nanosleep(&idleTime, 0);
+            continue;
+        }
+
+        uint64_t start = monotonicNanoseconds();
+        int err = 0;
+        while (self->tail != head && err >= 0) {
+            err = consumeRecord(self);
+        }
+        if (err >= 0) {
+            err = flush(self);
+        }
+        self->stats.busyNanoseconds += monotonicNanoseconds() - start;
+
+        if (err < 0) {
+            CLOG_C_SOFT_ERROR(&self->log, "could not write step log (%d), stopping the writer", err)
+            self->writeError = err;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int openFile(const char* basePath, const char* suffix, int flags)
+{
+    char path[NIMBLE_SERVER_STEP_LOG_MAX_PATH_OCTET_COUNT];
+    int printedCount = snprintf(path, sizeof(path), "%s%s", basePath, suffix);
+    if (printedCount < 0 || (size_t) printedCount >= sizeof(path)) {
+        return -ENAMETOOLONG;
+    }
+
+    int fileDescriptor = open(path, flags, 0644);
+    if (fileDescriptor < 0) {
+        return -errno;
+    }
+
+    return fileDescriptor;
+}
+
+/// Asks the application for the current game state and logs it as a snapshot, so a replay can start from it
+/// even if no client downloads the game state
+static void logServerSnapshot(NimbleServerStepLog* self)
+{
+    const NimbleServerCallbackObject* callbackObject = &self->server->callbackObject;
+    if (callbackObject->vtbl == 0 || callbackObject->vtbl->authoritativeStateSerializeFn == 0) {
+        return;
+    }
+
+    NimbleServerSerializedGameState serializedGameState;
+    callbackObject->vtbl->authoritativeStateSerializeFn(callbackObject->self, &serializedGameState);
+    nimbleServerStepLogAddSnapshot(self, serializedGameState.stepId, serializedGameState.gameState,
+                                   serializedGameState.gameStateOctetCount);
+}
+
+static void stepComposed(void* _self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    NimbleServerStepLog* self = (NimbleServerStepLog*) _self;
+    nimbleServerStepLogAddStep(self, stepId, octets, octetCount);
+
+    if (self->snapshotIntervalStepCount > 0 && ++self->stepCountSinceSnapshot >= self->snapshotIntervalStepCount) {
+        logServerSnapshot(self);
+    }
+}
+
+static void snapshotProvided(void* _self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    nimbleServerStepLogAddSnapshot((NimbleServerStepLog*) _self, stepId, octets, octetCount);
+}
+
+/// Creates (truncates) the segment file and the index file, and starts the writer thread
+/// @param self step log
+/// @param setup paths and sizes
+/// @param allocator allocator for the ring buffer and the write buffer
+/// @return negative on error
+int nimbleServerStepLogInit(NimbleServerStepLog* self, NimbleServerStepLogSetup setup,
+                            struct ImprintAllocator* allocator)
+{
+    self->log = setup.log;
+    self->isRunning = false;
+    self->segmentFileDescriptor = -1;
+    self->indexFileDescriptor = -1;
+    self->indexHeader = 0;
+    self->indexEntries = 0;
+
+    if (setup.ringOctetCount == 0 || (setup.ringOctetCount & (setup.ringOctetCount - 1)) != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "ring octet count %zu must be a power of two", setup.ringOctetCount)
+        return -1;
+    }
+
+    if (setup.writeBufferOctetCount < NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT ||
+        setup.initialIndexCapacity == 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "write buffer and initial index capacity must be set")
+        return -1;
+    }
+
+    self->ring = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, setup.ringOctetCount);
+    self->ringCapacity = setup.ringOctetCount;
+    self->head = 0;
+    self->tail = 0;
+    self->droppedCount = 0;
+    self->shouldStop = 0;
+    self->writeError = 0;
+
+    self->writeBuffer = IMPRINT_ALLOC_TYPE_COUNT(allocator, uint8_t, setup.writeBufferOctetCount);
+    self->writeBufferCapacity = setup.writeBufferOctetCount;
+    self->writeBufferOctetCount = 0;
+    self->pendingIndexCount = 0;
+    self->lastSnapshotOffset = 0;
+    self->server = 0;
+    self->snapshotIntervalStepCount = setup.snapshotIntervalStepCount;
+    self->stepCountSinceSnapshot = 0;
+    memset(&self->stats, 0, sizeof(self->stats));
+
+    int segmentFileDescriptor = openFile(setup.basePath, ".steps", O_WRONLY | O_CREAT | O_TRUNC);
+    if (segmentFileDescriptor < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not create segment file for '%s' (%d)", setup.basePath,
+                          segmentFileDescriptor)
+        return segmentFileDescriptor;
+    }
+    self->segmentFileDescriptor = segmentFileDescriptor;
+
+    // Offset zero is used for a missing record in the index, so the segment starts with a small header
+    uint8_t segmentHeader[NIMBLE_SERVER_STEP_LOG_SEGMENT_HEADER_OCTET_COUNT];
+    writeUInt32LittleEndian(&segmentHeader[0], NIMBLE_SERVER_STEP_LOG_MAGIC);
+    writeUInt32LittleEndian(&segmentHeader[4], NIMBLE_SERVER_STEP_LOG_FORMAT_VERSION);
+    int err = writeAll(segmentFileDescriptor, segmentHeader, sizeof(segmentHeader));
+    if (err < 0) {
+        nimbleServerStepLogClose(self);
+        return err;
+    }
+    self->segmentOctetCount = sizeof(segmentHeader);
+
+    int indexFileDescriptor = openFile(setup.basePath, ".index", O_RDWR | O_CREAT | O_TRUNC);
+    if (indexFileDescriptor < 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not create index file for '%s' (%d)", setup.basePath,
+                          indexFileDescriptor)
+        nimbleServerStepLogClose(self);
+        return indexFileDescriptor;
+    }
+    self->indexFileDescriptor = indexFileDescriptor;
+
+    if (ftruncate(indexFileDescriptor, (off_t) indexOctetCount(setup.initialIndexCapacity)) < 0) {
+        err = -errno;
+        nimbleServerStepLogClose(self);
+        return err;
+    }
+
+    void* mapped = mmap(0, indexOctetCount(setup.initialIndexCapacity), PROT_READ | PROT_WRITE, MAP_SHARED,
+                        indexFileDescriptor, 0);
+    if (mapped == MAP_FAILED) {
+        err = -errno;
+        nimbleServerStepLogClose(self);
+        return err;
+    }
+
+    self->indexHeader = (NimbleServerStepLogIndexHeader*) mapped;
+    self->indexEntries = (NimbleServerStepLogIndexEntry*) (self->indexHeader + 1);
+    self->indexCapacity = setup.initialIndexCapacity;
+    self->indexHeader->magic = NIMBLE_SERVER_STEP_LOG_MAGIC;
+    self->indexHeader->formatVersion = NIMBLE_SERVER_STEP_LOG_FORMAT_VERSION;
+    self->indexHeader->firstStepId = 0;
+    self->indexHeader->isFirstStepIdSet = 0;
+    self->indexHeader->entryCount = 0;
+    self->indexHeader->reserved = 0;
+
+    err = pthread_create(&self->thread, 0, writerThread, self);
+    if (err != 0) {
+        CLOG_C_SOFT_ERROR(&self->log, "could not start the step log writer thread (%d)", err)
+        nimbleServerStepLogClose(self);
+        return -err;
+    }
+    self->isRunning = true;
+
+    return 0;
+}
+
+/// Makes the game report all composed authoritative steps and game states to the step log, and logs the
+/// initial snapshot. Snapshots are only serialized if the server has an authoritativeStateSerializeFn.
+/// @param self step log
+/// @param server server to observe
+void nimbleServerStepLogAttach(NimbleServerStepLog* self, NimbleServer* server)
+{
+    self->server = server;
+    server->game.observer.stepComposedFn = stepComposed;
+    server->game.observer.snapshotFn = snapshotProvided;
+    server->game.observer.self = self;
+
+    logServerSnapshot(self);
+}
+
+/// Queues an authoritative step for writing. Never blocks, the step is dropped if the ring buffer is full.
+/// @param self step log
+/// @param stepId the StepId of the authoritative step
+/// @param octets serialized authoritative step
+/// @param octetCount octet count of the step
+void nimbleServerStepLogAddStep(NimbleServerStepLog* self, StepId stepId, const uint8_t* octets, size_t octetCount)
+{
+    addRecord(self, NimbleServerStepLogRecordTypeStep, stepId, octets, octetCount);
+}
+
+/// Queues a game state for writing. The following steps in the index refer to the latest written snapshot.
+/// @param self step log
+/// @param stepId the StepId of the game state
+/// @param octets game state
+/// @param octetCount octet count of the game state
+void nimbleServerStepLogAddSnapshot(NimbleServerStepLog* self, StepId stepId, const uint8_t* octets,
+                                    size_t octetCount)
+{
+    addRecord(self, NimbleServerStepLogRecordTypeSnapshot, stepId, octets, octetCount);
+    self->stepCountSinceSnapshot = 0;
+}
+
+/// Writes the remaining records, stops the writer thread and closes the files.
+/// The game must not call the step log after this, detach it first by clearing the game observer.
+/// @param self step log
+/// @return negative if the writer failed
+int nimbleServerStepLogClose(NimbleServerStepLog* self)
+{
+    if (self->isRunning) {
+        __atomic_store_n(&self->shouldStop, 1, __ATOMIC_RELEASE);
+        pthread_join(self->thread, 0);
+        self->isRunning = false;
+    }
+
+    if (self->indexHeader != 0) {
+        msync(self->indexHeader, indexOctetCount(self->indexCapacity), MS_SYNC);
+        munmap(self->indexHeader, indexOctetCount(self->indexCapacity));
+        self->indexHeader = 0;
+        self->indexEntries = 0;
+    }
+
+    if (self->indexFileDescriptor >= 0) {
+        close(self->indexFileDescriptor);
+        self->indexFileDescriptor = -1;
+    }
+
+    if (self->segmentFileDescriptor >= 0) {
+        close(self->segmentFileDescriptor);
+        self->segmentFileDescriptor = -1;
+    }
+
+    if (self->droppedCount > 0) {
+        CLOG_C_NOTICE(&self->log, "step log dropped %" PRIu64 " records, the writer could not keep up",
+                      self->droppedCount)
+    }
+
+    return self->writeError;
+}
@@ -0,0 +1,180 @@
+/*----------------------------------------------------------------------------------------------------------
+ *  Copyright (c) Peter Bjorklund. All rights reserved. https://github.com/piot/nimble-server-lib
+ *  Licensed under the MIT License. See LICENSE in the project root for license information.
+ *--------------------------------------------------------------------------------------------------------*/
+
+#if defined TORNADO_OS_LINUX && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#elif !defined TORNADO_OS_WINDOWS && !defined _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <nimble-server-step-log/step_log_reader.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t readUInt32LittleEndian(const uint8_t* source)
+{
+    return (uint32_t) source[0] | ((uint32_t) source[1] << 8) | ((uint32_t) source[2] << 16) |
+           ((uint32_t) source[3] << 24);
+}
+
+/// Maps a complete file read only
+/// @param basePath base path of the step log
+/// @param suffix appended to the base path
+/// @param[out] octetCount size of the file
+/// @return the mapped file or NULL on error
+static const void* mapFile(const char* basePath, const char* suffix, size_t* octetCount)
+{
+    char path[NIMBLE_SERVER_STEP_LOG_MAX_PATH_OCTET_COUNT];
+    int printedCount = snprintf(path, sizeof(path), "%s%s", basePath, suffix);
+    if (printedCount < 0 || (size_t) printedCount >= sizeof(path)) {
+        return 0;
+    }
+
+    int fileDescriptor = open(path, O_RDONLY);
+    if (fileDescriptor < 0) {
+        return 0;
+    }
+
+    struct stat status;
+    if (fstat(fileDescriptor, &status) < 0 || status.st_size <= 0) {
+        close(fileDescriptor);
+        return 0;
+    }
+
+    void* mapped = mmap(0, (size_t) status.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (mapped == MAP_FAILED) {
+        return 0;
+    }
+
+    *octetCount = (size_t) status.st_size;
+
+    return mapped;
+}
+
+/// Decodes the record at the offset, and checks that it is completely inside the segment
+static int readRecord(const NimbleServerStepLogReader* self, uint64_t offset, NimbleServerStepLogRecord* record)
+{
+    if (offset == 0 || offset + NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT > self->segmentOctetCount) {
+        return -1;
+    }
+
+    const uint8_t* header = self->segment + offset;
+    size_t octetCount = readUInt32LittleEndian(&header[8]);
+    if (offset + NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT + octetCount > self->segmentOctetCount) {
+        return -2;
+    }
+
+    record->type = (NimbleServerStepLogRecordType) header[0];
+    record->stepId = readUInt32LittleEndian(&header[4]);
+    record->octets = header + NIMBLE_SERVER_STEP_LOG_RECORD_HEADER_OCTET_COUNT;
+    record->octetCount = octetCount;
+
+    return 0;
+}
+
+static const NimbleServerStepLogIndexEntry* findEntry(const NimbleServerStepLogReader* self, StepId stepId)
+{
+    if (!self->indexHeader->isFirstStepIdSet) {
+        return 0;
+    }
+
+    size_t index = (StepId) (stepId - self->indexHeader->firstStepId);
+    if (index >= self->entryCount) {
+        return 0;
+    }
+
+    return &self->indexEntries[index];
+}
+
+/// Opens a step log that has been closed by the writer
+/// @param self reader
+/// @param basePath same base path as in NimbleServerStepLogSetup
+/// @return negative on error
+int nimbleServerStepLogReaderOpen(NimbleServerStepLogReader* self, const char* basePath)
+{
+    self->segment = mapFile(basePath, ".steps", &self->segmentOctetCount);
+    if (self->segment == 0) {
+        return -1;
+    }
+
+    const void* index = mapFile(basePath, ".index", &self->indexOctetCount);
+    if (index == 0) {
+        munmap((void*) self->segment, self->segmentOctetCount);
+        self->segment = 0;
+        return -2;
+    }
+
+    self->indexHeader = (const NimbleServerStepLogIndexHeader*) index;
+    self->indexEntries = (const NimbleServerStepLogIndexEntry*) (self->indexHeader + 1);
+
+    size_t maxEntryCount = (self->indexOctetCount - sizeof(NimbleServerStepLogIndexHeader)) /
+                           sizeof(NimbleServerStepLogIndexEntry);
+    if (self->indexOctetCount < sizeof(NimbleServerStepLogIndexHeader) ||
+        self->indexHeader->magic != NIMBLE_SERVER_STEP_LOG_MAGIC ||
+        self->indexHeader->formatVersion != NIMBLE_SERVER_STEP_LOG_FORMAT_VERSION ||
+        self->indexHeader->entryCount > maxEntryCount ||
+        readUInt32LittleEndian(self->segment) != NIMBLE_SERVER_STEP_LOG_MAGIC) {
+        nimbleServerStepLogReaderClose(self);
+        return -3;
+    }
+
+    self->entryCount = (size_t) self->indexHeader->entryCount;
+
+    return 0;
+}
+
+/// Unmaps the files. Records that have been read are not valid after this.
+/// @param self reader
+void nimbleServerStepLogReaderClose(NimbleServerStepLogReader* self)
+{
+    if (self->segment != 0) {
+        munmap((void*) self->segment, self->segmentOctetCount);
+        self->segment = 0;
+    }
+
+    if (self->indexHeader != 0) {
+        munmap((void*) self->indexHeader, self->indexOctetCount);
+        self->indexHeader = 0;
+        self->indexEntries = 0;
+    }
+}
+
+/// Looks up an authoritative step
+/// @param self reader
+/// @param stepId StepId to find
+/// @param[out] record the step
+/// @return negative if the step is not in the log
+int nimbleServerStepLogReaderReadStep(const NimbleServerStepLogReader* self, StepId stepId,
+                                      NimbleServerStepLogRecord* record)
+{
+    const NimbleServerStepLogIndexEntry* entry = findEntry(self, stepId);
+    if (entry == 0) {
+        return -1;
+    }
+
+    return readRecord(self, entry->stepOffset, record);
+}
+
+/// Finds the latest snapshot (game state) that was written before the step. A replay can start from the
+/// snapshot and apply the steps from the snapshot StepId up to stepId.
+/// @param self reader
+/// @param stepId StepId to find a snapshot for
+/// @param[out] record the snapshot
+/// @return negative if there is no snapshot before the step
+int nimbleServerStepLogReaderFindSnapshot(const NimbleServerStepLogReader* self, StepId stepId,
+                                          NimbleServerStepLogRecord* record)
+{
+    const NimbleServerStepLogIndexEntry* entry = findEntry(self, stepId);
+    if (entry == 0) {
+        return -1;
+    }
+
+    return readRecord(self, entry->snapshotOffset, record);
+}
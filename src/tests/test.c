@@ -4,9 +4,123 @@
  *--------------------------------------------------------------------------------------------------------*/
 
 #include "utest.h"
+#include <datagram-transport/transport.h>
+#include <flood/in_stream.h>
+#include <flood/out_stream.h>
 #include <imprint/default_setup.h>
+#include <nimble-serialize/client_out.h>
+#include <nimble-serialize/commands.h>
+#include <nimble-serialize/serialize.h>
+#include <nimble-server-simulation/simulation.h>
+#include <nimble-server/datagram_run.h>
+#include <nimble-server/local_channel.h>
 #include <nimble-server/local_party.h>
+#include <nimble-server/memory_report.h>
+#include <nimble-server/memory_requirement.h>
+#include <nimble-server/errors.h>
+#include <nimble-server/participant.h>
+#include <nimble-server/recorder.h>
+#include <nimble-server/relay.h>
+#include <nimble-server/reorder_window.h>
+#include <nimble-server/replayer.h>
+#include <nimble-server/req_step.h>
 #include <nimble-server/server.h>
+#include <nimble-server/spectators.h>
+#include <nimble-server/step_history.h>
+#include <nimble-server/steps_pool.h>
+#include <nimble-steps-serialize/pending_out_serialize.h>
+#include <ordered-datagram/out_logic.h>
+#if !defined _WIN32
+#include <nimble-server-shm-transport/shm_transport.h>
+#include <nimble-server-step-log/step_log.h>
+#include <nimble-server-step-log/step_log_reader.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#endif
+
+typedef struct CountingAllocator {
+    ImprintAllocator info;
+    ImprintAllocator* parent;
+    size_t allocatedOctetCount;
+    size_t allocationCount;
+} CountingAllocator;
+
+static void* countingAllocatorAlloc(void* self_, size_t size, const char* sourceFile, size_t line,
+                                    const char* description)
+{
+    CountingAllocator* self = (CountingAllocator*) self_;
+    self->allocatedOctetCount += size;
+    self->allocationCount++;
+    return self->parent->allocDebugFn(self->parent, size, sourceFile, line, description);
+}
+
+static void* countingAllocatorCalloc(void* self_, size_t size, const char* sourceFile, size_t line,
+                                     const char* description)
+{
+    CountingAllocator* self = (CountingAllocator*) self_;
+    self->allocatedOctetCount += size;
+    self->allocationCount++;
+    return self->parent->callocDebugFn(self->parent, size, sourceFile, line, description);
+}
+
+static void countingAllocatorInit(CountingAllocator* self, ImprintAllocator* parent)
+{
+    self->info.allocDebugFn = countingAllocatorAlloc;
+    self->info.callocDebugFn = countingAllocatorCalloc;
+    self->parent = parent;
+    self->allocatedOctetCount = 0;
+    self->allocationCount = 0;
+}
+
+/// Returns the server setup that the tests start from. The tests override the fields that they need.
+/// @param imprintSetup memory for the server
+/// @param logPrefix constant prefix of the server log
+/// @return server setup
+static NimbleServerSetup testServerSetup(ImprintDefaultSetup* imprintSetup, const char* logPrefix)
+{
+    NimbleServerSetup setup = {.applicationVersion.major = 0,
+                               .applicationVersion.minor = 0,
+                               .applicationVersion.patch = 0,
+                               .memory = &imprintSetup->tagAllocator.info,
+                               .blobAllocator = &imprintSetup->slabAllocator.info,
+                               .maxConnectionCount = 16,
+                               .maxParticipantCount = 16,
+                               .maxSingleParticipantStepOctetCount = 20,
+                               .maxParticipantCountForEachConnection = 2,
+                               .maxWaitingForReconnectTicks = 32,
+                               .maxGameStateOctetCount = 32,
+                               .callbackObject.self = 0,
+                               .now = 0,
+                               .targetTickTimeMs = 16,
+                               .log.config = &g_clog,
+                               .log.constantPrefix = logPrefix};
+
+    return setup;
+}
+
+/// Returns the simulation setup that the tests start from: four clients with one participant each on a network without
+/// impairments. The tests override the fields that they need.
+/// @param imprintSetup memory for the simulation
+/// @param logPrefix constant prefix of the simulation log
+/// @return simulation setup
+static NimbleServerSimulationSetup testSimulationSetup(ImprintDefaultSetup* imprintSetup, const char* logPrefix)
+{
+    NimbleServerImpairment noImpairment = {0};
+    NimbleServerSimulationSetup setup = {.clientCount = 4,
+                                         .participantsPerClient = 1,
+                                         .stepOctetCount = 8,
+                                         .redundancyCount = 3,
+                                         .tickTimeMs = 16,
+                                         .seed = 0x5eed,
+                                         .impairment = noImpairment,
+                                         .allocator = &imprintSetup->tagAllocator.info,
+                                         .blobAllocator = &imprintSetup->slabAllocator.info,
+                                         .log.config = &g_clog,
+                                         .log.constantPrefix = logPrefix};
+
+    return setup;
+}
 
 UTEST(NimbleSteps, verifyHostMigration)
 {
@@ -71,3 +185,2203 @@ UTEST(NimbleSteps, verifyHostMigration)
         const NimbleServerLocalParty* party = &server.localParties.parties[i];
     }
 }
+
+UTEST(NimbleServer, initInSingleArena)
+{
+    ImprintDefaultSetup imprintSetup;
+
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "server");
+    setup.useSingleArena = true;
+
+    size_t requiredOctetCount = nimbleServerCalculateMemoryRequirement(setup);
+    ASSERT_LT(setup.maxParticipantCount * NBS_WINDOW_SIZE * setup.maxSingleParticipantStepOctetCount,
+              requiredOctetCount);
+
+    int initErr = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, initErr);
+
+    uintptr_t partiesMisalignment = ((uintptr_t) server.localParties.parties) % NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT;
+    uintptr_t arenaMisalignment = ((uintptr_t) server.arenaMemory) % NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT;
+    ASSERT_EQ(0u, partiesMisalignment);
+    ASSERT_EQ(0u, arenaMisalignment);
+
+    const uint8_t* participantsMemory = (const uint8_t*) server.game.participants.participants;
+    uintptr_t participantsMisalignment = ((uintptr_t) participantsMemory) % NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT;
+    uintptr_t partyDiagnosticsMisalignment = ((uintptr_t) server.localParties.diagnostics) %
+                                             NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT;
+    uintptr_t connectionDiagnosticsMisalignment = ((uintptr_t) server.transportConnections[0].diagnostics) %
+                                                  NIMBLE_SERVER_CACHE_LINE_OCTET_COUNT;
+    ASSERT_EQ(0u, participantsMisalignment);
+    ASSERT_EQ(0u, partyDiagnosticsMisalignment);
+    ASSERT_EQ(0u, connectionDiagnosticsMisalignment);
+    ASSERT_TRUE(participantsMemory >= server.arenaMemory);
+    ASSERT_TRUE(participantsMemory < server.arenaMemory + server.arenaOctetCount);
+
+    for (StepId i = 0; i < 8; ++i) {
+        int reInitErr = nimbleServerReInitWithGame(&server, i, 0);
+        ASSERT_EQ(0, reInitErr);
+        ASSERT_TRUE((const uint8_t*) server.game.participants.participants == participantsMemory);
+    }
+}
+
+UTEST(NimbleServer, restartMatchesAtConstantMemory)
+{
+    ImprintDefaultSetup imprintSetup;
+
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    CountingAllocator countingAllocator;
+    countingAllocatorInit(&countingAllocator, &imprintSetup.tagAllocator.info);
+
+    NimbleServer server;
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "server");
+    setup.memory = &countingAllocator.info;
+
+    int initErr = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, initErr);
+
+    size_t allocatedAfterInit = countingAllocator.allocatedOctetCount;
+    size_t allocationCountAfterInit = countingAllocator.allocationCount;
+    const NimbleServerParticipant* participants = server.game.participants.participants;
+
+    NimbleSerializeLocalPartyInfo localPartyInfo[2] = {
+        {.participantCount = 1, .participantIds[0] = 0x02},
+        {.participantCount = 1, .participantIds[0] = 0x05},
+    };
+
+    for (size_t i = 0; i < 10000; ++i) {
+        int reInitErr = nimbleServerReInitWithGame(&server, (StepId) i, (MonotonicTimeMs) i * 16);
+        ASSERT_EQ(0, reInitErr);
+        ASSERT_EQ(setup.maxParticipantCount, nimbleServerCircularBufferCount(&server.game.participants.freeList));
+
+        int migrationErr = nimbleServerHostMigration(&server, localPartyInfo, 2);
+        ASSERT_EQ(0, migrationErr);
+        ASSERT_EQ(2u, server.game.participants.participantCount);
+    }
+
+    ASSERT_EQ(allocatedAfterInit, countingAllocator.allocatedOctetCount);
+    ASSERT_EQ(allocationCountAfterInit, countingAllocator.allocationCount);
+    ASSERT_TRUE(server.game.participants.participants == participants);
+}
+
+UTEST(NimbleServer, participantStepsFromSharedPool)
+{
+    ImprintDefaultSetup imprintSetup;
+
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+
+    const size_t maxSingleParticipantStepOctetCount = 20;
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "server");
+    setup.maxSingleParticipantStepOctetCount = maxSingleParticipantStepOctetCount;
+    setup.participantStepBudgetOctetCount =
+        2 * nimbleServerStepsCalculateMemoryRequirement(maxSingleParticipantStepOctetCount);
+
+    int initErr = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, initErr);
+
+    const NimbleServerStepsPool* pool = &server.game.participants.stepsPool;
+    ASSERT_EQ(2u, pool->capacity);
+    ASSERT_EQ(0u, pool->usedCount);
+
+    NimbleSerializeLocalPartyInfo localPartyInfo[3] = {
+        {.participantCount = 1, .participantIds[0] = 0x03},
+        {.participantCount = 1, .participantIds[0] = 0x07},
+        {.participantCount = 1, .participantIds[0] = 0x0a},
+    };
+
+    int migrationErr = nimbleServerHostMigration(&server, localPartyInfo, 2);
+    ASSERT_EQ(0, migrationErr);
+    ASSERT_EQ(2u, pool->usedCount);
+    ASSERT_TRUE(server.game.participants.participants[0x03].steps != 0);
+    ASSERT_TRUE(server.game.participants.participants[0x07].steps != 0);
+    ASSERT_TRUE(server.game.participants.participants[0x07].steps != server.game.participants.participants[0x03].steps);
+    ASSERT_TRUE(server.game.participants.participants[0x0a].steps == 0);
+
+    int reInitErr = nimbleServerReInitWithGame(&server, 0, 0);
+    ASSERT_EQ(0, reInitErr);
+    ASSERT_EQ(0u, pool->usedCount);
+
+    migrationErr = nimbleServerHostMigration(&server, localPartyInfo, 3);
+    ASSERT_EQ(NimbleServerErrOutOfParticipantMemory, migrationErr);
+    ASSERT_EQ(2u, pool->usedCount);
+}
+
+UTEST(NimbleServer, participantStepBudgetTooSmallForOneParticipant)
+{
+    ImprintDefaultSetup imprintSetup;
+
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServer server;
+
+    const size_t maxSingleParticipantStepOctetCount = 20;
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "server");
+    setup.maxSingleParticipantStepOctetCount = maxSingleParticipantStepOctetCount;
+    setup.participantStepBudgetOctetCount =
+        nimbleServerStepsCalculateMemoryRequirement(maxSingleParticipantStepOctetCount) - 1;
+
+    ASSERT_EQ(0u, nimbleServerStepsPoolCapacityFromBudget(setup.participantStepBudgetOctetCount,
+                                                          maxSingleParticipantStepOctetCount,
+                                                          setup.maxParticipantCount));
+
+    int initErr = nimbleServerInit(&server, setup);
+    ASSERT_EQ(NimbleServerErrOutOfParticipantMemory, initErr);
+}
+
+UTEST(NimbleServer, memoryReportMatchesAllocator)
+{
+    ImprintDefaultSetup imprintSetup;
+
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    CountingAllocator countingAllocator;
+    countingAllocatorInit(&countingAllocator, &imprintSetup.tagAllocator.info);
+
+    NimbleServer server;
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "server");
+    setup.memory = &countingAllocator.info;
+
+    int initErr = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, initErr);
+
+    NimbleServerMemoryReport report;
+    nimbleServerMemoryReport(&server, &report);
+
+    ASSERT_EQ(countingAllocator.allocatedOctetCount, report.reservedOctetCount);
+    ASSERT_EQ(0u, report.entries[NimbleServerMemoryTagParticipantSteps].inUseOctetCount);
+    ASSERT_EQ(0u, report.entries[NimbleServerMemoryTagGameStateCopies].reservedOctetCount);
+    ASSERT_EQ(0u, report.entries[NimbleServerMemoryTagBlobStreams].reservedOctetCount);
+    for (size_t i = 0; i < NimbleServerMemoryTagCount; ++i) {
+        ASSERT_LE(report.entries[i].inUseOctetCount, report.entries[i].reservedOctetCount);
+    }
+
+    size_t participantStepsReserved = report.entries[NimbleServerMemoryTagParticipantSteps].reservedOctetCount;
+    ASSERT_LT(0u, participantStepsReserved);
+
+    NimbleSerializeLocalPartyInfo localPartyInfo[2] = {
+        {.participantCount = 1, .participantIds[0] = 0x02},
+        {.participantCount = 1, .participantIds[0] = 0x05},
+    };
+
+    int migrationErr = nimbleServerHostMigration(&server, localPartyInfo, 2);
+    ASSERT_EQ(0, migrationErr);
+
+    nimbleServerMemoryReport(&server, &report);
+    ASSERT_EQ(countingAllocator.allocatedOctetCount, report.reservedOctetCount);
+    ASSERT_EQ(participantStepsReserved * 2 / setup.maxParticipantCount,
+              report.entries[NimbleServerMemoryTagParticipantSteps].inUseOctetCount);
+
+    const size_t gameStateCopyOctetCount = 100;
+    ImprintAllocatorWithFree* gameStateCopies = nimbleServerMemoryTagsWithFree(&server.memoryTags,
+                                                                               NimbleServerMemoryTagGameStateCopies);
+    void* gameStateCopy = IMPRINT_ALLOC(&gameStateCopies->allocator, gameStateCopyOctetCount, "game state copy");
+    ASSERT_TRUE(gameStateCopy != 0);
+
+    nimbleServerMemoryReport(&server, &report);
+    ASSERT_EQ(gameStateCopyOctetCount, report.entries[NimbleServerMemoryTagGameStateCopies].reservedOctetCount);
+    ASSERT_EQ(gameStateCopyOctetCount, report.entries[NimbleServerMemoryTagGameStateCopies].inUseOctetCount);
+    ASSERT_EQ(countingAllocator.allocatedOctetCount + gameStateCopyOctetCount, report.reservedOctetCount);
+
+    IMPRINT_FREE(gameStateCopies, gameStateCopy);
+
+    nimbleServerMemoryReport(&server, &report);
+    ASSERT_EQ(0u, report.entries[NimbleServerMemoryTagGameStateCopies].reservedOctetCount);
+    ASSERT_EQ(0u, server.memoryTags.counters[NimbleServerMemoryTagGameStateCopies].allocationCount);
+    ASSERT_EQ(countingAllocator.allocatedOctetCount, report.reservedOctetCount);
+}
+
+typedef struct HeadlessSimulation {
+    StepId nextStepId;
+    size_t callCount;
+    size_t stepCount;
+    bool isContiguous;
+} HeadlessSimulation;
+
+static void headlessSimulationSteps(void* _self, const NbsSteps* authoritativeSteps, StepId firstStepId,
+                                    size_t stepCount)
+{
+    HeadlessSimulation* self = (HeadlessSimulation*) _self;
+    if (self->callCount > 0 && firstStepId != self->nextStepId) {
+        self->isContiguous = false;
+    }
+
+    uint8_t step[1024];
+    for (size_t i = 0; i < stepCount; ++i) {
+        int index = nbsStepsGetIndexForStep(authoritativeSteps, (StepId) (firstStepId + i));
+        if (index < 0 || nbsStepsReadAtIndex(authoritativeSteps, index, step, sizeof(step)) <= 0) {
+            self->isContiguous = false;
+        }
+    }
+
+    self->nextStepId = (StepId) (firstStepId + stepCount);
+    self->callCount++;
+    self->stepCount += stepCount;
+}
+
+static void headlessSimulationSerialize(void* _self, NimbleServerSerializedGameState* state)
+{
+    HeadlessSimulation* self = (HeadlessSimulation*) _self;
+    static const uint8_t gameState[] = {0x42};
+    state->gameState = gameState;
+    state->gameStateOctetCount = sizeof(gameState);
+    state->stepId = self->nextStepId;
+    state->hash = 0;
+}
+
+UTEST(NimbleServer, composedStepsAreBatchedForHeadlessSimulation)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    HeadlessSimulation headless = {.nextStepId = 0, .callCount = 0, .stepCount = 0, .isContiguous = true};
+    static NimbleServerCallbackObjectVtbl vtbl = {.authoritativeStateSerializeFn = headlessSimulationSerialize,
+                                                  .authoritativeStepsComposedFn = headlessSimulationSteps};
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "headless");
+    setup.callbackObject.vtbl = &vtbl;
+    setup.callbackObject.self = &headless;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+    ASSERT_TRUE(simulation.server.game.isSimulatedOnServer);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    const size_t tickCount = 300;
+    size_t callCountBefore = headless.callCount;
+    for (size_t i = 0; i < tickCount; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+
+    ASSERT_TRUE(headless.isContiguous);
+    ASSERT_LE(headless.callCount - callCountBefore, tickCount);
+    ASSERT_LT(100u, headless.stepCount);
+    ASSERT_EQ(simulation.server.game.authoritativeSteps.expectedWriteId, headless.nextStepId);
+}
+
+typedef struct ClampingValidator {
+    size_t callCount;
+    size_t stepCount;
+    bool isSortedByParticipant;
+} ClampingValidator;
+
+#define CLAMPING_VALIDATOR_MAX_FIRST_OCTET (0x40)
+
+/// Rejects every eighth step and clamps the first octet of the others
+static void clampingValidatorValidate(void* _self, NimbleServerValidatedStep* steps, size_t stepCount)
+{
+    ClampingValidator* self = (ClampingValidator*) _self;
+
+    for (size_t i = 0; i < stepCount; ++i) {
+        NimbleServerValidatedStep* step = &steps[i];
+        if (i > 0 && step->participantId == steps[i - 1].participantId && step->stepId != steps[i - 1].stepId + 1) {
+            self->isSortedByParticipant = false;
+        }
+        if ((step->stepId % 8) == 0) {
+            step->isRejected = true;
+            continue;
+        }
+        if (step->octets[0] > CLAMPING_VALIDATOR_MAX_FIRST_OCTET) {
+            step->octets[0] = CLAMPING_VALIDATOR_MAX_FIRST_OCTET;
+        }
+    }
+
+    self->callCount++;
+    self->stepCount += stepCount;
+}
+
+UTEST(NimbleServer, predictedStepsAreValidatedInBatches)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    ClampingValidator validator = {.callCount = 0, .stepCount = 0, .isSortedByParticipant = true};
+    static NimbleServerCallbackObjectVtbl vtbl = {.predictedStepsValidateFn = clampingValidatorValidate};
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "validate");
+    setup.clientCount = 2;
+    setup.participantsPerClient = 2;
+    setup.callbackObject.vtbl = &vtbl;
+    setup.callbackObject.self = &validator;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+    for (size_t i = 0; i < 300; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+
+    const NimbleServerStepValidation* validation = &simulation.server.game.stepValidation;
+    ASSERT_TRUE(validator.isSortedByParticipant);
+    ASSERT_LT(100u, validator.callCount);
+    ASSERT_EQ(validator.callCount, validation->stats.batchCount);
+    ASSERT_EQ(validator.stepCount, validation->stats.validatedStepCount);
+    // Redundant steps are not validated again, and both participants of a client are in the same batch
+    ASSERT_LT(validator.callCount, validator.stepCount);
+    ASSERT_LT(0u, validation->stats.rejectedStepCount);
+
+    // Every composed step must have the rewritten payloads: empty for a rejected step, clamped otherwise
+    const NbsSteps* authoritativeSteps = &simulation.server.game.authoritativeSteps;
+    size_t checkedParticipantStepCount = 0;
+    uint8_t step[1024];
+    for (StepId stepId = authoritativeSteps->expectedReadId; stepId != authoritativeSteps->expectedWriteId;
+         ++stepId) {
+        int index = nbsStepsGetIndexForStep(authoritativeSteps, stepId);
+        ASSERT_LE(0, index);
+        int octetCount = nbsStepsReadAtIndex(authoritativeSteps, index, step, sizeof(step));
+        ASSERT_LT(0, octetCount);
+
+        size_t pos = 1;
+        for (size_t i = 0; i < step[0]; ++i) {
+            uint8_t maskAndId = step[pos++];
+            if (maskAndId & 0x80) {
+                // Joined, left and forced steps are not from the validator
+                break;
+            }
+            uint8_t participantOctetCount = step[pos++];
+            if ((stepId % 8) == 0) {
+                ASSERT_EQ(0, participantOctetCount);
+            } else {
+                ASSERT_EQ(8, participantOctetCount);
+                ASSERT_LE(step[pos], CLAMPING_VALIDATOR_MAX_FIRST_OCTET);
+            }
+            pos += participantOctetCount;
+            checkedParticipantStepCount++;
+        }
+    }
+    ASSERT_LT(0u, checkedParticipantStepCount);
+}
+
+/// Writes predicted steps for one participant, where the first octet of each step is the low octet of the StepId
+static size_t writeIngestDatagram(uint8_t* target, size_t maxOctetCount, uint8_t participantId, StepId firstStepId,
+                                  size_t stepCount, uint8_t stepOctetCount)
+{
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, target, maxOctetCount);
+    fldOutStreamWriteUInt32(&outStream, firstStepId);
+    fldOutStreamWriteUInt8(&outStream, 1);
+    fldOutStreamWriteUInt8(&outStream, participantId);
+    fldOutStreamWriteUInt8(&outStream, 0);
+    fldOutStreamWriteUInt8(&outStream, (uint8_t) stepCount);
+    uint8_t payload[32] = {0};
+    for (size_t i = 0; i < stepCount; ++i) {
+        payload[0] = (uint8_t) (firstStepId + i);
+        fldOutStreamWriteUInt8(&outStream, stepOctetCount);
+        fldOutStreamWriteOctets(&outStream, payload, stepOctetCount);
+    }
+
+    return outStream.pos;
+}
+
+UTEST(NimbleServer, redundantPredictedStepsAreSkipped)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "ingest");
+    setup.maxConnectionCount = 1;
+    setup.maxParticipantCount = 1;
+    setup.maxSingleParticipantStepOctetCount = 8;
+    setup.maxParticipantCountForEachConnection = 1;
+
+    static NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleSerializeLocalPartyInfo partyInfo;
+    partyInfo.participantCount = 1;
+    partyInfo.participantIds[0] = 0;
+    err = nimbleServerHostMigration(&server, &partyInfo, 1);
+    ASSERT_EQ(0, err);
+
+    NimbleServerLocalParty* party = &server.localParties.parties[0];
+    NbsSteps* steps = party->participantReferences.participantReferences[0]->steps;
+    nbsStepsReInit(steps, 100);
+
+    uint8_t datagram[256];
+    FldInStream inStream;
+
+    // A sliding window of five steps, with one new step for every datagram
+    for (StepId latestStepId = 100; latestStepId < 120; ++latestStepId) {
+        size_t octetCount = writeIngestDatagram(datagram, sizeof(datagram), 0, latestStepId - 4, 5, 8);
+        fldInStreamInit(&inStream, datagram, octetCount);
+        err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &server.game.stepValidation);
+        ASSERT_EQ(0, err);
+        ASSERT_EQ(octetCount, inStream.pos);
+        ASSERT_EQ(latestStepId + 1, steps->expectedWriteId);
+    }
+    ASSERT_EQ(20u, steps->stepsCount);
+
+    uint8_t step[8];
+    for (StepId stepId = 100; stepId < 120; ++stepId) {
+        int octetCount = nbsStepsReadExactStepId(steps, stepId, step, sizeof(step));
+        ASSERT_EQ(8, octetCount);
+        ASSERT_EQ((uint8_t) stepId, step[0]);
+    }
+
+    // A step longer than the max step octet count is rejected, even if it is redundant
+    size_t octetCount = writeIngestDatagram(datagram, sizeof(datagram), 0, 116, 5, 9);
+    fldInStreamInit(&inStream, datagram, octetCount);
+    err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &server.game.stepValidation);
+    ASSERT_EQ(NimbleServerErrSerialize, err);
+    ASSERT_EQ(120u, steps->expectedWriteId);
+
+    // A truncated step is rejected
+    octetCount = writeIngestDatagram(datagram, sizeof(datagram), 0, 118, 5, 8);
+    fldInStreamInit(&inStream, datagram, octetCount - 4);
+    err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &server.game.stepValidation);
+    ASSERT_EQ(NimbleServerErrSerialize, err);
+}
+
+UTEST(NimbleServer, predictedStepsForParticipantsOutsideThePartyAreRejected)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "ingest");
+    setup.maxConnectionCount = 2;
+    setup.maxParticipantCount = 2;
+    setup.maxSingleParticipantStepOctetCount = 8;
+    setup.maxParticipantCountForEachConnection = 1;
+
+    static NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleSerializeLocalPartyInfo partyInfos[2];
+    for (size_t i = 0; i < 2; ++i) {
+        partyInfos[i].participantCount = 1;
+        partyInfos[i].participantIds[0] = (NimbleSerializeParticipantId) i;
+    }
+    err = nimbleServerHostMigration(&server, partyInfos, 2);
+    ASSERT_EQ(0, err);
+
+    NimbleServerLocalParty* party = &server.localParties.parties[1];
+    NbsSteps* steps = party->participantReferences.participantReferences[0]->steps;
+    ASSERT_EQ(1, party->participantReferences.participantReferences[0]->id);
+    nbsStepsReInit(steps, 100);
+
+    uint8_t datagram[256];
+    FldInStream inStream;
+
+    // The participant ID is not an index into the party, so a party without participant 0 can send steps
+    size_t octetCount = writeIngestDatagram(datagram, sizeof(datagram), 1, 100, 1, 8);
+    fldInStreamInit(&inStream, datagram, octetCount);
+    err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &server.game.stepValidation);
+    ASSERT_EQ(0, err);
+    ASSERT_EQ(101u, steps->expectedWriteId);
+
+    // A participant in another party is rejected
+    octetCount = writeIngestDatagram(datagram, sizeof(datagram), 0, 101, 1, 8);
+    fldInStreamInit(&inStream, datagram, octetCount);
+    err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &server.game.stepValidation);
+    ASSERT_EQ(-2, err);
+
+    // A participant ID out of range for the game is rejected
+    octetCount = writeIngestDatagram(datagram, sizeof(datagram), 200, 101, 1, 8);
+    fldInStreamInit(&inStream, datagram, octetCount);
+    err = nimbleServerLocalPartyDeserializePredictedSteps(party, &inStream, &server.game.stepValidation);
+    ASSERT_EQ(-2, err);
+    ASSERT_EQ(101u, steps->expectedWriteId);
+}
+
+static int forcedStepFromCallback(void* self, uint8_t participantId, StepId stepId, const uint8_t* lastOctets,
+                                  size_t lastOctetCount, size_t forcedCountInRow, uint8_t* target, size_t maxOctetCount)
+{
+    (void) self;
+    (void) lastOctets;
+    (void) lastOctetCount;
+    (void) maxOctetCount;
+
+    target[0] = participantId;
+    target[1] = (uint8_t) stepId;
+    target[2] = (uint8_t) forcedCountInRow;
+
+    return 3;
+}
+
+UTEST(ForcedSteps, policiesCreateStepsFromLastReceivedStep)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "forced";
+
+    const uint8_t received[] = {0x40, 0xc0, 0x03};
+    uint8_t target[8];
+
+    NimbleServerForcedSteps zero;
+    nimbleServerForcedStepsInit(&zero, &imprintSetup.tagAllocator.info, NimbleServerForcedStepPolicyZero, 4, 8, 0, 0,
+                                log);
+    ASSERT_FALSE(nimbleServerForcedStepsIsEnabled(&zero));
+
+    NimbleServerForcedSteps repeat;
+    nimbleServerForcedStepsInit(&repeat, &imprintSetup.tagAllocator.info, NimbleServerForcedStepPolicyRepeatLast, 4,
+                                8, 0, 0, log);
+    ASSERT_EQ(-1, nimbleServerForcedStepsCreate(&repeat, 1, 1, 100, target, sizeof(target)));
+    nimbleServerForcedStepsReceived(&repeat, 1, received, sizeof(received));
+    ASSERT_EQ(3, nimbleServerForcedStepsCreate(&repeat, 1, 1, 101, target, sizeof(target)));
+    ASSERT_EQ(0, memcmp(received, target, sizeof(received)));
+    ASSERT_EQ(1u, repeat.substitutedStepCount);
+
+    NimbleServerForcedSteps decay;
+    nimbleServerForcedStepsInit(&decay, &imprintSetup.tagAllocator.info, NimbleServerForcedStepPolicyDecay, 4, 8, 0,
+                                0, log);
+    nimbleServerForcedStepsReceived(&decay, 2, received, sizeof(received));
+    ASSERT_EQ(3, nimbleServerForcedStepsCreate(&decay, 2, 2, 101, target, sizeof(target)));
+    ASSERT_EQ(0x20, target[0]);
+    ASSERT_EQ(0xe0, target[1]);
+    ASSERT_EQ(0x01, target[2]);
+    ASSERT_EQ(3, nimbleServerForcedStepsCreate(&decay, 2, 2, 102, target, sizeof(target)));
+    ASSERT_EQ(0x10, target[0]);
+    ASSERT_EQ(0xf0, target[1]);
+    ASSERT_EQ(0x00, target[2]);
+
+    nimbleServerForcedStepsReset(&decay, 2);
+    ASSERT_EQ(-1, nimbleServerForcedStepsCreate(&decay, 2, 2, 103, target, sizeof(target)));
+
+    NimbleServerForcedSteps callback;
+    nimbleServerForcedStepsInit(&callback, &imprintSetup.tagAllocator.info, NimbleServerForcedStepPolicyCallback, 4, 8,
+                                forcedStepFromCallback, 0, log);
+    nimbleServerForcedStepsReceived(&callback, 3, received, sizeof(received));
+    nimbleServerForcedStepsCreate(&callback, 3, 7, 200, target, sizeof(target));
+    ASSERT_EQ(3, nimbleServerForcedStepsCreate(&callback, 3, 7, 201, target, sizeof(target)));
+    ASSERT_EQ(7, target[0]);
+    ASSERT_EQ(201, target[1]);
+    ASSERT_EQ(2, target[2]);
+}
+
+/// Runs a simulation with jitter and loss, where the input is held for 16 steps
+static int runJitterSimulation(NimbleServerForcedStepPolicy policy, NimbleServerSimulationStats* stats)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerImpairment impairment = {.latencyMs = 20, .jitterMs = 60, .lossPerMille = 100};
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "jitter");
+    setup.redundancyCount = 1;
+    setup.impairment = impairment;
+    setup.forcedStepPolicy = policy;
+    setup.inputHoldStepCount = 16;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationJoinAll(&simulation, 1000);
+    if (err < 0) {
+        return err;
+    }
+    nimbleServerSimulationResetStats(&simulation);
+
+    for (size_t i = 0; i < 600; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    *stats = simulation.stats;
+
+    return 0;
+}
+
+UTEST(ForcedSteps, repeatingLastInputCausesFewerRollbacks)
+{
+    NimbleServerSimulationStats zeroStats;
+    int err = runJitterSimulation(NimbleServerForcedStepPolicyZero, &zeroStats);
+    ASSERT_EQ(0, err);
+
+    NimbleServerSimulationStats repeatStats;
+    err = runJitterSimulation(NimbleServerForcedStepPolicyRepeatLast, &repeatStats);
+    ASSERT_EQ(0, err);
+
+    // The impairment is the same for both runs, so the same steps are forced. An empty forced step is always a
+    // rollback, a repeated input only when the held input changed
+    ASSERT_LE(repeatStats.rollbackStepCount, zeroStats.rollbackStepCount);
+}
+
+UTEST(StepHistory, keepsConsecutiveStepsAndDiscardsOldest)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 1024 * 1024);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "history";
+
+    NimbleServerStepHistory history;
+    nimbleServerStepHistoryInit(&history, &imprintSetup.tagAllocator.info, 8, 40, log);
+
+    uint8_t step[10];
+    for (StepId stepId = 100; stepId < 110; ++stepId) {
+        tc_memset_octets(step, (uint8_t) stepId, sizeof(step));
+        int err = nimbleServerStepHistoryAdd(&history, stepId, step, 1 + (stepId & 3));
+        ASSERT_EQ(0, err);
+    }
+
+    // Octets for 100-109 are 1,2,3,4,1,2,3,4,1,2. Only the last steps that fit in 40 octets and 8 entries are kept.
+    ASSERT_EQ(8u, history.stepCount);
+    ASSERT_EQ(102u, history.firstStepId);
+    ASSERT_FALSE(nimbleServerStepHistoryHasStep(&history, 101));
+    ASSERT_TRUE(nimbleServerStepHistoryHasStep(&history, 109));
+    ASSERT_FALSE(nimbleServerStepHistoryHasStep(&history, 110));
+    ASSERT_EQ(3u, nimbleServerStepHistoryOctetCountFrom(&history, 108));
+
+    uint8_t target[10];
+    for (StepId stepId = 102; stepId < 110; ++stepId) {
+        int octetCount = nimbleServerStepHistoryRead(&history, stepId, target, sizeof(target));
+        ASSERT_EQ((int) (1 + (stepId & 3)), octetCount);
+        for (int i = 0; i < octetCount; ++i) {
+            ASSERT_EQ((uint8_t) stepId, target[i]);
+        }
+    }
+
+    int err = nimbleServerStepHistoryAdd(&history, 200, step, 4);
+    ASSERT_EQ(0, err);
+    ASSERT_EQ(1u, history.stepCount);
+    ASSERT_EQ(200u, history.firstStepId);
+}
+
+UTEST(StepHistory, discardedAuthoritativeStepsAreKept)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "history");
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleServerGame* game = &simulation.server.game;
+    nimbleServerGameInitHistory(game, &imprintSetup.tagAllocator.info, 1024, 64 * 1024);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+    for (size_t i = 0; i < 600; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+
+    ASSERT_LT(0u, game->history.stepCount);
+    ASSERT_EQ(game->authoritativeSteps.expectedReadId, (StepId) (game->history.firstStepId + game->history.stepCount));
+
+    uint8_t target[1024];
+    StepId oldestStepId = game->history.firstStepId;
+    int octetCount = nimbleServerStepHistoryRead(&game->history, oldestStepId, target, sizeof(target));
+    ASSERT_LT(0, octetCount);
+}
+
+/// Finds an octet sequence in a buffer
+static bool containsOctets(const uint8_t* octets, size_t octetCount, const uint8_t* wanted, size_t wantedOctetCount)
+{
+    for (size_t i = 0; i + wantedOctetCount <= octetCount; ++i) {
+        if (memcmp(octets + i, wanted, wantedOctetCount) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+UTEST(StepHistory, clientBehindTheWindowCatchesUpFromHistory)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "catchUp");
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleServerGame* game = &simulation.server.game;
+    nimbleServerGameInitHistory(game, &imprintSetup.tagAllocator.info, 1024, 64 * 1024);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+    for (size_t i = 0; i < 600; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+
+    // A client that is waiting for a step that is only in the history, not in the authoritative window. A recent
+    // one, so it is still in the history if the request discards more authoritative steps.
+    ASSERT_LT(10u, game->history.stepCount);
+    StepId waitingForStepId = (StepId) (game->authoritativeSteps.expectedReadId - 10);
+    ASSERT_TRUE(nimbleServerStepHistoryHasStep(&game->history, waitingForStepId));
+    ASSERT_TRUE((int32_t) (game->authoritativeSteps.expectedReadId - waitingForStepId) > 0);
+    ASSERT_EQ(0u, game->latestGameStateOctetCount);
+
+    NimbleServerTransportConnection* transportConnection = 0;
+    for (size_t i = 0; i < NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS; ++i) {
+        NimbleServerTransportConnection* candidate = &simulation.server.transportConnections[i];
+        if (candidate->isUsed && candidate->assignedParty != 0) {
+            transportConnection = candidate;
+            break;
+        }
+    }
+    ASSERT_TRUE(transportConnection != 0);
+
+    // A step request without any predicted steps
+    uint8_t request[32];
+    FldOutStream requestStream;
+    fldOutStreamInit(&requestStream, request, sizeof(request));
+    err = nbsPendingStepsSerializeOutHeader(&requestStream, waitingForStepId);
+    ASSERT_EQ(0, err);
+    fldOutStreamWriteUInt32(&requestStream, waitingForStepId);
+    fldOutStreamWriteUInt8(&requestStream, 0);
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, request, requestStream.pos);
+
+    static uint8_t reply[DATAGRAM_TRANSPORT_MAX_SIZE];
+    FldOutStream replyStream;
+    fldOutStreamInit(&replyStream, reply, sizeof(reply));
+
+    err = nimbleServerReqGameStep(game, transportConnection, &simulation.server.authoritativeStepsPerSecondStat,
+                                  &inStream, &replyStream);
+    ASSERT_LT(0, err);
+
+    // The range starts at the step the client is waiting for, and is copied from the history
+    ASSERT_EQ(waitingForStepId, game->catchUpSteps.expectedReadId);
+    ASSERT_LT(0u, game->catchUpSteps.stepsCount);
+
+    uint8_t expected[1024];
+    uint8_t sent[1024];
+    for (size_t i = 0; i < game->catchUpSteps.stepsCount; ++i) {
+        StepId stepId = (StepId) (waitingForStepId + i);
+        if (!nimbleServerStepHistoryHasStep(&game->history, stepId)) {
+            break;
+        }
+        int expectedOctetCount = nimbleServerStepHistoryRead(&game->history, stepId, expected, sizeof(expected));
+        ASSERT_LT(0, expectedOctetCount);
+        int sentOctetCount = nbsStepsReadExactStepId(&game->catchUpSteps, stepId, sent, sizeof(sent));
+        ASSERT_EQ(expectedOctetCount, sentOctetCount);
+        ASSERT_EQ(0, memcmp(expected, sent, (size_t) sentOctetCount));
+    }
+
+    // The first step from the history is in the reply datagram
+    int firstOctetCount = nimbleServerStepHistoryRead(&game->history, waitingForStepId, expected, sizeof(expected));
+    ASSERT_LT(0, firstOctetCount);
+    ASSERT_TRUE(containsOctets(reply, replyStream.pos, expected, (size_t) firstOctetCount));
+}
+
+typedef struct CountingRunOut {
+    size_t singleCount;
+    size_t runCount;
+    size_t lastRunOctetCount;
+    size_t lastRunSegmentOctetCount;
+    uint8_t lastRunFirstOctet;
+} CountingRunOut;
+
+static int countingSingleSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    CountingRunOut* self = (CountingRunOut*) _self;
+    (void) data;
+    (void) octetCount;
+
+    self->singleCount++;
+
+    return 0;
+}
+
+static int countingRunSend(void* _self, const uint8_t* octets, size_t octetCount, size_t segmentOctetCount)
+{
+    CountingRunOut* self = (CountingRunOut*) _self;
+
+    self->runCount++;
+    self->lastRunOctetCount = octetCount;
+    self->lastRunSegmentOctetCount = segmentOctetCount;
+    self->lastRunFirstOctet = octets[0];
+
+    return 0;
+}
+
+static void fillDatagramRun(NimbleServerDatagramRun* run, const size_t* octetCounts, size_t datagramCount)
+{
+    nimbleServerDatagramRunInit(run);
+    for (size_t i = 0; i < datagramCount; ++i) {
+        uint8_t* target = nimbleServerDatagramRunNext(run);
+        memset(target, (int) i, octetCounts[i]);
+        nimbleServerDatagramRunCommit(run, octetCounts[i]);
+    }
+}
+
+UTEST(DatagramRun, equalSizedDatagramsAreSentTogether)
+{
+    static NimbleServerDatagramRun run;
+
+    // Three blob stream chunks, the shorter last chunk of the blob, and a datagram that can not be in the same run
+    const size_t octetCounts[] = {100, 100, 100, 40, 200};
+    const size_t datagramCount = sizeof(octetCounts) / sizeof(octetCounts[0]);
+
+    CountingRunOut counting;
+    memset(&counting, 0, sizeof(counting));
+    DatagramTransportOut transportOut;
+    transportOut.self = &counting;
+    transportOut.send = countingSingleSend;
+    NimbleServerDatagramRunOut runOut;
+    runOut.self = &counting;
+    runOut.sendRun = countingRunSend;
+
+    fillDatagramRun(&run, octetCounts, datagramCount);
+    ASSERT_EQ(0, nimbleServerDatagramRunFlush(&run, &transportOut, &runOut));
+    ASSERT_EQ(1u, counting.runCount);
+    ASSERT_EQ(340u, counting.lastRunOctetCount);
+    ASSERT_EQ(100u, counting.lastRunSegmentOctetCount);
+    ASSERT_EQ(0, counting.lastRunFirstOctet);
+    ASSERT_EQ(1u, counting.singleCount);
+    ASSERT_EQ(0u, run.datagramCount);
+
+    // Without a runOut, every datagram is sent on its own
+    fillDatagramRun(&run, octetCounts, datagramCount);
+    ASSERT_EQ(0, nimbleServerDatagramRunFlush(&run, &transportOut, 0));
+    ASSERT_EQ(1u, counting.runCount);
+    ASSERT_EQ(1u + datagramCount, counting.singleCount);
+
+    for (size_t i = 0; i < NIMBLE_SERVER_DATAGRAM_RUN_MAX_COUNT; ++i) {
+        ASSERT_TRUE(nimbleServerDatagramRunNext(&run) != 0);
+        nimbleServerDatagramRunCommit(&run, 10);
+    }
+    ASSERT_TRUE(nimbleServerDatagramRunNext(&run) == 0);
+}
+
+typedef struct CountingSendTo {
+    size_t datagramCount;
+    int lastConnectionId;
+} CountingSendTo;
+
+static int countingSendTo(void* _self, int connectionId, const uint8_t* data, size_t octetCount)
+{
+    CountingSendTo* self = (CountingSendTo*) _self;
+    (void) data;
+    (void) octetCount;
+
+    self->datagramCount++;
+    self->lastConnectionId = connectionId;
+
+    return 0;
+}
+
+static NimbleServerReorderWindowResult receiveSequenceId(NimbleServerReorderWindow* window, uint16_t sequenceId)
+{
+    uint8_t octets[2];
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, octets, sizeof(octets));
+    fldOutStreamWriteUInt16(&outStream, sequenceId);
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, octets, outStream.pos);
+
+    NimbleServerReorderWindowResult result;
+    nimbleServerReorderWindowReceive(window, &inStream, &result);
+
+    return result;
+}
+
+UTEST(ReorderWindow, lateDatagramsAreAcceptedOnce)
+{
+    NimbleServerReorderWindow window;
+    nimbleServerReorderWindowInit(&window);
+
+    ASSERT_EQ(NimbleServerReorderWindowNewer, receiveSequenceId(&window, 65534));
+    // Wraps around
+    ASSERT_EQ(NimbleServerReorderWindowNewer, receiveSequenceId(&window, 1));
+    ASSERT_EQ(NimbleServerReorderWindowLate, receiveSequenceId(&window, 65535));
+    ASSERT_EQ(NimbleServerReorderWindowDuplicate, receiveSequenceId(&window, 65535));
+    ASSERT_EQ(NimbleServerReorderWindowDuplicate, receiveSequenceId(&window, 1));
+    ASSERT_EQ(NimbleServerReorderWindowLate, receiveSequenceId(&window, 0));
+
+    ASSERT_EQ(NimbleServerReorderWindowNewer, receiveSequenceId(&window, 1 + NIMBLE_SERVER_REORDER_WINDOW_SIZE));
+    ASSERT_EQ(NimbleServerReorderWindowTooOld, receiveSequenceId(&window, 1));
+    ASSERT_EQ(NimbleServerReorderWindowLate, receiveSequenceId(&window, 2));
+
+    ASSERT_EQ(3u, window.lateCount);
+    ASSERT_EQ(2u, window.duplicateCount);
+    ASSERT_EQ(1u, window.tooOldCount);
+}
+
+UTEST(Spectators, pushSharesSerializationBetweenSpectators)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "spectators");
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    const NimbleServerGame* game = &simulation.server.game;
+
+    static NimbleServerSpectators spectators;
+    nimbleServerSpectatorsInit(&spectators, &imprintSetup.tagAllocator.info, 32, 4, setup.log);
+    for (int i = 0; i < 32; ++i) {
+        int spectatorIndex = nimbleServerSpectatorsAdd(&spectators, 100 + i, 0,
+                                                       game->authoritativeSteps.expectedWriteId);
+        ASSERT_EQ(i, spectatorIndex);
+    }
+    ASSERT_EQ(NimbleServerErrSessionFull, nimbleServerSpectatorsAdd(&spectators, 200, 0, 0));
+
+    CountingSendTo counting = {0, -1};
+    DatagramTransportMulti transport = {.self = &counting, .sendTo = countingSendTo, .receiveFrom = 0};
+
+    nimbleServerSimulationTick(&simulation);
+    ASSERT_EQ(0, nimbleServerSpectatorsPush(&spectators, game, &transport));
+
+    for (size_t i = 0; i < spectators.capacity; ++i) {
+        nimbleServerSpectatorsAck(&spectators, &spectators.spectators[i], spectators.spectators[i].waitingForStepId);
+    }
+
+    size_t pushCount = 0;
+    for (size_t tick = 0; tick < 100; ++tick) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+        int sentCount = nimbleServerSpectatorsPush(&spectators, game, &transport);
+        ASSERT_LE(0, sentCount);
+        if (sentCount > 0) {
+            ASSERT_EQ(32, sentCount);
+            pushCount++;
+        }
+    }
+
+    ASSERT_LT(0u, pushCount);
+    ASSERT_EQ(pushCount, spectators.stats.serializeCount);
+    ASSERT_EQ(counting.datagramCount, spectators.stats.pushDatagramCount);
+    ASSERT_EQ(131, counting.lastConnectionId);
+    for (size_t i = 0; i < spectators.capacity; ++i) {
+        ASSERT_EQ(game->authoritativeSteps.expectedWriteId, spectators.spectators[i].pushedUpToStepId);
+    }
+
+    nimbleServerSpectatorsRemove(&spectators, &spectators.spectators[3]);
+    ASSERT_EQ(31u, spectators.count);
+    ASSERT_EQ(3, nimbleServerSpectatorsAdd(&spectators, 300, 0, game->authoritativeSteps.expectedWriteId));
+}
+
+UTEST(Spectators, disconnectedSpectatorFreesItsTransportConnection)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "spectatorDisconnect");
+    setup.maxSpectatorCount = 4;
+
+    static NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, err);
+
+    const uint8_t connectionIndex = 5;
+    NimbleServerTransportConnection* transportConnection = &server.transportConnections[connectionIndex];
+
+    // The same transport connection joins as a spectator and disconnects, more times than there are spectators
+    for (size_t round = 0; round < 2 * setup.maxSpectatorCount; ++round) {
+        err = nimbleServerConnectionConnected(&server, connectionIndex);
+        ASSERT_EQ(0, err);
+
+        int spectatorIndex = nimbleServerSpectatorsAdd(&server.spectators, connectionIndex, transportConnection, 0);
+        ASSERT_LE(0, spectatorIndex);
+        ASSERT_TRUE(transportConnection->spectator != 0);
+        ASSERT_EQ(1u, server.spectators.count);
+
+        err = nimbleServerConnectionDisconnected(&server, connectionIndex);
+        ASSERT_EQ(0, err);
+        ASSERT_EQ(0u, server.spectators.count);
+        ASSERT_TRUE(transportConnection->spectator == 0);
+        ASSERT_FALSE(transportConnection->isUsed);
+    }
+}
+
+UTEST(ImpairedTransport, sameSeedGivesSameDatagrams)
+{
+    ImprintDefaultSetup imprintSetup;
+
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerImpairment impairment = {.latencyMs = 30,
+                                         .jitterMs = 20,
+                                         .lossPerMille = 100,
+                                         .duplicatePerMille = 100,
+                                         .reorderPerMille = 100,
+                                         .reorderExtraDelayMs = 40,
+                                         .bandwidthOctetsPerSecond = 0,
+                                         .maxQueueDelayMs = 0};
+
+    static NimbleServerMemoryTransport memoryTransports[2];
+    static NimbleServerImpairedTransport impairedTransports[2];
+    static uint16_t receivedOrder[2][1024];
+    size_t receivedCount[2] = {0, 0};
+
+    for (size_t run = 0; run < 2; ++run) {
+        nimbleServerMemoryTransportInit(&memoryTransports[run], &imprintSetup.tagAllocator.info, 64);
+        nimbleServerImpairedTransportInit(&impairedTransports[run], memoryTransports[run].multiTransport,
+                                          &imprintSetup.tagAllocator.info, 1024, 0xfeed, impairment);
+
+        DatagramTransportMulti* serverTransport = &impairedTransports[run].multiTransport;
+        MonotonicTimeMs now = 0;
+
+        for (uint16_t i = 0; i < 400; ++i) {
+            uint8_t datagram[2] = {(uint8_t) (i >> 8), (uint8_t) (i & 0xff)};
+            nimbleServerMemoryTransportClientSend(&memoryTransports[run], i % 4, datagram, sizeof(datagram));
+
+            now += 16;
+            nimbleServerImpairedTransportUpdate(&impairedTransports[run], now);
+
+            while (true) {
+                int connectionId;
+                uint8_t received[DATAGRAM_TRANSPORT_MAX_SIZE];
+                ssize_t octetCount = serverTransport->receiveFrom(serverTransport->self, &connectionId, received,
+                                                                  sizeof(received));
+                if (octetCount == 0) {
+                    break;
+                }
+                ASSERT_EQ(2, octetCount);
+                ASSERT_LT(receivedCount[run], 1024u);
+                receivedOrder[run][receivedCount[run]++] = (uint16_t) ((received[0] << 8) | received[1]);
+            }
+        }
+    }
+
+    ASSERT_EQ(receivedCount[0], receivedCount[1]);
+    for (size_t i = 0; i < receivedCount[0]; ++i) {
+        ASSERT_EQ(receivedOrder[0][i], receivedOrder[1][i]);
+    }
+
+    const NimbleServerImpairedTransportStats* stats = &impairedTransports[0].toServer.stats;
+    ASSERT_EQ(400u, stats->sentCount);
+    ASSERT_LT(0u, stats->lostCount);
+    ASSERT_LT(0u, stats->duplicatedCount);
+    ASSERT_LT(0u, stats->reorderedCount);
+    ASSERT_LE(stats->deliveredCount, stats->sentCount - stats->lostCount + stats->duplicatedCount);
+}
+
+static int soakRun(NimbleServerSimulation* simulation, NimbleServerImpairment impairment, size_t tickCount)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "soak");
+    setup.clientCount = 8;
+    setup.impairment = impairment;
+
+    int err = nimbleServerSimulationInit(simulation, setup);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationJoinAll(simulation, 500);
+    if (err < 0) {
+        return err;
+    }
+
+    nimbleServerSimulationResetStats(simulation);
+
+    for (size_t i = 0; i < tickCount; ++i) {
+        err = nimbleServerSimulationTick(simulation);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+UTEST(Soak, cleanNetwork)
+{
+    static NimbleServerSimulation simulation;
+    NimbleServerImpairment noImpairment = {0};
+
+    int err = soakRun(&simulation, noImpairment, 2000);
+    ASSERT_EQ(0, err);
+
+    const NimbleServerSimulationStats* stats = &simulation.stats;
+    ASSERT_EQ(8u, stats->joinedClientCount);
+    ASSERT_LE(stats->joinTimeMaxMs, 100u);
+
+    ASSERT_GE(stats->authoritativeStepCount, 1900u);
+    uint64_t forcedPerMille = stats->forcedStepCount * 1000u / (stats->forcedStepCount + stats->providedStepCount);
+    ASSERT_LE(forcedPerMille, 10u);
+
+    ASSERT_LT(0u, stats->stepLatencySampleCount);
+    uint64_t averageLatencyMs = stats->stepLatencyTotalMs / stats->stepLatencySampleCount;
+    ASSERT_LE(averageLatencyMs, 128u);
+}
+
+UTEST(Soak, lossyNetwork)
+{
+    static NimbleServerSimulation simulation;
+    NimbleServerImpairment impairment = {.latencyMs = 40,
+                                         .jitterMs = 20,
+                                         .lossPerMille = 50,
+                                         .duplicatePerMille = 20,
+                                         .reorderPerMille = 20,
+                                         .reorderExtraDelayMs = 30,
+                                         .bandwidthOctetsPerSecond = 64 * 1024,
+                                         .maxQueueDelayMs = 200};
+
+    int err = soakRun(&simulation, impairment, 3000);
+    ASSERT_EQ(0, err);
+
+    const NimbleServerSimulationStats* stats = &simulation.stats;
+    ASSERT_EQ(8u, stats->joinedClientCount);
+    ASSERT_LE(stats->joinTimeMaxMs, 2000u);
+
+    ASSERT_GE(stats->authoritativeStepCount, 2700u);
+    uint64_t forcedPerMille = stats->forcedStepCount * 1000u / (stats->forcedStepCount + stats->providedStepCount);
+    ASSERT_LE(forcedPerMille, 100u);
+
+    ASSERT_LT(0u, stats->stepLatencySampleCount);
+    uint64_t averageLatencyMs = stats->stepLatencyTotalMs / stats->stepLatencySampleCount;
+    ASSERT_LE(averageLatencyMs, 300u);
+}
+
+typedef struct RecordingBuffer {
+    uint8_t* octets;
+    size_t capacity;
+    size_t octetCount;
+} RecordingBuffer;
+
+static int recordingBufferWrite(void* _self, const uint8_t* octets, size_t octetCount)
+{
+    RecordingBuffer* self = (RecordingBuffer*) _self;
+    if (self->octetCount + octetCount > self->capacity) {
+        return -1;
+    }
+
+    tc_memcpy_octets(self->octets + self->octetCount, octets, octetCount);
+    self->octetCount += octetCount;
+
+    return 0;
+}
+
+UTEST(Replay, recordedSessionGivesSameOutput)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerImpairment impairment = {.latencyMs = 20, .jitterMs = 10, .lossPerMille = 20, .duplicatePerMille = 20};
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "record");
+    setup.participantsPerClient = 2;
+    setup.impairment = impairment;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    static uint8_t recordingOctets[4 * 1024 * 1024];
+    RecordingBuffer recording = {.octets = recordingOctets, .capacity = sizeof(recordingOctets), .octetCount = 0};
+    NimbleServerRecorder recorder;
+    err = nimbleServerRecorderInit(&recorder, &simulation.server, recordingBufferWrite, &recording);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+    for (size_t i = 0; i < 500; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+    ASSERT_EQ(0, recorder.writeError);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "replay";
+
+    static NimbleServerReplayer replayer;
+    err = nimbleServerReplayerInit(&replayer, recording.octets, recording.octetCount, &imprintSetup.tagAllocator.info,
+                                   &imprintSetup.slabAllocator.info, log);
+    ASSERT_EQ(0, err);
+
+    ASSERT_EQ(simulation.server.game.isSimulatedOnServer, replayer.server.game.isSimulatedOnServer);
+
+    err = nimbleServerReplayerRun(&replayer);
+    ASSERT_EQ(0, err);
+
+    ASSERT_EQ(recorder.recordCount, replayer.stats.recordCount);
+    ASSERT_LT(0u, replayer.stats.outputCount);
+    ASSERT_EQ(0u, replayer.stats.mismatchCount);
+    ASSERT_EQ(simulation.server.game.authoritativeSteps.expectedWriteId,
+              replayer.server.game.authoritativeSteps.expectedWriteId);
+}
+
+typedef struct DirectFeedResponse {
+    DatagramTransportMulti multiTransport;
+    int connectionId;
+} DirectFeedResponse;
+
+static int directFeedResponseSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    DirectFeedResponse* self = (DirectFeedResponse*) _self;
+    return self->multiTransport.sendTo(self->multiTransport.self, self->connectionId, data, octetCount);
+}
+
+typedef struct HeldDatagram {
+    uint8_t octets[DATAGRAM_TRANSPORT_MAX_SIZE];
+    ssize_t octetCount;
+    int connectionId;
+} HeldDatagram;
+
+/// Reads one datagram from the server transport without feeding it
+static void holdDatagram(NimbleServer* server, HeldDatagram* held)
+{
+    held->octetCount = server->multiTransport.receiveFrom(server->multiTransport.self, &held->connectionId,
+                                                          held->octets, sizeof(held->octets));
+}
+
+/// Feeds a held datagram with nimbleServerFeed(), the replies are sent on the server transport
+/// @return true if there was a datagram to feed
+static bool feedHeldDatagram(NimbleServer* server, const HeldDatagram* held)
+{
+    if (held->octetCount <= 0) {
+        return false;
+    }
+
+    DirectFeedResponse directResponse = {.multiTransport = server->multiTransport, .connectionId = held->connectionId};
+    DatagramTransportOut transportOut = {.self = &directResponse, .send = directFeedResponseSend};
+    NimbleServerResponse response = {.transportOut = &transportOut, .runOut = 0};
+    nimbleServerFeed(server, (uint8_t) held->connectionId, held->octets, (size_t) held->octetCount, &response);
+
+    return true;
+}
+
+static uint64_t hashAuthoritativeStep(const NbsSteps* steps, StepId stepId)
+{
+    uint8_t step[1024];
+    int index = nbsStepsGetIndexForStep(steps, stepId);
+    if (index < 0) {
+        return 0;
+    }
+    int octetCount = nbsStepsReadAtIndex(steps, index, step, sizeof(step));
+    if (octetCount < 0) {
+        return 0;
+    }
+
+    return nimbleServerRecordingHash(step, (size_t) octetCount);
+}
+
+UTEST(Replay, validatedSessionGivesSameSteps)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    ClampingValidator validator = {.callCount = 0, .stepCount = 0, .isSortedByParticipant = true};
+    static NimbleServerCallbackObjectVtbl vtbl = {.predictedStepsValidateFn = clampingValidatorValidate};
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "recordValidated");
+    setup.participantsPerClient = 2;
+    setup.callbackObject.vtbl = &vtbl;
+    setup.callbackObject.self = &validator;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    static uint8_t recordingOctets[4 * 1024 * 1024];
+    RecordingBuffer recording = {.octets = recordingOctets, .capacity = sizeof(recordingOctets), .octetCount = 0};
+    NimbleServerRecorder recorder;
+    err = nimbleServerRecorderInit(&recorder, &simulation.server, recordingBufferWrite, &recording);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+    for (size_t i = 0; i < 300; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+    ASSERT_EQ(0, recorder.writeError);
+    ASSERT_LT(0u, simulation.server.game.stepValidation.stats.rejectedStepCount);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "replayValidated";
+
+    static NimbleServerReplayer replayer;
+    err = nimbleServerReplayerInit(&replayer, recording.octets, recording.octetCount, &imprintSetup.tagAllocator.info,
+                                   &imprintSetup.slabAllocator.info, log);
+    ASSERT_EQ(0, err);
+    ASSERT_TRUE(nimbleServerStepValidationIsEnabled(&replayer.server.game.stepValidation));
+
+    size_t validatorCallCount = validator.callCount;
+    err = nimbleServerReplayerRun(&replayer);
+    ASSERT_EQ(0, err);
+
+    // The replay uses the recorded validation results, the validator of the application is not called
+    ASSERT_EQ(validatorCallCount, validator.callCount);
+    ASSERT_EQ(recorder.recordCount, replayer.stats.recordCount);
+    ASSERT_EQ(0u, replayer.stats.mismatchCount);
+    ASSERT_EQ(simulation.server.game.stepValidation.stats.batchCount,
+              replayer.server.game.stepValidation.stats.batchCount);
+    ASSERT_EQ(simulation.server.game.stepValidation.stats.rejectedStepCount,
+              replayer.server.game.stepValidation.stats.rejectedStepCount);
+
+    const NbsSteps* recordedSteps = &simulation.server.game.authoritativeSteps;
+    const NbsSteps* replayedSteps = &replayer.server.game.authoritativeSteps;
+    ASSERT_EQ(recordedSteps->expectedWriteId, replayedSteps->expectedWriteId);
+    for (StepId stepId = recordedSteps->expectedReadId; stepId != recordedSteps->expectedWriteId; ++stepId) {
+        ASSERT_EQ(hashAuthoritativeStep(recordedSteps, stepId), hashAuthoritativeStep(replayedSteps, stepId));
+    }
+}
+
+UTEST(Replay, directFeedsBetweenUpdatesGiveSameSteps)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "record");
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    static uint8_t recordingOctets[4 * 1024 * 1024];
+    RecordingBuffer recording = {.octets = recordingOctets, .capacity = sizeof(recordingOctets), .octetCount = 0};
+    NimbleServerRecorder recorder;
+    err = nimbleServerRecorderInit(&recorder, &simulation.server, recordingBufferWrite, &recording);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    // Every other tick, one datagram is fed directly before the update and one after it, the update reads the rest
+    // from the transport. The other ticks read everything from the transport before the update.
+    size_t directFeedCount = 0;
+    for (size_t i = 0; i < 300; ++i) {
+        err = nimbleServerSimulationTickClients(&simulation);
+        ASSERT_EQ(0, err);
+
+        if ((i % 2) == 0) {
+            err = nimbleServerSimulationTickServer(&simulation);
+            ASSERT_EQ(0, err);
+        } else {
+            simulation.nowMs += (MonotonicTimeMs) simulation.tickTimeMs;
+            err = nimbleServerImpairedTransportUpdate(&simulation.impairedTransport, simulation.nowMs);
+            ASSERT_EQ(0, err);
+
+            static HeldDatagram beforeUpdate;
+            holdDatagram(&simulation.server, &beforeUpdate);
+            directFeedCount += feedHeldDatagram(&simulation.server, &beforeUpdate) ? 1 : 0;
+
+            static HeldDatagram afterUpdate;
+            holdDatagram(&simulation.server, &afterUpdate);
+
+            err = nimbleServerUpdate(&simulation.server, simulation.nowMs);
+            ASSERT_EQ(0, err);
+
+            directFeedCount += feedHeldDatagram(&simulation.server, &afterUpdate) ? 1 : 0;
+        }
+
+        nimbleServerSimulationDeliverToClients(&simulation);
+    }
+    ASSERT_EQ(0, recorder.writeError);
+    ASSERT_LT(200u, directFeedCount);
+
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "replay";
+
+    static NimbleServerReplayer replayer;
+    err = nimbleServerReplayerInit(&replayer, recording.octets, recording.octetCount, &imprintSetup.tagAllocator.info,
+                                   &imprintSetup.slabAllocator.info, log);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerReplayerRun(&replayer);
+    ASSERT_EQ(0, err);
+
+    ASSERT_EQ(recorder.recordCount, replayer.stats.recordCount);
+    ASSERT_EQ(0u, replayer.stats.mismatchCount);
+
+    const NbsSteps* recordedSteps = &simulation.server.game.authoritativeSteps;
+    const NbsSteps* replayedSteps = &replayer.server.game.authoritativeSteps;
+    ASSERT_EQ(recordedSteps->expectedWriteId, replayedSteps->expectedWriteId);
+
+    StepId firstStepId = recordedSteps->expectedReadId;
+    if ((int32_t) (replayedSteps->expectedReadId - firstStepId) > 0) {
+        firstStepId = replayedSteps->expectedReadId;
+    }
+    ASSERT_LT(100, (int32_t) (recordedSteps->expectedWriteId - firstStepId));
+
+    for (StepId stepId = firstStepId; stepId != recordedSteps->expectedWriteId; ++stepId) {
+        ASSERT_EQ(hashAuthoritativeStep(recordedSteps, stepId), hashAuthoritativeStep(replayedSteps, stepId));
+    }
+}
+
+UTEST(Relay, edgeReceivesTheUpstreamSteps)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "relay");
+    setup.participantsPerClient = 2;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    static NimbleServerMemoryTransport link;
+    nimbleServerMemoryTransportInit(&link, &imprintSetup.tagAllocator.info, 256);
+    static NimbleServerMemoryTransport local;
+    nimbleServerMemoryTransportInit(&local, &imprintSetup.tagAllocator.info, 64);
+
+    static NimbleServerRelayUpstream upstream;
+    NimbleServerRelayUpstreamSetup upstreamSetup = {.server = &simulation.server,
+                                                    .linkTransport = link.multiTransport,
+                                                    .allocator = &imprintSetup.tagAllocator.info,
+                                                    .firstTunnelTransportIndex = 32,
+                                                    .tunnelCount = 4,
+                                                    .log = setup.log};
+    err = nimbleServerRelayUpstreamInit(&upstream, upstreamSetup);
+    ASSERT_EQ(0, err);
+
+    NimbleServerSetup edgeSetup = simulation.server.setup;
+    edgeSetup.multiTransport = local.multiTransport;
+    NimbleServerRelaySetup relaySetup = {.upstreamTransport = link.clientMultiTransport,
+                                         .upstreamConnectionId = 7,
+                                         .useSnapshots = false,
+                                         .allocator = &imprintSetup.tagAllocator.info,
+                                         .log = setup.log};
+    static NimbleServerRelay relay;
+    err = nimbleServerRelayInit(&relay, edgeSetup, relaySetup);
+    ASSERT_EQ(0, err);
+
+    // A client of the edge that joins with participants is tunneled to the upstream server
+    NimbleServerSyntheticClient client;
+    nimbleServerSyntheticClientInit(&client, 3, 1, 8, 3, setup.log);
+
+    for (size_t i = 0; i < 200; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+        err = nimbleServerRelayUpstreamUpdate(&upstream);
+        ASSERT_EQ(0, err);
+
+        err = nimbleServerSyntheticClientTick(&client, simulation.applicationVersion, 0, &local);
+        ASSERT_EQ(0, err);
+        err = nimbleServerRelayUpdate(&relay, simulation.nowMs);
+        ASSERT_EQ(0, err);
+
+        int connectionId;
+        uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+        ssize_t octetCount;
+        while ((octetCount = nimbleServerMemoryTransportClientReceive(&local, &connectionId, datagram,
+                                                                      sizeof(datagram))) > 0) {
+            nimbleServerSyntheticClientReceive(&client, datagram, (size_t) octetCount);
+        }
+    }
+
+    const NbsSteps* upstreamSteps = &simulation.server.game.authoritativeSteps;
+    const NbsSteps* edgeSteps = &relay.edge.game.authoritativeSteps;
+    ASSERT_TRUE(relay.hasStarted);
+    ASSERT_EQ(upstreamSteps->expectedWriteId, edgeSteps->expectedWriteId);
+    ASSERT_LT(0u, edgeSteps->stepsCount);
+    ASSERT_EQ(0u, relay.stats.restartCount);
+    ASSERT_LT(0u, relay.stats.hopLatencySampleCount);
+
+    uint8_t expected[1024];
+    uint8_t received[1024];
+    for (StepId stepId = edgeSteps->expectedReadId; stepId != edgeSteps->expectedWriteId; ++stepId) {
+        int expectedOctetCount = nbsStepsReadAtIndex(upstreamSteps, nbsStepsGetIndexForStep(upstreamSteps, stepId),
+                                                     expected, sizeof(expected));
+        int receivedOctetCount = nbsStepsReadAtIndex(edgeSteps, nbsStepsGetIndexForStep(edgeSteps, stepId), received,
+                                                     sizeof(received));
+        ASSERT_LT(0, receivedOctetCount);
+        ASSERT_EQ(expectedOctetCount, receivedOctetCount);
+        ASSERT_EQ(0, memcmp(expected, received, (size_t) receivedOctetCount));
+    }
+
+    // The connect is handled by the edge, the join request is answered by the upstream server
+    ASSERT_TRUE(relay.tunnels[3].isTunneled);
+    ASSERT_TRUE(simulation.server.transportConnections[32].isUsed);
+    ASSERT_LE(2u, upstream.stats.tunnelDatagramCount);
+    ASSERT_LE(2u, client.replyDatagramCount);
+}
+
+/// Adds a predicted step for the host party, so the upstream server keeps composing, and updates the upstream server,
+/// the upstream relay and the edge relay
+static int tickRelayWithHostParty(NimbleServerSimulation* simulation, NimbleServerRelayUpstream* upstream,
+                                  NimbleServerRelay* relay, NimbleServerLocalChannel* channel,
+                                  StepId* nextPredictedStepId)
+{
+    uint8_t predicted[8] = {0};
+    uint8_t participantId = channel->party->participantReferences.participantReferences[0]->id;
+    int err = nimbleServerLocalChannelAddPredictedStep(channel, participantId, (*nextPredictedStepId)++, predicted,
+                                                       sizeof(predicted));
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerSimulationTickServer(simulation);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerLocalChannelCompose(channel);
+    if (err < 0) {
+        return err;
+    }
+
+    err = nimbleServerRelayUpstreamUpdate(upstream);
+    if (err < 0) {
+        return err;
+    }
+
+    return nimbleServerRelayUpdate(relay, simulation->nowMs);
+}
+
+static void deliverToSyntheticClient(NimbleServerMemoryTransport* local, NimbleServerSyntheticClient* client)
+{
+    int connectionId;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    ssize_t octetCount;
+    while ((octetCount = nimbleServerMemoryTransportClientReceive(local, &connectionId, datagram, sizeof(datagram))) >
+           0) {
+        if (client != 0 && connectionId == client->connectionId) {
+            nimbleServerSyntheticClientReceive(client, datagram, (size_t) octetCount);
+        }
+    }
+}
+
+UTEST(Relay, tunnelsAreFreedWhenClientsDisconnect)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    // The simulated clients never connect. The upstream server has room for the host party and one tunneled client.
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "relayReconnect");
+    setup.clientCount = 2;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleSerializeJoinGameRequestPlayer players[1];
+    players[0].localIndex = 0;
+    NimbleServerLocalChannel channel;
+    err = nimbleServerLocalChannelJoin(&channel, &simulation.server, 60, players, 1);
+    ASSERT_EQ(0, err);
+    StepId nextPredictedStepId = channel.party->participantReferences.participantReferences[0]->steps->expectedWriteId;
+
+    static NimbleServerMemoryTransport link;
+    nimbleServerMemoryTransportInit(&link, &imprintSetup.tagAllocator.info, 256);
+    static NimbleServerMemoryTransport local;
+    nimbleServerMemoryTransportInit(&local, &imprintSetup.tagAllocator.info, 64);
+
+    const uint8_t tunnelTransportIndex = 32;
+    static NimbleServerRelayUpstream upstream;
+    NimbleServerRelayUpstreamSetup upstreamSetup = {.server = &simulation.server,
+                                                    .linkTransport = link.multiTransport,
+                                                    .allocator = &imprintSetup.tagAllocator.info,
+                                                    .firstTunnelTransportIndex = tunnelTransportIndex,
+                                                    .tunnelCount = 1,
+                                                    .log = setup.log};
+    err = nimbleServerRelayUpstreamInit(&upstream, upstreamSetup);
+    ASSERT_EQ(0, err);
+
+    NimbleServerSetup edgeSetup = simulation.server.setup;
+    edgeSetup.multiTransport = local.multiTransport;
+    NimbleServerRelaySetup relaySetup = {.upstreamTransport = link.clientMultiTransport,
+                                         .upstreamConnectionId = 7,
+                                         .useSnapshots = false,
+                                         .allocator = &imprintSetup.tagAllocator.info,
+                                         .log = setup.log};
+    static NimbleServerRelay relay;
+    err = nimbleServerRelayInit(&relay, edgeSetup, relaySetup);
+    ASSERT_EQ(0, err);
+
+    // More clients than there are tunnels and free participants, one after the other. A join can only succeed if
+    // the previous client released its tunnel and its participant.
+    const size_t reconnectCount = 4;
+    for (size_t round = 0; round < reconnectCount; ++round) {
+        int localConnectionId = 3 + (int) round;
+        NimbleServerSyntheticClient client;
+        nimbleServerSyntheticClientInit(&client, localConnectionId, 1, 8, 3, setup.log);
+
+        for (size_t i = 0; i < 200 && client.phase != NimbleServerSyntheticClientPhasePlaying; ++i) {
+            err = nimbleServerSyntheticClientTick(&client, simulation.applicationVersion,
+                                                  simulation.server.game.authoritativeSteps.expectedWriteId, &local);
+            ASSERT_EQ(0, err);
+            err = tickRelayWithHostParty(&simulation, &upstream, &relay, &channel, &nextPredictedStepId);
+            ASSERT_EQ(0, err);
+            deliverToSyntheticClient(&local, &client);
+
+            const NimbleServerTransportConnection* tunnelConnection =
+                &simulation.server.transportConnections[tunnelTransportIndex];
+            const NimbleServerLocalParty* party = tunnelConnection->assignedParty;
+            if (client.phase == NimbleServerSyntheticClientPhaseJoining && client.hasReceivedReply && party != 0) {
+                const NimbleServerParticipant* participant = party->participantReferences.participantReferences[0];
+                NimbleSerializeParticipantId participantIds[1];
+                participantIds[0] = participant->id;
+                nimbleServerSyntheticClientStartPlaying(&client, participant->steps->expectedWriteId, participantIds);
+            }
+        }
+
+        ASSERT_EQ(NimbleServerSyntheticClientPhasePlaying, client.phase);
+        ASSERT_TRUE(relay.tunnels[localConnectionId].isTunneled);
+        ASSERT_TRUE(upstream.tunnels[0].isUsed);
+        ASSERT_EQ(2u, simulation.server.game.participants.participantCount);
+
+        for (size_t i = 0; i < 10; ++i) {
+            err = nimbleServerSyntheticClientTick(&client, simulation.applicationVersion,
+                                                  simulation.server.game.authoritativeSteps.expectedWriteId, &local);
+            ASSERT_EQ(0, err);
+            err = tickRelayWithHostParty(&simulation, &upstream, &relay, &channel, &nextPredictedStepId);
+            ASSERT_EQ(0, err);
+            deliverToSyntheticClient(&local, &client);
+        }
+
+        err = nimbleServerRelayConnectionDisconnected(&relay, (uint8_t) localConnectionId);
+        ASSERT_EQ(0, err);
+        ASSERT_FALSE(relay.tunnels[localConnectionId].isTunneled);
+
+        // The tunnel closed frame reaches the upstream, and the leaving participant is removed when a step is composed
+        for (size_t i = 0; i < 20; ++i) {
+            err = tickRelayWithHostParty(&simulation, &upstream, &relay, &channel, &nextPredictedStepId);
+            ASSERT_EQ(0, err);
+            deliverToSyntheticClient(&local, 0);
+        }
+
+        ASSERT_FALSE(upstream.tunnels[0].isUsed);
+        ASSERT_TRUE(simulation.server.transportConnections[tunnelTransportIndex].assignedParty == 0);
+        ASSERT_EQ(1u, simulation.server.localParties.partiesCount);
+        ASSERT_EQ(1u, simulation.server.game.participants.participantCount);
+    }
+
+    ASSERT_EQ(reconnectCount, upstream.stats.closedTunnelCount);
+    ASSERT_EQ(reconnectCount, relay.stats.closedTunnelCount);
+    ASSERT_EQ(0u, upstream.stats.expiredLinkCount);
+
+    err = nimbleServerLocalChannelLeave(&channel);
+    ASSERT_EQ(0, err);
+}
+
+UTEST(LocalChannel, hostPartyStepsAreComposedWithoutTransport)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "localChannel");
+    setup.clientCount = 2;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    NimbleSerializeJoinGameRequestPlayer players[1];
+    players[0].localIndex = 0;
+    NimbleServerLocalChannel channel;
+    err = nimbleServerLocalChannelJoin(&channel, &simulation.server, 60, players, 1);
+    ASSERT_EQ(0, err);
+    ASSERT_EQ(1u, channel.party->participantReferences.participantReferenceCount);
+
+    const NimbleServerParticipant* participant = channel.party->participantReferences.participantReferences[0];
+    StepId nextPredictedStepId = participant->steps->expectedWriteId;
+    StepId expectedReadStepId = channel.nextReadStepId;
+    size_t readCount = 0;
+
+    for (size_t i = 0; i < 200; ++i) {
+        uint8_t predicted[8] = {0};
+        predicted[0] = (uint8_t) i;
+        int addedCount = nimbleServerLocalChannelAddPredictedStep(&channel, participant->id, nextPredictedStepId++,
+                                                                  predicted, sizeof(predicted));
+        ASSERT_EQ(1, addedCount);
+
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+
+        err = nimbleServerLocalChannelCompose(&channel);
+        ASSERT_LE(0, err);
+
+        StepId stepId;
+        uint8_t authoritative[1024];
+        int octetCount;
+        while ((octetCount = nimbleServerLocalChannelReadAuthoritativeStep(&channel, &stepId, authoritative,
+                                                                           sizeof(authoritative))) > 0) {
+            ASSERT_EQ(expectedReadStepId, stepId);
+            expectedReadStepId++;
+            readCount++;
+        }
+        ASSERT_EQ(0, octetCount);
+    }
+
+    // An old step is ignored, and a gap is reported
+    uint8_t predicted[8] = {0};
+    ASSERT_EQ(0, nimbleServerLocalChannelAddPredictedStep(&channel, participant->id, nextPredictedStepId - 1, predicted,
+                                                          sizeof(predicted)));
+    ASSERT_GT(0, nimbleServerLocalChannelAddPredictedStep(&channel, participant->id, nextPredictedStepId + 1, predicted,
+                                                          sizeof(predicted)));
+
+    ASSERT_EQ(200u, channel.stats.insertedStepCount);
+    ASSERT_LT(100u, readCount);
+    ASSERT_EQ(simulation.server.game.authoritativeSteps.expectedWriteId, expectedReadStepId);
+
+    err = nimbleServerLocalChannelLeave(&channel);
+    ASSERT_EQ(0, err);
+}
+
+/// Writes a ping request datagram, in the same way as a client
+/// @return octet count of the datagram
+static size_t writePingDatagram(OrderedDatagramOutLogic* outLogic, uint8_t* datagram, size_t maxOctetCount,
+                                uint64_t clientTime, Clog* log)
+{
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram, maxOctetCount);
+
+    orderedDatagramOutLogicPrepare(outLogic, &outStream);
+    nimbleSerializeWriteCommand(&outStream, NimbleSerializeCmdPingRequest, log);
+    fldOutStreamWriteUInt64(&outStream, clientTime);
+    orderedDatagramOutLogicCommit(outLogic);
+
+    return outStream.pos;
+}
+
+UTEST(NimbleServer, connectedTransportConnectionsReplyToDatagrams)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "connected");
+
+    static NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, err);
+
+    CountingRunOut counting = {0};
+    DatagramTransportOut transportOut = {.self = &counting, .send = countingSingleSend};
+    NimbleServerResponse response = {.transportOut = &transportOut, .runOut = 0};
+
+    // The daemon connects a transport connection for each new client address, starting with zero, and then feeds the
+    // datagrams from the address
+    for (uint8_t connectionIndex = 0; connectionIndex < 4; ++connectionIndex) {
+        err = nimbleServerConnectionConnected(&server, connectionIndex);
+        ASSERT_EQ(0, err);
+        ASSERT_EQ(connectionIndex, server.transportConnections[connectionIndex].transportIndex);
+
+        OrderedDatagramOutLogic outLogic;
+        orderedDatagramOutLogicInit(&outLogic);
+
+        for (uint64_t clientTime = 0; clientTime < 3; ++clientTime) {
+            uint8_t datagram[32];
+            size_t octetCount = writePingDatagram(&outLogic, datagram, sizeof(datagram), clientTime, &setup.log);
+            err = nimbleServerFeed(&server, connectionIndex, datagram, octetCount, &response);
+            ASSERT_EQ(0, err);
+        }
+    }
+
+    ASSERT_EQ(4u * 3u, counting.singleCount);
+    ASSERT_EQ(-44, nimbleServerConnectionConnected(&server, 0));
+
+    // The daemon disconnects idle addresses, also if the client never joined, and can reuse the transport connection
+    ASSERT_EQ(0, nimbleServerConnectionDisconnected(&server, 0));
+    ASSERT_FALSE(server.transportConnections[0].isUsed);
+    ASSERT_EQ(-2, nimbleServerConnectionDisconnected(&server, 0));
+    ASSERT_EQ(0, nimbleServerConnectionConnected(&server, 0));
+}
+
+/// Writes a connect request datagram, in the same way as a client
+/// @return octet count of the datagram
+static size_t writeConnectDatagram(OrderedDatagramOutLogic* outLogic, uint8_t* datagram, size_t maxOctetCount,
+                                   NimbleSerializeVersion applicationVersion, NimbleSerializeClientRequestId requestId,
+                                   Clog* log)
+{
+    FldOutStream outStream;
+    fldOutStreamInit(&outStream, datagram, maxOctetCount);
+
+    NimbleSerializeConnectRequest request;
+    request.applicationVersion = applicationVersion;
+    request.useDebugStreams = false;
+    request.clientRequestId = requestId;
+
+    orderedDatagramOutLogicPrepare(outLogic, &outStream);
+    nimbleSerializeClientOutConnect(&outStream, &request, log);
+    orderedDatagramOutLogicCommit(outLogic);
+
+    return outStream.pos;
+}
+
+UTEST(NimbleServer, connectionIdsAreReusedAfterDisconnect)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 32 * 1024 * 1024);
+
+    NimbleServerSetup setup = testServerSetup(&imprintSetup, "reconnect");
+
+    static NimbleServer server;
+    int err = nimbleServerInit(&server, setup);
+    ASSERT_EQ(0, err);
+
+    CountingRunOut counting = {0};
+    DatagramTransportOut transportOut = {.self = &counting, .send = countingSingleSend};
+    NimbleServerResponse response = {.transportOut = &transportOut, .runOut = 0};
+
+    const size_t freeIdCount = nimbleServerCircularBufferCount(&server.freeTransportConnectionList);
+    const size_t connectCount = 4 * NIMBLE_NIMBLE_SERVER_MAX_TRANSPORT_CONNECTIONS;
+
+    // Clients connect and disconnect many more times than there are connection ids
+    for (size_t i = 0; i < connectCount; ++i) {
+        uint8_t connectionIndex = (uint8_t) (i % 3);
+        err = nimbleServerConnectionConnected(&server, connectionIndex);
+        ASSERT_EQ(0, err);
+
+        const NimbleServerTransportConnection* transportConnection = &server.transportConnections[connectionIndex];
+
+        OrderedDatagramOutLogic outLogic;
+        orderedDatagramOutLogicInit(&outLogic);
+
+        uint8_t connectionId = 0;
+        // The second connect request is a resend, and gets the same connection id
+        for (size_t send = 0; send < 2; ++send) {
+            uint8_t datagram[64];
+            size_t octetCount = writeConnectDatagram(&outLogic, datagram, sizeof(datagram), setup.applicationVersion,
+                                                     (NimbleSerializeClientRequestId) i, &setup.log);
+            err = nimbleServerFeed(&server, connectionIndex, datagram, octetCount, &response);
+            ASSERT_EQ(0, err);
+            ASSERT_TRUE(transportConnection->isIdFromFreeList);
+            ASSERT_EQ(freeIdCount - 1, nimbleServerCircularBufferCount(&server.freeTransportConnectionList));
+            if (send == 0) {
+                connectionId = transportConnection->id;
+            }
+            ASSERT_EQ(connectionId, transportConnection->id);
+        }
+
+        err = nimbleServerConnectionDisconnected(&server, connectionIndex);
+        ASSERT_EQ(0, err);
+        ASSERT_FALSE(transportConnection->isIdFromFreeList);
+        ASSERT_EQ(freeIdCount, nimbleServerCircularBufferCount(&server.freeTransportConnectionList));
+    }
+
+    ASSERT_EQ(2 * connectCount, counting.singleCount);
+}
+
+#if !defined _WIN32
+UTEST(ShmTransport, datagramsGoBothWays)
+{
+    Clog log;
+    log.config = &g_clog;
+    log.constantPrefix = "shm";
+
+    NimbleServerShmTransport server;
+    NimbleServerShmTransportSetup setup = {
+        .name = "/nimble-server-test-shm", .connectionCount = 2, .slotCount = 4, .log = log};
+    int err = nimbleServerShmTransportCreate(&server, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleServerShmTransportClient first;
+    NimbleServerShmTransportClient second;
+    ASSERT_EQ(0, nimbleServerShmTransportClientAttach(&first, "/nimble-server-test-shm", log));
+    ASSERT_EQ(1, nimbleServerShmTransportClientAttach(&second, "/nimble-server-test-shm", log));
+
+    const uint8_t ping[] = {0x01, 0x02, 0x03};
+    ASSERT_EQ(0, second.transport.send(second.transport.self, ping, sizeof(ping)));
+
+    int connectionId;
+    uint8_t datagram[DATAGRAM_TRANSPORT_MAX_SIZE];
+    ssize_t octetCount = server.multiTransport.receiveFrom(server.multiTransport.self, &connectionId, datagram,
+                                                           sizeof(datagram));
+    ASSERT_EQ((ssize_t) sizeof(ping), octetCount);
+    ASSERT_EQ(1, connectionId);
+    ASSERT_EQ(0, memcmp(ping, datagram, sizeof(ping)));
+    ASSERT_EQ(0, server.multiTransport.receiveFrom(server.multiTransport.self, &connectionId, datagram,
+                                                   sizeof(datagram)));
+
+    const uint8_t pong[] = {0x04, 0x05};
+    ASSERT_EQ(0, server.multiTransport.sendTo(server.multiTransport.self, connectionId, pong, sizeof(pong)));
+    ASSERT_EQ(0, first.transport.receive(first.transport.self, datagram, sizeof(datagram)));
+    ASSERT_EQ(1, nimbleServerShmTransportClientWait(&second, 0));
+    ASSERT_EQ((ssize_t) sizeof(pong), second.transport.receive(second.transport.self, datagram, sizeof(datagram)));
+    ASSERT_EQ(0, memcmp(pong, datagram, sizeof(pong)));
+
+    // A full ring drops the datagram, the same way as a full socket buffer
+    for (size_t i = 0; i < 5; ++i) {
+        ASSERT_EQ(0, first.transport.send(first.transport.self, ping, sizeof(ping)));
+    }
+    ASSERT_EQ(1u, first.stats.droppedDatagramCount);
+    ASSERT_EQ(1, nimbleServerShmTransportWait(&server, 0));
+
+    nimbleServerShmTransportClientDetach(&first);
+    nimbleServerShmTransportClientDetach(&second);
+    nimbleServerShmTransportDestroy(&server);
+}
+
+UTEST(StepLog, indexFindsComposedSteps)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "stepLog");
+    setup.participantsPerClient = 2;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    NimbleServerStepLogSetup stepLogSetup = {.basePath = "nimble_server_test_step_log",
+                                             .ringOctetCount = 1024 * 1024,
+                                             .writeBufferOctetCount = 4 * 1024,
+                                             .initialIndexCapacity = 16,
+                                             .log = setup.log};
+    static NimbleServerStepLog stepLog;
+    err = nimbleServerStepLogInit(&stepLog, stepLogSetup, &imprintSetup.tagAllocator.info);
+    ASSERT_EQ(0, err);
+    nimbleServerStepLogAttach(&stepLog, &simulation.server);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    const uint8_t gameState[] = {0xca, 0xfe, 0xba, 0xbe};
+    StepId snapshotStepId = simulation.server.game.authoritativeSteps.expectedWriteId;
+    simulation.server.game.observer.snapshotFn(simulation.server.game.observer.self, snapshotStepId, gameState,
+                                               sizeof(gameState));
+
+    for (size_t i = 0; i < 300; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+
+    simulation.server.game.observer.stepComposedFn = 0;
+    simulation.server.game.observer.snapshotFn = 0;
+    err = nimbleServerStepLogClose(&stepLog);
+    ASSERT_EQ(0, err);
+    ASSERT_EQ(0u, stepLog.droppedCount);
+    ASSERT_EQ(1u, stepLog.stats.snapshotCount);
+    ASSERT_LE(250u, stepLog.stats.stepCount);
+
+    NimbleServerStepLogReader reader;
+    err = nimbleServerStepLogReaderOpen(&reader, stepLogSetup.basePath);
+    ASSERT_EQ(0, err);
+
+    const NbsSteps* authoritativeSteps = &simulation.server.game.authoritativeSteps;
+    ASSERT_EQ(stepLog.stats.stepCount, (uint64_t) reader.entryCount);
+    ASSERT_EQ(authoritativeSteps->expectedWriteId, (StepId) (reader.indexHeader->firstStepId + reader.entryCount));
+
+    uint8_t expected[1024];
+    for (StepId stepId = authoritativeSteps->expectedReadId; stepId != authoritativeSteps->expectedWriteId; ++stepId) {
+        int index = nbsStepsGetIndexForStep(authoritativeSteps, stepId);
+        ASSERT_LE(0, index);
+        int expectedOctetCount = nbsStepsReadAtIndex(authoritativeSteps, index, expected, sizeof(expected));
+        ASSERT_LT(0, expectedOctetCount);
+
+        NimbleServerStepLogRecord record;
+        err = nimbleServerStepLogReaderReadStep(&reader, stepId, &record);
+        ASSERT_EQ(0, err);
+        ASSERT_EQ(stepId, record.stepId);
+        ASSERT_EQ((size_t) expectedOctetCount, record.octetCount);
+        ASSERT_EQ(0, memcmp(expected, record.octets, record.octetCount));
+    }
+
+    StepId lastStepId = (StepId) (authoritativeSteps->expectedWriteId - 1);
+    NimbleServerStepLogRecord snapshot;
+    err = nimbleServerStepLogReaderFindSnapshot(&reader, lastStepId, &snapshot);
+    ASSERT_EQ(0, err);
+    ASSERT_EQ(snapshotStepId, snapshot.stepId);
+    ASSERT_EQ(sizeof(gameState), snapshot.octetCount);
+
+    NimbleServerStepLogRecord missing;
+    ASSERT_GT(0, nimbleServerStepLogReaderReadStep(&reader, (StepId) (authoritativeSteps->expectedWriteId + 10),
+                                                   &missing));
+
+    nimbleServerStepLogReaderClose(&reader);
+    remove("nimble_server_test_step_log.steps");
+    remove("nimble_server_test_step_log.index");
+}
+
+UTEST(StepLog, snapshotsAreLoggedAtStartAndPeriodically)
+{
+    static ImprintDefaultSetup imprintSetup;
+    imprintDefaultSetupInit(&imprintSetup, 64 * 1024 * 1024);
+
+    HeadlessSimulation headless = {.nextStepId = 0, .callCount = 0, .stepCount = 0, .isContiguous = true};
+    static NimbleServerCallbackObjectVtbl vtbl = {.authoritativeStateSerializeFn = headlessSimulationSerialize,
+                                                  .authoritativeStepsComposedFn = headlessSimulationSteps};
+
+    NimbleServerSimulationSetup setup = testSimulationSetup(&imprintSetup, "stepLogSnapshots");
+    setup.callbackObject.vtbl = &vtbl;
+    setup.callbackObject.self = &headless;
+
+    static NimbleServerSimulation simulation;
+    int err = nimbleServerSimulationInit(&simulation, setup);
+    ASSERT_EQ(0, err);
+
+    const size_t snapshotIntervalStepCount = 50;
+    NimbleServerStepLogSetup stepLogSetup = {.basePath = "nimble_server_test_step_log_snapshots",
+                                             .ringOctetCount = 1024 * 1024,
+                                             .writeBufferOctetCount = 4 * 1024,
+                                             .initialIndexCapacity = 16,
+                                             .snapshotIntervalStepCount = snapshotIntervalStepCount,
+                                             .log = setup.log};
+    static NimbleServerStepLog stepLog;
+    err = nimbleServerStepLogInit(&stepLog, stepLogSetup, &imprintSetup.tagAllocator.info);
+    ASSERT_EQ(0, err);
+    nimbleServerStepLogAttach(&stepLog, &simulation.server);
+
+    err = nimbleServerSimulationJoinAll(&simulation, 500);
+    ASSERT_EQ(0, err);
+
+    for (size_t i = 0; i < 300; ++i) {
+        err = nimbleServerSimulationTick(&simulation);
+        ASSERT_EQ(0, err);
+    }
+
+    simulation.server.game.observer.stepComposedFn = 0;
+    simulation.server.game.observer.snapshotFn = 0;
+    err = nimbleServerStepLogClose(&stepLog);
+    ASSERT_EQ(0, err);
+    ASSERT_EQ(0u, stepLog.droppedCount);
+    ASSERT_LE(250u, stepLog.stats.stepCount);
+    // The initial snapshot, and one for every interval, without any client downloading the game state
+    ASSERT_EQ(1 + stepLog.stats.stepCount / snapshotIntervalStepCount, stepLog.stats.snapshotCount);
+
+    NimbleServerStepLogReader reader;
+    err = nimbleServerStepLogReaderOpen(&reader, stepLogSetup.basePath);
+    ASSERT_EQ(0, err);
+
+    // Every logged step can be reached from a snapshot, and the latest step from a recent one. The game state of the
+    // headless simulation can be a few steps behind the composed steps.
+    StepId firstStepId = reader.indexHeader->firstStepId;
+    NimbleServerStepLogRecord snapshot;
+    err = nimbleServerStepLogReaderFindSnapshot(&reader, firstStepId, &snapshot);
+    ASSERT_EQ(0, err);
+
+    StepId lastStepId = (StepId) (firstStepId + reader.entryCount - 1);
+    err = nimbleServerStepLogReaderFindSnapshot(&reader, lastStepId, &snapshot);
+    ASSERT_EQ(0, err);
+    ASSERT_LE((StepId) (lastStepId - snapshot.stepId), (StepId) (2 * snapshotIntervalStepCount));
+
+    nimbleServerStepLogReaderClose(&reader);
+    remove("nimble_server_test_step_log_snapshots.steps");
+    remove("nimble_server_test_step_log_snapshots.index");
+}
+
+#define PING_WORKER_COUNT (4)
+#define PING_WORKER_PING_COUNT (4000)
+
+/// A worker thread with a server of its own, like the workers of the daemon
+typedef struct PingWorker {
+    size_t index;
+    ImprintDefaultSetup imprintSetup;
+    NimbleServer server;
+    uint64_t expectedClientTime;
+    size_t replyCount;
+    size_t wrongReplyCount;
+    int result;
+} PingWorker;
+
+/// Checks that the pong ends with the client time of the ping that was just fed to the server of the worker
+static int checkPongSend(void* _self, const uint8_t* data, size_t octetCount)
+{
+    PingWorker* self = (PingWorker*) _self;
+
+    self->replyCount++;
+    if (octetCount < sizeof(uint64_t)) {
+        self->wrongReplyCount++;
+        return 0;
+    }
+
+    FldInStream inStream;
+    fldInStreamInit(&inStream, data + octetCount - sizeof(uint64_t), sizeof(uint64_t));
+    uint64_t clientTime;
+    fldInStreamReadUInt64(&inStream, &clientTime);
+    if (clientTime != self->expectedClientTime) {
+        self->wrongReplyCount++;
+    }
+
+    return 0;
+}
+
+static void* runPingWorker(void* _self)
+{
+    PingWorker* self = (PingWorker*) _self;
+
+    NimbleServerSetup setup = testServerSetup(&self->imprintSetup, "pingWorker");
+    setup.maxConnectionCount = 4;
+    setup.maxParticipantCount = 4;
+    setup.maxParticipantCountForEachConnection = 1;
+    setup.maxGameStateOctetCount = 1024;
+    Clog log = setup.log;
+
+    self->result = nimbleServerInit(&self->server, setup);
+    if (self->result < 0) {
+        return 0;
+    }
+
+    DatagramTransportOut transportOut;
+    transportOut.self = self;
+    transportOut.send = checkPongSend;
+
+    NimbleServerResponse response;
+    response.transportOut = &transportOut;
+    response.runOut = 0;
+
+    OrderedDatagramOutLogic outLogic;
+    orderedDatagramOutLogicInit(&outLogic);
+
+    for (size_t i = 0; i < PING_WORKER_PING_COUNT; ++i) {
+        uint8_t datagram[32];
+        self->expectedClientTime = ((uint64_t) self->index << 32) | i;
+        size_t octetCount = writePingDatagram(&outLogic, datagram, sizeof(datagram), self->expectedClientTime, &log);
+
+        int err = nimbleServerFeed(&self->server, 0, datagram, octetCount, &response);
+        if (err < 0) {
+            self->result = err;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+UTEST(Workers, eachServerRepliesWithItsOwnPongs)
+{
+    static PingWorker workers[PING_WORKER_COUNT];
+    pthread_t threads[PING_WORKER_COUNT];
+
+    for (size_t i = 0; i < PING_WORKER_COUNT; ++i) {
+        PingWorker* worker = &workers[i];
+        worker->index = i;
+        worker->replyCount = 0;
+        worker->wrongReplyCount = 0;
+        worker->result = 0;
+        imprintDefaultSetupInit(&worker->imprintSetup, 16 * 1024 * 1024);
+    }
+
+    for (size_t i = 0; i < PING_WORKER_COUNT; ++i) {
+        ASSERT_EQ(0, pthread_create(&threads[i], 0, runPingWorker, &workers[i]));
+    }
+
+    for (size_t i = 0; i < PING_WORKER_COUNT; ++i) {
+        pthread_join(threads[i], 0);
+    }
+
+    for (size_t i = 0; i < PING_WORKER_COUNT; ++i) {
+        const PingWorker* worker = &workers[i];
+        ASSERT_EQ(0, worker->result);
+        ASSERT_EQ((size_t) PING_WORKER_PING_COUNT, worker->replyCount);
+        ASSERT_EQ(0u, worker->wrongReplyCount);
+        imprintDefaultSetupDestroy(&workers[i].imprintSetup);
+    }
+}
+#endif